@@ -0,0 +1,2010 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <fcntl.h>
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bit_mask.h"
+#include "capture_file.h"
+#include "color_lut.h"
+#include "concurrent_blocking_queue.h"
+#include "cpu_hsv_thresholder.h"
+#include "dma_buf_alloc.h"
+#include "dma_buf_pool.h"
+#include "frame_scheduler.h"
+#include "frame_trace.h"
+#include "gl_context.h"
+#include "gl_hsv_histogram.h"
+#include "gl_hsv_thresholder.h"
+#include "hsv_color.h"
+#include "hsv_histogram.h"
+#include "hsv_thresholder.h"
+#include "lens_remap.h"
+#include "mask_stats.h"
+#include "pixel_deinterleave.h"
+#include "roi_tracker.h"
+#include "ring_queue.h"
+#include "thread_pool.h"
+#include "yuv_conversion.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+// Heap allocations in the process, so the pipeline runs can show what the thresholder allocates at steady state.
+// Consumers standing in for the display thread turn counting off for their own thread. The deletes aren't inlined,
+// GCC takes a malloc'd pointer reaching free through an inlined delete for a mismatch.
+static std::atomic<std::uint64_t> allocations{0};
+static thread_local bool count_allocations = true;
+
+void *operator new(std::size_t size) {
+    if (count_allocations) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void *data = std::malloc(size ? size : 1)) {
+        return data;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *data) noexcept {
+    std::free(data);
+}
+
+__attribute__((noinline)) void operator delete(void *data, std::size_t) noexcept {
+    std::free(data);
+}
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void report(const std::string &group, const std::string &name, const std::string &metric, double value) {
+    char line[160];
+    snprintf(line, sizeof(line), "%-12s %-36s %14.2f %s", group.c_str(), name.c_str(), value, metric.c_str());
+    std::cout << line << std::endl;
+}
+
+// Stands in for a dma-heap so the pool and the CPU backend run on any machine
+static int memfd_alloc(std::size_t size) {
+    int fd = memfd_create("libcamera_meme_bench", MFD_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("failed to create memfd");
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) < 0) {
+        close(fd);
+        throw std::runtime_error("failed to size memfd");
+    }
+    return fd;
+}
+
+// A real dma-buf backed by a memfd, which EGL can import unlike the memfd itself. Needs /dev/udmabuf
+// (CONFIG_UDMABUF).
+static int udmabuf_alloc(std::size_t size) {
+    static const auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    size = (size + page_size - 1) / page_size * page_size;
+
+    static int device = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (device < 0) {
+        throw std::runtime_error("failed to open /dev/udmabuf");
+    }
+
+    int memfd = memfd_create("libcamera_meme_bench", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        throw std::runtime_error("failed to create memfd");
+    }
+    // udmabuf only takes memfds that can't shrink under it
+    if (ftruncate(memfd, static_cast<off_t>(size)) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        close(memfd);
+        throw std::runtime_error("failed to size and seal memfd");
+    }
+
+    udmabuf_create create{};
+    create.memfd = static_cast<__u32>(memfd);
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = size;
+    int fd = ioctl(device, UDMABUF_CREATE, &create);
+    close(memfd);
+    if (fd < 0) {
+        throw std::runtime_error("failed to create udmabuf");
+    }
+    return fd;
+}
+
+// Adapts the old queue to the same close-aware interface, -1 doubles as the close marker
+class BlockingQueueAdapter {
+public:
+    explicit BlockingQueueAdapter(std::size_t) {}
+
+    void push(int value) {
+        m_queue.push(value);
+    }
+
+    std::optional<int> pop() {
+        auto value = m_queue.pop();
+        if (value == -1) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    void close() {
+        m_queue.push(-1);
+    }
+private:
+    ConcurrentBlockingQueue<int> m_queue;
+};
+
+template <typename Queue>
+class RingQueueAdapter {
+public:
+    explicit RingQueueAdapter(std::size_t capacity, RingQueueWait wait) : m_queue(capacity, wait) {}
+
+    void push(int value) {
+        m_queue.push(value);
+    }
+
+    std::optional<int> pop() {
+        return m_queue.pop();
+    }
+
+    void close() {
+        m_queue.close();
+    }
+private:
+    Queue m_queue;
+};
+
+template <typename Queue, typename... Args>
+static void bench_queue(const std::string &name, Args... args) {
+    constexpr int items = 2'000'000;
+    constexpr int round_trips = 100'000;
+
+    {
+        Queue queue(args...);
+        auto start = bench_clock::now();
+        std::thread producer([&]() {
+            for (int i = 0; i < items; i++) {
+                queue.push(i);
+            }
+            queue.close();
+        });
+        long long sum = 0;
+        while (auto value = queue.pop()) {
+            sum += *value;
+        }
+        producer.join();
+        auto elapsed = seconds_since(start);
+        if (sum != static_cast<long long>(items) * (items - 1) / 2) {
+            throw std::runtime_error("queue lost items in " + name);
+        }
+        report("queue", name, "Mitems/s", items / elapsed / 1e6);
+    }
+
+    // Round trips through a pair of queues, this is what a frame handoff between two threads costs
+    {
+        Queue ping(args...);
+        Queue pong(args...);
+        std::thread echo([&]() {
+            while (auto value = ping.pop()) {
+                pong.push(*value);
+            }
+            pong.close();
+        });
+        auto start = bench_clock::now();
+        for (int i = 0; i < round_trips; i++) {
+            ping.push(i);
+            pong.pop();
+        }
+        auto elapsed = seconds_since(start);
+        ping.close();
+        echo.join();
+        report("queue", name, "ns/round trip", elapsed / round_trips * 1e9);
+    }
+}
+
+static void bench_queues() {
+    constexpr std::size_t capacity = 1024;
+    bench_queue<BlockingQueueAdapter>("ConcurrentBlockingQueue", capacity);
+    bench_queue<RingQueueAdapter<RingQueue<int>>>("RingQueue<Spsc> park", capacity, RingQueueWait::Park);
+    bench_queue<RingQueueAdapter<RingQueue<int>>>("RingQueue<Spsc> spin", capacity, RingQueueWait::SpinThenPark);
+    bench_queue<RingQueueAdapter<RingQueue<int, RingQueueThreading::Mpmc>>>("RingQueue<Mpmc> park", capacity,
+                                                                             RingQueueWait::Park);
+    bench_queue<RingQueueAdapter<RingQueue<int, RingQueueThreading::Mpmc>>>("RingQueue<Mpmc> spin", capacity,
+                                                                             RingQueueWait::SpinThenPark);
+}
+
+static std::vector<SimdLevel> supported_simd_levels() {
+    std::vector<SimdLevel> levels{SimdLevel::Scalar};
+    auto best = detected_simd_level();
+    if (best == SimdLevel::Avx2) {
+        levels.push_back(SimdLevel::Ssse3);
+    }
+    if (best != SimdLevel::Scalar) {
+        levels.push_back(best);
+    }
+    return levels;
+}
+
+// Every kernel has to produce exactly what the scalar loop does, including the tails that don't fill a vector
+static void verify_deinterleave() {
+    std::mt19937 rng(1234);
+    for (std::size_t pixels: {0, 1, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1000, 1920 * 3 + 5}) {
+        std::vector<uint8_t> src(pixels * 4);
+        for (auto &byte: src) {
+            byte = static_cast<uint8_t>(rng());
+        }
+
+        std::vector<uint8_t> expected_color(pixels * 3), expected_mask(pixels);
+        deinterleave_color_mask(src.data(), expected_color.data(), expected_mask.data(), pixels, SimdLevel::Scalar);
+
+        for (auto level: supported_simd_levels()) {
+            // One byte of slack past the end catches kernels that write beyond the buffer
+            std::vector<uint8_t> color(pixels * 3 + 1, 0xAA), mask(pixels + 1, 0xAA);
+            deinterleave_color_mask(src.data(), color.data(), mask.data(), pixels, level);
+            if (std::memcmp(color.data(), expected_color.data(), pixels * 3) != 0 || color.back() != 0xAA ||
+                std::memcmp(mask.data(), expected_mask.data(), pixels) != 0 || mask.back() != 0xAA) {
+                throw std::runtime_error(std::string("deinterleave mismatch for ") + simd_level_name(level) +
+                                         " at " + std::to_string(pixels) + " pixels");
+            }
+        }
+    }
+}
+
+static void bench_deinterleave() {
+    verify_deinterleave();
+
+    constexpr int width = 1920, height = 1080, frames = 100;
+    std::vector<uint8_t> src(width * height * 4, 0x7F), color(width * height * 3), mask(width * height);
+    ThreadPool pool;
+
+    auto run = [&](const std::string &name, SimdLevel level, ThreadPool *frame_pool) {
+        auto start = bench_clock::now();
+        for (int i = 0; i < frames; i++) {
+            deinterleave_color_mask(src.data(), width * 4, color.data(), width * 3, mask.data(), width,
+                                    width, height, frame_pool, level);
+        }
+        report("deinterleave", name, "ms/frame", seconds_since(start) / frames * 1e3);
+    };
+
+    for (auto level: supported_simd_levels()) {
+        run(std::string("1080p ") + simd_level_name(level), level, nullptr);
+    }
+    run(std::string("1080p ") + simd_level_name(detected_simd_level()) + " x" + std::to_string(pool.concurrency()),
+        detected_simd_level(), &pool);
+}
+
+// Random YUV420 planes, plus the same samples repacked as NV12 and YUYV. YUYV repeats each chroma row since it
+// only subsamples horizontally. With an even patch size the picture is squares of that size in one color each,
+// which GPU sampling between texels can't blur, and accept can turn down colors until one suits.
+struct SyntheticYuv {
+    int width;
+    int height;
+    std::vector<uint8_t> y, u, v;
+    std::vector<uint8_t> nv12_uv, yuyv;
+
+    SyntheticYuv(int width, int height, unsigned int seed, int patch = 1,
+                 const std::function<bool(uint8_t, uint8_t, uint8_t)> &accept = {})
+            : width(width), height(height), y(width * height), u(((width + 1) / 2) * ((height + 1) / 2)),
+              v(u.size()) {
+        std::mt19937 rng(seed);
+        for (auto *plane: {&y, &u, &v}) {
+            for (auto &byte: *plane) {
+                byte = static_cast<uint8_t>(rng());
+            }
+        }
+
+        auto chroma_width = static_cast<std::size_t>((width + 1) / 2);
+        if (patch > 1) {
+            // Each square takes the color of its top left pixel
+            for (int row = 0; row < height; row += patch) {
+                for (int x = 0; x < width; x += patch) {
+                    auto &luma = y[row * width + x];
+                    auto chroma = (row / 2) * chroma_width + x / 2;
+                    while (accept && !accept(luma, u[chroma], v[chroma])) {
+                        luma = static_cast<uint8_t>(rng());
+                        u[chroma] = static_cast<uint8_t>(rng());
+                        v[chroma] = static_cast<uint8_t>(rng());
+                    }
+                }
+            }
+            for (int row = 0; row < height; row++) {
+                for (int x = 0; x < width; x++) {
+                    y[row * width + x] = y[row / patch * patch * width + x / patch * patch];
+                }
+            }
+            int chroma_patch = patch / 2;
+            for (std::size_t row = 0; row < u.size() / chroma_width; row++) {
+                for (std::size_t x = 0; x < chroma_width; x++) {
+                    auto top_left = row / chroma_patch * chroma_patch * chroma_width + x / chroma_patch * chroma_patch;
+                    u[row * chroma_width + x] = u[top_left];
+                    v[row * chroma_width + x] = v[top_left];
+                }
+            }
+        }
+
+        nv12_uv.resize(u.size() * 2);
+        for (std::size_t i = 0; i < u.size(); i++) {
+            nv12_uv[i * 2] = u[i];
+            nv12_uv[i * 2 + 1] = v[i];
+        }
+        yuyv.resize(chroma_width * 4 * height);
+        for (int row = 0; row < height; row++) {
+            for (std::size_t i = 0; i < chroma_width; i++) {
+                auto *group = &yuyv[(row * chroma_width + i) * 4];
+                auto x = i * 2;
+                group[0] = y[row * width + x];
+                group[1] = u[(row / 2) * chroma_width + i];
+                group[2] = x + 1 < static_cast<std::size_t>(width) ? y[row * width + x + 1] : 0;
+                group[3] = v[(row / 2) * chroma_width + i];
+            }
+        }
+    }
+
+    [[nodiscard]] CpuHsvThresholder::Frame frame(YuvFormat format) const {
+        auto luma_stride = static_cast<std::size_t>(width);
+        auto chroma_stride = static_cast<std::size_t>((width + 1) / 2);
+        switch (format) {
+            case YuvFormat::Nv12:
+                return {{y.data(), nv12_uv.data(), nullptr}, {luma_stride, chroma_stride * 2, 0}};
+            case YuvFormat::Yuyv:
+                return {{yuyv.data(), nullptr, nullptr}, {chroma_stride * 4, 0, 0}};
+            default:
+                return {{y.data(), u.data(), v.data()}, {luma_stride, chroma_stride, chroma_stride}};
+        }
+    }
+};
+
+struct ThresholdOutputs {
+    std::vector<uint8_t> target, color, stats;
+
+    ThresholdOutputs(int width, int height, HsvThresholder::OutputMode mode)
+            : target(mode == HsvThresholder::OutputMode::Packed ? width * height * 4 :
+                     mode == HsvThresholder::OutputMode::BitPacked ?
+                             HsvThresholder::bit_packed_row_words(width) * 4 * height : width * height),
+              color(mode == HsvThresholder::OutputMode::Packed ? 0 : width * height * 4),
+              stats(mode == HsvThresholder::OutputMode::BitPacked || mode == HsvThresholder::OutputMode::RangeBits ? 0 :
+                    stats_tile_count(width) * stats_tile_count(height) * sizeof(TileStats)) {}
+
+    CpuHsvThresholder::Outputs pointers() {
+        return {target.data(), color.empty() ? nullptr : color.data(), stats.empty() ? nullptr : stats.data()};
+    }
+
+    bool operator==(const ThresholdOutputs &other) const = default;
+};
+
+static const char *output_mode_name(HsvThresholder::OutputMode mode) {
+    switch (mode) {
+        case HsvThresholder::OutputMode::Packed:
+            return "packed";
+        case HsvThresholder::OutputMode::Planar:
+            return "planar";
+        case HsvThresholder::OutputMode::BitPacked:
+            return "bit packed";
+        case HsvThresholder::OutputMode::RangeBits:
+            return "range bits";
+    }
+    return "unknown";
+}
+
+static constexpr std::array<HsvThresholder::OutputMode, 4> ALL_OUTPUT_MODES = {
+        HsvThresholder::OutputMode::Packed, HsvThresholder::OutputMode::Planar, HsvThresholder::OutputMode::BitPacked,
+        HsvThresholder::OutputMode::RangeBits,
+};
+
+static const char *yuv_format_name(YuvFormat format) {
+    switch (format) {
+        case YuvFormat::Yuv420:
+            return "yuv420";
+        case YuvFormat::Nv12:
+            return "nv12";
+        case YuvFormat::Yuyv:
+            return "yuyv";
+    }
+    return "unknown";
+}
+
+static constexpr std::array<YuvFormat, 3> ALL_YUV_FORMATS = {YuvFormat::Yuv420, YuvFormat::Nv12, YuvFormat::Yuyv};
+
+// The stats of a window's mask, laid out with the tile rows of a frame_width wide frame and the window's tiles at
+// the top left. Tiles outside the window are zero.
+static std::vector<uint8_t> tile_stats_reference(const uint8_t *mask, std::size_t stride, int width, int height,
+                                                 int frame_width, std::size_t size) {
+    std::vector<uint8_t> stats(size);
+    auto *tiles = reinterpret_cast<TileStats *>(stats.data());
+    for (int tile_row = 0; tile_row < stats_tile_count(height); tile_row++) {
+        int row = tile_row * STATS_TILE_SIZE;
+        tile_stats_from_mask(mask + row * stride, stride, width, std::min(STATS_TILE_SIZE, height - row),
+                             tiles + tile_row * stats_tile_count(frame_width));
+    }
+    return stats;
+}
+
+// The vector kernels promise bit identical output to the scalar loop, odd sizes cover the row and tile tails.
+// The interleaved formats carry the same samples, so they have to match the YUV420 result too.
+static void verify_cpu_threshold() {
+    // threshold() writes through the pointers it's given, the pool is only there for testFrame
+    DmaBufPool pool(memfd_alloc, 0);
+    for (auto [width, height]: {std::pair{1, 1}, {7, 3}, {37, 21}, {64, 48}, {333, 77}}) {
+        SyntheticYuv input(width, height, width * 31 + height);
+        for (auto mode: ALL_OUTPUT_MODES) {
+            HsvThresholder::OutputConfig config;
+            config.mode = mode;
+
+            CpuHsvThresholder reference_thresholder(width, height, YuvFormat::Yuv420, pool, config, 1, SimdLevel::Scalar);
+            ThresholdOutputs expected(width, height, mode);
+            reference_thresholder.threshold(input.frame(YuvFormat::Yuv420), EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT,
+                                            expected.pointers());
+
+            for (auto format: ALL_YUV_FORMATS) {
+                for (auto level: supported_simd_levels()) {
+                    CpuHsvThresholder thresholder(width, height, format, pool, config, 3, level);
+                    ThresholdOutputs outputs(width, height, mode);
+                    thresholder.threshold(input.frame(format), EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT,
+                                          outputs.pointers());
+                    if (!(outputs == expected)) {
+                        throw std::runtime_error(std::string("cpu threshold mismatch for ") + yuv_format_name(format) +
+                                                 " " + simd_level_name(level) + " " + output_mode_name(mode) + " at " +
+                                                 std::to_string(width) + "x" + std::to_string(height));
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Several ranges at once, one of them wrapping around red. Bit i of a RangeBits mask has to be set exactly where a
+// planar mask of range i alone is.
+static const std::vector<HsvRange> TEST_RANGES = {
+        {{0.9f, 0.3f, 0.2f}, {0.05f, 1.0f, 1.0f}},
+        {{0.1f, 0.4f, 0.4f}, {0.2f, 1.0f, 1.0f}},
+        {{0.3f, 0.0f, 0.0f}, {0.6f, 0.5f, 0.8f}},
+        {{0.0f, 0.0f, 0.5f}, {1.0f, 0.2f, 1.0f}},
+};
+
+static void verify_cpu_range_bits() {
+    DmaBufPool pool(memfd_alloc, 0);
+    for (auto [width, height]: {std::pair{7, 3}, {37, 21}, {333, 77}}) {
+        SyntheticYuv input(width, height, width * 17 + height);
+        auto frame = input.frame(YuvFormat::Yuv420);
+
+        std::vector<ThresholdOutputs> singles;
+        for (const auto &range: TEST_RANGES) {
+            HsvThresholder::OutputConfig config;
+            config.mode = HsvThresholder::OutputMode::Planar;
+            CpuHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, 1, SimdLevel::Scalar);
+            thresholder.setRanges({range});
+            singles.emplace_back(width, height, config.mode);
+            thresholder.threshold(frame, EGL_ITU_REC709_EXT, EGL_YUV_NARROW_RANGE_EXT, singles.back().pointers());
+        }
+
+        for (auto level: supported_simd_levels()) {
+            HsvThresholder::OutputConfig config;
+            config.mode = HsvThresholder::OutputMode::RangeBits;
+            CpuHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, 3, level);
+            thresholder.setRanges(TEST_RANGES);
+            ThresholdOutputs outputs(width, height, config.mode);
+            thresholder.threshold(frame, EGL_ITU_REC709_EXT, EGL_YUV_NARROW_RANGE_EXT, outputs.pointers());
+
+            for (std::size_t i = 0; i < outputs.target.size(); i++) {
+                uint8_t expected = 0;
+                for (std::size_t range = 0; range < singles.size(); range++) {
+                    expected |= singles[range].target[i] ? 1 << range : 0;
+                }
+                if (outputs.target[i] != expected) {
+                    throw std::runtime_error(std::string("cpu range bits mismatch for ") + simd_level_name(level) +
+                                             " at " + std::to_string(width) + "x" + std::to_string(height));
+                }
+            }
+        }
+    }
+}
+
+// What the display thread reads out of a bit packed mask has to describe the same pixels as a planar mask of the same
+// frame. Widths around the 32 pixel words cover a partial last word.
+static void verify_bit_mask_runs() {
+    DmaBufPool pool(memfd_alloc, 0);
+    for (auto [width, height]: {std::pair{1, 1}, {31, 5}, {32, 4}, {33, 7}, {97, 13}, {333, 77}}) {
+        SyntheticYuv input(width, height, width * 13 + height);
+        auto frame = input.frame(YuvFormat::Yuv420);
+        auto threshold = [&](HsvThresholder::OutputMode mode) {
+            HsvThresholder::OutputConfig config;
+            config.mode = mode;
+            CpuHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, 1, detected_simd_level());
+            // Broad enough for runs that cross words, but not the whole frame
+            thresholder.setRanges({{{0.0f, 0.0f, 0.25f}, {1.0f, 1.0f, 1.0f}}});
+            ThresholdOutputs outputs(width, height, mode);
+            thresholder.threshold(frame, EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT, outputs.pointers());
+            return outputs;
+        };
+        auto planar = threshold(HsvThresholder::OutputMode::Planar);
+        auto bits = threshold(HsvThresholder::OutputMode::BitPacked);
+
+        std::size_t expected_pixels = 0;
+        std::vector<MaskRun> expected_runs;
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row = planar.target.data() + static_cast<std::size_t>(y) * width;
+            for (int x = 0; x < width; x++) {
+                if (!row[x]) {
+                    continue;
+                }
+                expected_pixels++;
+                if (x > 0 && row[x - 1]) {
+                    expected_runs.back().end = x + 1;
+                } else {
+                    expected_runs.push_back({y, x, x + 1});
+                }
+            }
+        }
+
+        auto stride_words = static_cast<std::size_t>(HsvThresholder::bit_packed_row_words(width));
+        std::vector<MaskRun> runs;
+        extract_mask_runs(bits.target.data(), stride_words, width, height, runs);
+        auto same_run = [](const MaskRun &a, const MaskRun &b) {
+            return a.row == b.row && a.begin == b.begin && a.end == b.end;
+        };
+        if (count_mask_pixels(bits.target.data(), stride_words, width, height) != expected_pixels ||
+            !std::equal(runs.begin(), runs.end(), expected_runs.begin(), expected_runs.end(), same_run)) {
+            throw std::runtime_error("bit packed mask doesn't match the planar one at " + std::to_string(width) + "x" +
+                                     std::to_string(height));
+        }
+    }
+}
+
+// Another thread flips between two range sets as fast as it can while frames are thresholded. Every frame has to
+// come out exactly as one of the two sets would make it, never a mix.
+static void verify_live_ranges() {
+    constexpr int width = 64, height = 48, frames = 2000;
+    DmaBufPool pool(memfd_alloc, 0);
+    SyntheticYuv input(width, height, 5);
+    auto frame = input.frame(YuvFormat::Yuv420);
+    HsvThresholder::OutputConfig config;
+    config.mode = HsvThresholder::OutputMode::RangeBits;
+
+    std::array<std::vector<HsvRange>, 2> sets = {
+            std::vector<HsvRange>{TEST_RANGES[0], TEST_RANGES[1]},
+            std::vector<HsvRange>{TEST_RANGES[2], TEST_RANGES[3], TEST_RANGES[1]},
+    };
+    std::vector<ThresholdOutputs> expected;
+    for (const auto &ranges: sets) {
+        CpuHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, 1, SimdLevel::Scalar);
+        thresholder.setRanges(ranges);
+        expected.emplace_back(width, height, config.mode);
+        thresholder.threshold(frame, EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT, expected.back().pointers());
+    }
+
+    CpuHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, 2, detected_simd_level());
+    thresholder.setRanges(sets[0]);
+    std::atomic<bool> done{false};
+    std::thread tuner([&]() {
+        for (std::size_t i = 0; !done.load(std::memory_order_relaxed); i++) {
+            thresholder.setRanges(sets[i % 2]);
+        }
+    });
+    std::array<int, 2> seen{};
+    for (int i = 0; i < frames; i++) {
+        ThresholdOutputs outputs(width, height, config.mode);
+        thresholder.threshold(frame, EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT, outputs.pointers());
+        if (outputs == expected[0]) {
+            seen[0]++;
+        } else if (outputs == expected[1]) {
+            seen[1]++;
+        } else {
+            done = true;
+            tuner.join();
+            throw std::runtime_error("frame " + std::to_string(i) + " saw a torn range update");
+        }
+    }
+    done = true;
+    tuner.join();
+    report("cpu threshold", "live ranges, frames with the first set", "%", seen[0] * 100.0 / frames);
+}
+
+// A window has to come out exactly as that part of the whole frame's output, from the top left of the buffers and
+// with the whole frame's strides. Its tile stats are of the window alone, and the other tiles zero.
+static void verify_cpu_roi() {
+    constexpr int width = 333, height = 77;
+    DmaBufPool pool(memfd_alloc, 0);
+    SyntheticYuv input(width, height, 11);
+    // Odd, so it's grown to {36, 10, 102, 46}
+    const HsvThresholder::Roi requested{37, 11, 101, 45};
+    const HsvThresholder::Roi expected_roi{36, 10, 102, 46};
+
+    for (auto mode: ALL_OUTPUT_MODES) {
+        HsvThresholder::OutputConfig config;
+        config.mode = mode;
+        config.color = true;
+        for (auto format: ALL_YUV_FORMATS) {
+            CpuHsvThresholder thresholder(width, height, format, pool, config, 3, detected_simd_level());
+            ThresholdOutputs full(width, height, mode);
+            thresholder.threshold(input.frame(format), EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT, full.pointers());
+
+            thresholder.setRoi(requested);
+            ThresholdOutputs window(width, height, mode);
+            auto roi = thresholder.threshold(input.frame(format), EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT,
+                                             window.pointers());
+            auto fail = [&](const std::string &what) {
+                throw std::runtime_error("cpu roi " + what + " mismatch for " + yuv_format_name(format) + " " +
+                                         output_mode_name(mode));
+            };
+            if (roi != expected_roi) {
+                fail("window");
+            }
+
+            for (int row = 0; row < roi.height; row++) {
+                for (int x = 0; x < roi.width; x++) {
+                    auto out = static_cast<std::size_t>(row) * width + x;
+                    auto in = static_cast<std::size_t>(roi.y + row) * width + roi.x + x;
+                    bool same;
+                    switch (mode) {
+                        case HsvThresholder::OutputMode::Packed:
+                            same = std::memcmp(&window.target[out * 4], &full.target[in * 4], 4) == 0;
+                            break;
+                        case HsvThresholder::OutputMode::BitPacked: {
+                            auto row_bytes = static_cast<std::size_t>(HsvThresholder::bit_packed_row_words(width)) * 4;
+                            auto bit = [&](const std::vector<uint8_t> &bits, int r, int c) {
+                                return (bits[r * row_bytes + c / 8] >> (c % 8)) & 1;
+                            };
+                            same = bit(window.target, row, x) == bit(full.target, roi.y + row, roi.x + x);
+                            break;
+                        }
+                        default:
+                            same = window.target[out] == full.target[in] &&
+                                   std::memcmp(&window.color[out * 4], &full.color[in * 4], 4) == 0;
+                            break;
+                    }
+                    if (!same) {
+                        fail("pixel");
+                    }
+                }
+            }
+
+            if (!window.stats.empty()) {
+                // The window's mask, tightly packed, reduced on its own
+                std::vector<uint8_t> mask(static_cast<std::size_t>(roi.width) * roi.height);
+                for (int row = 0; row < roi.height; row++) {
+                    for (int x = 0; x < roi.width; x++) {
+                        auto out = static_cast<std::size_t>(row) * width + x;
+                        mask[row * roi.width + x] = mode == HsvThresholder::OutputMode::Packed ?
+                                                    window.target[out * 4 + 3] : window.target[out];
+                    }
+                }
+                if (window.stats != tile_stats_reference(mask.data(), roi.width, roi.width, roi.height, width,
+                                                         window.stats.size())) {
+                    fail("stats");
+                }
+            }
+        }
+    }
+}
+
+// The window follows the biggest blob with the margin around it, keeps its minimum size against the frame's edge
+// and lets go after lost_frames frames without one
+static void verify_roi_tracker() {
+    constexpr int width = 1920, height = 1080;
+    RoiTracker::Config config;
+    config.margin = 32;
+    config.lost_frames = 3;
+    RoiTracker tracker(width, height, config);
+    const HsvThresholder::Roi full{0, 0, width, height};
+
+    auto blob = [](int min_x, int min_y, int max_x, int max_y, double count) {
+        BlobMoments moments;
+        moments.count = count;
+        moments.min_x = min_x;
+        moments.min_y = min_y;
+        moments.max_x = max_x;
+        moments.max_y = max_y;
+        return moments;
+    };
+
+    auto roi = tracker.update({blob(10, 10, 20, 20, 50), blob(1000, 500, 1499, 699, 4000)}, full, 1);
+    if (roi != HsvThresholder::Roi{968, 450, 564, 300}) {
+        throw std::runtime_error("roi tracker didn't frame the biggest blob");
+    }
+    // In mask pixels of a half scale window, right against the frame's corner
+    roi = tracker.update({blob(190, 140, 199, 149, 100)}, {1520, 780, 400, 300}, 2);
+    if (roi != HsvThresholder::Roi{1520, 780, 400, 300}) {
+        throw std::runtime_error("roi tracker didn't keep the window inside the frame");
+    }
+    for (int i = 0; i < config.lost_frames; i++) {
+        if (!tracker.update({}, *roi, 2) && i + 1 < config.lost_frames) {
+            throw std::runtime_error("roi tracker let go too early");
+        }
+    }
+    if (tracker.roi()) {
+        throw std::runtime_error("roi tracker didn't go back to the whole frame");
+    }
+}
+
+// A made up wide angle lens at 1080p with strong barrel distortion
+static const LensCalibration TEST_LENS = {{1000.0, 1000.0, 959.5, 539.5}, {-0.3, 0.1, 0.001, -0.0005, 0.0}};
+
+// Against the model worked out by hand, and the interpolation between entries that scaled outputs use
+static void verify_undistort_remap() {
+    constexpr int width = 1920, height = 1080;
+    auto straight = undistort_remap({TEST_LENS.intrinsics, {}}, width, height);
+    for (std::size_t i = 0; i < straight.x.size(); i++) {
+        if (std::abs(straight.x[i] - static_cast<float>(i % width)) > 1e-3f ||
+            std::abs(straight.y[i] - static_cast<float>(i / width)) > 1e-3f) {
+            throw std::runtime_error("undistort remap moved pixels without any distortion");
+        }
+    }
+
+    auto table = undistort_remap(TEST_LENS, width, height);
+    const auto &k = TEST_LENS.intrinsics;
+    const auto &d = TEST_LENS.distortion;
+    // 500 pixels right of the principal point: x = 0.5, y = 0
+    double r2 = 0.25;
+    double expected_x = k.cx + k.fx * (0.5 * (1 + d.k1 * r2 + d.k2 * r2 * r2) + d.p2 * (r2 + 0.5));
+    double expected_y = k.cy + k.fy * d.p1 * r2;
+    auto [x, y] = table.at(k.cx + 500, k.cy);
+    if (std::abs(x - expected_x) > 1e-2 || std::abs(y - expected_y) > 1e-2) {
+        throw std::runtime_error("undistort remap doesn't match the lens model");
+    }
+    // Straightening barrel distortion pulls the corners in from well inside the frame
+    if (table.x[0] < 100 || table.y[0] < 50) {
+        throw std::runtime_error("undistort remap didn't pull the corners in");
+    }
+
+    auto [mid_x, mid_y] = table.at(100.5, 200.5);
+    auto entry = [&](const std::vector<float> &map, int ex, int ey) {
+        return map[static_cast<std::size_t>(ey) * width + ex];
+    };
+    float want_x = (entry(table.x, 100, 200) + entry(table.x, 101, 200) + entry(table.x, 100, 201) +
+                    entry(table.x, 101, 201)) / 4;
+    float want_y = (entry(table.y, 100, 200) + entry(table.y, 101, 200) + entry(table.y, 100, 201) +
+                    entry(table.y, 101, 201)) / 4;
+    if (std::abs(mid_x - want_x) > 1e-3f || std::abs(mid_y - want_y) > 1e-3f) {
+        throw std::runtime_error("remap table interpolates wrong between entries");
+    }
+}
+
+// Each texel of a packed identity table has to put its output pixel back on the middle of the input pixels it
+// covers, to within the fixed point's rounding, and only pixels that land off the input may be REMAP_OUTSIDE
+static void verify_pack_remap() {
+    constexpr int width = 64, height = 48;
+    auto decode = [](const std::vector<uint8_t> &texels, std::size_t i) {
+        return std::pair{texels[i * 4] << 8 | texels[i * 4 + 1], texels[i * 4 + 2] << 8 | texels[i * 4 + 3]};
+    };
+    auto table = [&](int shift_x, int shift_y) {
+        RemapTable remap{width, height, std::vector<float>(width * height), std::vector<float>(width * height)};
+        for (int row = 0; row < height; row++) {
+            for (int column = 0; column < width; column++) {
+                remap.x[row * width + column] = static_cast<float>(column + shift_x);
+                remap.y[row * width + column] = static_cast<float>(row + shift_y);
+            }
+        }
+        return remap;
+    };
+
+    for (int scale: {1, 2}) {
+        int output_width = width / scale, output_height = height / scale;
+        auto texels = pack_remap(table(0, 0), output_width, output_height, scale);
+        for (int row = 0; row < output_height; row++) {
+            for (int column = 0; column < output_width; column++) {
+                auto [x, y] = decode(texels, row * output_width + column);
+                double want_x = (column + 0.5) * scale / width, want_y = (row + 0.5) * scale / height;
+                if (std::abs(x / static_cast<double>(REMAP_ONE) - want_x) > 0.5 / REMAP_ONE ||
+                    std::abs(y / static_cast<double>(REMAP_ONE) - want_y) > 0.5 / REMAP_ONE) {
+                    throw std::runtime_error("packed identity remap moved a pixel at a scale of " +
+                                             std::to_string(scale));
+                }
+            }
+        }
+    }
+
+    // Half a frame left and down, so the left columns and the bottom rows come from off the input
+    auto texels = pack_remap(table(-width / 2, height / 2), width, height, 1);
+    for (int row = 0; row < height; row++) {
+        for (int column = 0; column < width; column++) {
+            bool outside = column < width / 2 || row >= height / 2;
+            auto [x, y] = decode(texels, row * width + column);
+            if ((x == REMAP_OUTSIDE) != outside) {
+                throw std::runtime_error("packed remap got which pixels are off the input wrong");
+            }
+        }
+    }
+}
+
+// The buffer layout the GL backend writes, and the suggestions on hand made histograms
+static void verify_hsv_histogram() {
+    std::vector<uint8_t> buffer(HSV_HISTOGRAM_BUFFER_SIZE);
+    auto put = [&](std::size_t texel, std::uint32_t count) {
+        buffer[texel * 4] = count & 0xff;
+        buffer[texel * 4 + 1] = (count >> 8) & 0xff;
+        buffer[texel * 4 + 2] = (count >> 16) & 0xff;
+        buffer[texel * 4 + 3] = 0xff;
+    };
+    put(3 * HISTOGRAM_HUE_BINS + 5, 0x123456);
+    put(HISTOGRAM_HUE_BINS * HISTOGRAM_SATURATION_BINS + 7, 300);
+    auto read = read_hsv_histogram(buffer.data());
+    if (read.hue_saturation[3 * HISTOGRAM_HUE_BINS + 5] != 0x123456 ||
+        read.value[7] != 300 || read.total() != 300) {
+        throw std::runtime_error("histogram buffer read wrong");
+    }
+
+    if (suggest_hsv_range(HsvHistogram{})) {
+        throw std::runtime_error("suggested a range without any samples");
+    }
+    // A saturated red target either side of hue 0 with some grey background, which mustn't widen the hue
+    HsvHistogram red;
+    for (int h: {30, 31, 0, 1}) {
+        red.hue_saturation[24 * HISTOGRAM_HUE_BINS + h] = 100;
+        red.value[20] += 100;
+    }
+    red.hue_saturation[12] = 8;
+    red.value[5] = 8;
+    auto range = suggest_hsv_range(red, 0.95);
+    auto bin = [](int b) { return static_cast<float>(b) / HISTOGRAM_HUE_BINS; };
+    if (!range || range->lower[0] != bin(30) || range->upper[0] != bin(2) || range->lower[1] != bin(24) ||
+        range->upper[1] != bin(25) || range->lower[2] != bin(20) || range->upper[2] != bin(21)) {
+        throw std::runtime_error("suggested the wrong range for a red target");
+    }
+}
+
+static void bench_cpu_threshold() {
+    verify_cpu_threshold();
+    verify_cpu_range_bits();
+    verify_bit_mask_runs();
+    verify_live_ranges();
+    verify_cpu_roi();
+    verify_roi_tracker();
+    verify_undistort_remap();
+    verify_pack_remap();
+    verify_hsv_histogram();
+
+    constexpr int width = 1920, height = 1080, frames = 20;
+    SyntheticYuv input(width, height, 42);
+    DmaBufPool pool(memfd_alloc, 0);
+
+    auto run = [&](YuvFormat format, HsvThresholder::OutputMode mode, SimdLevel level, unsigned int threads,
+                   std::size_t range_count = 1, std::optional<HsvThresholder::Roi> roi = std::nullopt) {
+        HsvThresholder::OutputConfig config;
+        config.mode = mode;
+        CpuHsvThresholder thresholder(width, height, format, pool, config, threads, level);
+        if (range_count > 1) {
+            thresholder.setRanges({TEST_RANGES.begin(), TEST_RANGES.begin() + range_count});
+        }
+        thresholder.setRoi(roi);
+        ThresholdOutputs outputs(width, height, mode);
+
+        auto start = bench_clock::now();
+        for (int i = 0; i < frames; i++) {
+            thresholder.threshold(input.frame(format), EGL_ITU_REC709_EXT, EGL_YUV_NARROW_RANGE_EXT, outputs.pointers());
+        }
+        report("cpu threshold", std::string("1080p ") + yuv_format_name(format) + " " + output_mode_name(mode) + " " +
+                                simd_level_name(level) + " x" + std::to_string(threads) +
+                                (range_count > 1 ? " " + std::to_string(range_count) + " ranges" : "") +
+                                (roi ? " " + std::to_string(roi->width) + "x" + std::to_string(roi->height) + " roi"
+                                     : ""), "ms/frame",
+               seconds_since(start) / frames * 1e3);
+    };
+
+    for (auto level: supported_simd_levels()) {
+        run(YuvFormat::Yuv420, HsvThresholder::OutputMode::Planar, level, 1);
+    }
+    for (auto format: {YuvFormat::Nv12, YuvFormat::Yuyv}) {
+        run(format, HsvThresholder::OutputMode::Planar, detected_simd_level(), 1);
+    }
+    for (std::size_t range_count = 2; range_count <= TEST_RANGES.size(); range_count *= 2) {
+        run(YuvFormat::Yuv420, HsvThresholder::OutputMode::RangeBits, detected_simd_level(), 1, range_count);
+    }
+    // A tracking window, 17x fewer pixels than the frame
+    run(YuvFormat::Yuv420, HsvThresholder::OutputMode::Planar, detected_simd_level(), 1, 1,
+        HsvThresholder::Roi{760, 390, 400, 300});
+    unsigned int threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (auto mode: ALL_OUTPUT_MODES) {
+        run(YuvFormat::Yuv420, mode, detected_simd_level(), threads);
+    }
+}
+
+// Round trips through the pool, then whole CPU backend frames with a consumer that holds on to the last few. Up to
+// the reserved depth nothing should be allocated after the first frame, past it the pool grows until the cap and
+// then starts dropping.
+static void bench_dma_buf_pool() {
+    {
+        DmaBufPool pool(memfd_alloc, 1);
+        pool.reserve(1 << 20, 1);
+        constexpr int rounds = 1'000'000;
+        auto start = bench_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            auto buffer = pool.acquire(1 << 20);
+            if (!buffer) {
+                throw std::runtime_error("pool refused its only buffer");
+            }
+        }
+        report("dma-buf pool", "acquire + release", "ns/op", seconds_since(start) / rounds * 1e9);
+    }
+
+    constexpr int width = 1920, height = 1080, frames = 60;
+    constexpr std::size_t depth = 3, buffers_per_frame = 3;
+
+    SyntheticYuv input(width, height, 7);
+    int input_fd = memfd_alloc(input.y.size() + input.u.size() + input.v.size());
+    {
+        auto *data = static_cast<uint8_t *>(mmap(nullptr, input.y.size() + input.u.size() * 2, PROT_WRITE, MAP_SHARED,
+                                                 input_fd, 0));
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("failed to mmap input memfd");
+        }
+        std::memcpy(data, input.y.data(), input.y.size());
+        std::memcpy(data + input.y.size(), input.u.data(), input.u.size());
+        std::memcpy(data + input.y.size() + input.u.size(), input.v.data(), input.v.size());
+        munmap(data, input.y.size() + input.u.size() * 2);
+    }
+    auto chroma_pitch = static_cast<EGLint>((width + 1) / 2);
+    std::array<HsvThresholder::DmaBufPlaneData, 3> planes = {{
+            {input_fd, 0, width},
+            {input_fd, static_cast<EGLint>(input.y.size()), chroma_pitch},
+            {input_fd, static_cast<EGLint>(input.y.size() + input.u.size()), chroma_pitch},
+    }};
+
+    for (std::size_t hold: {depth, depth + 1, depth * 2, depth * 2 + 1}) {
+        HsvThresholder::OutputConfig config;
+        config.mode = HsvThresholder::OutputMode::Planar;
+        config.color = true;
+        config.stats = true;
+
+        DmaBufPool pool(memfd_alloc, depth * 2 * buffers_per_frame);
+        pool.reserve(HsvThresholder::target_buffer_size(config, width, height), depth);
+        pool.reserve(HsvThresholder::color_buffer_size(config, width, height), depth);
+        pool.reserve(HsvThresholder::stats_buffer_size(config, width, height), depth);
+        auto reserved = pool.stats().buffers;
+
+        CpuHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config);
+        std::optional<HsvThresholder::OutputFrame> latest;
+        thresholder.setOnComplete([&](HsvThresholder::OutputFrame frame) {
+            latest = std::move(frame);
+        });
+
+        // The consumer keeps each frame for hold frame times, dropped frames leave a gap
+        std::deque<std::optional<HsvThresholder::OutputFrame>> held;
+        int completed = 0;
+        for (int i = 0; i < frames; i++) {
+            while (held.size() >= hold) {
+                held.pop_front();
+            }
+            thresholder.testFrame(planes, EGL_ITU_REC709_EXT, EGL_YUV_NARROW_RANGE_EXT);
+            completed += latest.has_value();
+            held.push_back(std::move(latest));
+            latest.reset();
+        }
+
+        auto stats = pool.stats();
+        auto name = "holding " + std::to_string(hold) + " frames";
+        report("dma-buf pool", name + " grown by", "buffers", static_cast<double>(stats.buffers - reserved));
+        report("dma-buf pool", name + " reused", "%", 100.0 * static_cast<double>(stats.reuses) /
+                                                      static_cast<double>(std::max<std::uint64_t>(stats.acquisitions, 1)));
+        report("dma-buf pool", name + " dropped", "frames", frames - completed);
+    }
+    close(input_fd);
+}
+
+// How fast the display thread can read a 1080p ARGB frame out of each heap, syncs included. memfd is ordinary
+// cached memory, the baseline a cached heap should get close to.
+static void bench_heap_bandwidth() {
+    constexpr std::size_t size = 1920 * 1080 * 4;
+    constexpr int rounds = 20;
+
+    auto run = [&](const std::string &name, int fd) {
+        auto *data = static_cast<uint64_t *>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("failed to mmap " + name);
+        }
+        {
+            ScopedDmaBufSync sync(fd, DmaBufAccess::Write);
+            for (std::size_t i = 0; i < size / sizeof(uint64_t); i++) {
+                data[i] = i;
+            }
+        }
+
+        uint64_t sum = 0;
+        auto start = bench_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            ScopedDmaBufSync sync(fd, DmaBufAccess::Read);
+            for (std::size_t i = 0; i < size / sizeof(uint64_t); i++) {
+                sum += data[i];
+            }
+        }
+        auto seconds = seconds_since(start);
+        munmap(data, size);
+
+        // Keeps the loop from being optimized out
+        if (sum == 0) {
+            throw std::runtime_error("read nothing from " + name);
+        }
+        report("heap read", name, "GB/s", static_cast<double>(size) * rounds / seconds / 1e9);
+    };
+
+    int memfd = memfd_alloc(size);
+    run("memfd", memfd);
+    close(memfd);
+
+    for (const auto &heap: DmaBufAlloc::available_heaps()) {
+        try {
+            DmaBufAlloc allocator(heap);
+            int fd = allocator.alloc_buf(size);
+            run(heap, fd);
+            DmaBufAlloc::free_buf(fd);
+        } catch (const std::exception &e) {
+            std::cout << "heap read   skipping " << heap << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+// What the table costs to rebuild when the thresholds change, and how often its rounding to the grid gives a
+// different answer than the exact HSV test
+static void bench_color_lut() {
+    auto classify = hsv_box_classifier(HsvThresholder::DEFAULT_LOWER_THRESH, HsvThresholder::DEFAULT_UPPER_THRESH);
+    auto yuv = yuv_to_rgb_coefficients(EGL_ITU_REC601_EXT, EGL_YUV_NARROW_RANGE_EXT);
+
+    std::mt19937 rng(99);
+    std::vector<std::array<uint8_t, 3>> samples(1'000'000);
+    for (auto &sample: samples) {
+        sample = {static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng())};
+    }
+
+    for (int size: {32, 64, 128}) {
+        auto start = bench_clock::now();
+        ColorLut lut(size, classify, yuv);
+        report("color lut", std::to_string(size) + "^3 build", "ms", seconds_since(start) * 1e3);
+
+        std::size_t disagree = 0;
+        for (const auto &[y, cb, cr]: samples) {
+            float luma = (static_cast<float>(y) - yuv.y_offset) * yuv.y_scale;
+            float cb_offset = static_cast<float>(cb) - 128.0f, cr_offset = static_cast<float>(cr) - 128.0f;
+            bool inside = classify(std::clamp(luma + yuv.cr_r * cr_offset, 0.0f, 1.0f),
+                                   std::clamp(luma + yuv.cb_g * cb_offset + yuv.cr_g * cr_offset, 0.0f, 1.0f),
+                                   std::clamp(luma + yuv.cb_b * cb_offset, 0.0f, 1.0f));
+            disagree += lut.contains(y / 255.0f, cb / 255.0f, cr / 255.0f) != inside;
+        }
+        report("color lut", std::to_string(size) + "^3 disagreement", "%", 100.0 * disagree / samples.size());
+    }
+
+    // The builder has to hand back the newest request even when several pile up. Mid grey pushed all the way
+    // towards Cr comes out red, and all the way away from it cyan.
+    auto red = [](float r, float, float) { return r > 0.5f; };
+    auto is_red = [](const ColorLut &lut) {
+        return lut.contains(0.5f, 0.5f, 1.0f) && !lut.contains(0.5f, 0.5f, 0.0f);
+    };
+    ColorLutBuilder builder(32, classify);
+    builder.rebuild(yuv);
+    for (int i = 0; i < 8; i++) {
+        float hue = i / 8.0f;
+        builder.request(hsv_box_classifier({hue, 0.0f, 0.0f}, {hue, 1.0f, 1.0f}));
+    }
+    builder.request(red);
+    std::unique_ptr<ColorLut> newest;
+    for (auto start = bench_clock::now(); seconds_since(start) < 10;) {
+        if (auto lut = builder.takeFinished()) {
+            newest = std::move(lut);
+            if (is_red(*newest)) {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!newest || !is_red(*newest)) {
+        throw std::runtime_error("color lut builder never delivered the newest table");
+    }
+    // A new conversion is built straight away from the newest classifier
+    if (!is_red(builder.rebuild(yuv_to_rgb_coefficients(EGL_ITU_REC709_EXT, EGL_YUV_FULL_RANGE_EXT)))) {
+        throw std::runtime_error("color lut builder rebuilt an old classifier");
+    }
+}
+
+// Where the pipeline runs get their buffers: udmabuf or the system heap give dma-bufs that both backends can use,
+// plain memfds only work for the CPU backend
+struct PipelineBuffers {
+    std::string name;
+    std::function<int(std::size_t)> allocate;
+    bool importable;
+};
+
+// Why the GL backend can't run here at all, e.g. a driver without dma-buf import. Anything past this probe that
+// throws is a real failure.
+static std::optional<std::string> gl_unavailable(EglPlatform egl_platform) {
+    try {
+        GlContext context(egl_platform);
+    } catch (const std::exception &e) {
+        return e.what();
+    }
+    return std::nullopt;
+}
+
+static PipelineBuffers pipeline_buffers() {
+    try {
+        DmaBufAlloc::free_buf(udmabuf_alloc(1));
+        return {"udmabuf", udmabuf_alloc, true};
+    } catch (const std::exception &) {}
+
+    auto heaps = DmaBufAlloc::available_heaps();
+    if (std::find(heaps.begin(), heaps.end(), "system") != heaps.end()) {
+        static DmaBufAlloc system_heap("system");
+        return {"system heap", [](std::size_t size) { return system_heap.alloc_buf(size); }, true};
+    }
+    return {"memfd", memfd_alloc, false};
+}
+
+// A frame in a dma-buf with the planes back to back, the way a camera buffer holds them
+struct DmaBufFrame {
+    int fd;
+    std::array<HsvThresholder::DmaBufPlaneData, 3> planes{};
+
+    DmaBufFrame(const SyntheticYuv &yuv, YuvFormat format, const std::function<int(std::size_t)> &allocate) {
+        auto source = yuv.frame(format);
+        std::size_t size = 0;
+        for (int i = 0; i < yuv_plane_count(format); i++) {
+            auto [row_bytes, rows] = yuv_plane_size(format, i, yuv.width, yuv.height);
+            planes[i] = {-1, static_cast<EGLint>(size), static_cast<EGLint>(row_bytes)};
+            size += row_bytes * rows;
+        }
+        fd = allocate(size);
+        for (auto &plane: planes) {
+            plane.fd = fd;
+        }
+
+        auto *data = static_cast<uint8_t *>(mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0));
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("failed to mmap a frame");
+        }
+        {
+            ScopedDmaBufSync sync(fd, DmaBufAccess::Write);
+            for (int i = 0; i < yuv_plane_count(format); i++) {
+                auto [row_bytes, rows] = yuv_plane_size(format, i, yuv.width, yuv.height);
+                for (int row = 0; row < rows; row++) {
+                    std::memcpy(data + planes[i].offset + row * row_bytes, source.planes[i] + row * source.strides[i],
+                                row_bytes);
+                }
+            }
+        }
+        munmap(data, size);
+    }
+
+    ~DmaBufFrame() {
+        close(fd);
+    }
+
+    DmaBufFrame(const DmaBufFrame &) = delete;
+    DmaBufFrame &operator=(const DmaBufFrame &) = delete;
+};
+
+// One frame through a thresholder that finishes it before testFrame returns, which is any that isn't pipelined
+static HsvThresholder::OutputFrame threshold_once(HsvThresholder &thresholder, const DmaBufFrame &input) {
+    std::optional<HsvThresholder::OutputFrame> output;
+    thresholder.setOnComplete([&output](HsvThresholder::OutputFrame frame) {
+        output = std::move(frame);
+    });
+    thresholder.testFrame(input.planes, EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT);
+    thresholder.resetOnComplete();
+    if (!output) {
+        throw std::runtime_error("the output pool ran dry for a single frame");
+    }
+    return std::move(*output);
+}
+
+// A copy of the first size bytes of an output buffer, so the buffer can go back to the pool
+static std::vector<uint8_t> read_output(const DmaBufPool::Buffer &buffer, std::size_t size) {
+    ScopedDmaBufSync sync(buffer.fd(), DmaBufAccess::Read);
+    return {buffer.data(), buffer.data() + size};
+}
+
+struct PipelineRun {
+    ThresholderBackend backend;
+    EglPlatform egl_platform;
+    YuvFormat format;
+    int width;
+    int height;
+    std::size_t depth;
+    // GL only, in place of the erode and dilate the display thread would otherwise do
+    std::vector<HsvThresholder::MorphologyStep> morphology = {};
+    // GL only, see OutputConfig::remap
+    std::shared_ptr<const RemapTable> remap = {};
+    // GL only, the display thread also suggests a range from each frame's histogram
+    bool histogram = false;
+};
+
+static void report_latency(const std::string &group, const std::string &name, const LatencyHistogram &histogram) {
+    char line[160];
+    snprintf(line, sizeof(line), "%-12s %-36s p50 %8.2f p99 %8.2f ms", group.c_str(), name.c_str(),
+             histogram.percentile(0.5) / 1e6, histogram.percentile(0.99) / 1e6);
+    std::cout << line << std::endl;
+}
+
+// Synthetic frames through the same thread layout as main: the thresholder on its own thread fed from a few camera
+// buffers, and a display thread that deinterleaves the packed output and finds blobs in the tile stats. depth is
+// how many frames the output pool is reserved for, and for the GL backend more than one means pipelined.
+static void bench_pipeline_run(const PipelineRun &run, const PipelineBuffers &buffers) {
+    constexpr int warmup = 10, frames = 120;
+    const int width = run.width, height = run.height;
+
+    HsvThresholder::OutputConfig config;
+    config.stats = true;
+    config.morphology = run.morphology;
+    config.remap = run.remap;
+    config.histogram = run.histogram;
+    const std::size_t buffers_per_frame = run.histogram ? 3 : 2;
+    DmaBufPool output_pool(buffers.allocate, run.depth * 2 * buffers_per_frame);
+    output_pool.reserve(HsvThresholder::target_buffer_size(config, width, height), run.depth);
+    output_pool.reserve(HsvThresholder::stats_buffer_size(config, width, height), run.depth);
+    if (run.histogram) {
+        output_pool.reserve(HSV_HISTOGRAM_BUFFER_SIZE, run.depth);
+    }
+    auto reserved = output_pool.stats().buffers;
+
+    // Like a camera, a couple more input buffers than frames in flight
+    SyntheticYuv yuv(width, height, 11);
+    std::vector<std::unique_ptr<DmaBufFrame>> inputs;
+    for (std::size_t n = 0; n < run.depth + 2; n++) {
+        inputs.push_back(std::make_unique<DmaBufFrame>(yuv, run.format, buffers.allocate));
+    }
+
+    FrameTracer tracer;
+    RingQueue<std::size_t> free_inputs(inputs.size());
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        free_inputs.push(i);
+    }
+    RingQueue<HsvThresholder::OutputFrame> output_queue(output_pool.maxBuffers());
+    std::atomic<int> displayed{0};
+    double seconds = 0;
+    std::uint64_t steady_allocations = 0;
+    std::exception_ptr error;
+
+    std::thread worker([&]() {
+        try {
+            auto thresholder = make_hsv_thresholder(run.backend, width, height, run.format, output_pool, config,
+                                                    run.depth > 1, run.egl_platform);
+            thresholder->setTracer(&tracer);
+            thresholder->setOnComplete([&](HsvThresholder::OutputFrame frame) {
+                output_queue.push(std::move(frame));
+            });
+
+            std::thread display([&]() {
+                // find_blobs allocates its results every frame, which says nothing about the thresholder
+                count_allocations = false;
+                ThreadPool pool;
+                std::vector<uint8_t> color(static_cast<std::size_t>(width) * height * 3);
+                std::vector<uint8_t> mask(static_cast<std::size_t>(width) * height);
+                while (auto next = output_queue.pop()) {
+                    {
+                        auto frame = std::move(*next);
+                        auto popped = FrameTracer::now();
+                        tracer.record(TraceStage::OutputQueue, frame.tag, frame.tag.handoff, popped);
+
+                        ScopedDmaBufSync target_sync(frame.target.fd(), DmaBufAccess::Read);
+                        ScopedDmaBufSync stats_sync(frame.stats->fd(), DmaBufAccess::Read);
+                        deinterleave_color_mask(frame.target.data(), width * 4, color.data(), width * 3, mask.data(),
+                                                width, width, height, &pool);
+                        auto blobs = find_blobs(frame.stats->data(), stats_tile_count(width), stats_tile_count(height),
+                                                STATS_TILE_SIZE, 64);
+                        if (frame.histogram) {
+                            ScopedDmaBufSync histogram_sync(frame.histogram->fd(), DmaBufAccess::Read);
+                            if (!suggest_hsv_range(read_hsv_histogram(frame.histogram->data()))) {
+                                throw std::runtime_error("gl histogram came back empty");
+                            }
+                        }
+
+                        auto done = FrameTracer::now();
+                        tracer.record(TraceStage::Readback, frame.tag, popped, done);
+                        tracer.record(TraceStage::Total, frame.tag, frame.tag.sensor_timestamp, done);
+                    }
+                    displayed.fetch_add(1, std::memory_order_release);
+                }
+            });
+
+            auto dispatch = [&](int sequence) {
+                auto index = *free_inputs.pop();
+                FrameTag tag;
+                tag.sequence = static_cast<std::uint32_t>(sequence);
+                tag.sensor_timestamp = FrameTracer::now();
+                tag.handoff = tag.sensor_timestamp;
+                thresholder->testFrame(inputs[index]->planes, EGL_ITU_REC709_EXT, EGL_YUV_NARROW_RANGE_EXT,
+                                       [&free_inputs, index]() { free_inputs.push(index); }, tag);
+            };
+            // Dropped frames never reach the display thread
+            auto drain = [&](int dispatched) {
+                while (displayed.load(std::memory_order_acquire) +
+                       static_cast<int>(output_pool.stats().exhaustions) < dispatched) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            };
+
+            // First frames pay for imports and lazily compiled shaders
+            for (int i = 0; i < warmup; i++) {
+                dispatch(i);
+            }
+            drain(warmup);
+            tracer.reset();
+
+            auto allocations_before = allocations.load();
+            auto start = bench_clock::now();
+            for (int i = warmup; i < warmup + frames; i++) {
+                dispatch(i);
+            }
+            drain(warmup + frames);
+            seconds = seconds_since(start);
+            steady_allocations = allocations.load() - allocations_before;
+
+            thresholder.reset();
+            output_queue.close();
+            display.join();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    });
+    worker.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    auto name = std::string(run.backend == ThresholderBackend::Gl ? "gl " : "cpu ") + yuv_format_name(run.format) +
+                " " + std::to_string(width) + "x" + std::to_string(height) + " d" + std::to_string(run.depth);
+    if (!run.morphology.empty()) {
+        name += " open r" + std::to_string(run.morphology.front().radius);
+    }
+    if (run.remap) {
+        name += " undistorted";
+    }
+    if (run.histogram) {
+        name += " histogram";
+    }
+    auto stats = output_pool.stats();
+    report("pipeline", name, "fps", frames / seconds);
+    report("pipeline", name + " allocations", "per frame", static_cast<double>(steady_allocations) / frames);
+    report("pipeline", name + " pool grown by", "buffers", static_cast<double>(stats.buffers - reserved));
+    report("pipeline", name + " dropped", "frames", static_cast<double>(stats.exhaustions));
+    for (auto stage: {TraceStage::Import, TraceStage::Render, TraceStage::Gpu, TraceStage::Threshold,
+                      TraceStage::OutputQueue, TraceStage::Readback, TraceStage::Total}) {
+        if (tracer.histogram(stage).count()) {
+            report_latency("pipeline", name + " " + trace_stage_name(stage), tracer.histogram(stage));
+        }
+    }
+}
+
+// Most patches of a SyntheticYuv, so masks come out as blobs with straight edges and holes
+static const HsvRange BRIGHT_RANGE = {{0.0f, 0.0f, 0.5f}, {1.0f, 1.0f, 1.0f}};
+// Even and away from the frame's edges, so setRoi keeps it as it is
+static const HsvThresholder::Roi TEST_WINDOW = {100, 50, 202, 150};
+
+// Erodes or dilates the width x height window at the top left of a mask with rows stride bytes apart, taking the
+// min or max over the kernel clamped to the window
+static std::vector<uint8_t> morphology_pass(const std::vector<uint8_t> &mask, int stride, int width, int height,
+                                            int radius, bool erode) {
+    auto result = mask;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t value = erode ? 255 : 0;
+            for (int dy = -radius; dy <= radius; dy++) {
+                for (int dx = -radius; dx <= radius; dx++) {
+                    auto sample = mask[std::clamp(y + dy, 0, height - 1) * stride + std::clamp(x + dx, 0, width - 1)];
+                    value = erode ? std::min(value, sample) : std::max(value, sample);
+                }
+            }
+            result[y * stride + x] = value;
+        }
+    }
+    return result;
+}
+
+static std::vector<uint8_t> morphology_reference(std::vector<uint8_t> mask, int stride, int width, int height,
+                                                 const std::vector<HsvThresholder::MorphologyStep> &steps) {
+    for (const auto &step: steps) {
+        auto repeat = [&](bool erode) {
+            for (int i = 0; i < step.iterations; i++) {
+                mask = morphology_pass(mask, stride, width, height, step.radius, erode);
+            }
+        };
+        switch (step.op) {
+            case HsvThresholder::MorphologyOp::Erode:
+                repeat(true);
+                break;
+            case HsvThresholder::MorphologyOp::Dilate:
+                repeat(false);
+                break;
+            case HsvThresholder::MorphologyOp::Open:
+                repeat(true);
+                repeat(false);
+                break;
+            case HsvThresholder::MorphologyOp::Close:
+                repeat(false);
+                repeat(true);
+                break;
+        }
+    }
+    return mask;
+}
+
+// The morphology passes against the naive reference run over the same thresholder's mask without them, so only the
+// passes are under test. Radii past 1, chained steps and iterations, and a window where the kernel has to clamp to
+// the window's edge rather than the frame's.
+static void verify_gl_morphology(EglPlatform egl_platform, const PipelineBuffers &buffers) {
+    constexpr int width = 640, height = 360;
+    using Op = HsvThresholder::MorphologyOp;
+    const std::vector<std::vector<HsvThresholder::MorphologyStep>> cases = {
+            {{Op::Erode, 1}}, {{Op::Dilate, 3}}, {{Op::Open, 2, 2}}, {{Op::Close, 2}, {Op::Dilate, 1}},
+    };
+    DmaBufFrame input(SyntheticYuv(width, height, 21, 8), YuvFormat::Yuv420, buffers.allocate);
+    DmaBufPool pool(buffers.allocate, 2);
+    HsvThresholder::OutputConfig config;
+    config.mode = HsvThresholder::OutputMode::Planar;
+    auto mask_size = HsvThresholder::target_buffer_size(config, width, height);
+    GlHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, false, egl_platform);
+    thresholder.setRanges({BRIGHT_RANGE});
+
+    for (auto window: {std::optional<HsvThresholder::Roi>(), std::optional(TEST_WINDOW)}) {
+        thresholder.setRoi(window);
+        thresholder.setMorphology({});
+        auto plain = threshold_once(thresholder, input);
+        auto roi = plain.roi;
+        auto mask = read_output(plain.target, mask_size);
+        for (const auto &steps: cases) {
+            thresholder.setMorphology(steps);
+            auto frame = threshold_once(thresholder, input);
+            auto expected = morphology_reference(mask, width, roi.width, roi.height, steps);
+            auto output = read_output(frame.target, mask_size);
+            for (int y = 0; y < roi.height; y++) {
+                if (!std::equal(&output[y * width], &output[y * width] + roi.width, &expected[y * width])) {
+                    throw std::runtime_error("gl morphology mismatch in row " + std::to_string(y) + " of a " +
+                                             std::to_string(roi.width) + "x" + std::to_string(roi.height) +
+                                             " window");
+                }
+            }
+        }
+    }
+}
+
+// GlMaskReducer against tile_stats_from_mask over the mask it reduced. 360 rows end in half a tile, and so does
+// the window's width.
+static void verify_gl_tile_stats(EglPlatform egl_platform, const PipelineBuffers &buffers) {
+    constexpr int width = 640, height = 360;
+    DmaBufFrame input(SyntheticYuv(width, height, 23, 8), YuvFormat::Yuv420, buffers.allocate);
+    DmaBufPool pool(buffers.allocate, 2);
+    HsvThresholder::OutputConfig config;
+    config.mode = HsvThresholder::OutputMode::Planar;
+    config.stats = true;
+    auto mask_size = HsvThresholder::target_buffer_size(config, width, height);
+    auto stats_size = HsvThresholder::stats_buffer_size(config, width, height);
+    GlHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, false, egl_platform);
+    thresholder.setRanges({BRIGHT_RANGE});
+
+    for (auto window: {std::optional<HsvThresholder::Roi>(), std::optional(TEST_WINDOW)}) {
+        thresholder.setRoi(window);
+        auto frame = threshold_once(thresholder, input);
+        auto mask = read_output(frame.target, mask_size);
+        auto expected = tile_stats_reference(mask.data(), width, frame.roi.width, frame.roi.height, width, stats_size);
+        if (read_output(*frame.stats, stats_size) != expected) {
+            throw std::runtime_error("gl tile stats mismatch for a " + std::to_string(frame.roi.width) + "x" +
+                                     std::to_string(frame.roi.height) + " window");
+        }
+    }
+}
+
+// What the shaders make of a full range BT.601 sample, which is how threshold_once hands frames over
+static Hsv sample_hsv(uint8_t y, uint8_t u, uint8_t v) {
+    static const auto yuv = yuv_to_rgb_coefficients(EGL_ITU_REC601_EXT, EGL_YUV_FULL_RANGE_EXT);
+    float luma = yuv.y_scale * (static_cast<float>(y) - yuv.y_offset);
+    float cb = static_cast<float>(u) - 128.0f, cr = static_cast<float>(v) - 128.0f;
+    return rgb_to_hsv(std::clamp(luma + yuv.cr_r * cr, 0.0f, 1.0f),
+                      std::clamp(luma + yuv.cb_g * cb + yuv.cr_g * cr, 0.0f, 1.0f),
+                      std::clamp(luma + yuv.cb_b * cb, 0.0f, 1.0f));
+}
+
+// The GPU histogram against the bins of the same samples counted on the CPU. The patches are colors well inside
+// their bins, so a mediump rgb2hsv lands in the same ones, and every sample falls inside a patch. The whole frame
+// at a step of 4 is more samples than one copy of the histogram can count.
+static void verify_gl_histogram(EglPlatform egl_platform, const PipelineBuffers &buffers) {
+    constexpr int width = 640, height = 360, patch = 8;
+    auto inside_bins = [](uint8_t y, uint8_t u, uint8_t v) {
+        auto well_inside = [](float channel, int bins) {
+            float bin = channel * static_cast<float>(bins);
+            return bin - std::floor(bin) > 0.2f && bin - std::floor(bin) < 0.8f;
+        };
+        auto hsv = sample_hsv(y, u, v);
+        return hsv.s > 0.1f && well_inside(hsv.h, HISTOGRAM_HUE_BINS) &&
+               well_inside(hsv.s, HISTOGRAM_SATURATION_BINS) && well_inside(hsv.v, HISTOGRAM_VALUE_BINS);
+    };
+    SyntheticYuv yuv(width, height, 25, patch, inside_bins);
+    DmaBufFrame input(yuv, YuvFormat::Yuv420, buffers.allocate);
+    DmaBufPool pool(buffers.allocate, 2);
+
+    // Regions on the patch grid and steps that divide it put each sample in the middle of a patch
+    for (auto [step, region]: {std::pair{4, HsvThresholder::Roi{0, 0, width, height}},
+                               std::pair{8, HsvThresholder::Roi{64, 40, 200, 96}}}) {
+        HsvThresholder::OutputConfig config;
+        config.histogram = true;
+        config.histogram_step = step;
+        config.histogram_region = region;
+        GlHsvThresholder thresholder(width, height, YuvFormat::Yuv420, pool, config, false, egl_platform);
+        auto frame = threshold_once(thresholder, input);
+        auto histogram = read_hsv_histogram(read_output(*frame.histogram, HSV_HISTOGRAM_BUFFER_SIZE).data());
+
+        HsvHistogram expected;
+        auto chroma_width = static_cast<std::size_t>(width / 2);
+        for (int y = region.y + step / 2; y < region.y + region.height; y += step) {
+            for (int x = region.x + step / 2; x < region.x + region.width; x += step) {
+                auto chroma = (y / 2) * chroma_width + x / 2;
+                auto hsv = sample_hsv(yuv.y[y * width + x], yuv.u[chroma], yuv.v[chroma]);
+                auto bin = [](float channel, int bins) {
+                    return std::min(static_cast<int>(channel * static_cast<float>(bins)), bins - 1);
+                };
+                expected.hue_saturation[bin(hsv.s, HISTOGRAM_SATURATION_BINS) * HISTOGRAM_HUE_BINS +
+                                        bin(hsv.h, HISTOGRAM_HUE_BINS)]++;
+                expected.value[bin(hsv.v, HISTOGRAM_VALUE_BINS)]++;
+            }
+        }
+        auto samples = static_cast<std::uint64_t>(GlHsvHistogram::gridSize(region.width, step)) *
+                       GlHsvHistogram::gridSize(region.height, step);
+        if (histogram.total() != samples) {
+            throw std::runtime_error("gl histogram counted " + std::to_string(histogram.total()) + " of " +
+                                     std::to_string(samples) + " samples");
+        }
+        if (histogram.hue_saturation != expected.hue_saturation || histogram.value != expected.value) {
+            throw std::runtime_error("gl histogram bins don't match the samples at a step of " + std::to_string(step));
+        }
+    }
+}
+
+// A remapped mask and color against a plain thresholder's output of the same frame, looked up on the CPU through
+// the same table. It mirrors the frame and moves it up a patch, so the bottom rows come from off the input and
+// come out black. Its entries sit in the middle of patches, where the fixed point's rounding can't reach another
+// color.
+static void verify_gl_remap(EglPlatform egl_platform, const PipelineBuffers &buffers) {
+    constexpr int width = 640, height = 360, patch = 8;
+    auto table = std::make_shared<RemapTable>();
+    *table = {width, height, std::vector<float>(width * height), std::vector<float>(width * height)};
+    for (int row = 0; row < height; row++) {
+        int source_row = row + patch;
+        for (int column = 0; column < width; column++) {
+            int source_column = width - 1 - column;
+            table->x[row * width + column] = static_cast<float>(source_column / patch * patch) + patch / 2.0f - 0.5f;
+            table->y[row * width + column] = source_row < height ? static_cast<float>(source_row / patch * patch) +
+                                                                   patch / 2.0f - 0.5f
+                                                                 : static_cast<float>(source_row);
+        }
+    }
+
+    DmaBufFrame input(SyntheticYuv(width, height, 27, patch), YuvFormat::Yuv420, buffers.allocate);
+    DmaBufPool pool(buffers.allocate, 4);
+    HsvThresholder::OutputConfig config;
+    config.mode = HsvThresholder::OutputMode::Planar;
+    config.color = true;
+    auto mask_size = HsvThresholder::target_buffer_size(config, width, height);
+    auto color_size = HsvThresholder::color_buffer_size(config, width, height);
+    GlHsvThresholder plain_thresholder(width, height, YuvFormat::Yuv420, pool, config, false, egl_platform);
+    plain_thresholder.setRanges({BRIGHT_RANGE});
+    config.remap = table;
+    GlHsvThresholder remap_thresholder(width, height, YuvFormat::Yuv420, pool, config, false, egl_platform);
+    remap_thresholder.setRanges({BRIGHT_RANGE});
+
+    auto plain = threshold_once(plain_thresholder, input);
+    auto remapped = threshold_once(remap_thresholder, input);
+    auto plain_mask = read_output(plain.target, mask_size), plain_color = read_output(*plain.color, color_size);
+    auto mask = read_output(remapped.target, mask_size), color = read_output(*remapped.color, color_size);
+    for (int row = 0; row < height; row++) {
+        for (int column = 0; column < width; column++) {
+            auto i = static_cast<std::size_t>(row) * width + column;
+            double x = table->x[i], y = table->y[i];
+            bool same;
+            // The same test pack_remap makes. Black is outside BRIGHT_RANGE, so off the input the mask is clear.
+            if (x + 0.5 < 0.0 || x + 0.5 > width || y + 0.5 < 0.0 || y + 0.5 > height) {
+                same = mask[i] == 0 && color[i * 4] == 0 && color[i * 4 + 1] == 0 && color[i * 4 + 2] == 0;
+            } else {
+                auto source = static_cast<std::size_t>(std::floor(y + 0.5)) * width +
+                              static_cast<std::size_t>(std::floor(x + 0.5));
+                same = mask[i] == plain_mask[source] &&
+                       std::equal(&color[i * 4], &color[i * 4 + 4], &plain_color[source * 4]);
+            }
+            if (!same) {
+                throw std::runtime_error("gl remap mismatch at " + std::to_string(column) + ", " +
+                                         std::to_string(row));
+            }
+        }
+    }
+}
+
+// The GL backend's outputs against what the CPU makes of the same input
+static void verify_gl_backend(EglPlatform egl_platform, const PipelineBuffers &buffers) {
+    verify_gl_morphology(egl_platform, buffers);
+    verify_gl_tile_stats(egl_platform, buffers);
+    verify_gl_histogram(egl_platform, buffers);
+    verify_gl_remap(egl_platform, buffers);
+}
+
+// Resolution and pipeline depth matrix for YUV420 and NV12, on both backends. The GL backend runs on whatever
+// egl_platform gives, surfaceless by default so llvmpipe works without a display.
+static void bench_pipeline(EglPlatform egl_platform) {
+    auto buffers = pipeline_buffers();
+    std::cout << "pipeline     buffers from " << buffers.name << std::endl;
+
+    std::vector<ThresholderBackend> backends = {ThresholderBackend::Cpu};
+    if (!buffers.importable) {
+        std::cout << "pipeline     skipping gl: memfds can't be imported into EGL" << std::endl;
+    } else if (auto reason = gl_unavailable(egl_platform)) {
+        std::cout << "pipeline     skipping gl: " << *reason << std::endl;
+    } else {
+        verify_gl_backend(egl_platform, buffers);
+        backends.insert(backends.begin(), ThresholderBackend::Gl);
+    }
+
+    for (auto backend: backends) {
+        for (auto [width, height]: {std::pair{640, 480}, std::pair{1280, 720}, std::pair{1920, 1080}}) {
+            for (std::size_t depth: {1, 2, 3}) {
+                for (auto format: {YuvFormat::Yuv420, YuvFormat::Nv12}) {
+                    bench_pipeline_run({backend, egl_platform, format, width, height, depth}, buffers);
+                }
+            }
+        }
+        if (backend == ThresholderBackend::Gl) {
+            bench_pipeline_run({backend, egl_platform, YuvFormat::Nv12, 1920, 1080, 3,
+                                {{HsvThresholder::MorphologyOp::Open, 2}}}, buffers);
+            auto remap = std::make_shared<const RemapTable>(undistort_remap(TEST_LENS, 1920, 1080));
+            bench_pipeline_run({backend, egl_platform, YuvFormat::Nv12, 1920, 1080, 3, {}, remap}, buffers);
+            bench_pipeline_run({backend, egl_platform, YuvFormat::Nv12, 1920, 1080, 3, {}, {}, true}, buffers);
+        }
+    }
+}
+
+// Three cameras at different rates and sizes sharing one submission thread, like main with the GL backend but on
+// CPU thresholders. Together they ask for more than the thread can do, so frames have to be replaced, but only the
+// fast camera's: the slow one has to get every frame through.
+static void bench_scheduler() {
+    struct Source {
+        const char *name;
+        int width;
+        int height;
+        int fps;
+    };
+    constexpr Source sources[] = {
+            {"fast 640x480 at 240 fps", 640, 480, 240},
+            {"medium 1280x720 at 60 fps", 1280, 720, 60},
+            {"slow 1920x1080 at 15 fps", 1920, 1080, 15},
+    };
+    constexpr auto duration = std::chrono::seconds(2);
+
+    DmaBufPool pool(memfd_alloc, 0);
+    FrameScheduler scheduler(std::size(sources));
+    std::vector<std::unique_ptr<SyntheticYuv>> inputs;
+    std::vector<std::unique_ptr<CpuHsvThresholder>> thresholders;
+    std::vector<std::unique_ptr<ThresholdOutputs>> outputs;
+    std::vector<LatencyHistogram> latencies(std::size(sources));
+    HsvThresholder::OutputConfig config;
+    config.mode = HsvThresholder::OutputMode::Planar;
+    for (const auto &source: sources) {
+        inputs.push_back(std::make_unique<SyntheticYuv>(source.width, source.height, source.fps));
+        thresholders.push_back(std::make_unique<CpuHsvThresholder>(source.width, source.height, YuvFormat::Yuv420,
+                                                                   pool, config, 1, detected_simd_level()));
+        outputs.push_back(std::make_unique<ThresholdOutputs>(source.width, source.height, config.mode));
+    }
+
+    std::thread submission([&]() {
+        scheduler.run();
+    });
+    std::vector<std::thread> cameras;
+    auto end = bench_clock::now() + duration;
+    for (std::size_t i = 0; i < std::size(sources); i++) {
+        cameras.emplace_back([&, i]() {
+            auto period = std::chrono::nanoseconds(1'000'000'000 / sources[i].fps);
+            for (auto next = bench_clock::now(); next < end; next += period) {
+                std::this_thread::sleep_until(next);
+                auto submitted = FrameTracer::now();
+                scheduler.submit(i, [&, i, submitted]() {
+                    thresholders[i]->threshold(inputs[i]->frame(YuvFormat::Yuv420), EGL_ITU_REC709_EXT,
+                                               EGL_YUV_NARROW_RANGE_EXT, outputs[i]->pointers());
+                    latencies[i].record(FrameTracer::now() - submitted);
+                });
+            }
+        });
+    }
+    for (auto &camera: cameras) {
+        camera.join();
+    }
+    scheduler.close();
+    submission.join();
+
+    for (std::size_t i = 0; i < std::size(sources); i++) {
+        auto stats = scheduler.stats(i);
+        report("scheduler", std::string(sources[i].name) + " run", "%", stats.run * 100.0 / stats.submitted);
+        report_latency("scheduler", std::string(sources[i].name), latencies[i]);
+    }
+    auto slow = scheduler.stats(std::size(sources) - 1);
+    if (slow.replaced > slow.submitted / 10) {
+        throw std::runtime_error("scheduler starved the slow camera: " + std::to_string(slow.replaced) + " of " +
+                                 std::to_string(slow.submitted) + " frames replaced");
+    }
+}
+
+// How long a GL thresholder takes to construct with nothing in its program binary directory, and again once the
+// first one has filled it in. Frames aren't needed, so this works on drivers that can't import memfds.
+static void bench_gl_startup(EglPlatform egl_platform) {
+    if (auto reason = gl_unavailable(egl_platform)) {
+        std::cout << "gl startup   skipping: " << *reason << std::endl;
+        return;
+    }
+    constexpr int width = 1920, height = 1080;
+    auto dir = std::filesystem::temp_directory_path() / "libcamera_meme_bench_programs";
+    std::filesystem::remove_all(dir);
+    DmaBufPool pool(memfd_alloc, 0);
+
+    for (auto mode: {HsvThresholder::OutputMode::Packed, HsvThresholder::OutputMode::RangeBits}) {
+        HsvThresholder::OutputConfig config;
+        config.mode = mode;
+        config.stats = mode == HsvThresholder::OutputMode::Packed;
+        config.color = true;
+        config.bake_ranges = true;
+        config.program_binary_dir = dir.string();
+
+        for (auto run: {"cold", "warm"}) {
+            auto start = bench_clock::now();
+            GlHsvThresholder thresholder(width, height, YuvFormat::Nv12, pool, config, false, egl_platform);
+            auto seconds = seconds_since(start);
+            auto stats = thresholder.programStats();
+            report("gl startup", std::string(output_mode_name(mode)) + " " + run, "ms", seconds * 1e3);
+            report("gl startup", std::string(output_mode_name(mode)) + " " + run + " compiles", "programs",
+                   static_cast<double>(stats.compiles));
+        }
+    }
+    std::filesystem::remove_all(dir);
+}
+
+// A capture through a pipelined thresholder and a display thread that finds blobs, like main does with the camera
+static void replay_capture(const std::string &name, const CaptureReader &reader, CaptureReplay::Speed speed,
+                           ThresholderBackend backend, EglPlatform egl_platform, const PipelineBuffers &buffers) {
+    constexpr std::size_t depth = 3;
+    const auto &format = reader.format();
+    const int width = static_cast<int>(format.width), height = static_cast<int>(format.height);
+
+    HsvThresholder::OutputConfig config;
+    config.stats = true;
+    DmaBufPool output_pool(buffers.allocate, depth * 2 * 2);
+    output_pool.reserve(HsvThresholder::target_buffer_size(config, width, height), depth);
+    output_pool.reserve(HsvThresholder::stats_buffer_size(config, width, height), depth);
+
+    CaptureReplay replay(reader, buffers.allocate, depth + 2);
+    FrameTracer tracer;
+    RingQueue<HsvThresholder::OutputFrame> output_queue(output_pool.maxBuffers());
+    std::size_t blobs = 0;
+    double seconds = 0;
+    std::exception_ptr error;
+
+    std::thread worker([&]() {
+        try {
+            auto thresholder = make_hsv_thresholder(backend, width, height, format.format, output_pool, config, true,
+                                                    egl_platform);
+            thresholder->setTracer(&tracer);
+            thresholder->setOnComplete([&](HsvThresholder::OutputFrame frame) {
+                output_queue.push(std::move(frame));
+            });
+
+            std::thread display([&]() {
+                while (auto next = output_queue.pop()) {
+                    auto frame = std::move(*next);
+                    auto popped = FrameTracer::now();
+                    tracer.record(TraceStage::OutputQueue, frame.tag, frame.tag.handoff, popped);
+
+                    ScopedDmaBufSync stats_sync(frame.stats->fd(), DmaBufAccess::Read);
+                    blobs += find_blobs(frame.stats->data(), stats_tile_count(width), stats_tile_count(height),
+                                        STATS_TILE_SIZE, 64).size();
+
+                    auto done = FrameTracer::now();
+                    tracer.record(TraceStage::Readback, frame.tag, popped, done);
+                    tracer.record(TraceStage::Total, frame.tag, frame.tag.sensor_timestamp, done);
+                }
+            });
+
+            auto start = bench_clock::now();
+            replay.run(*thresholder, speed);
+            // Finishes the frames in flight, and the replay's inputs are free again after this
+            thresholder.reset();
+            seconds = seconds_since(start);
+            output_queue.close();
+            display.join();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    });
+    worker.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    auto frames = static_cast<double>(reader.frameCount());
+    report("replay", name, "fps", frames / seconds);
+    report("replay", name + " dropped", "frames", static_cast<double>(output_pool.stats().exhaustions));
+    report("replay", name + " blobs", "per frame", static_cast<double>(blobs) / frames);
+    report_latency("replay", name + " total", tracer.histogram(TraceStage::Total));
+}
+
+static void replay_capture_file(const std::string &path, CaptureReplay::Speed speed, EglPlatform egl_platform) {
+    CaptureReader reader(path);
+    auto buffers = pipeline_buffers();
+    const auto &format = reader.format();
+    std::cout << "replay       " << reader.frameCount() << " frames of " << yuv_format_name(format.format) << " "
+              << format.width << "x" << format.height << " from " << path << ", buffers from " << buffers.name
+              << std::endl;
+
+    std::vector<ThresholderBackend> backends = {ThresholderBackend::Cpu};
+    if (!buffers.importable) {
+        std::cout << "replay       skipping gl: memfds can't be imported into EGL" << std::endl;
+    } else if (auto reason = gl_unavailable(egl_platform)) {
+        std::cout << "replay       skipping gl: " << *reason << std::endl;
+    } else {
+        backends.insert(backends.begin(), ThresholderBackend::Gl);
+    }
+    for (auto backend: backends) {
+        replay_capture(backend == ThresholderBackend::Gl ? "gl" : "cpu", reader, speed, backend, egl_platform,
+                       buffers);
+    }
+}
+
+// Records synthetic 1080p NV12 frames at 120 fps the way main records the camera, checks that they read back
+// exactly, and replays them at both speeds. The recording has to keep up without dropping anything.
+static void bench_capture(EglPlatform egl_platform) {
+    constexpr int width = 1920, height = 1080, frames = 240;
+    constexpr std::int64_t frame_interval = 1'000'000'000 / 120;
+
+    SyntheticYuv yuv(width, height, 5);
+    auto source = yuv.frame(YuvFormat::Nv12);
+    CaptureFormat format{};
+    format.width = width;
+    format.height = height;
+    format.format = YuvFormat::Nv12;
+    format.encoding = EGL_ITU_REC709_EXT;
+    format.range = EGL_YUV_NARROW_RANGE_EXT;
+    for (int i = 0; i < yuv_plane_count(format.format); i++) {
+        auto [row_bytes, rows] = yuv_plane_size(format.format, i, width, height);
+        format.planes[i] = {-1, static_cast<EGLint>(format.frame_bytes), static_cast<EGLint>(row_bytes)};
+        format.frame_bytes += row_bytes * rows;
+    }
+    std::vector<uint8_t> frame(format.frame_bytes);
+    for (int i = 0; i < yuv_plane_count(format.format); i++) {
+        auto [row_bytes, rows] = yuv_plane_size(format.format, i, width, height);
+        for (int row = 0; row < rows; row++) {
+            std::memcpy(frame.data() + format.planes[i].offset + row * row_bytes,
+                        source.planes[i] + row * source.strides[i], row_bytes);
+        }
+    }
+
+    auto path = (std::filesystem::temp_directory_path() / "libcamera_meme_bench.capture").string();
+    CaptureRecorder::Stats stats{};
+    double record_seconds = 0;
+    {
+        CaptureRecorder recorder(path, format, frames);
+        auto start = FrameTracer::now();
+        for (int i = 0; i < frames; i++) {
+            auto due = start + i * frame_interval;
+            if (auto wait = due - FrameTracer::now(); wait > 0) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+            }
+            // Every frame gets its own first bytes, so the read back can tell them apart
+            std::memcpy(frame.data(), &i, sizeof(i));
+            CaptureRecord record{};
+            record.sequence = static_cast<std::uint32_t>(i * 2);
+            record.sensor_timestamp = due;
+            record.exposure_time = 1000 + i;
+
+            auto record_start = bench_clock::now();
+            recorder.record(frame.data(), record);
+            record_seconds += seconds_since(record_start);
+        }
+        stats = recorder.stats();
+    }
+    report("capture", "1080p nv12 record call", "ms", record_seconds * 1e3 / frames);
+    report("capture", "1080p nv12 dropped at 120 fps", "frames", static_cast<double>(stats.dropped));
+
+    {
+        CaptureReader reader(path);
+        if (reader.frameCount() != frames - stats.dropped) {
+            throw std::runtime_error("capture holds " + std::to_string(reader.frameCount()) + " frames, expected " +
+                                     std::to_string(frames - stats.dropped));
+        }
+        std::size_t previous = 0;
+        for (std::size_t n = 0; n < reader.frameCount(); n++) {
+            int i;
+            std::memcpy(&i, reader.frameData(n), sizeof(i));
+            std::memcpy(frame.data(), &i, sizeof(i));
+            const auto &record = reader.record(n);
+            if ((n && static_cast<std::size_t>(i) <= previous) || record.sequence != static_cast<std::uint32_t>(i * 2) ||
+                record.exposure_time != 1000 + i ||
+                std::memcmp(reader.frameData(n), frame.data(), format.frame_bytes) != 0) {
+                throw std::runtime_error("capture frame " + std::to_string(n) + " doesn't read back as recorded");
+            }
+            previous = static_cast<std::size_t>(i);
+        }
+        report("capture", "1080p nv12 file", "MB", static_cast<double>(std::filesystem::file_size(path)) / 1e6);
+    }
+
+    replay_capture_file(path, CaptureReplay::Speed::Maximum, egl_platform);
+    replay_capture_file(path, CaptureReplay::Speed::Original, egl_platform);
+    std::filesystem::remove(path);
+}
+
+// Percentiles have to land within a bucket of the exact answer, and recording has to stay cheap enough to leave on
+// in the hot path
+static void bench_frame_tracer() {
+    std::mt19937 rng(7);
+    std::lognormal_distribution<double> latency(std::log(5e6), 0.5);
+    std::vector<std::int64_t> values(100'000);
+    LatencyHistogram histogram;
+    for (auto &value: values) {
+        value = static_cast<std::int64_t>(latency(rng));
+        histogram.record(value);
+    }
+    std::sort(values.begin(), values.end());
+    for (double quantile: {0.5, 0.9, 0.99, 1.0}) {
+        auto exact = values[static_cast<std::size_t>(std::ceil(quantile * values.size())) - 1];
+        auto reported = histogram.percentile(quantile);
+        if (reported < exact || reported > exact + exact / 16 + 1) {
+            throw std::runtime_error("latency histogram p" + std::to_string(quantile * 100) + " is " +
+                                     std::to_string(reported) + ", expected " + std::to_string(exact));
+        }
+    }
+    if (histogram.min() != values.front() || histogram.max() != values.back()) {
+        throw std::runtime_error("latency histogram min or max is off");
+    }
+
+    constexpr int spans = 1'000'000;
+    for (std::size_t capacity: {std::size_t(0), std::size_t(1) << 16}) {
+        FrameTracer tracer(capacity);
+        auto start = bench_clock::now();
+        for (int i = 0; i < spans; i++) {
+            FrameTag tag{static_cast<std::uint32_t>(i), 1, 1};
+            auto now = FrameTracer::now();
+            tracer.record(TraceStage::Import, tag, now - 1000, now);
+        }
+        report("tracer", capacity ? "now + record, ring" : "now + record, histograms", "ns",
+               seconds_since(start) * 1e9 / spans);
+    }
+}
+
+// The first argument is the EGL platform for the GL pipeline runs, "surfaceless" (the default) or "default". Given a
+// capture file recorded by libcamera_meme as well, only that is replayed: as fast as possible, or with "original"
+// as the third argument at the speed it was recorded.
+int main(int argc, char **argv) {
+    auto egl_platform = argc > 1 ? egl_platform_from_name(argv[1]) : EglPlatform::Surfaceless;
+    if (argc > 2) {
+        auto speed = argc > 3 && std::string(argv[3]) == "original" ? CaptureReplay::Speed::Original
+                                                                     : CaptureReplay::Speed::Maximum;
+        replay_capture_file(argv[2], speed, egl_platform);
+        return 0;
+    }
+
+    bench_queues();
+    bench_deinterleave();
+    bench_cpu_threshold();
+    bench_dma_buf_pool();
+    bench_heap_bandwidth();
+    bench_color_lut();
+    bench_frame_tracer();
+    bench_capture(egl_platform);
+    bench_scheduler();
+    bench_gl_startup(egl_platform);
+    bench_pipeline(egl_platform);
+    return 0;
+}
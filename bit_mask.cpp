@@ -0,0 +1,72 @@
+#include "bit_mask.h"
+
+#include <bit>
+#include <cstring>
+
+static uint32_t load_word(const uint8_t *row, int word) {
+    uint32_t value;
+    std::memcpy(&value, row + word * 4, sizeof(value));
+    if constexpr (std::endian::native == std::endian::big) {
+        value = __builtin_bswap32(value);
+    }
+    return value;
+}
+
+// Padding bits past the image width are always clear on the GPU side, but don't rely on it
+static uint32_t valid_bits(int width, int word) {
+    int remaining = width - word * 32;
+    return remaining >= 32 ? ~0u : (1u << remaining) - 1;
+}
+
+std::size_t count_mask_pixels(const uint8_t *bits, std::size_t stride_words, int width, int height) {
+    int words = (width + 31) / 32;
+    std::size_t count = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = bits + y * stride_words * 4;
+        for (int word = 0; word < words; word++) {
+            count += std::popcount(load_word(row, word) & valid_bits(width, word));
+        }
+    }
+    return count;
+}
+
+void extract_mask_runs(const uint8_t *bits, std::size_t stride_words, int width, int height, std::vector<MaskRun> &runs) {
+    int words = (width + 31) / 32;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = bits + y * stride_words * 4;
+        int run_begin = -1;
+        for (int word = 0; word < words; word++) {
+            uint32_t value = load_word(row, word) & valid_bits(width, word);
+            // Skip the common cases without walking any bits
+            if (run_begin < 0 && value == 0) {
+                continue;
+            }
+            if (run_begin >= 0 && value == ~0u) {
+                continue;
+            }
+
+            int bit = 0;
+            while (bit < 32) {
+                if (run_begin < 0) {
+                    uint32_t rest = value >> bit;
+                    if (rest == 0) {
+                        break;
+                    }
+                    bit += std::countr_zero(rest);
+                    run_begin = word * 32 + bit;
+                } else {
+                    uint32_t rest = ~value >> bit;
+                    if (rest == 0) {
+                        break;
+                    }
+                    bit += std::countr_zero(rest);
+                    runs.push_back({y, run_begin, word * 32 + bit});
+                    run_begin = -1;
+                }
+            }
+        }
+        if (run_begin >= 0) {
+            runs.push_back({y, run_begin, width});
+        }
+    }
+}
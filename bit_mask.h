@@ -0,0 +1,22 @@
+#ifndef LIBCAMERA_MEME_BIT_MASK_H
+#define LIBCAMERA_MEME_BIT_MASK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Helpers for the 1 bit per pixel masks GlHsvThresholder writes in OutputMode::BitPacked: 32 pixels per
+// little endian word, leftmost pixel in bit 0, stride_words words per row.
+
+struct MaskRun {
+    int row;
+    int begin;
+    int end; // exclusive
+};
+
+std::size_t count_mask_pixels(const uint8_t *bits, std::size_t stride_words, int width, int height);
+
+// Appends every horizontal run of set pixels, in row order
+void extract_mask_runs(const uint8_t *bits, std::size_t stride_words, int width, int height, std::vector<MaskRun> &runs);
+
+#endif //LIBCAMERA_MEME_BIT_MASK_H
@@ -1,13 +1,109 @@
 #include "camera_grabber.h"
 
+#include <algorithm>
+#include <cctype>
 #include <iostream>
+#include <set>
 #include <stdexcept>
+#include <utility>
 
 #include <libcamera/control_ids.h>
 #include <sys/mman.h>
 
-CameraGrabber::CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int width, int height) : m_camera(std::move(camera)),
-                                                                                                 m_buf_allocator(m_camera) {
+// The cheapest format the thresholders can read natively, by bytes per pixel. Ties go to the pipeline's default
+// since that's usually what the ISP writes without an extra conversion.
+static std::optional<libcamera::PixelFormat> cheapest_yuv_format(const libcamera::StreamConfiguration &config) {
+    std::optional<libcamera::PixelFormat> best;
+    int best_bits = 0;
+    auto consider = [&](const libcamera::PixelFormat &pixel_format) {
+        auto format = yuv_format_from_fourcc(pixel_format.fourcc());
+        if (format && (!best || yuv_bits_per_pixel(*format) < best_bits)) {
+            best = pixel_format;
+            best_bits = yuv_bits_per_pixel(*format);
+        }
+    };
+
+    consider(config.pixelFormat);
+    for (const auto &pixel_format: config.formats().pixelformats()) {
+        consider(pixel_format);
+    }
+    return best;
+}
+
+// The bits per sample of a raw Bayer or mono format, e.g. 10 for SRGGB10_CSI2P. 0 for compressed formats, which
+// don't say.
+static unsigned int raw_bit_depth(const libcamera::PixelFormat &format) {
+    auto name = format.toString();
+    auto digits = std::find_if_not(name.begin(), name.end(), [](unsigned char c) { return std::isalpha(c); });
+    unsigned int depth = 0;
+    for (; digits != name.end() && std::isdigit(static_cast<unsigned char>(*digits)); ++digits) {
+        depth = depth * 10 + (*digits - '0');
+    }
+    return depth;
+}
+
+std::vector<CameraGrabber::SensorMode> CameraGrabber::sensorModes(libcamera::Camera &camera) {
+    auto config = camera.generateConfiguration({libcamera::StreamRole::Raw});
+    if (!config || config->size() == 0) {
+        return {};
+    }
+
+    std::vector<SensorMode> modes;
+    const auto &formats = config->at(0).formats();
+    for (const auto &format: formats.pixelformats()) {
+        auto bit_depth = raw_bit_depth(format);
+        if (!bit_depth) {
+            continue;
+        }
+        for (const auto &size: formats.sizes(format)) {
+            // Packed and unpacked variants of the same readout are the same mode
+            bool known = std::any_of(modes.begin(), modes.end(), [&](const SensorMode &mode) {
+                return mode.size == size && mode.bit_depth == bit_depth;
+            });
+            if (!known) {
+                modes.push_back({size, format, bit_depth});
+            }
+        }
+    }
+    return modes;
+}
+
+std::optional<CameraGrabber::SensorMode> pick_sensor_mode(const std::vector<CameraGrabber::SensorMode> &modes,
+                                                          int width, int height) {
+    auto area = [](const CameraGrabber::SensorMode &mode) {
+        return static_cast<std::uint64_t>(mode.size.width) * mode.size.height;
+    };
+    auto covers = [&](const CameraGrabber::SensorMode &mode) {
+        return mode.size.width >= static_cast<unsigned int>(width) &&
+               mode.size.height >= static_cast<unsigned int>(height);
+    };
+
+    auto better = [&](const CameraGrabber::SensorMode &mode, const CameraGrabber::SensorMode &best) {
+        if (covers(mode) != covers(best)) {
+            return covers(mode);
+        }
+        if (!covers(mode)) {
+            return area(mode) > area(best);
+        }
+        if (area(mode) != area(best)) {
+            return area(mode) < area(best);
+        }
+        return mode.bit_depth < best.bit_depth;
+    };
+
+    std::optional<CameraGrabber::SensorMode> best;
+    for (const auto &mode: modes) {
+        if (!best || better(mode, *best)) {
+            best = mode;
+        }
+    }
+    return best;
+}
+
+CameraGrabber::CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int width, int height,
+                             unsigned int buffer_count, std::optional<SensorMode> sensor_mode, Controls controls)
+        : m_camera(std::move(camera)), m_buf_allocator(m_camera), m_pending_controls(controls),
+          m_controls_pending(true) {
     if (m_camera->acquire()) {
         throw std::runtime_error("failed to acquire camera");
     }
@@ -16,15 +112,39 @@ CameraGrabber::CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int widt
     config->at(0).size.width = width;
     config->at(0).size.height = height;
 
+    auto pixel_format = cheapest_yuv_format(config->at(0));
+    if (!pixel_format) {
+        throw std::runtime_error("camera offers no YUV420, NV12 or YUYV output");
+    }
+    config->at(0).pixelFormat = *pixel_format;
+    if (buffer_count) {
+        config->at(0).bufferCount = buffer_count;
+    }
+    if (sensor_mode) {
+        libcamera::SensorConfiguration sensor_config;
+        sensor_config.bitDepth = sensor_mode->bit_depth;
+        sensor_config.outputSize = sensor_mode->size;
+        config->sensorConfig = sensor_config;
+    }
+
     if (config->validate() == libcamera::CameraConfiguration::Invalid) {
         throw std::runtime_error("failed to validate config");
     }
+    auto format = yuv_format_from_fourcc(config->at(0).pixelFormat.fourcc());
+    if (!format) {
+        throw std::runtime_error("camera adjusted the stream to an unsupported pixel format");
+    }
+    m_format = *format;
 
     if (m_camera->configure(config.get()) < 0) {
         throw std::runtime_error("failed to configure stream");
     }
 
-    std::cout << config->at(0).toString() << std::endl;
+    std::cout << config->at(0).toString() << " with " << config->at(0).bufferCount << " buffers";
+    if (sensor_mode) {
+        std::cout << " from sensor mode " << sensor_mode->size.toString() << " " << sensor_mode->bit_depth << "-bit";
+    }
+    std::cout << std::endl;
 
     auto stream = config->at(0).stream();
     if (m_buf_allocator.allocate(stream) < 0) {
@@ -33,12 +153,7 @@ CameraGrabber::CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int widt
     m_config = std::move(config);
 
     for (const auto &buffer: m_buf_allocator.buffers(stream)) {
-        auto request = m_camera->createRequest();
-
-        auto &controls = request->controls();
-        controls.set(libcamera::controls::FrameDurationLimits, {static_cast<int64_t>(8333), static_cast<int64_t>(8333)});
-        controls.set(libcamera::controls::ExposureTime, 1);
-
+        auto request = m_camera->createRequest(m_requests.size());
         request->addBuffer(stream, buffer.get());
         m_requests.push_back(std::move(request));
 
@@ -48,46 +163,180 @@ CameraGrabber::CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int widt
             fd = plane.fd.get();
             len += plane.length;
         }
-        auto memory = static_cast<const char *>(mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0));
-        m_mapped.emplace(fd, memory);
+        auto memory = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error("failed to mmap camera buffer");
+        }
+        m_mapped.emplace(fd, std::make_pair(static_cast<const char *>(memory), len));
     }
 
+    m_completed_at.resize(m_requests.size());
+    m_request_generation.resize(m_requests.size());
+
     m_camera->requestCompleted.connect(this, &CameraGrabber::requestComplete);
 }
 
+CameraGrabber::~CameraGrabber() {
+    if (m_started) {
+        m_camera->stop();
+    }
+    m_camera->requestCompleted.disconnect(this);
+
+    releaseBuffers();
+    m_camera->release();
+}
+
+void CameraGrabber::releaseBuffers() {
+    std::set<int> fds;
+    for (const auto &buffer: m_buf_allocator.buffers(m_config->at(0).stream())) {
+        for (const auto &plane: buffer->planes()) {
+            fds.insert(plane.fd.get());
+        }
+    }
+    if (m_onBufferReleased) {
+        for (auto fd: fds) {
+            m_onBufferReleased->operator()(fd);
+        }
+    }
+
+    for (const auto &[fd, mapping]: m_mapped) {
+        munmap(const_cast<char *>(mapping.first), mapping.second);
+    }
+    m_mapped.clear();
+
+    m_requests.clear();
+    m_buf_allocator.free(m_config->at(0).stream());
+}
+
+const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &CameraGrabber::buffers() const {
+    return m_buf_allocator.buffers(m_config->at(0).stream());
+}
+
+CameraGrabber::MappedBuffer CameraGrabber::readBuffer(const libcamera::FrameBuffer &buffer) const {
+    // Mapped under the fd of the last plane, like the constructor does it
+    int fd = buffer.planes().back().fd.get();
+    const auto &[data, size] = m_mapped.at(fd);
+    return {ScopedDmaBufSync(fd, DmaBufAccess::Read), data, size};
+}
+
 void CameraGrabber::requestComplete(libcamera::Request *request) {
     if (request->status() == libcamera::Request::RequestCancelled) {
         return;
     }
 
-    static int i = 0;
+    m_completed_at[request->cookie()] = FrameTracer::now();
 
-    i++;
+    // Only ever called from the camera manager's thread, so the sequence needs no lock
+    auto sequence = request->buffers().begin()->second->metadata().sequence;
+    if (m_last_sequence && sequence > *m_last_sequence + 1) {
+        m_skipped += sequence - *m_last_sequence - 1;
+    }
+    m_last_sequence = sequence;
+
+    auto applied = appliedControls(request);
+    {
+        std::scoped_lock lock(m_controls_mutex);
+        m_latest_applied = applied;
+    }
 
-    if(m_onData) {
+    ++m_delivered;
+    if (m_onData) {
         m_onData->operator()(request);
     }
+}
 
-    std::cout << i << std::endl;
+FrameTag CameraGrabber::frameTag(const libcamera::Request *request) const {
+    const auto &metadata = request->buffers().begin()->second->metadata();
+    FrameTag tag;
+    tag.sequence = metadata.sequence;
+    // Pipelines that don't report the control still stamp the buffer, on the same clock
+    tag.sensor_timestamp = request->metadata().get(libcamera::controls::SensorTimestamp)
+            .value_or(static_cast<std::int64_t>(metadata.timestamp));
+    tag.handoff = m_completed_at.at(request->cookie());
+    return tag;
 }
 
-void CameraGrabber::requeueRequest(libcamera::Request *request) {
-    request->reuse(libcamera::Request::ReuseFlag::ReuseBuffers);
+CameraGrabber::DeliveryStats CameraGrabber::deliveryStats() const {
+    return {m_delivered.load(), m_skipped.load()};
+}
+
+std::uint64_t CameraGrabber::setControls(const Controls &controls) {
+    std::scoped_lock lock(m_controls_mutex);
+    if (controls.frame_duration_us) {
+        m_pending_controls.frame_duration_us = controls.frame_duration_us;
+    }
+    if (controls.exposure_us) {
+        m_pending_controls.exposure_us = controls.exposure_us;
+    }
+    m_controls_pending = true;
+    return ++m_controls_generation;
+}
+
+std::optional<std::pair<std::int64_t, std::int64_t>> CameraGrabber::frameDurationLimits() const {
+    const auto &controls = m_camera->controls();
+    if (!controls.count(&libcamera::controls::FrameDurationLimits)) {
+        return std::nullopt;
+    }
+    const auto &limits = controls.at(&libcamera::controls::FrameDurationLimits);
+    return std::make_pair(limits.min().get<std::int64_t>(), limits.max().get<std::int64_t>());
+}
+
+CameraGrabber::AppliedControls CameraGrabber::appliedControls(const libcamera::Request *request) const {
+    AppliedControls applied;
+    applied.sequence = request->buffers().begin()->second->metadata().sequence;
+    {
+        std::scoped_lock lock(m_controls_mutex);
+        applied.generation = m_request_generation.at(request->cookie());
+    }
+    const auto &metadata = request->metadata();
+    applied.frame_duration_us = metadata.get(libcamera::controls::FrameDuration);
+    applied.exposure_us = metadata.get(libcamera::controls::ExposureTime);
+    return applied;
+}
+
+std::optional<CameraGrabber::AppliedControls> CameraGrabber::latestApplied() const {
+    std::scoped_lock lock(m_controls_mutex);
+    return m_latest_applied;
+}
+
+void CameraGrabber::queueRequest(libcamera::Request *request) {
+    // Held while queueing too, so requests reach the camera in the order their generations were assigned
+    std::scoped_lock lock(m_controls_mutex);
+    if (m_controls_pending) {
+        auto &controls = request->controls();
+        if (m_pending_controls.frame_duration_us) {
+            auto duration = *m_pending_controls.frame_duration_us;
+            controls.set(libcamera::controls::FrameDurationLimits, {duration, duration});
+        }
+        if (m_pending_controls.exposure_us) {
+            controls.set(libcamera::controls::ExposureTime, *m_pending_controls.exposure_us);
+        }
+        m_pending_controls = {};
+        m_controls_pending = false;
+        m_sent_generation = m_controls_generation;
+    }
+    m_request_generation.at(request->cookie()) = m_sent_generation;
+
     if (m_camera->queueRequest(request) < 0) {
         throw std::runtime_error("failed to queue request");
     }
 }
 
+void CameraGrabber::requeueRequest(libcamera::Request *request) {
+    // Also clears the controls the request last carried, libcamera keeps applying them regardless
+    request->reuse(libcamera::Request::ReuseFlag::ReuseBuffers);
+    queueRequest(request);
+}
+
 void CameraGrabber::startAndQueue() {
     if (m_camera->start()) {
         throw std::runtime_error("failed to start camera");
     }
+    m_started = true;
 
 // TODO: HANDLE THIS BETTER
     for (auto &request: m_requests) {
-        if (m_camera->queueRequest(request.get()) < 0) {
-            throw std::runtime_error("failed to queue request");
-        }
+        queueRequest(request.get());
     }
 }
 
@@ -99,6 +348,18 @@ void CameraGrabber::resetOnData() {
     m_onData.reset();
 }
 
+void CameraGrabber::setOnBufferReleased(std::function<void(int)> onBufferReleased) {
+    m_onBufferReleased = std::move(onBufferReleased);
+}
+
+void CameraGrabber::resetOnBufferReleased() {
+    m_onBufferReleased.reset();
+}
+
 const libcamera::StreamConfiguration &CameraGrabber::streamConfiguration() {
     return m_config->at(0);
 }
+
+YuvFormat CameraGrabber::yuvFormat() const {
+    return m_format;
+}
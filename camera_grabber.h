@@ -3,30 +3,139 @@
 
 #include <libcamera/camera.h>
 #include <libcamera/framebuffer_allocator.h>
+#include <libcamera/geometry.h>
+#include <libcamera/pixel_format.h>
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <functional>
 #include <optional>
+#include <vector>
+
+#include "dma_buf_alloc.h"
+#include "frame_trace.h"
+#include "yuv_conversion.h"
 
 class CameraGrabber {
 public:
-    explicit CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int width, int height);
+    struct DeliveryStats {
+        std::uint64_t delivered; // requests that reached onData
+        std::uint64_t skipped; // gaps in the sensor sequence, frames the camera dropped for lack of a queued buffer
+    };
+
+    // Staged with setControls and sent with the next request queued, libcamera keeps them until they're changed
+    struct Controls {
+        // Minimum and maximum both, so the sensor runs at exactly 1e6 / frame_duration_us fps
+        std::optional<std::int64_t> frame_duration_us;
+        std::optional<std::int32_t> exposure_us;
+    };
+
+    // What the pipeline reported for one frame. The sensor takes a few frames to apply new controls, compare the
+    // values to what was asked for to see whether a change has landed.
+    struct AppliedControls {
+        std::uint64_t sequence;
+        // The newest setControls call sent with this request or an earlier one, 0 for the constructor's
+        std::uint64_t generation;
+        std::optional<std::int64_t> frame_duration_us;
+        std::optional<std::int32_t> exposure_us;
+    };
+
+    // One of the sensor's raw readouts, binned or cropped, which the ISP scales to the stream size
+    struct SensorMode {
+        libcamera::Size size;
+        libcamera::PixelFormat format;
+        unsigned int bit_depth;
+    };
+
+    // Read-only CPU view of a whole camera buffer, bracketed with DMA_BUF_IOCTL_SYNC for as long as it lives
+    struct MappedBuffer {
+        ScopedDmaBufSync sync;
+        const char *data;
+        size_t size;
+    };
+
+    // Picks the cheapest of the YUV layouts the thresholders read natively out of what the camera offers
+    // buffer_count of 0 keeps the pipeline's default, and without a sensor_mode the pipeline picks one. Every
+    // completed request goes to the onData callback, in order, which owns it until requeueRequest. For only the
+    // newest frame, submit them to a FrameScheduler with requeueRequest as the drop callback: its slot per camera
+    // hands a frame that's still waiting back to the camera as soon as a newer one arrives.
+    explicit CameraGrabber(std::shared_ptr<libcamera::Camera> camera, int width, int height,
+                           unsigned int buffer_count = 0,
+                           std::optional<SensorMode> sensor_mode = std::nullopt,
+                           Controls controls = {8333, 1});
+    ~CameraGrabber();
+
+    // Empty for cameras without a raw stream, e.g. USB ones
+    static std::vector<SensorMode> sensorModes(libcamera::Camera &camera);
+
+    // Thread safe. Merged into any controls not yet sent, returns the generation AppliedControls reports once the
+    // request carrying them completes.
+    std::uint64_t setControls(const Controls &controls);
+    // The range the configured sensor mode allows, if the pipeline reports it
+    [[nodiscard]] std::optional<std::pair<std::int64_t, std::int64_t>> frameDurationLimits() const;
+    // Valid until the request is requeued
+    [[nodiscard]] AppliedControls appliedControls(const libcamera::Request *request) const;
+    // Of the most recently completed request
+    [[nodiscard]] std::optional<AppliedControls> latestApplied() const;
     const libcamera::StreamConfiguration &streamConfiguration();
+    YuvFormat yuvFormat() const;
     void setOnData(std::function<void(libcamera::Request*)> onData);
     void resetOnData();
+    // Called with each dma-buf fd just before the buffer behind it is freed, so importers can drop their caches
+    void setOnBufferReleased(std::function<void(int)> onBufferReleased);
+    void resetOnBufferReleased();
+
+    // The stream's buffers, allocated by the constructor and freed with the grabber
+    [[nodiscard]] const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers() const;
+    // The buffer has to belong to this grabber's stream, and the view must go before the request is requeued
+    MappedBuffer readBuffer(const libcamera::FrameBuffer &buffer) const;
+
+    // Sequence, sensor timestamp and completion time of a completed request, valid until it's requeued
+    [[nodiscard]] FrameTag frameTag(const libcamera::Request *request) const;
 
     void startAndQueue();
     void requeueRequest(libcamera::Request *request);
 
+    [[nodiscard]] DeliveryStats deliveryStats() const;
+
 private:
     std::vector<std::unique_ptr<libcamera::Request>> m_requests;
-    std::map<int, const char *> m_mapped;
+    std::map<int, std::pair<const char *, size_t>> m_mapped;
+    // FrameTracer::now() at completion, indexed by request cookie
+    std::vector<std::int64_t> m_completed_at;
+    // Controls generation sent with or before each request, indexed by request cookie
+    std::vector<std::uint64_t> m_request_generation;
     void requestComplete(libcamera::Request *request);
+    void queueRequest(libcamera::Request *request);
+    void releaseBuffers();
 
     std::shared_ptr<libcamera::Camera> m_camera;
     std::unique_ptr<libcamera::CameraConfiguration> m_config;
     libcamera::FrameBufferAllocator m_buf_allocator;
     std::optional<std::function<void(libcamera::Request*)>> m_onData;
+    std::optional<std::function<void(int)>> m_onBufferReleased;
+    YuvFormat m_format;
+    bool m_started = false;
+
+    std::atomic<std::uint64_t> m_delivered{0};
+    std::atomic<std::uint64_t> m_skipped{0};
+    std::optional<unsigned int> m_last_sequence;
+
+    mutable std::mutex m_controls_mutex;
+    Controls m_pending_controls;
+    bool m_controls_pending = false;
+    std::uint64_t m_controls_generation = 0;
+    std::uint64_t m_sent_generation = 0;
+    std::optional<AppliedControls> m_latest_applied;
 };
 
+// The smallest mode that still covers width x height, so the sensor reads out as few lines as possible and runs
+// at the highest frame rate the stream allows. That can be a crop with a narrower field of view than a binned mode
+// of the same size. Ties go to the lower bit depth, which is quicker over CSI-2. Falls back to the largest mode if
+// none is big enough, and nullopt if there are none.
+std::optional<CameraGrabber::SensorMode> pick_sensor_mode(const std::vector<CameraGrabber::SensorMode> &modes,
+                                                          int width, int height);
+
 #endif //LIBCAMERA_MEME_CAMERA_GRABBER_H
@@ -0,0 +1,309 @@
+#include "capture_file.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dma_buf_alloc.h"
+#include "frame_trace.h"
+
+static_assert(std::is_trivially_copyable_v<CaptureHeader> && std::is_trivially_copyable_v<CaptureRecord>,
+              "capture files store these structs as they are laid out in memory");
+
+static std::uint64_t align_up(std::uint64_t value) {
+    return (value + CAPTURE_ALIGNMENT - 1) / CAPTURE_ALIGNMENT * CAPTURE_ALIGNMENT;
+}
+
+CaptureRecorder::CaptureRecorder(const std::string &path, const CaptureFormat &format, std::size_t max_frames,
+                                 std::size_t staging_frames)
+        : m_staging(nullptr, std::free), m_free_staging(staging_frames), m_staged(staging_frames) {
+    if (!format.frame_bytes || !max_frames || !staging_frames) {
+        throw std::runtime_error("capture needs a frame size, a frame limit and staging buffers");
+    }
+
+    CaptureHeader header{};
+    header.magic = CaptureHeader::MAGIC;
+    header.format = format;
+    header.slot_bytes = static_cast<std::uint32_t>(align_up(format.frame_bytes));
+    header.max_frames = max_frames;
+    header.records_offset = align_up(sizeof(CaptureHeader));
+    header.slots_offset = align_up(header.records_offset + max_frames * sizeof(CaptureRecord));
+    header.frame_count = 0;
+    auto file_size = header.slots_offset + max_frames * header.slot_bytes;
+
+    // Filesystems without O_DIRECT refuse it at open
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if (m_fd < 0 && errno == EINVAL) {
+        m_direct = false;
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (m_fd < 0) {
+        throw std::runtime_error("failed to create capture file " + path);
+    }
+
+    // Allocating every block up front keeps the writes from stalling on block allocation, and fails now rather
+    // than halfway through a recording if the disk is too small
+    if (fallocate(m_fd, 0, 0, static_cast<off_t>(file_size)) < 0 &&
+        (errno != EOPNOTSUPP || ftruncate(m_fd, static_cast<off_t>(file_size)) < 0)) {
+        close(m_fd);
+        throw std::runtime_error("failed to preallocate capture file " + path);
+    }
+
+    auto *mapped = mmap(nullptr, header.slots_offset, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(m_fd);
+        throw std::runtime_error("failed to mmap capture file header");
+    }
+    m_header = static_cast<CaptureHeader *>(mapped);
+    m_records = reinterpret_cast<CaptureRecord *>(static_cast<std::uint8_t *>(mapped) + header.records_offset);
+    std::memcpy(m_header, &header, sizeof(header));
+
+    // Whole slots are written, so the padding after each frame has to be initialized once
+    auto staging_bytes = static_cast<std::size_t>(header.slot_bytes) * staging_frames;
+    m_staging.reset(static_cast<std::uint8_t *>(std::aligned_alloc(CAPTURE_ALIGNMENT, staging_bytes)));
+    if (!m_staging) {
+        munmap(m_header, header.slots_offset);
+        close(m_fd);
+        throw std::runtime_error("failed to allocate capture staging buffers");
+    }
+    std::memset(m_staging.get(), 0, staging_bytes);
+    for (std::size_t i = 0; i < staging_frames; i++) {
+        m_free_staging.push(i);
+    }
+
+    m_writer = std::thread([this]() {
+        writeFrames();
+    });
+}
+
+CaptureRecorder::~CaptureRecorder() {
+    m_staged.close();
+    m_writer.join();
+
+    auto frame_count = std::atomic_ref(m_header->frame_count).load(std::memory_order_acquire);
+    auto slots_offset = m_header->slots_offset;
+    auto used_bytes = slots_offset + frame_count * m_header->slot_bytes;
+    msync(m_header, slots_offset, MS_SYNC);
+    munmap(m_header, slots_offset);
+    // Cuts off the unused slots. If that fails the capture is still valid, just with the preallocated tail left in.
+    [[maybe_unused]] auto truncated = ftruncate(m_fd, static_cast<off_t>(used_bytes));
+    fdatasync(m_fd);
+    close(m_fd);
+}
+
+bool CaptureRecorder::record(const std::uint8_t *data, const CaptureRecord &record) {
+    if (m_failed.load(std::memory_order_relaxed) || m_next_frame >= m_header->max_frames) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto staging = m_free_staging.try_pop();
+    if (!staging) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::memcpy(m_staging.get() + *staging * m_header->slot_bytes, data, m_header->format.frame_bytes);
+    // Never blocks, there's room for every staging buffer
+    m_staged.push(Staged{*staging, m_next_frame++, record});
+    return true;
+}
+
+void CaptureRecorder::writeFrames() {
+    const auto slot_bytes = m_header->slot_bytes;
+    std::optional<off_t> previous;
+
+    while (auto staged = m_staged.pop()) {
+        if (m_failed.load(std::memory_order_relaxed)) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            m_free_staging.push(staged->staging);
+            continue;
+        }
+
+        auto offset = static_cast<off_t>(m_header->slots_offset + staged->frame * slot_bytes);
+        const auto *data = m_staging.get() + staged->staging * slot_bytes;
+        std::size_t written = 0;
+        while (written < slot_bytes) {
+            auto result = pwrite(m_fd, data + written, slot_bytes - written, offset + static_cast<off_t>(written));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            // Some filesystems accept O_DIRECT at open and only refuse the writes
+            if (result < 0 && errno == EINVAL && m_direct) {
+                m_direct = false;
+                fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            written += static_cast<std::size_t>(result);
+        }
+        m_free_staging.push(staged->staging);
+
+        if (written < slot_bytes) {
+            m_failed.store(true, std::memory_order_relaxed);
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        if (!m_direct) {
+            // Write-behind: start writeback of this frame right away, then wait for the previous one and drop it
+            // from the page cache, so dirty pages never pile up into a writeback storm
+            sync_file_range(m_fd, offset, slot_bytes, SYNC_FILE_RANGE_WRITE);
+            if (previous) {
+                sync_file_range(m_fd, *previous, slot_bytes, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                                            SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(m_fd, *previous, slot_bytes, POSIX_FADV_DONTNEED);
+            }
+            previous = offset;
+        }
+
+        // Frames are written in order, so the count only ever covers complete frames
+        m_records[staged->frame] = staged->record;
+        std::atomic_ref(m_header->frame_count).store(staged->frame + 1, std::memory_order_release);
+        m_recorded.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+CaptureRecorder::Stats CaptureRecorder::stats() const {
+    return {m_recorded.load(std::memory_order_relaxed), m_dropped.load(std::memory_order_relaxed)};
+}
+
+CaptureReader::CaptureReader(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("failed to open capture file " + path);
+    }
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < sizeof(CaptureHeader)) {
+        close(fd);
+        throw std::runtime_error("capture file " + path + " is too short");
+    }
+    m_size = static_cast<std::size_t>(st.st_size);
+    auto *mapped = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("failed to mmap capture file " + path);
+    }
+    m_data = static_cast<const std::uint8_t *>(mapped);
+    m_header = reinterpret_cast<const CaptureHeader *>(m_data);
+    // Replays read front to back
+    madvise(mapped, m_size, MADV_SEQUENTIAL);
+
+    auto invalid = [&](const std::string &reason) {
+        munmap(mapped, m_size);
+        return std::runtime_error("capture file " + path + " " + reason);
+    };
+    const auto &header = *m_header;
+    if (header.magic != CaptureHeader::MAGIC) {
+        throw invalid("is not a capture or from another version");
+    }
+    if (header.format.frame_bytes > header.slot_bytes || header.frame_count > header.max_frames ||
+        header.records_offset + header.max_frames * sizeof(CaptureRecord) > header.slots_offset ||
+        header.slots_offset + header.frame_count * header.slot_bytes > m_size) {
+        throw invalid("is truncated or corrupt");
+    }
+    const auto &format = header.format;
+    for (int i = 0; i < yuv_plane_count(format.format); i++) {
+        auto [row_bytes, rows] = yuv_plane_size(format.format, i, static_cast<int>(format.width),
+                                                static_cast<int>(format.height));
+        const auto &plane = format.planes[i];
+        if (plane.offset < 0 || plane.pitch < row_bytes ||
+            plane.offset + static_cast<std::int64_t>(plane.pitch) * (rows - 1) + row_bytes > format.frame_bytes) {
+            throw invalid("has planes outside its frames");
+        }
+    }
+}
+
+CaptureReader::~CaptureReader() {
+    munmap(const_cast<std::uint8_t *>(m_data), m_size);
+}
+
+const CaptureFormat &CaptureReader::format() const {
+    return m_header->format;
+}
+
+std::size_t CaptureReader::frameCount() const {
+    return m_header->frame_count;
+}
+
+const CaptureRecord &CaptureReader::record(std::size_t frame) const {
+    if (frame >= frameCount()) {
+        throw std::out_of_range("capture frame out of range");
+    }
+    return reinterpret_cast<const CaptureRecord *>(m_data + m_header->records_offset)[frame];
+}
+
+const std::uint8_t *CaptureReader::frameData(std::size_t frame) const {
+    if (frame >= frameCount()) {
+        throw std::out_of_range("capture frame out of range");
+    }
+    return m_data + m_header->slots_offset + frame * m_header->slot_bytes;
+}
+
+CaptureReplay::CaptureReplay(const CaptureReader &reader, const std::function<int(std::size_t)> &allocate,
+                             std::size_t input_buffers) : m_reader(reader), m_free_inputs(input_buffers) {
+    auto size = reader.format().frame_bytes;
+    for (std::size_t i = 0; i < input_buffers; i++) {
+        int fd = allocate(size);
+        auto *data = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("failed to mmap replay input buffer");
+        }
+        m_inputs.push_back({fd, static_cast<std::uint8_t *>(data)});
+        m_free_inputs.push(i);
+    }
+}
+
+CaptureReplay::~CaptureReplay() {
+    for (const auto &input: m_inputs) {
+        munmap(input.data, m_reader.format().frame_bytes);
+        close(input.fd);
+    }
+}
+
+void CaptureReplay::run(HsvThresholder &thresholder, Speed speed) {
+    const auto &format = m_reader.format();
+    const auto start = FrameTracer::now();
+    const auto first_timestamp = m_reader.frameCount() ? m_reader.record(0).sensor_timestamp : 0;
+
+    for (std::size_t frame = 0; frame < m_reader.frameCount(); frame++) {
+        const auto &record = m_reader.record(frame);
+        // Frames without a sensor timestamp just go out as soon as they can
+        if (speed == Speed::Original && first_timestamp > 0 && record.sensor_timestamp > first_timestamp) {
+            auto wait = start + (record.sensor_timestamp - first_timestamp) - FrameTracer::now();
+            if (wait > 0) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+            }
+        }
+
+        auto index = *m_free_inputs.pop();
+        const auto &input = m_inputs[index];
+        {
+            ScopedDmaBufSync sync(input.fd, DmaBufAccess::Write);
+            std::memcpy(input.data, m_reader.frameData(frame), format.frame_bytes);
+        }
+
+        auto planes = format.planes;
+        for (auto &plane: planes) {
+            plane.fd = input.fd;
+        }
+        FrameTag tag;
+        tag.sequence = record.sequence;
+        tag.sensor_timestamp = FrameTracer::now();
+        tag.handoff = tag.sensor_timestamp;
+        thresholder.testFrame(planes, format.encoding, format.range, [this, index]() {
+            m_free_inputs.push(index);
+        }, tag);
+    }
+}
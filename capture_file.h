@@ -0,0 +1,174 @@
+#ifndef LIBCAMERA_MEME_CAPTURE_FILE_H
+#define LIBCAMERA_MEME_CAPTURE_FILE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <EGL/egl.h>
+
+#include "hsv_thresholder.h"
+#include "ring_queue.h"
+#include "yuv_conversion.h"
+
+// Raw camera frames on disk. The file is preallocated when recording starts:
+//
+//   CaptureHeader | CaptureRecord[max_frames] | frame slots
+//
+// All three start on CAPTURE_ALIGNMENT boundaries, and every slot is frame_bytes rounded up to it, so frames can
+// be written with O_DIRECT and mapped straight back. Records past frame_count are unused.
+constexpr std::size_t CAPTURE_ALIGNMENT = 4096;
+
+// Everything about the stream that stays the same from frame to frame. Stored as is, in native byte order.
+struct CaptureFormat {
+    std::uint32_t width;
+    std::uint32_t height;
+    YuvFormat format;
+    EGLint encoding; // EGL_EXT_image_dma_buf_import values, what testFrame takes
+    EGLint range;
+    // Where the planes are in a frame, fd unused. Only the first yuv_plane_count(format) count.
+    std::array<HsvThresholder::DmaBufPlaneData, 3> planes;
+    std::uint32_t frame_bytes;
+};
+
+struct CaptureHeader {
+    static constexpr std::uint64_t MAGIC = 0x31305041434d434cULL; // "LCMCAP01"
+
+    std::uint64_t magic;
+    CaptureFormat format;
+    std::uint32_t slot_bytes;
+    std::uint64_t max_frames;
+    std::uint64_t records_offset;
+    std::uint64_t slots_offset;
+    // Only ever grows, written after the frame's data and record
+    std::uint64_t frame_count;
+};
+
+// Per-frame metadata. Controls the pipeline didn't report are zero.
+struct CaptureRecord {
+    std::uint32_t sequence;
+    std::int64_t sensor_timestamp; // ns, CLOCK_MONOTONIC like FrameTracer::now()
+    std::int32_t exposure_time; // us
+    float analogue_gain;
+    float digital_gain;
+    std::array<float, 2> colour_gains; // red, blue
+    std::int64_t frame_duration; // us
+};
+
+// Appends frames to a capture file without holding up the caller: record() copies the frame into one of a few
+// staging buffers and a writer thread puts it on disk with O_DIRECT, so capture neither blocks on writeback nor
+// evicts the pipeline's working set from the page cache. Filesystems without O_DIRECT (tmpfs) get buffered writes
+// with write-behind instead. When the disk falls behind and every staging buffer is busy, frames are dropped from
+// the recording, never from the pipeline.
+class CaptureRecorder {
+public:
+    struct Stats {
+        std::uint64_t recorded;
+        std::uint64_t dropped; // staging full, or the file was
+    };
+
+    // Replaces whatever is at path and preallocates room for max_frames
+    CaptureRecorder(const std::string &path, const CaptureFormat &format, std::size_t max_frames,
+                    std::size_t staging_frames = 4);
+    // Writes out what's staged and leaves a complete file behind
+    ~CaptureRecorder();
+
+    CaptureRecorder(const CaptureRecorder &) = delete;
+    CaptureRecorder &operator=(const CaptureRecorder &) = delete;
+
+    // data holds format.frame_bytes bytes laid out like format.planes. Returns false if the frame was dropped.
+    // Safe to call from one thread at a time, typically the camera's.
+    bool record(const std::uint8_t *data, const CaptureRecord &record);
+
+    [[nodiscard]] Stats stats() const;
+
+private:
+    struct Staged {
+        std::size_t staging;
+        std::uint64_t frame;
+        CaptureRecord record;
+    };
+
+    void writeFrames();
+
+    int m_fd = -1;
+    bool m_direct = true;
+    // Mapped, along with the records after it. Frames never are, they go through pwrite.
+    CaptureHeader *m_header = nullptr;
+    CaptureRecord *m_records = nullptr;
+    std::uint64_t m_next_frame = 0;
+    // Set by the writer after a failed write, every frame after that is dropped
+    std::atomic<bool> m_failed{false};
+
+    std::unique_ptr<std::uint8_t, void (*)(void *)> m_staging;
+    RingQueue<std::size_t> m_free_staging;
+    RingQueue<Staged> m_staged;
+    std::thread m_writer;
+
+    std::atomic<std::uint64_t> m_recorded{0};
+    std::atomic<std::uint64_t> m_dropped{0};
+};
+
+// A capture file mapped read-only
+class CaptureReader {
+public:
+    explicit CaptureReader(const std::string &path);
+    ~CaptureReader();
+
+    CaptureReader(const CaptureReader &) = delete;
+    CaptureReader &operator=(const CaptureReader &) = delete;
+
+    [[nodiscard]] const CaptureFormat &format() const;
+    [[nodiscard]] std::size_t frameCount() const;
+    [[nodiscard]] const CaptureRecord &record(std::size_t frame) const;
+    [[nodiscard]] const std::uint8_t *frameData(std::size_t frame) const;
+
+private:
+    const std::uint8_t *m_data;
+    std::size_t m_size;
+    const CaptureHeader *m_header;
+};
+
+// Feeds a capture to a thresholder the way the camera would: frames are copied out of the file into a few input
+// dma-bufs, and each one is reused once the thresholder releases it.
+class CaptureReplay {
+public:
+    enum class Speed {
+        // Frames go out as far apart as their sensor timestamps were
+        Original,
+        // Each frame goes out as soon as an input buffer is free
+        Maximum,
+    };
+
+    // allocate returns dma-buf fds, e.g. DmaBufAlloc::alloc_buf. The replay owns them, so the thresholder has to be
+    // done with every frame before the replay goes.
+    CaptureReplay(const CaptureReader &reader, const std::function<int(std::size_t)> &allocate,
+                  std::size_t input_buffers = 4);
+    ~CaptureReplay();
+
+    CaptureReplay(const CaptureReplay &) = delete;
+    CaptureReplay &operator=(const CaptureReplay &) = delete;
+
+    // Runs every frame through the thresholder on the calling thread, which has to be the thresholder's.
+    // Frames are tagged with their recorded sequence and the time they were submitted, which stands in for the
+    // sensor timestamp. Returns once the last frame has been submitted.
+    void run(HsvThresholder &thresholder, Speed speed);
+
+private:
+    struct Input {
+        int fd;
+        std::uint8_t *data;
+    };
+
+    const CaptureReader &m_reader;
+    std::vector<Input> m_inputs;
+    RingQueue<std::size_t> m_free_inputs;
+};
+
+#endif //LIBCAMERA_MEME_CAPTURE_FILE_H
@@ -0,0 +1,152 @@
+#include "color_lut.h"
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "hsv_color.h"
+
+ColorClassifier hsv_box_classifier(const std::array<float, 3> &lower, const std::array<float, 3> &upper) {
+    return [lower, upper](float r, float g, float b) {
+        return hsv_in_range(rgb_to_hsv(r, g, b), lower, upper);
+    };
+}
+
+ColorClassifier hsv_ranges_classifier(std::vector<HsvRange> ranges) {
+    return [ranges = std::move(ranges)](float r, float g, float b) {
+        auto hsv = rgb_to_hsv(r, g, b);
+        return std::any_of(ranges.begin(), ranges.end(), [&](const HsvRange &range) {
+            return hsv_in_range(hsv, range);
+        });
+    };
+}
+
+ColorLut::ColorLut(int size, const ColorClassifier &classify, const YuvToRgb &conversion) : m_size(size) {
+    if (size < 2 || size > MAX_SIZE || !std::has_single_bit(static_cast<unsigned int>(size))) {
+        throw std::runtime_error("color lut size has to be a power of two up to " + std::to_string(MAX_SIZE));
+    }
+
+    // Roughly square atlas, 8x8 slices for 64 entries per axis and 16x8 for 128
+    int bits = std::countr_zero(static_cast<unsigned int>(size));
+    m_columns = 1 << ((bits + 1) / 2);
+    m_atlas.resize(static_cast<std::size_t>(atlasWidth()) * atlasHeight());
+
+    // In 8 bit steps, what the coefficients are per
+    float step = 255.0f / static_cast<float>(size - 1);
+    for (int cr = 0; cr < size; cr++) {
+        int origin_x = (cr % m_columns) * size;
+        int origin_y = (cr / m_columns) * size;
+        float cr_offset = static_cast<float>(cr) * step - 128.0f;
+        for (int cb = 0; cb < size; cb++) {
+            uint8_t *row = m_atlas.data() + static_cast<std::size_t>(origin_y + cb) * atlasWidth() + origin_x;
+            float cb_offset = static_cast<float>(cb) * step - 128.0f;
+            for (int y = 0; y < size; y++) {
+                float luma = (static_cast<float>(y) * step - conversion.y_offset) * conversion.y_scale;
+                float r = std::clamp(luma + conversion.cr_r * cr_offset, 0.0f, 1.0f);
+                float g = std::clamp(luma + conversion.cb_g * cb_offset + conversion.cr_g * cr_offset, 0.0f, 1.0f);
+                float b = std::clamp(luma + conversion.cb_b * cb_offset, 0.0f, 1.0f);
+                row[y] = classify(r, g, b) ? 255 : 0;
+            }
+        }
+    }
+}
+
+int ColorLut::size() const {
+    return m_size;
+}
+
+int ColorLut::columns() const {
+    return m_columns;
+}
+
+int ColorLut::atlasWidth() const {
+    return m_columns * m_size;
+}
+
+int ColorLut::atlasHeight() const {
+    return m_size / m_columns * m_size;
+}
+
+const uint8_t *ColorLut::data() const {
+    return m_atlas.data();
+}
+
+bool ColorLut::contains(float y, float cb, float cr) const {
+    auto cell = [&](float value) {
+        return std::clamp(static_cast<int>(value * static_cast<float>(m_size - 1) + 0.5f), 0, m_size - 1);
+    };
+    int cell_cr = cell(cr);
+    int x = (cell_cr % m_columns) * m_size + cell(y);
+    int row = (cell_cr / m_columns) * m_size + cell(cb);
+    return m_atlas[static_cast<std::size_t>(row) * atlasWidth() + x] != 0;
+}
+
+ColorLutBuilder::ColorLutBuilder(int size, ColorClassifier classify) : m_size(size), m_classify(std::move(classify)) {
+    m_thread = std::thread([this]() {
+        run();
+    });
+}
+
+ColorLutBuilder::~ColorLutBuilder() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_one();
+    m_thread.join();
+}
+
+void ColorLutBuilder::request(ColorClassifier classify) {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_classify = std::move(classify);
+        m_pending = true;
+    }
+    m_cond.notify_one();
+}
+
+ColorLut ColorLutBuilder::rebuild(const YuvToRgb &conversion) {
+    ColorClassifier classify;
+    {
+        std::scoped_lock lock(m_mutex);
+        m_conversion = conversion;
+        m_generation++;
+        m_pending = false;
+        m_finished.reset();
+        classify = m_classify;
+    }
+    return {m_size, classify, conversion};
+}
+
+std::unique_ptr<ColorLut> ColorLutBuilder::takeFinished() {
+    std::scoped_lock lock(m_mutex);
+    return std::move(m_finished);
+}
+
+void ColorLutBuilder::run() {
+    while (true) {
+        ColorClassifier classify;
+        YuvToRgb conversion;
+        int generation;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&]{ return m_stopping || (m_pending && m_conversion); });
+            if (m_stopping) {
+                return;
+            }
+            classify = m_classify;
+            conversion = *m_conversion;
+            generation = m_generation;
+            m_pending = false;
+        }
+
+        auto lut = std::make_unique<ColorLut>(m_size, classify, conversion);
+
+        std::scoped_lock lock(m_mutex);
+        if (generation == m_generation) {
+            m_finished = std::move(lut);
+        }
+    }
+}
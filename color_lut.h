@@ -0,0 +1,86 @@
+#ifndef LIBCAMERA_MEME_COLOR_LUT_H
+#define LIBCAMERA_MEME_COLOR_LUT_H
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "hsv_color.h"
+#include "yuv_conversion.h"
+
+// Decides whether an RGB color, components in [0, 1], is part of the target. Any shape of region works, not
+// just the HSV box the shader tests.
+using ColorClassifier = std::function<bool(float r, float g, float b)>;
+
+// The shader's inRange(rgb2hsv(color)) test
+ColorClassifier hsv_box_classifier(const std::array<float, 3> &lower, const std::array<float, 3> &upper);
+// Inside any of the ranges, what the shader tests when given several
+ColorClassifier hsv_ranges_classifier(std::vector<HsvRange> ranges);
+
+// A size^3 table of classifier answers sampled on a regular grid of the camera's Y'CbCr samples, normalized to
+// [0, 1], and looked up by rounding to the nearest grid point. Each grid point is converted to RGB with the
+// frame's conversion before it's classified, so the shader looks up its samples as they are. GLES2 has no 3D
+// textures, so the table is stored as a 2D atlas of size x size slices, one per Cr level, columns() slices to an
+// atlas row. Entries are 0 or 255 so it uploads as a luminance texture.
+class ColorLut {
+public:
+    // size has to be a power of two from 2 to MAX_SIZE
+    static constexpr int MAX_SIZE = 128;
+
+    ColorLut(int size, const ColorClassifier &classify, const YuvToRgb &conversion);
+
+    [[nodiscard]] int size() const;
+    [[nodiscard]] int columns() const;
+    [[nodiscard]] int atlasWidth() const;
+    [[nodiscard]] int atlasHeight() const;
+    [[nodiscard]] const uint8_t *data() const;
+
+    // The same lookup the shader does, with 8 bit samples divided by 255
+    [[nodiscard]] bool contains(float y, float cb, float cr) const;
+private:
+    int m_size;
+    int m_columns;
+    std::vector<uint8_t> m_atlas;
+};
+
+// Builds tables on a thread of its own so changing the thresholds never stalls a frame. Requests that arrive
+// while a build is running replace each other, only the newest one is built next. Nothing is built in the
+// background before the first rebuild says which conversion the frames use.
+class ColorLutBuilder {
+public:
+    ColorLutBuilder(int size, ColorClassifier classify);
+    ~ColorLutBuilder();
+
+    ColorLutBuilder(const ColorLutBuilder &) = delete;
+    ColorLutBuilder &operator=(const ColorLutBuilder &) = delete;
+
+    void request(ColorClassifier classify);
+    // The newest classifier's table for frames with this conversion, built on the calling thread. Later requests
+    // are built for it too, and tables still being built for the old one are thrown away.
+    ColorLut rebuild(const YuvToRgb &conversion);
+    // The newest finished table if there is one that hasn't been taken yet. Never blocks.
+    std::unique_ptr<ColorLut> takeFinished();
+private:
+    void run();
+
+    int m_size;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    ColorClassifier m_classify; // the newest request
+    bool m_pending = false;
+    std::optional<YuvToRgb> m_conversion;
+    int m_generation = 0; // bumped by every rebuild, a table built before one is stale
+    std::unique_ptr<ColorLut> m_finished;
+    bool m_stopping = false;
+
+    std::thread m_thread;
+};
+
+#endif //LIBCAMERA_MEME_COLOR_LUT_H
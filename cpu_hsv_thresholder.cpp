@@ -0,0 +1,731 @@
+#include "cpu_hsv_thresholder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dma_buf_alloc.h"
+#include "hsv_color.h"
+#include "mask_stats.h"
+#include "yuv_conversion.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIBCAMERA_MEME_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+// ARMv7 NEON has no float division, it stays on the scalar loop
+#include <arm_neon.h>
+#define LIBCAMERA_MEME_NEON 1
+#endif
+
+namespace {
+    // The shader compares against the thresholds widened by its epsilon, these are stored already widened
+    struct ThresholdParams {
+        YuvToRgb yuv;
+        int range_count;
+        float lower[HsvThresholder::MAX_RANGES][3];
+        float upper[HsvThresholder::MAX_RANGES][3];
+        bool wraps[HsvThresholder::MAX_RANGES];
+        // What a pixel inside each range ORs into its mask byte: 255 for one bit masks, 1 << i for range bits
+        int bits[HsvThresholder::MAX_RANGES];
+    };
+}
+
+static ThresholdParams make_params(EGLint encoding, EGLint range, const std::vector<HsvRange> &ranges,
+                                   bool range_bits) {
+    ThresholdParams params{yuv_to_rgb_coefficients(encoding, range), static_cast<int>(ranges.size()), {}, {}, {}, {}};
+    for (std::size_t r = 0; r < ranges.size(); r++) {
+        for (int i = 0; i < 3; i++) {
+            params.lower[r][i] = ranges[r].lower[i] - HSV_RANGE_EPSILON;
+            params.upper[r][i] = ranges[r].upper[i] + HSV_RANGE_EPSILON;
+        }
+        params.wraps[r] = ranges[r].hueWraps();
+        params.bits[r] = range_bits ? 1 << r : 255;
+    }
+    return params;
+}
+
+static inline uint8_t to_unorm8(float value) {
+    return static_cast<uint8_t>(static_cast<int>(value * 255.0f + 0.5f));
+}
+
+// The reference for the vector kernels, which do the same float operations as rgb_to_hsv in the same order so
+// the results are bit identical. Output bytes are laid out the way the GL pass writes them into ARGB8888, R G B then mask.
+static void threshold_row_scalar(const uint8_t *y, const uint8_t *u, const uint8_t *v, int begin, int end,
+                                 const ThresholdParams &p, uint8_t *mask, uint8_t *packed, uint8_t *color) {
+    for (int x = begin; x < end; x++) {
+        float luma = (static_cast<float>(y[x]) - p.yuv.y_offset) * p.yuv.y_scale;
+        float cb = static_cast<float>(u[x / 2]) - 128.0f;
+        float cr = static_cast<float>(v[x / 2]) - 128.0f;
+        float r = std::clamp(luma + p.yuv.cr_r * cr, 0.0f, 1.0f);
+        float g = std::clamp(luma + p.yuv.cb_g * cb + p.yuv.cr_g * cr, 0.0f, 1.0f);
+        float b = std::clamp(luma + p.yuv.cb_b * cb, 0.0f, 1.0f);
+
+        auto hsv = rgb_to_hsv(r, g, b);
+        uint8_t m = 0;
+        for (int i = 0; i < p.range_count; i++) {
+            bool above_hue = hsv.h >= p.lower[i][0];
+            bool below_hue = hsv.h <= p.upper[i][0];
+            bool hue = p.wraps[i] ? above_hue || below_hue : above_hue && below_hue;
+            if (hue && hsv.s >= p.lower[i][1] && hsv.v >= p.lower[i][2] && hsv.s <= p.upper[i][1] &&
+                hsv.v <= p.upper[i][2]) {
+                m |= p.bits[i];
+            }
+        }
+
+        mask[x] = m;
+        if (packed) {
+            packed[x * 4] = to_unorm8(r);
+            packed[x * 4 + 1] = to_unorm8(g);
+            packed[x * 4 + 2] = to_unorm8(b);
+            packed[x * 4 + 3] = m;
+        }
+        if (color) {
+            color[x * 4] = to_unorm8(r);
+            color[x * 4 + 1] = to_unorm8(g);
+            color[x * 4 + 2] = to_unorm8(b);
+            color[x * 4 + 3] = 255;
+        }
+    }
+}
+
+// The vector kernels all take 16 pixels (8 chroma samples) per iteration and hand the tail to the scalar loop.
+// Colors and the mask come out as 0 to 255 in 32 bit lanes and get narrowed back to bytes at the end.
+
+#ifdef LIBCAMERA_MEME_X86
+__attribute__((target("sse2"), always_inline))
+static inline __m128 select_sse2(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline __m128i range_mask_sse2(__m128 h, __m128 s, __m128 val, const ThresholdParams &p) {
+    __m128i mask = _mm_setzero_si128();
+    for (int i = 0; i < p.range_count; i++) {
+        __m128 above_hue = _mm_cmpge_ps(h, _mm_set1_ps(p.lower[i][0]));
+        __m128 below_hue = _mm_cmple_ps(h, _mm_set1_ps(p.upper[i][0]));
+        __m128 in_range = p.wraps[i] ? _mm_or_ps(above_hue, below_hue) : _mm_and_ps(above_hue, below_hue);
+        in_range = _mm_and_ps(in_range, _mm_and_ps(_mm_cmpge_ps(s, _mm_set1_ps(p.lower[i][1])),
+                                                   _mm_cmpge_ps(val, _mm_set1_ps(p.lower[i][2]))));
+        in_range = _mm_and_ps(in_range, _mm_and_ps(_mm_cmple_ps(s, _mm_set1_ps(p.upper[i][1])),
+                                                   _mm_cmple_ps(val, _mm_set1_ps(p.upper[i][2]))));
+        mask = _mm_or_si128(mask, _mm_and_si128(_mm_castps_si128(in_range), _mm_set1_epi32(p.bits[i])));
+    }
+    return mask;
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline void threshold4_sse2(__m128i y, __m128i u, __m128i v, const ThresholdParams &p,
+                                   __m128i &r8, __m128i &g8, __m128i &b8, __m128i &m8) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    __m128 luma = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(y), _mm_set1_ps(p.yuv.y_offset)), _mm_set1_ps(p.yuv.y_scale));
+    __m128 cb = _mm_sub_ps(_mm_cvtepi32_ps(u), _mm_set1_ps(128.0f));
+    __m128 cr = _mm_sub_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(128.0f));
+    __m128 r = _mm_add_ps(luma, _mm_mul_ps(_mm_set1_ps(p.yuv.cr_r), cr));
+    __m128 g = _mm_add_ps(_mm_add_ps(luma, _mm_mul_ps(_mm_set1_ps(p.yuv.cb_g), cb)),
+                          _mm_mul_ps(_mm_set1_ps(p.yuv.cr_g), cr));
+    __m128 b = _mm_add_ps(luma, _mm_mul_ps(_mm_set1_ps(p.yuv.cb_b), cb));
+    r = _mm_max_ps(_mm_min_ps(r, one), zero);
+    g = _mm_max_ps(_mm_min_ps(g, one), zero);
+    b = _mm_max_ps(_mm_min_ps(b, one), zero);
+
+    __m128 gb = _mm_cmpge_ps(g, b);
+    __m128 o_x = select_sse2(gb, g, b);
+    __m128 o_y = select_sse2(gb, b, g);
+    __m128 o_z = select_sse2(gb, zero, _mm_set1_ps(-1.0f));
+    __m128 o_w = select_sse2(gb, _mm_set1_ps(-1.0f / 3.0f), _mm_set1_ps(2.0f / 3.0f));
+    __m128 ro = _mm_cmpge_ps(r, o_x);
+    __m128 t_x = select_sse2(ro, r, o_x);
+    __m128 t_y = o_y;
+    __m128 t_z = select_sse2(ro, o_z, o_w);
+    __m128 t_w = select_sse2(ro, o_x, r);
+
+    __m128 chroma = _mm_sub_ps(t_x, _mm_min_ps(t_w, t_y));
+    const __m128 n = _mm_set1_ps(1.0e-10f);
+    __m128 h = _mm_add_ps(t_z, _mm_div_ps(_mm_sub_ps(t_w, t_y), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(6.0f), chroma), n)));
+    h = _mm_andnot_ps(_mm_set1_ps(-0.0f), h);
+    __m128 s = _mm_div_ps(chroma, _mm_add_ps(t_x, n));
+    __m128 val = t_x;
+
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    r8 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, scale), half));
+    g8 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, scale), half));
+    b8 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half));
+    m8 = range_mask_sse2(h, s, val, p);
+}
+
+// Zero extends 16 bytes into four vectors of 32 bit lanes
+__attribute__((target("sse2"), always_inline))
+static inline void widen_sse2(__m128i bytes, __m128i out[4]) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    out[0] = _mm_unpacklo_epi16(lo, zero);
+    out[1] = _mm_unpackhi_epi16(lo, zero);
+    out[2] = _mm_unpacklo_epi16(hi, zero);
+    out[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline __m128i narrow_sse2(const __m128i in[4]) {
+    return _mm_packus_epi16(_mm_packs_epi32(in[0], in[1]), _mm_packs_epi32(in[2], in[3]));
+}
+
+// Interleaves four planes of 16 bytes into 16 four byte pixels
+__attribute__((target("sse2"), always_inline))
+static inline void store_interleaved_sse2(uint8_t *dst, __m128i a, __m128i b, __m128i c, __m128i d) {
+    __m128i ab_lo = _mm_unpacklo_epi8(a, b);
+    __m128i ab_hi = _mm_unpackhi_epi8(a, b);
+    __m128i cd_lo = _mm_unpacklo_epi8(c, d);
+    __m128i cd_hi = _mm_unpackhi_epi8(c, d);
+    auto out = reinterpret_cast<__m128i *>(dst);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(ab_lo, cd_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(ab_lo, cd_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(ab_hi, cd_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(ab_hi, cd_hi));
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline void store_outputs_sse2(int x, __m128i r8, __m128i g8, __m128i b8, __m128i m8,
+                                      uint8_t *mask, uint8_t *packed, uint8_t *color) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(mask + x), m8);
+    if (packed) {
+        store_interleaved_sse2(packed + x * 4, r8, g8, b8, m8);
+    }
+    if (color) {
+        store_interleaved_sse2(color + x * 4, r8, g8, b8, _mm_set1_epi8(-1));
+    }
+}
+
+__attribute__((target("sse2")))
+static void threshold_row_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, int width,
+                               const ThresholdParams &p, uint8_t *mask, uint8_t *packed, uint8_t *color) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i y16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+        __m128i u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(u + x / 2));
+        __m128i v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v + x / 2));
+
+        // Each chroma sample covers two pixels
+        __m128i ys[4], us[4], vs[4];
+        widen_sse2(y16, ys);
+        widen_sse2(_mm_unpacklo_epi8(u8, u8), us);
+        widen_sse2(_mm_unpacklo_epi8(v8, v8), vs);
+
+        __m128i r[4], g[4], b[4], m[4];
+        for (int i = 0; i < 4; i++) {
+            threshold4_sse2(ys[i], us[i], vs[i], p, r[i], g[i], b[i], m[i]);
+        }
+        store_outputs_sse2(x, narrow_sse2(r), narrow_sse2(g), narrow_sse2(b), narrow_sse2(m), mask, packed, color);
+    }
+
+    threshold_row_scalar(y, u, v, x, width, p, mask, packed, color);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i range_mask_avx2(__m256 h, __m256 s, __m256 val, const ThresholdParams &p) {
+    __m256i mask = _mm256_setzero_si256();
+    for (int i = 0; i < p.range_count; i++) {
+        __m256 above_hue = _mm256_cmp_ps(h, _mm256_set1_ps(p.lower[i][0]), _CMP_GE_OQ);
+        __m256 below_hue = _mm256_cmp_ps(h, _mm256_set1_ps(p.upper[i][0]), _CMP_LE_OQ);
+        __m256 in_range = p.wraps[i] ? _mm256_or_ps(above_hue, below_hue) : _mm256_and_ps(above_hue, below_hue);
+        in_range = _mm256_and_ps(in_range, _mm256_and_ps(_mm256_cmp_ps(s, _mm256_set1_ps(p.lower[i][1]), _CMP_GE_OQ),
+                                                         _mm256_cmp_ps(val, _mm256_set1_ps(p.lower[i][2]), _CMP_GE_OQ)));
+        in_range = _mm256_and_ps(in_range, _mm256_and_ps(_mm256_cmp_ps(s, _mm256_set1_ps(p.upper[i][1]), _CMP_LE_OQ),
+                                                         _mm256_cmp_ps(val, _mm256_set1_ps(p.upper[i][2]), _CMP_LE_OQ)));
+        mask = _mm256_or_si256(mask, _mm256_and_si256(_mm256_castps_si256(in_range), _mm256_set1_epi32(p.bits[i])));
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void threshold8_avx2(__m256i y, __m256i u, __m256i v, const ThresholdParams &p,
+                                   __m256i &r8, __m256i &g8, __m256i &b8, __m256i &m8) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    __m256 luma = _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(y), _mm256_set1_ps(p.yuv.y_offset)),
+                                _mm256_set1_ps(p.yuv.y_scale));
+    __m256 cb = _mm256_sub_ps(_mm256_cvtepi32_ps(u), _mm256_set1_ps(128.0f));
+    __m256 cr = _mm256_sub_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(128.0f));
+    __m256 r = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(p.yuv.cr_r), cr));
+    __m256 g = _mm256_add_ps(_mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(p.yuv.cb_g), cb)),
+                             _mm256_mul_ps(_mm256_set1_ps(p.yuv.cr_g), cr));
+    __m256 b = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(p.yuv.cb_b), cb));
+    r = _mm256_max_ps(_mm256_min_ps(r, one), zero);
+    g = _mm256_max_ps(_mm256_min_ps(g, one), zero);
+    b = _mm256_max_ps(_mm256_min_ps(b, one), zero);
+
+    // blendv takes the second operand where the mask is set
+    __m256 gb = _mm256_cmp_ps(g, b, _CMP_GE_OQ);
+    __m256 o_x = _mm256_blendv_ps(b, g, gb);
+    __m256 o_y = _mm256_blendv_ps(g, b, gb);
+    __m256 o_z = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), zero, gb);
+    __m256 o_w = _mm256_blendv_ps(_mm256_set1_ps(2.0f / 3.0f), _mm256_set1_ps(-1.0f / 3.0f), gb);
+    __m256 ro = _mm256_cmp_ps(r, o_x, _CMP_GE_OQ);
+    __m256 t_x = _mm256_blendv_ps(o_x, r, ro);
+    __m256 t_y = o_y;
+    __m256 t_z = _mm256_blendv_ps(o_w, o_z, ro);
+    __m256 t_w = _mm256_blendv_ps(r, o_x, ro);
+
+    __m256 chroma = _mm256_sub_ps(t_x, _mm256_min_ps(t_w, t_y));
+    const __m256 n = _mm256_set1_ps(1.0e-10f);
+    __m256 h = _mm256_add_ps(t_z, _mm256_div_ps(_mm256_sub_ps(t_w, t_y),
+                                                _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(6.0f), chroma), n)));
+    h = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), h);
+    __m256 s = _mm256_div_ps(chroma, _mm256_add_ps(t_x, n));
+    __m256 val = t_x;
+
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    r8 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(r, scale), half));
+    g8 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(g, scale), half));
+    b8 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(b, scale), half));
+    m8 = range_mask_avx2(h, s, val, p);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m128i narrow_avx2(__m256i lo, __m256i hi) {
+    // packs works per 128 bit lane, the permute puts the 16 words back in pixel order
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+}
+
+__attribute__((target("avx2")))
+static void threshold_row_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v, int width,
+                               const ThresholdParams &p, uint8_t *mask, uint8_t *packed, uint8_t *color) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i y16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+        __m128i u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(u + x / 2));
+        __m128i v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v + x / 2));
+        __m128i u16 = _mm_unpacklo_epi8(u8, u8);
+        __m128i v16 = _mm_unpacklo_epi8(v8, v8);
+
+        __m256i r[2], g[2], b[2], m[2];
+        threshold8_avx2(_mm256_cvtepu8_epi32(y16), _mm256_cvtepu8_epi32(u16), _mm256_cvtepu8_epi32(v16), p,
+                        r[0], g[0], b[0], m[0]);
+        threshold8_avx2(_mm256_cvtepu8_epi32(_mm_srli_si128(y16, 8)), _mm256_cvtepu8_epi32(_mm_srli_si128(u16, 8)),
+                        _mm256_cvtepu8_epi32(_mm_srli_si128(v16, 8)), p, r[1], g[1], b[1], m[1]);
+        store_outputs_sse2(x, narrow_avx2(r[0], r[1]), narrow_avx2(g[0], g[1]), narrow_avx2(b[0], b[1]),
+                           narrow_avx2(m[0], m[1]), mask, packed, color);
+    }
+
+    threshold_row_scalar(y, u, v, x, width, p, mask, packed, color);
+}
+#endif
+
+#ifdef LIBCAMERA_MEME_NEON
+static inline uint32x4_t range_mask_neon(float32x4_t h, float32x4_t s, float32x4_t val, const ThresholdParams &p) {
+    uint32x4_t mask = vdupq_n_u32(0);
+    for (int i = 0; i < p.range_count; i++) {
+        uint32x4_t above_hue = vcgeq_f32(h, vdupq_n_f32(p.lower[i][0]));
+        uint32x4_t below_hue = vcleq_f32(h, vdupq_n_f32(p.upper[i][0]));
+        uint32x4_t in_range = p.wraps[i] ? vorrq_u32(above_hue, below_hue) : vandq_u32(above_hue, below_hue);
+        in_range = vandq_u32(in_range, vandq_u32(vcgeq_f32(s, vdupq_n_f32(p.lower[i][1])),
+                                                 vcgeq_f32(val, vdupq_n_f32(p.lower[i][2]))));
+        in_range = vandq_u32(in_range, vandq_u32(vcleq_f32(s, vdupq_n_f32(p.upper[i][1])),
+                                                 vcleq_f32(val, vdupq_n_f32(p.upper[i][2]))));
+        mask = vorrq_u32(mask, vandq_u32(in_range, vdupq_n_u32(static_cast<uint32_t>(p.bits[i]))));
+    }
+    return mask;
+}
+
+static inline void threshold4_neon(float32x4_t y, float32x4_t u, float32x4_t v, const ThresholdParams &p,
+                                   uint32x4_t &r8, uint32x4_t &g8, uint32x4_t &b8, uint32x4_t &m8) {
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+
+    // Separate multiplies and adds, a fused multiply-add would round differently from the scalar loop
+    float32x4_t luma = vmulq_f32(vsubq_f32(y, vdupq_n_f32(p.yuv.y_offset)), vdupq_n_f32(p.yuv.y_scale));
+    float32x4_t cb = vsubq_f32(u, vdupq_n_f32(128.0f));
+    float32x4_t cr = vsubq_f32(v, vdupq_n_f32(128.0f));
+    float32x4_t r = vaddq_f32(luma, vmulq_f32(vdupq_n_f32(p.yuv.cr_r), cr));
+    float32x4_t g = vaddq_f32(vaddq_f32(luma, vmulq_f32(vdupq_n_f32(p.yuv.cb_g), cb)),
+                              vmulq_f32(vdupq_n_f32(p.yuv.cr_g), cr));
+    float32x4_t b = vaddq_f32(luma, vmulq_f32(vdupq_n_f32(p.yuv.cb_b), cb));
+    r = vmaxq_f32(vminq_f32(r, one), zero);
+    g = vmaxq_f32(vminq_f32(g, one), zero);
+    b = vmaxq_f32(vminq_f32(b, one), zero);
+
+    uint32x4_t gb = vcgeq_f32(g, b);
+    float32x4_t o_x = vbslq_f32(gb, g, b);
+    float32x4_t o_y = vbslq_f32(gb, b, g);
+    float32x4_t o_z = vbslq_f32(gb, zero, vdupq_n_f32(-1.0f));
+    float32x4_t o_w = vbslq_f32(gb, vdupq_n_f32(-1.0f / 3.0f), vdupq_n_f32(2.0f / 3.0f));
+    uint32x4_t ro = vcgeq_f32(r, o_x);
+    float32x4_t t_x = vbslq_f32(ro, r, o_x);
+    float32x4_t t_y = o_y;
+    float32x4_t t_z = vbslq_f32(ro, o_z, o_w);
+    float32x4_t t_w = vbslq_f32(ro, o_x, r);
+
+    float32x4_t chroma = vsubq_f32(t_x, vminq_f32(t_w, t_y));
+    const float32x4_t n = vdupq_n_f32(1.0e-10f);
+    float32x4_t h = vabsq_f32(vaddq_f32(t_z, vdivq_f32(vsubq_f32(t_w, t_y),
+                                                        vaddq_f32(vmulq_f32(vdupq_n_f32(6.0f), chroma), n))));
+    float32x4_t s = vdivq_f32(chroma, vaddq_f32(t_x, n));
+    float32x4_t val = t_x;
+
+    const float32x4_t scale = vdupq_n_f32(255.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    r8 = vcvtq_u32_f32(vaddq_f32(vmulq_f32(r, scale), half));
+    g8 = vcvtq_u32_f32(vaddq_f32(vmulq_f32(g, scale), half));
+    b8 = vcvtq_u32_f32(vaddq_f32(vmulq_f32(b, scale), half));
+    m8 = range_mask_neon(h, s, val, p);
+}
+
+static inline void widen_neon(uint8x16_t bytes, float32x4_t out[4]) {
+    uint16x8_t lo = vmovl_u8(vget_low_u8(bytes));
+    uint16x8_t hi = vmovl_u8(vget_high_u8(bytes));
+    out[0] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo)));
+    out[1] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo)));
+    out[2] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi)));
+    out[3] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi)));
+}
+
+static inline uint8x16_t narrow_neon(const uint32x4_t in[4]) {
+    uint16x8_t lo = vcombine_u16(vmovn_u32(in[0]), vmovn_u32(in[1]));
+    uint16x8_t hi = vcombine_u16(vmovn_u32(in[2]), vmovn_u32(in[3]));
+    return vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+}
+
+static void threshold_row_neon(const uint8_t *y, const uint8_t *u, const uint8_t *v, int width,
+                               const ThresholdParams &p, uint8_t *mask, uint8_t *packed, uint8_t *color) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x8_t u8 = vld1_u8(u + x / 2);
+        uint8x8_t v8 = vld1_u8(v + x / 2);
+
+        // Each chroma sample covers two pixels
+        float32x4_t ys[4], us[4], vs[4];
+        widen_neon(vld1q_u8(y + x), ys);
+        widen_neon(vcombine_u8(vzip1_u8(u8, u8), vzip2_u8(u8, u8)), us);
+        widen_neon(vcombine_u8(vzip1_u8(v8, v8), vzip2_u8(v8, v8)), vs);
+
+        uint32x4_t r[4], g[4], b[4], m[4];
+        for (int i = 0; i < 4; i++) {
+            threshold4_neon(ys[i], us[i], vs[i], p, r[i], g[i], b[i], m[i]);
+        }
+
+        uint8x16x4_t pixels = {{narrow_neon(r), narrow_neon(g), narrow_neon(b), narrow_neon(m)}};
+        vst1q_u8(mask + x, pixels.val[3]);
+        if (packed) {
+            vst4q_u8(packed + x * 4, pixels);
+        }
+        if (color) {
+            pixels.val[3] = vdupq_n_u8(255);
+            vst4q_u8(color + x * 4, pixels);
+        }
+    }
+
+    threshold_row_scalar(y, u, v, x, width, p, mask, packed, color);
+}
+#endif
+
+static void threshold_row(SimdLevel level, const uint8_t *y, const uint8_t *u, const uint8_t *v, int width,
+                          const ThresholdParams &p, uint8_t *mask, uint8_t *packed, uint8_t *color) {
+    switch (level) {
+#ifdef LIBCAMERA_MEME_X86
+        case SimdLevel::Avx2:
+            threshold_row_avx2(y, u, v, width, p, mask, packed, color);
+            return;
+        // Nothing here needs more than SSE2, so SSSE3 machines get the 128 bit kernel
+        case SimdLevel::Ssse3:
+            threshold_row_sse2(y, u, v, width, p, mask, packed, color);
+            return;
+#endif
+#ifdef LIBCAMERA_MEME_NEON
+        case SimdLevel::Neon:
+            threshold_row_neon(y, u, v, width, p, mask, packed, color);
+            return;
+#endif
+        default:
+            threshold_row_scalar(y, u, v, 0, width, p, mask, packed, color);
+    }
+}
+
+static void split_uv_row(const uint8_t *uv, std::size_t chroma_width, uint8_t *u, uint8_t *v) {
+    for (std::size_t i = 0; i < chroma_width; i++) {
+        u[i] = uv[i * 2];
+        v[i] = uv[i * 2 + 1];
+    }
+}
+
+// y gets two samples per group, so it has to hold chroma_width * 2 bytes even for odd widths
+static void split_yuyv_row(const uint8_t *yuyv, std::size_t chroma_width, uint8_t *y, uint8_t *u, uint8_t *v) {
+    for (std::size_t i = 0; i < chroma_width; i++) {
+        y[i * 2] = yuyv[i * 4];
+        u[i] = yuyv[i * 4 + 1];
+        y[i * 2 + 1] = yuyv[i * 4 + 2];
+        v[i] = yuyv[i * 4 + 3];
+    }
+}
+
+// Same layout as the OUTPUT_BITS shader, stored byte by byte so it doesn't depend on the host's endianness
+static void pack_mask_bits(const uint8_t *mask, int width, uint8_t *bits, int row_bytes) {
+    for (int byte = 0; byte < row_bytes; byte++) {
+        uint8_t value = 0;
+        for (int i = 0; i < 8; i++) {
+            int x = byte * 8 + i;
+            if (x < width && mask[x]) {
+                value |= 1 << i;
+            }
+        }
+        bits[byte] = value;
+    }
+}
+
+CpuHsvThresholder::CpuHsvThresholder(int width, int height, YuvFormat input_format, DmaBufPool &output_pool,
+                                     const OutputConfig& output_config, unsigned int threads, SimdLevel level)
+        : m_width(width), m_height(height), m_input_format(input_format), m_output_config(output_config), m_level(level),
+          m_output_pool(output_pool), m_pool(threads) {
+    if (!simd_level_supported(m_level)) {
+        m_level = detected_simd_level();
+    }
+    if (m_output_config.scale != 1) {
+        throw std::runtime_error("the cpu thresholder can't downscale the mask");
+    }
+    if ((m_output_config.color_width > 0 && m_output_config.color_width != width) ||
+        (m_output_config.color_height > 0 && m_output_config.color_height != height)) {
+        throw std::runtime_error("the cpu thresholder can't downscale the color output");
+    }
+    if (!m_output_config.morphology.empty()) {
+        throw std::runtime_error("the cpu thresholder has no morphology passes");
+    }
+    if (m_output_config.remap) {
+        throw std::runtime_error("the cpu thresholder can't remap the input");
+    }
+    if (m_output_config.histogram) {
+        throw std::runtime_error("the cpu thresholder doesn't collect histograms");
+    }
+    if (m_output_config.stats && (m_output_config.mode == OutputMode::BitPacked ||
+                                  m_output_config.mode == OutputMode::RangeBits)) {
+        throw std::runtime_error("tile stats need a packed or planar mask");
+    }
+}
+
+CpuHsvThresholder::~CpuHsvThresholder() {
+    for (const auto &[fd, mapping]: m_inputs) {
+        unmap(mapping);
+    }
+}
+
+CpuHsvThresholder::Mapping CpuHsvThresholder::map_dma_buf(int fd, std::size_t size) {
+    auto ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        throw std::runtime_error("failed to mmap dma_buf");
+    }
+    return {static_cast<uint8_t *>(ptr), size};
+}
+
+void CpuHsvThresholder::unmap(const Mapping &mapping) {
+    munmap(mapping.data, mapping.size);
+}
+
+const uint8_t *CpuHsvThresholder::mapInput(int fd) {
+    auto it = m_inputs.find(fd);
+    if (it != m_inputs.end()) {
+        return it->second.data;
+    }
+
+    auto size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        throw std::runtime_error("failed to get dma_buf size");
+    }
+    auto mapping = map_dma_buf(fd, static_cast<std::size_t>(size));
+    m_inputs.emplace(fd, mapping);
+    return mapping.data;
+}
+
+void CpuHsvThresholder::processEvictions() {
+    std::vector<int> evictions;
+    {
+        std::scoped_lock lock(m_evictions_mutex);
+        evictions.swap(m_pending_evictions);
+    }
+    for (auto fd: evictions) {
+        auto it = m_inputs.find(fd);
+        if (it != m_inputs.end()) {
+            unmap(it->second);
+            m_inputs.erase(it);
+        }
+    }
+}
+
+void CpuHsvThresholder::testFrame(const std::array<DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range,
+                                  std::function<void()> onInputReleased, const FrameTag &tag) {
+    auto entered = FrameTracer::now();
+    processEvictions();
+
+    auto output = acquire_output_frame(m_output_pool, m_output_config, m_width, m_height);
+    if (!output) {
+        std::cout << "output pool exhausted, dropping frame" << std::endl;
+        if (onInputReleased) {
+            onInputReleased();
+        }
+        return;
+    }
+    output->tag = tag;
+
+    // Cached heaps only see the camera's writes and publish ours inside these brackets. They close before the
+    // callbacks run. Fixed size so steady state doesn't allocate.
+    std::array<std::optional<ScopedDmaBufSync>, 6> syncs;
+    std::size_t sync_count = 0;
+
+    Frame frame{};
+    for (int i = 0; i < yuv_plane_count(m_input_format); i++) {
+        const auto &plane = yuv_plane_data[i];
+        auto [row_bytes, rows] = yuv_plane_size(m_input_format, i, m_width, m_height);
+        auto end = static_cast<std::size_t>(plane.offset) + static_cast<std::size_t>(plane.pitch) * (rows - 1) + row_bytes;
+        const uint8_t *base = mapInput(plane.fd);
+        if (end > m_inputs.at(plane.fd).size) {
+            throw std::runtime_error("yuv plane runs past the end of its dma_buf");
+        }
+        frame.planes[i] = base + plane.offset;
+        frame.strides[i] = plane.pitch;
+
+        bool synced = std::any_of(yuv_plane_data.begin(), yuv_plane_data.begin() + i, [&](const DmaBufPlaneData &other) {
+            return other.fd == plane.fd;
+        });
+        if (!synced) {
+            syncs[sync_count++].emplace(plane.fd, DmaBufAccess::Read);
+        }
+    }
+    syncs[sync_count++].emplace(output->target.fd(), DmaBufAccess::Write);
+    if (output->color) {
+        syncs[sync_count++].emplace(output->color->fd(), DmaBufAccess::Write);
+    }
+    if (output->stats) {
+        syncs[sync_count++].emplace(output->stats->fd(), DmaBufAccess::Write);
+    }
+    auto imported = FrameTracer::now();
+    trace(TraceStage::Import, tag, entered, imported);
+
+    output->roi = threshold(frame, encoding, range, {
+            output->target.data(),
+            output->color ? output->color->data() : nullptr,
+            output->stats ? output->stats->data() : nullptr,
+    });
+    for (auto &sync: syncs) {
+        sync.reset();
+    }
+    trace(TraceStage::Threshold, tag, imported, FrameTracer::now());
+
+    completeFrame(std::move(*output), onInputReleased);
+}
+
+HsvThresholder::Roi CpuHsvThresholder::threshold(const Frame &frame, EGLint encoding, EGLint range,
+                                                 const Outputs &outputs) {
+    if (auto ranges = takeRanges()) {
+        m_ranges = std::move(*ranges);
+    }
+    auto roi = frameRoi(m_output_config, m_width, m_height);
+    auto params = make_params(encoding, range, m_ranges, m_output_config.mode == OutputMode::RangeBits);
+    auto mode = m_output_config.mode;
+    // Outputs keep the whole frame's strides, the window starts at their top left
+    int tiles_x = stats_tile_count(m_width);
+    int bit_row_bytes = bit_packed_row_words(m_width) * 4;
+    int roi_bit_row_bytes = bit_packed_row_words(roi.width) * 4;
+    auto stride = static_cast<std::size_t>(m_width);
+    auto width = static_cast<std::size_t>(roi.width);
+    // roi.x is even, so the chroma of the window starts on a whole sample
+    auto luma_offset = static_cast<std::size_t>(roi.x) * (m_input_format == YuvFormat::Yuyv ? 2 : 1);
+    auto chroma_offset = static_cast<std::size_t>(roi.x) / 2;
+
+    if (outputs.stats && roi != Roi{0, 0, m_width, m_height}) {
+        std::memset(outputs.stats, 0, stats_buffer_size(m_output_config, m_width, m_height));
+    }
+
+    // Bands are whole tile rows so each one can reduce its own mask rows to tile stats
+    auto band = [&](int tile_row_begin, int tile_row_end) {
+        thread_local std::vector<uint8_t> mask_rows;
+        mask_rows.resize(width * STATS_TILE_SIZE);
+        // Planar copies of the current row for the interleaved formats: Y, then U and V at half width
+        thread_local std::vector<uint8_t> split_row;
+        auto chroma_width = static_cast<std::size_t>((roi.width + 1) / 2);
+        split_row.resize(chroma_width * 4);
+        uint8_t *split_y = split_row.data();
+        uint8_t *split_u = split_y + chroma_width * 2;
+        uint8_t *split_v = split_u + chroma_width;
+
+        for (int tile_row = tile_row_begin; tile_row < tile_row_end; tile_row++) {
+            int row_begin = tile_row * STATS_TILE_SIZE;
+            int rows = std::min(STATS_TILE_SIZE, roi.height - row_begin);
+
+            for (int j = 0; j < rows; j++) {
+                int out_row = row_begin + j;
+                int row = roi.y + out_row;
+                uint8_t *mask = mask_rows.data() + j * width;
+                uint8_t *packed = nullptr, *color = nullptr;
+                if (mode == OutputMode::Packed) {
+                    packed = outputs.target ? outputs.target + out_row * stride * 4 : nullptr;
+                } else if (outputs.color) {
+                    color = outputs.color + out_row * stride * 4;
+                }
+
+                const uint8_t *y = frame.planes[0] + row * frame.strides[0] + luma_offset;
+                const uint8_t *u = split_u, *v = split_v;
+                switch (m_input_format) {
+                    case YuvFormat::Yuv420:
+                        u = frame.planes[1] + (row / 2) * frame.strides[1] + chroma_offset;
+                        v = frame.planes[2] + (row / 2) * frame.strides[2] + chroma_offset;
+                        break;
+                    case YuvFormat::Nv12:
+                        split_uv_row(frame.planes[1] + (row / 2) * frame.strides[1] + chroma_offset * 2, chroma_width,
+                                     split_u, split_v);
+                        break;
+                    case YuvFormat::Yuyv:
+                        split_yuyv_row(y, chroma_width, split_y, split_u, split_v);
+                        y = split_y;
+                        break;
+                }
+
+                threshold_row(m_level, y, u, v, roi.width, params, mask, packed, color);
+
+                if ((mode == OutputMode::Planar || mode == OutputMode::RangeBits) && outputs.target) {
+                    std::memcpy(outputs.target + out_row * stride, mask, width);
+                } else if (mode == OutputMode::BitPacked && outputs.target) {
+                    pack_mask_bits(mask, roi.width, outputs.target + out_row * bit_row_bytes, roi_bit_row_bytes);
+                }
+            }
+
+            if (outputs.stats) {
+                tile_stats_from_mask(mask_rows.data(), width, roi.width, rows,
+                                     reinterpret_cast<TileStats *>(outputs.stats) + tile_row * tiles_x);
+            }
+        }
+    };
+
+    m_pool.parallelFor(0, stats_tile_count(roi.height), band);
+    return roi;
+}
+
+void CpuHsvThresholder::completeFrame(OutputFrame frame, const std::function<void()>& onInputReleased) {
+    frame.tag.handoff = FrameTracer::now();
+    if (onInputReleased) {
+        onInputReleased();
+    }
+    if (m_onComplete) {
+        m_onComplete->operator()(std::move(frame));
+    }
+}
+
+void CpuHsvThresholder::setOnComplete(std::function<void(OutputFrame)> onComplete) {
+    m_onComplete = std::move(onComplete);
+}
+
+void CpuHsvThresholder::resetOnComplete() {
+    m_onComplete.reset();
+}
+
+void CpuHsvThresholder::evictImports(int fd) {
+    std::scoped_lock lock(m_evictions_mutex);
+    m_pending_evictions.push_back(fd);
+}
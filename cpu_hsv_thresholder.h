@@ -0,0 +1,89 @@
+#ifndef LIBCAMERA_MEME_CPU_HSV_THRESHOLDER_H
+#define LIBCAMERA_MEME_CPU_HSV_THRESHOLDER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "hsv_thresholder.h"
+#include "pixel_deinterleave.h"
+#include "thread_pool.h"
+
+// Same thresholding as GlHsvThresholder's shader without a GPU: the camera and output dma-bufs are mmapped and
+// the frame is split into bands of tile rows across a thread pool. The HSV test, the YUV to RGB matrices and the
+// output layouts follow the shader, but chroma is replicated where the GPU filters it, so edge pixels can differ.
+// NV12 and YUYV rows are split into planar scratch rows first. testFrame is synchronous, both callbacks fire
+// before it returns.
+//
+// Downscaled masks and color buffers aren't supported, the output sizes have to match the input. A roi is read
+// straight out of the mapped planes.
+class CpuHsvThresholder : public HsvThresholder {
+public:
+    // output_pool has to outlive the thresholder, its mappings are written directly
+    CpuHsvThresholder(int width, int height, YuvFormat input_format, DmaBufPool &output_pool,
+                      const OutputConfig& output_config,
+                      unsigned int threads = std::thread::hardware_concurrency(),
+                      SimdLevel level = detected_simd_level());
+    ~CpuHsvThresholder() override;
+
+    CpuHsvThresholder(const CpuHsvThresholder &) = delete;
+    CpuHsvThresholder &operator=(const CpuHsvThresholder &) = delete;
+
+    void setOnComplete(std::function<void(OutputFrame)> onComplete) override;
+    void resetOnComplete() override;
+
+    // The mappings are dropped on the thresholding thread before the next frame is read
+    void evictImports(int fd) override;
+    void testFrame(const std::array<DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range,
+                   std::function<void()> onInputReleased = {}, const FrameTag &tag = {}) override;
+
+    // Thresholds planes already in memory into the given output pointers, any of which can be null. Used by
+    // testFrame and by the benchmark. Planes are in the input format's order, strides are in bytes. Returns the
+    // window it covered, see setRoi.
+    struct Frame {
+        std::array<const uint8_t *, 3> planes;
+        std::array<std::size_t, 3> strides;
+    };
+    struct Outputs {
+        uint8_t *target; // laid out as OutputConfig::mode says
+        uint8_t *color;
+        uint8_t *stats;
+    };
+    Roi threshold(const Frame &frame, EGLint encoding, EGLint range, const Outputs &outputs);
+private:
+    struct Mapping {
+        uint8_t *data = nullptr;
+        std::size_t size = 0;
+    };
+
+    static Mapping map_dma_buf(int fd, std::size_t size);
+    static void unmap(const Mapping &mapping);
+
+    const uint8_t *mapInput(int fd);
+    void processEvictions();
+    void completeFrame(OutputFrame frame, const std::function<void()>& onInputReleased);
+
+    int m_width;
+    int m_height;
+    YuvFormat m_input_format;
+    OutputConfig m_output_config;
+    SimdLevel m_level;
+    std::optional<std::function<void(OutputFrame)>> m_onComplete;
+    std::vector<HsvRange> m_ranges{{DEFAULT_LOWER_THRESH, DEFAULT_UPPER_THRESH}};
+
+    DmaBufPool &m_output_pool;
+
+    std::unordered_map<int, Mapping> m_inputs; // (camera dma_buf fd, read only mapping of the whole buffer)
+    std::vector<int> m_pending_evictions;
+    std::mutex m_evictions_mutex;
+
+    ThreadPool m_pool;
+};
+
+#endif //LIBCAMERA_MEME_CPU_HSV_THRESHOLDER_H
@@ -1,6 +1,10 @@
 #include "dma_buf_alloc.h"
 
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
 #include <stdexcept>
+#include <utility>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -9,14 +13,21 @@
 #include <linux/dma-heap.h>
 #include <sys/ioctl.h>
 
-DmaBufAlloc::DmaBufAlloc(const std::string &heap_name) {
-    int heap_fd = open(heap_name.c_str(), O_RDWR, 0);
+static constexpr const char *DMA_HEAP_DIR = "/dev/dma_heap";
+
+DmaBufAlloc::DmaBufAlloc(const std::string &heap_name)
+        : m_heap_path(heap_name.find('/') == std::string::npos ? std::string(DMA_HEAP_DIR) + "/" + heap_name : heap_name) {
+    int heap_fd = open(m_heap_path.c_str(), O_RDWR | O_CLOEXEC, 0);
     if (heap_fd < 0) {
-        throw std::runtime_error("failed to open dma_heap");
+        throw std::runtime_error("failed to open dma_heap " + m_heap_path);
     }
     m_heap_fd = heap_fd;
 }
 
+DmaBufAlloc::~DmaBufAlloc() {
+    close(m_heap_fd);
+}
+
 int DmaBufAlloc::alloc_buf(std::size_t len) {
     struct dma_heap_allocation_data alloc = {};
     alloc.len = len;
@@ -29,6 +40,66 @@ int DmaBufAlloc::alloc_buf(std::size_t len) {
     return alloc.fd;
 }
 
+const std::string &DmaBufAlloc::heap_path() const {
+    return m_heap_path;
+}
+
 void DmaBufAlloc::free_buf(int fd) {
     close(fd);
 }
+
+std::vector<std::string> DmaBufAlloc::available_heaps() {
+    std::vector<std::string> heaps;
+    std::error_code error;
+    for (const auto &entry: std::filesystem::directory_iterator(DMA_HEAP_DIR, error)) {
+        heaps.push_back(entry.path().filename().string());
+    }
+    return heaps;
+}
+
+static std::uint64_t sync_flags(DmaBufAccess access) {
+    switch (access) {
+        case DmaBufAccess::Read:
+            return DMA_BUF_SYNC_READ;
+        case DmaBufAccess::Write:
+            return DMA_BUF_SYNC_WRITE;
+        case DmaBufAccess::ReadWrite:
+            return DMA_BUF_SYNC_RW;
+    }
+    throw std::runtime_error("unknown dma_buf access");
+}
+
+// False if fd isn't a dma-buf
+static bool dma_buf_sync(int fd, std::uint64_t flags) {
+    struct dma_buf_sync sync = {};
+    sync.flags = flags;
+    while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        if (errno == ENOTTY) {
+            return false;
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            throw std::runtime_error("DMA_BUF_IOCTL_SYNC failed");
+        }
+    }
+    return true;
+}
+
+ScopedDmaBufSync::ScopedDmaBufSync(int fd, DmaBufAccess access) : m_fd(fd), m_access(access) {
+    if (!dma_buf_sync(m_fd, DMA_BUF_SYNC_START | sync_flags(m_access))) {
+        m_fd = -1;
+    }
+}
+
+ScopedDmaBufSync::~ScopedDmaBufSync() {
+    if (m_fd < 0) {
+        return;
+    }
+    try {
+        dma_buf_sync(m_fd, DMA_BUF_SYNC_END | sync_flags(m_access));
+    } catch (const std::exception &) {
+        // Nothing left to do about it, the access is over either way
+    }
+}
+
+ScopedDmaBufSync::ScopedDmaBufSync(ScopedDmaBufSync &&other) noexcept
+        : m_fd(std::exchange(other.m_fd, -1)), m_access(other.m_access) {}
@@ -3,15 +3,51 @@
 
 #include <string>
 #include <cstddef>
+#include <vector>
 
 class DmaBufAlloc {
 public:
+    // heap_name is a path, or a name under /dev/dma_heap such as "system" or "linux,cma". Whether the CPU
+    // mapping is cached depends on the heap, cached ones need ScopedDmaBufSync around CPU access.
     explicit DmaBufAlloc(const std::string& heap_name);
+    ~DmaBufAlloc();
+
+    DmaBufAlloc(const DmaBufAlloc &) = delete;
+    DmaBufAlloc &operator=(const DmaBufAlloc &) = delete;
+
     int alloc_buf(std::size_t len);
+    [[nodiscard]] const std::string &heap_path() const;
 
     static void free_buf(int fd);
+    // Names of the heaps under /dev/dma_heap, empty if there are none
+    static std::vector<std::string> available_heaps();
 private:
+    std::string m_heap_path;
     int m_heap_fd;
 };
 
+enum class DmaBufAccess {
+    Read,
+    Write,
+    ReadWrite,
+};
+
+// Brackets CPU access to a mapped dma-buf with DMA_BUF_IOCTL_SYNC start and end, which is what makes cached heaps
+// coherent with the devices. Cheap on uncached heaps. fds that aren't dma-bufs, like memfd test frames, are let
+// through without syncing.
+class ScopedDmaBufSync {
+public:
+    ScopedDmaBufSync(int fd, DmaBufAccess access);
+    ~ScopedDmaBufSync();
+
+    ScopedDmaBufSync(ScopedDmaBufSync &&other) noexcept;
+    ScopedDmaBufSync &operator=(ScopedDmaBufSync &&other) = delete;
+
+    ScopedDmaBufSync(const ScopedDmaBufSync &) = delete;
+    ScopedDmaBufSync &operator=(const ScopedDmaBufSync &) = delete;
+private:
+    int m_fd;
+    DmaBufAccess m_access;
+};
+
 #endif //LIBCAMERA_MEME_DMA_BUF_ALLOC_H
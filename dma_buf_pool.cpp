@@ -0,0 +1,199 @@
+#include "dma_buf_pool.h"
+
+#include <algorithm>
+#include <bit>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Outlives the pool while handles are still out, so buffers released late still find their way home
+struct DmaBufPool::Shared {
+    std::function<int(std::size_t)> allocate;
+    std::size_t max_buffers;
+
+    std::mutex mutex;
+    std::unordered_map<std::size_t, std::vector<Buffer::Entry>> idle; // (size class, idle buffers)
+    std::unordered_map<std::size_t, std::size_t> class_buffers; // (size class, buffers allocated)
+    // Counts allocations that are still in progress outside the lock, so the cap holds
+    std::size_t buffers = 0;
+    Stats stats{};
+
+    ~Shared() {
+        for (const auto &[size, entries]: idle) {
+            for (const auto &entry: entries) {
+                munmap(entry.data, entry.size);
+                DmaBufAlloc::free_buf(entry.fd);
+            }
+        }
+    }
+
+    Buffer::Entry allocateEntry(std::size_t size) const {
+        int fd = allocate(size);
+        auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            DmaBufAlloc::free_buf(fd);
+            throw std::runtime_error("failed to mmap pooled dma_buf");
+        }
+        return {fd, static_cast<std::uint8_t *>(data), size};
+    }
+
+    // Takes a slot under the cap, or returns false if there is none left
+    bool reserveSlot(std::size_t size) {
+        if (buffers >= max_buffers) {
+            return false;
+        }
+        buffers++;
+        class_buffers[size]++;
+        return true;
+    }
+
+    void releaseSlot(std::size_t size) {
+        buffers--;
+        class_buffers[size]--;
+    }
+};
+
+DmaBufPool::Buffer::Buffer(std::shared_ptr<Shared> shared, Entry entry)
+        : m_shared(std::move(shared)), m_entry(entry) {}
+
+DmaBufPool::Buffer::~Buffer() {
+    reset();
+}
+
+DmaBufPool::Buffer::Buffer(Buffer &&other) noexcept
+        : m_shared(std::move(other.m_shared)), m_entry(std::exchange(other.m_entry, {})) {}
+
+DmaBufPool::Buffer &DmaBufPool::Buffer::operator=(Buffer &&other) noexcept {
+    if (this != &other) {
+        reset();
+        m_shared = std::move(other.m_shared);
+        m_entry = std::exchange(other.m_entry, {});
+    }
+    return *this;
+}
+
+int DmaBufPool::Buffer::fd() const {
+    return m_entry.fd;
+}
+
+std::uint8_t *DmaBufPool::Buffer::data() const {
+    return m_entry.data;
+}
+
+std::size_t DmaBufPool::Buffer::size() const {
+    return m_entry.size;
+}
+
+void DmaBufPool::Buffer::reset() {
+    if (!m_shared) {
+        return;
+    }
+    {
+        std::scoped_lock lock(m_shared->mutex);
+        m_shared->idle[m_entry.size].push_back(m_entry);
+        m_shared->stats.idle++;
+    }
+    m_shared.reset();
+    m_entry = {};
+}
+
+DmaBufPool::DmaBufPool(std::function<int(std::size_t)> allocate, std::size_t max_buffers)
+        : m_shared(std::make_shared<Shared>()) {
+    m_shared->allocate = std::move(allocate);
+    m_shared->max_buffers = max_buffers;
+}
+
+DmaBufPool::DmaBufPool(DmaBufAlloc &allocator, std::size_t max_buffers)
+        : DmaBufPool([&allocator](std::size_t size) { return allocator.alloc_buf(size); }, max_buffers) {}
+
+std::optional<DmaBufPool::Buffer> DmaBufPool::acquire(std::size_t size) {
+    size = sizeClass(size);
+    {
+        std::scoped_lock lock(m_shared->mutex);
+        auto &idle = m_shared->idle[size];
+        if (!idle.empty()) {
+            auto entry = idle.back();
+            idle.pop_back();
+            m_shared->stats.idle--;
+            m_shared->stats.acquisitions++;
+            m_shared->stats.reuses++;
+            return Buffer(m_shared, entry);
+        }
+        if (!m_shared->reserveSlot(size)) {
+            m_shared->stats.exhaustions++;
+            return std::nullopt;
+        }
+    }
+
+    // Growing can take a while on a CMA heap, other threads keep releasing and reusing in the meantime
+    Buffer::Entry entry;
+    try {
+        entry = m_shared->allocateEntry(size);
+    } catch (...) {
+        std::scoped_lock lock(m_shared->mutex);
+        m_shared->releaseSlot(size);
+        throw;
+    }
+
+    std::scoped_lock lock(m_shared->mutex);
+    m_shared->stats.acquisitions++;
+    m_shared->stats.buffers++;
+    m_shared->stats.bytes += size;
+    return Buffer(m_shared, entry);
+}
+
+void DmaBufPool::reserve(std::size_t size, std::size_t count) {
+    size = sizeClass(size);
+    while (true) {
+        {
+            std::scoped_lock lock(m_shared->mutex);
+            if (m_shared->class_buffers[size] >= count) {
+                return;
+            }
+            if (!m_shared->reserveSlot(size)) {
+                throw std::runtime_error("dma_buf pool reservation is over max_buffers");
+            }
+        }
+
+        Buffer::Entry entry;
+        try {
+            entry = m_shared->allocateEntry(size);
+        } catch (...) {
+            std::scoped_lock lock(m_shared->mutex);
+            m_shared->releaseSlot(size);
+            throw;
+        }
+
+        std::scoped_lock lock(m_shared->mutex);
+        m_shared->idle[size].push_back(entry);
+        m_shared->stats.buffers++;
+        m_shared->stats.idle++;
+        m_shared->stats.bytes += size;
+    }
+}
+
+DmaBufPool::Stats DmaBufPool::stats() const {
+    std::scoped_lock lock(m_shared->mutex);
+    return m_shared->stats;
+}
+
+std::size_t DmaBufPool::maxBuffers() const {
+    return m_shared->max_buffers;
+}
+
+std::size_t DmaBufPool::sizeClass(std::size_t size) {
+    static const auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+    auto pages = std::max<std::size_t>((size + page_size - 1) / page_size, 1);
+    if (pages <= 16) {
+        return pages * page_size;
+    }
+    // Four classes between each power of two, e.g. 20, 24, 28 and 32 pages
+    auto step = std::size_t(1) << (std::bit_width(pages - 1) - 3);
+    return (pages + step - 1) / step * step * page_size;
+}
@@ -0,0 +1,81 @@
+#ifndef LIBCAMERA_MEME_DMA_BUF_POOL_H
+#define LIBCAMERA_MEME_DMA_BUF_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include "dma_buf_alloc.h"
+
+// Recycles dma-bufs so a pipeline at steady state never allocates. Requests are rounded up to a size class, whole
+// pages and at most a quarter over past 16 pages, and each buffer is mapped read/write once for its whole life, so
+// the mapping is page (and so cache line) aligned. Buffers are only closed once the pool and every handle to them
+// are gone, which lets importers key their caches on the fd. Thread safe.
+class DmaBufPool {
+    struct Shared;
+public:
+    struct Stats {
+        std::uint64_t acquisitions; // successful acquire calls
+        std::uint64_t reuses; // acquisitions served by an idle buffer instead of a new allocation
+        std::uint64_t exhaustions; // acquire calls refused because max_buffers were already out
+        std::size_t buffers; // allocated so far, idle or not
+        std::size_t idle;
+        std::size_t bytes;
+    };
+
+    // Move-only, hands the buffer back to the pool when destroyed or reset
+    class Buffer {
+    public:
+        Buffer() = default;
+        ~Buffer();
+        Buffer(Buffer &&other) noexcept;
+        Buffer &operator=(Buffer &&other) noexcept;
+
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+
+        [[nodiscard]] int fd() const;
+        [[nodiscard]] std::uint8_t *data() const;
+        // The size class, at least what was asked for
+        [[nodiscard]] std::size_t size() const;
+
+        void reset();
+    private:
+        friend class DmaBufPool;
+
+        struct Entry {
+            int fd = -1;
+            std::uint8_t *data = nullptr;
+            std::size_t size = 0;
+        };
+
+        Buffer(std::shared_ptr<Shared> shared, Entry entry);
+
+        std::shared_ptr<Shared> m_shared;
+        Entry m_entry;
+    };
+
+    // allocate returns a new dma-buf fd of at least the given size, which the pool then owns
+    DmaBufPool(std::function<int(std::size_t)> allocate, std::size_t max_buffers);
+    // allocator has to outlive the pool
+    DmaBufPool(DmaBufAlloc &allocator, std::size_t max_buffers);
+
+    DmaBufPool(const DmaBufPool &) = delete;
+    DmaBufPool &operator=(const DmaBufPool &) = delete;
+
+    // nullopt when no buffer of this size class is idle and max_buffers are already allocated
+    std::optional<Buffer> acquire(std::size_t size);
+    // Allocates until the size class has count buffers, so the first frames don't pay for it
+    void reserve(std::size_t size, std::size_t count);
+
+    [[nodiscard]] Stats stats() const;
+    [[nodiscard]] std::size_t maxBuffers() const;
+
+    static std::size_t sizeClass(std::size_t size);
+private:
+    std::shared_ptr<Shared> m_shared;
+};
+
+#endif //LIBCAMERA_MEME_DMA_BUF_POOL_H
@@ -0,0 +1,83 @@
+#include "frame_scheduler.h"
+
+#include <stdexcept>
+#include <utility>
+
+FrameScheduler::FrameScheduler(std::size_t sources) : m_slots(sources) {
+    if (sources == 0) {
+        throw std::runtime_error("frame scheduler needs at least one source");
+    }
+}
+
+void FrameScheduler::submit(std::size_t source, std::function<void()> run, std::function<void()> drop) {
+    std::function<void()> stale;
+    {
+        std::scoped_lock lock(m_mutex);
+        if (m_closed) {
+            return;
+        }
+        auto &slot = m_slots.at(source);
+        slot.stats.submitted++;
+        if (slot.pending) {
+            slot.stats.replaced++;
+            stale = std::move(slot.drop);
+        } else {
+            slot.pending = true;
+            m_pending++;
+        }
+        slot.run = std::move(run);
+        slot.drop = std::move(drop);
+    }
+    m_cond.notify_one();
+
+    // Outside the lock, it typically hands a buffer back to the camera
+    if (stale) {
+        stale();
+    }
+}
+
+void FrameScheduler::run() {
+    while (true) {
+        std::function<void()> next;
+        {
+            std::unique_lock lock(m_mutex);
+            m_cond.wait(lock, [&] { return m_pending > 0 || m_closed; });
+            if (m_closed) {
+                return;
+            }
+            for (std::size_t i = 0; i < m_slots.size(); i++) {
+                auto source = (m_next + i) % m_slots.size();
+                auto &slot = m_slots[source];
+                if (slot.pending) {
+                    next = std::move(slot.run);
+                    slot.drop = nullptr;
+                    slot.pending = false;
+                    slot.stats.run++;
+                    m_pending--;
+                    m_next = source + 1;
+                    break;
+                }
+            }
+        }
+        next();
+    }
+}
+
+void FrameScheduler::close() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_closed = true;
+        for (auto &slot: m_slots) {
+            slot.run = nullptr;
+            slot.drop = nullptr;
+            slot.pending = false;
+        }
+        m_pending = 0;
+    }
+    m_cond.notify_all();
+}
+
+FrameScheduler::SourceStats FrameScheduler::stats(std::size_t source) const {
+    std::scoped_lock lock(m_mutex);
+    return m_slots.at(source).stats;
+}
@@ -0,0 +1,54 @@
+#ifndef LIBCAMERA_MEME_FRAME_SCHEDULER_H
+#define LIBCAMERA_MEME_FRAME_SCHEDULER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Funnels frames from several sources (cameras) into the one thread that owns the GL context. Each source has a
+// single slot that always holds its newest frame, so a source that's fallen behind only ever runs its latest one,
+// and the thread takes the sources in turn. So every source with a frame waiting gets one per round, and a fast
+// camera can only ever replace its own stale frames, not crowd out a slow one.
+class FrameScheduler {
+public:
+    struct SourceStats {
+        std::uint64_t submitted;
+        std::uint64_t run;
+        std::uint64_t replaced; // dropped unrun because a newer frame from the same source arrived
+    };
+
+    explicit FrameScheduler(std::size_t sources);
+
+    FrameScheduler(const FrameScheduler &) = delete;
+    FrameScheduler &operator=(const FrameScheduler &) = delete;
+
+    // Safe to call from any thread. If the source still had a frame waiting, that frame's drop callback runs here,
+    // on the caller's thread. After close, frames are discarded without either callback.
+    void submit(std::size_t source, std::function<void()> run, std::function<void()> drop = {});
+
+    // Runs frames on the calling thread until close. Frames still waiting then are discarded.
+    void run();
+    void close();
+
+    [[nodiscard]] SourceStats stats(std::size_t source) const;
+
+private:
+    struct Slot {
+        std::function<void()> run;
+        std::function<void()> drop;
+        bool pending = false;
+        SourceStats stats{};
+    };
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<Slot> m_slots;
+    std::size_t m_pending = 0;
+    std::size_t m_next = 0; // where the next round-robin scan starts
+    bool m_closed = false;
+};
+
+#endif //LIBCAMERA_MEME_FRAME_SCHEDULER_H
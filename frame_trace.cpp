@@ -0,0 +1,201 @@
+#include "frame_trace.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+#include <time.h>
+
+const char *trace_stage_name(TraceStage stage) {
+    switch (stage) {
+        case TraceStage::Exposure:
+            return "exposure";
+        case TraceStage::CameraQueue:
+            return "camera queue";
+        case TraceStage::Import:
+            return "import";
+        case TraceStage::Render:
+            return "render";
+        case TraceStage::Gpu:
+            return "gpu";
+        case TraceStage::Threshold:
+            return "threshold";
+        case TraceStage::OutputQueue:
+            return "output queue";
+        case TraceStage::Readback:
+            return "readback";
+        case TraceStage::Total:
+            return "total";
+        case TraceStage::Count:
+            break;
+    }
+    return "unknown";
+}
+
+int LatencyHistogram::bucket_index(std::uint64_t value) {
+    value = std::min<std::uint64_t>(value, (std::uint64_t(1) << (MAX_SHIFT + SUB_BUCKET_BITS)) - 1);
+    if (value < SUB_BUCKETS) {
+        return static_cast<int>(value);
+    }
+    // Past the first SUB_BUCKETS values every power of two gets the top half of the sub buckets
+    int shift = std::bit_width(value) - SUB_BUCKET_BITS;
+    auto sub_bucket = static_cast<int>(value >> shift);
+    return SUB_BUCKETS + (shift - 1) * SUB_BUCKETS / 2 + sub_bucket - SUB_BUCKETS / 2;
+}
+
+std::int64_t LatencyHistogram::bucket_upper_bound(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+    int sub_bucket = (index - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+    return (static_cast<std::int64_t>(sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(std::int64_t value) {
+    value = std::max<std::int64_t>(value, 0);
+    m_buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+
+    auto min = m_min.load(std::memory_order_relaxed);
+    while (value < min && !m_min.compare_exchange_weak(min, value, std::memory_order_relaxed)) {}
+    auto max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+std::uint64_t LatencyHistogram::count() const {
+    return m_count.load(std::memory_order_relaxed);
+}
+
+std::int64_t LatencyHistogram::min() const {
+    return count() ? m_min.load(std::memory_order_relaxed) : 0;
+}
+
+std::int64_t LatencyHistogram::max() const {
+    return m_max.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    auto n = count();
+    return n ? static_cast<double>(m_sum.load(std::memory_order_relaxed)) / static_cast<double>(n) : 0.0;
+}
+
+std::int64_t LatencyHistogram::percentile(double quantile) const {
+    // Summed from the buckets rather than m_count, so a racing record can't push the target past the end
+    std::uint64_t total = 0;
+    for (const auto &bucket: m_buckets) {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if (!total) {
+        return 0;
+    }
+
+    auto target = static_cast<std::uint64_t>(std::ceil(std::clamp(quantile, 0.0, 1.0) * static_cast<double>(total)));
+    target = std::max<std::uint64_t>(target, 1);
+    std::uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            // Never report past the largest value actually seen
+            return std::min(bucket_upper_bound(i), max());
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::reset() {
+    for (auto &bucket: m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_min.store(INT64_MAX, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+FrameTracer::FrameTracer(std::size_t trace_capacity)
+        : m_trace_capacity(trace_capacity), m_spans(trace_capacity ? new Span[trace_capacity]() : nullptr) {}
+
+std::int64_t FrameTracer::now() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void FrameTracer::record(TraceStage stage, const FrameTag &tag, std::int64_t begin, std::int64_t end) {
+    if (begin <= 0 || end < begin) {
+        return;
+    }
+    m_histograms[static_cast<std::size_t>(stage)].record(end - begin);
+
+    if (m_trace_capacity) {
+        auto index = m_next_span.fetch_add(1, std::memory_order_relaxed) % m_trace_capacity;
+        m_spans[index] = {begin, end, tag.sequence, stage};
+    }
+}
+
+const LatencyHistogram &FrameTracer::histogram(TraceStage stage) const {
+    return m_histograms.at(static_cast<std::size_t>(stage));
+}
+
+void FrameTracer::reset() {
+    for (auto &histogram: m_histograms) {
+        histogram.reset();
+    }
+    m_next_span.store(0, std::memory_order_release);
+}
+
+void FrameTracer::printSummary(std::ostream &out) const {
+    auto ms = [](double ns) {
+        return ns / 1e6;
+    };
+
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(2);
+    for (std::size_t i = 0; i < m_histograms.size(); i++) {
+        const auto &histogram = m_histograms[i];
+        if (!histogram.count()) {
+            continue;
+        }
+        out << std::setw(14) << trace_stage_name(static_cast<TraceStage>(i)) << ": " << histogram.count()
+            << " frames, min " << ms(histogram.min()) << " mean " << ms(histogram.mean())
+            << " p50 " << ms(histogram.percentile(0.5)) << " p90 " << ms(histogram.percentile(0.9))
+            << " p99 " << ms(histogram.percentile(0.99)) << " max " << ms(histogram.max()) << " ms" << std::endl;
+    }
+    out.flags(flags);
+}
+
+void FrameTracer::writeChromeTrace(const std::string &path) const {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("failed to open trace file " + path);
+    }
+
+    // One track per stage. Only the GPU stage can overlap itself, when several frames are in flight.
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (std::size_t i = 0; i < static_cast<std::size_t>(TraceStage::Count); i++) {
+        out << (i ? "," : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i
+            << ",\"args\":{\"name\":\"" << trace_stage_name(static_cast<TraceStage>(i)) << "\"}}";
+    }
+
+    auto recorded = m_next_span.load(std::memory_order_acquire);
+    auto count = std::min<std::uint64_t>(recorded, m_trace_capacity);
+    out << std::fixed << std::setprecision(3);
+    for (auto n = recorded - count; n < recorded; n++) {
+        const auto &span = m_spans[n % m_trace_capacity];
+        // Chrome traces are in microseconds
+        out << ",{\"name\":\"" << trace_stage_name(span.stage) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << static_cast<int>(span.stage) << ",\"ts\":" << static_cast<double>(span.begin) / 1e3
+            << ",\"dur\":" << static_cast<double>(span.end - span.begin) / 1e3
+            << ",\"args\":{\"sequence\":" << span.sequence << "}}";
+    }
+    out << "]}" << std::endl;
+
+    if (!out) {
+        throw std::runtime_error("failed to write trace file " + path);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef LIBCAMERA_MEME_FRAME_TRACE_H
+#define LIBCAMERA_MEME_FRAME_TRACE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+// Where a frame spends its time, in pipeline order
+enum class TraceStage {
+    Exposure, // sensor timestamp (start of exposure) until libcamera completes the request
+    CameraQueue, // completed request waiting for the thresholder thread
+    Import, // importing or mapping the camera planes and output buffers
+    Render, // GL only: recording and submitting the passes, plus the GPU work when not pipelined
+    Gpu, // GL pipelined only: submitted until the fence signals
+    Threshold, // CPU only: the thresholding itself
+    OutputQueue, // finished frame waiting for the display thread
+    Readback, // display thread reading the outputs
+    Total, // sensor timestamp until the display thread is done with the frame
+    Count,
+};
+
+const char *trace_stage_name(TraceStage stage);
+
+// Travels with a frame from the camera to the display thread. Times are on the FrameTracer::now() clock, zero when
+// unknown.
+struct FrameTag {
+    std::uint32_t sequence = 0;
+    std::int64_t sensor_timestamp = 0;
+    // When the frame was last handed to a queue, so whoever pops it can record the wait
+    std::int64_t handoff = 0;
+};
+
+// Log-linear histogram in the style of HdrHistogram: 16 buckets per power of two, so any value is reported within
+// about 6%. Recording is lock-free and allocation free, and can race with reads.
+class LatencyHistogram {
+public:
+    void record(std::int64_t value);
+
+    [[nodiscard]] std::uint64_t count() const;
+    [[nodiscard]] std::int64_t min() const;
+    [[nodiscard]] std::int64_t max() const;
+    [[nodiscard]] double mean() const;
+    // The upper bound of the bucket holding the given quantile in [0, 1]
+    [[nodiscard]] std::int64_t percentile(double quantile) const;
+    // Not atomic with respect to concurrent records
+    void reset();
+
+private:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // Enough for 2^40 ns, anything longer lands in the last bucket
+    static constexpr int MAX_SHIFT = 40 - SUB_BUCKET_BITS;
+    static constexpr int BUCKETS = SUB_BUCKETS + MAX_SHIFT * SUB_BUCKETS / 2;
+
+    static int bucket_index(std::uint64_t value);
+    static std::int64_t bucket_upper_bound(int index);
+
+    std::array<std::atomic<std::uint64_t>, BUCKETS> m_buckets{};
+    std::atomic<std::uint64_t> m_count{0};
+    std::atomic<std::int64_t> m_sum{0};
+    std::atomic<std::int64_t> m_min{INT64_MAX};
+    std::atomic<std::int64_t> m_max{0};
+};
+
+// Per-stage latency histograms, plus an optional ring of the most recent stage spans that can be dumped as a
+// Chrome trace (chrome://tracing or ui.perfetto.dev). Everything is allocated up front, so any thread can record
+// from the hot path.
+class FrameTracer {
+public:
+    // trace_capacity is how many spans the ring keeps, zero for histograms only
+    explicit FrameTracer(std::size_t trace_capacity = 0);
+
+    FrameTracer(const FrameTracer &) = delete;
+    FrameTracer &operator=(const FrameTracer &) = delete;
+
+    // CLOCK_MONOTONIC in ns, the clock V4L2 stamps camera buffers with
+    static std::int64_t now();
+
+    // Spans that start at zero or end before they begin are ignored, e.g. a missing sensor timestamp
+    void record(TraceStage stage, const FrameTag &tag, std::int64_t begin, std::int64_t end);
+
+    [[nodiscard]] const LatencyHistogram &histogram(TraceStage stage) const;
+    // Starts over, e.g. after a warmup. Only consistent once nothing is recording anymore.
+    void reset();
+
+    // One line per stage that saw any frames: count, min, mean, p50, p90, p99 and max in ms
+    void printSummary(std::ostream &out) const;
+    // Only consistent once nothing is recording anymore
+    void writeChromeTrace(const std::string &path) const;
+
+private:
+    struct Span {
+        std::int64_t begin;
+        std::int64_t end;
+        std::uint32_t sequence;
+        TraceStage stage;
+    };
+
+    std::array<LatencyHistogram, static_cast<std::size_t>(TraceStage::Count)> m_histograms;
+    std::size_t m_trace_capacity;
+    std::unique_ptr<Span[]> m_spans;
+    std::atomic<std::uint64_t> m_next_span{0};
+};
+
+#endif //LIBCAMERA_MEME_FRAME_TRACE_H
@@ -0,0 +1,116 @@
+#include "gl_context.h"
+
+#include <stdexcept>
+
+#include "gl_utility.h"
+
+static EGLDisplay surfaceless_display() {
+    if (!has_extension(eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS), "EGL_MESA_platform_surfaceless")) {
+        throw std::runtime_error("EGL_MESA_platform_surfaceless not supported");
+    }
+    static auto eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress(
+            "eglGetPlatformDisplayEXT");
+    return eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+}
+
+GlContext::GlContext(EglPlatform egl_platform) {
+    bool surfaceless = egl_platform == EglPlatform::Surfaceless;
+    auto display = surfaceless ? surfaceless_display() : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLERROR();
+    if (display == EGL_NO_DISPLAY) {
+        throw std::runtime_error("failed to get default display");
+    }
+
+    if (!eglInitialize(display, nullptr, nullptr)) {
+        throw std::runtime_error("failed to initialize display");
+    }
+    EGLERROR();
+
+    auto display_extensions = eglQueryString(display, EGL_EXTENSIONS);
+    // Checked up front, otherwise the first frame is where it would fail
+    if (!has_extension(display_extensions, "EGL_EXT_image_dma_buf_import")) {
+        throw std::runtime_error("display can't import dma-bufs, EGL_EXT_image_dma_buf_import missing");
+    }
+    if (surfaceless && (!has_extension(display_extensions, "EGL_KHR_surfaceless_context") ||
+                        !has_extension(display_extensions, "EGL_KHR_no_config_context"))) {
+        throw std::runtime_error("surfaceless display needs EGL_KHR_surfaceless_context and EGL_KHR_no_config_context");
+    }
+
+    const EGLint attribs[] = {
+            EGL_RED_SIZE, 8,
+            EGL_GREEN_SIZE, 8,
+            EGL_BLUE_SIZE, 8,
+            EGL_ALPHA_SIZE, 8,
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+            EGL_NONE
+    };
+
+    // Everything is drawn into imported dma-bufs, a surfaceless context needs neither a config nor a surface
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    EGLint num_configs;
+    if (!surfaceless && (!eglChooseConfig(display, attribs, &config, 1, &num_configs) || num_configs < 1)) {
+        throw std::runtime_error("failed to choose config");
+    }
+    EGLERROR();
+
+    if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+        throw std::runtime_error("failed to bind API");
+    }
+    EGLERROR();
+    m_display = display;
+
+    const EGLint ctx_attribs[] = {
+            EGL_CONTEXT_CLIENT_VERSION, 2,
+            EGL_NONE
+    };
+    auto context = eglCreateContext(display, config, EGL_NO_CONTEXT, ctx_attribs);
+    if (!context) {
+        throw std::runtime_error("failed to create context");
+    }
+    EGLERROR();
+    m_context = context;
+
+    if (!surfaceless) {
+        // Only there to make the context current, nothing is ever drawn to it
+        const EGLint pbuffer_attribs[] = {
+                EGL_WIDTH, 1,
+                EGL_HEIGHT, 1,
+                EGL_NONE
+        };
+        auto surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+        if (!surface) {
+            throw std::runtime_error("failed to create pixel buffer surface");
+        }
+        EGLERROR();
+        m_surface = surface;
+    }
+
+    makeCurrent();
+}
+
+GlContext::~GlContext() {
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (m_surface != EGL_NO_SURFACE) {
+        eglDestroySurface(m_display, m_surface);
+    }
+    eglDestroyContext(m_display, m_context);
+}
+
+EGLDisplay GlContext::display() const {
+    return m_display;
+}
+
+bool GlContext::hasDisplayExtension(const std::string &name) const {
+    return has_extension(eglQueryString(m_display, EGL_EXTENSIONS), name);
+}
+
+void GlContext::makeCurrent() const {
+    if (eglGetCurrentContext() == m_context) {
+        return;
+    }
+    if (!eglMakeCurrent(m_display, m_surface, m_surface, m_context)) {
+        throw std::runtime_error("failed to bind egl context");
+    }
+    EGLERROR();
+}
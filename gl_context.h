@@ -0,0 +1,34 @@
+#ifndef LIBCAMERA_MEME_GL_CONTEXT_H
+#define LIBCAMERA_MEME_GL_CONTEXT_H
+
+#include <string>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "hsv_thresholder.h"
+
+// An EGL display with a GLES2 context, made current on the thread that creates it. Several GlHsvThresholders can
+// share one, so that a process with N cameras feeds a single context from a single submission thread instead of N
+// contexts the driver has to switch between. Everything that uses it has to stay on that thread.
+class GlContext {
+public:
+    explicit GlContext(EglPlatform egl_platform = EglPlatform::Default);
+    ~GlContext();
+
+    GlContext(const GlContext &) = delete;
+    GlContext &operator=(const GlContext &) = delete;
+
+    [[nodiscard]] EGLDisplay display() const;
+    [[nodiscard]] bool hasDisplayExtension(const std::string &name) const;
+
+    // Throws if the context is current on another thread
+    void makeCurrent() const;
+
+private:
+    EGLDisplay m_display;
+    EGLContext m_context;
+    EGLSurface m_surface = EGL_NO_SURFACE;
+};
+
+#endif //LIBCAMERA_MEME_GL_CONTEXT_H
@@ -0,0 +1,273 @@
+#include "gl_hsv_histogram.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <libdrm/drm_fourcc.h>
+
+// Copies are laid out left to right, then top to bottom, each a histogram buffer's worth of texels
+static constexpr int MAX_COPY_COLUMNS = 64;
+static constexpr int COPY_WIDTH = HISTOGRAM_HUE_BINS;
+static constexpr int COPY_HEIGHT = HISTOGRAM_SATURATION_BINS + 1;
+// What one channel of a copy can count before it saturates
+static constexpr int POINTS_PER_COPY = 4 * 255;
+
+// Prefixed with the layout, see histogram_defines
+static constexpr const char *SCATTER_VERTEX_SOURCE =
+        "attribute float vertex;"
+        "varying lowp vec4 lane;"
+        ""
+        "uniform sampler2D samples;"
+        "uniform vec2 samplesSize;"
+        "uniform float gridWidth;"
+        "uniform vec2 copiesSize;"
+        // 0 to add the hue by saturation bin, 1 for the value row below it
+        "uniform float valueRow;"
+        ""
+        // Whole number quotient, safe from the division landing just under it
+        "float quotient(float a, float b) {"
+        "  return floor((a + 0.5) / b);"
+        "}"
+        ""
+        "void main(void) {"
+        "  float row = quotient(vertex, gridWidth);"
+        "  vec2 cell = vec2(vertex - row * gridWidth, row);"
+        "  vec3 bins = floor(texture2D(samples, (cell + 0.5) / samplesSize).rgb * 255.0 + 0.5);"
+        ""
+        "  float slot = quotient(vertex, 4.0);"
+        "  lane = vec4(equal(vec4(vertex - slot * 4.0), vec4(0.0, 1.0, 2.0, 3.0)));"
+        "  float copy = slot - quotient(slot, float(COPIES)) * float(COPIES);"
+        "  float copyRow = quotient(copy, COPY_COLUMNS);"
+        "  vec2 origin = vec2(copy - copyRow * COPY_COLUMNS, copyRow) * COPY_SIZE;"
+        "  vec2 bin = valueRow > 0.5 ? vec2(bins.z, COPY_SIZE.y - 1.0) : bins.xy;"
+        ""
+        "  gl_Position = vec4((origin + bin + 0.5) / copiesSize * 2.0 - 1.0, 0.0, 1.0);"
+        "  gl_PointSize = 1.0;"
+        "}";
+
+static constexpr const char *SCATTER_FRAGMENT_SOURCE =
+        "#version 100\n"
+        ""
+        "precision mediump float;"
+        ""
+        "varying lowp vec4 lane;"
+        ""
+        "void main(void) {"
+        "  gl_FragColor = lane / 255.0;"
+        "}";
+
+static constexpr const char *SUM_VERTEX_SOURCE =
+        "#version 100\n"
+        ""
+        "attribute vec2 vertex;"
+        ""
+        "void main(void) {"
+        "   gl_Position = vec4(vertex, 0.0, 1.0);"
+        "}";
+
+// Every texel of the buffer reads its bin from all copies. The sums stay below 2^24, exact in highp floats.
+static constexpr const char *SUM_FRAGMENT_SOURCE =
+        "precision highp float;"
+        ""
+        "uniform sampler2D copies;"
+        "uniform vec2 copiesSize;"
+        ""
+        "void main(void) {"
+        "  vec2 bin = floor(gl_FragCoord.xy);"
+        "  float count = 0.0;"
+        "  for (int i = 0; i < COPIES; i++) {"
+        "    float copyRow = floor((float(i) + 0.5) / COPY_COLUMNS);"
+        "    vec2 texel = vec2(float(i) - copyRow * COPY_COLUMNS, copyRow) * COPY_SIZE + bin;"
+        "    vec4 lanes = floor(texture2D(copies, (texel + 0.5) / copiesSize) * 255.0 + 0.5);"
+        "    count += lanes.r + lanes.g + lanes.b + lanes.a;"
+        "  }"
+        ""
+        "  float high = floor(count / 65536.0);"
+        "  float rest = count - high * 65536.0;"
+        "  float middle = floor(rest / 256.0);"
+        "  vec4 bytes = vec4(rest - middle * 256.0, middle, high, 0.0);"
+        // ARGB8888 keeps B, G, R, A in memory order
+        "  gl_FragColor = bytes.zyxw / 255.0;"
+        "}";
+
+static std::string histogram_defines(int copies, int copy_columns) {
+    return "#version 100\n#define COPIES " + std::to_string(copies) + "\n#define COPY_COLUMNS " +
+           std::to_string(copy_columns) + ".0\n#define COPY_SIZE vec2(" + std::to_string(COPY_WIDTH) + ".0, " +
+           std::to_string(COPY_HEIGHT) + ".0)\n";
+}
+
+static void make_rgba_target(int width, int height, GLuint &texture, GLuint &framebuffer) {
+    glGenTextures(1, &texture);
+    GLERROR();
+    glBindTexture(GL_TEXTURE_2D, texture);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    GLERROR();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    GLERROR();
+
+    glGenFramebuffers(1, &framebuffer);
+    GLERROR();
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    GLERROR();
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    GLERROR();
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("failed to complete histogram framebuffer");
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+GlHsvHistogram::GlHsvHistogram(int width, int height, int step, GlProgramCache &programs) {
+    if (step < 1) {
+        throw std::runtime_error("the histogram step has to be at least 1");
+    }
+    m_grid_width = gridSize(width, step);
+    m_grid_height = gridSize(height, step);
+    auto points = m_grid_width * m_grid_height;
+    m_copies = std::max((points + POINTS_PER_COPY - 1) / POINTS_PER_COPY, 1);
+    int copy_columns = std::min(m_copies, MAX_COPY_COLUMNS);
+    m_copies_width = copy_columns * COPY_WIDTH;
+    m_copies_height = (m_copies + copy_columns - 1) / copy_columns * COPY_HEIGHT;
+
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    GLERROR();
+    if (m_copies_height > max_size) {
+        throw std::runtime_error("too many histogram samples, the histogram step has to be larger");
+    }
+
+    make_rgba_target(m_grid_width, m_grid_height, m_samples_texture, m_samples_framebuffer);
+    make_rgba_target(m_copies_width, m_copies_height, m_copies_texture, m_copies_framebuffer);
+
+    std::vector<GLfloat> indices(static_cast<std::size_t>(points));
+    for (std::size_t i = 0; i < indices.size(); i++) {
+        indices[i] = static_cast<GLfloat>(i);
+    }
+    glGenBuffers(1, &m_index_vbo);
+    GLERROR();
+    glBindBuffer(GL_ARRAY_BUFFER, m_index_vbo);
+    GLERROR();
+    glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(indices.size() * sizeof(GLfloat)), indices.data(),
+                 GL_STATIC_DRAW);
+    GLERROR();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    auto defines = histogram_defines(m_copies, copy_columns);
+    m_scatter_program = programs.program(defines + SCATTER_VERTEX_SOURCE, SCATTER_FRAGMENT_SOURCE);
+    glUseProgram(m_scatter_program);
+    GLERROR();
+    glUniform1i(glGetUniformLocation(m_scatter_program, "samples"), 1);
+    GLERROR();
+    glUniform2f(glGetUniformLocation(m_scatter_program, "samplesSize"), static_cast<GLfloat>(m_grid_width),
+                static_cast<GLfloat>(m_grid_height));
+    GLERROR();
+    glUniform2f(glGetUniformLocation(m_scatter_program, "copiesSize"), static_cast<GLfloat>(m_copies_width),
+                static_cast<GLfloat>(m_copies_height));
+    GLERROR();
+    m_grid_width_loc = glGetUniformLocation(m_scatter_program, "gridWidth");
+    m_value_row_loc = glGetUniformLocation(m_scatter_program, "valueRow");
+
+    m_sum_program = programs.program(SUM_VERTEX_SOURCE, defines + SUM_FRAGMENT_SOURCE);
+    glUseProgram(m_sum_program);
+    GLERROR();
+    glUniform1i(glGetUniformLocation(m_sum_program, "copies"), 1);
+    GLERROR();
+    glUniform2f(glGetUniformLocation(m_sum_program, "copiesSize"), static_cast<GLfloat>(m_copies_width),
+                static_cast<GLfloat>(m_copies_height));
+    GLERROR();
+}
+
+GlHsvHistogram::~GlHsvHistogram() {
+    glDeleteBuffers(1, &m_index_vbo);
+    glDeleteFramebuffers(1, &m_copies_framebuffer);
+    glDeleteTextures(1, &m_copies_texture);
+    glDeleteFramebuffers(1, &m_samples_framebuffer);
+    glDeleteTextures(1, &m_samples_texture);
+}
+
+bool GlHsvHistogram::supported() {
+    GLint units = 0;
+    glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &units);
+    GLERROR();
+    return units > 0;
+}
+
+GLuint GlHsvHistogram::samplesFramebuffer() const {
+    return m_samples_framebuffer;
+}
+
+DmaBufRenderTarget GlHsvHistogram::importTarget(EGLDisplay display, int fd) const {
+    return import_render_target(display, fd, DRM_FORMAT_ARGB8888, COPY_WIDTH, COPY_HEIGHT, COPY_WIDTH * 4);
+}
+
+void GlHsvHistogram::accumulate(int grid_width, int grid_height, const DmaBufRenderTarget &target) {
+    grid_width = std::min(grid_width, m_grid_width);
+    grid_height = std::min(grid_height, m_grid_height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_copies_framebuffer);
+    GLERROR();
+    glViewport(0, 0, m_copies_width, m_copies_height);
+    GLERROR();
+    glClear(GL_COLOR_BUFFER_BIT);
+    GLERROR();
+
+    glActiveTexture(GL_TEXTURE1);
+    GLERROR();
+    glBindTexture(GL_TEXTURE_2D, m_samples_texture);
+    GLERROR();
+
+    GLint quad_vbo;
+    glGetVertexAttribiv(QUAD_VERTEX_ATTRIB, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &quad_vbo);
+    GLERROR();
+    glBindBuffer(GL_ARRAY_BUFFER, m_index_vbo);
+    GLERROR();
+    glVertexAttribPointer(QUAD_VERTEX_ATTRIB, 1, GL_FLOAT, GL_FALSE, 0, nullptr);
+    GLERROR();
+
+    glUseProgram(m_scatter_program);
+    GLERROR();
+    glUniform1f(m_grid_width_loc, static_cast<GLfloat>(grid_width));
+    GLERROR();
+    glEnable(GL_BLEND);
+    GLERROR();
+    glBlendFunc(GL_ONE, GL_ONE);
+    GLERROR();
+    for (auto value_row: {0.0f, 1.0f}) {
+        glUniform1f(m_value_row_loc, value_row);
+        GLERROR();
+        glDrawArrays(GL_POINTS, 0, grid_width * grid_height);
+        GLERROR();
+    }
+    glDisable(GL_BLEND);
+    GLERROR();
+
+    glBindBuffer(GL_ARRAY_BUFFER, static_cast<GLuint>(quad_vbo));
+    GLERROR();
+    glVertexAttribPointer(QUAD_VERTEX_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    GLERROR();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    GLERROR();
+    glViewport(0, 0, COPY_WIDTH, COPY_HEIGHT);
+    GLERROR();
+    glBindTexture(GL_TEXTURE_2D, m_copies_texture);
+    GLERROR();
+    glUseProgram(m_sum_program);
+    GLERROR();
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    GLERROR();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    GLERROR();
+}
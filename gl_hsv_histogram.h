@@ -0,0 +1,62 @@
+#ifndef LIBCAMERA_MEME_GL_HSV_HISTOGRAM_H
+#define LIBCAMERA_MEME_GL_HSV_HISTOGRAM_H
+
+#include <GLES2/gl2.h>
+#include <EGL/egl.h>
+
+#include "gl_program_cache.h"
+#include "gl_utility.h"
+#include "hsv_histogram.h"
+
+// Counts a grid of samples into an HsvHistogram buffer without the CPU. The caller draws each sample's bins into
+// samplesFramebuffer(), then every sample becomes a point that lands on its bin and adds one there with additive
+// blending. An RGBA8 target saturates at 255, so the points are dealt round robin over the four channels of as
+// many copies of the histogram as it takes for no channel to ever pass that, and a last pass adds the copies up
+// into the 24 bit counts of the buffer. Needs vertex texture fetch. Lives in the caller's GL context.
+class GlHsvHistogram {
+public:
+    // At most one sample every step input pixels of a width x height frame. The programs come from programs,
+    // which has to outlive the histogram.
+    GlHsvHistogram(int width, int height, int step, GlProgramCache &programs);
+    ~GlHsvHistogram();
+
+    GlHsvHistogram(const GlHsvHistogram &) = delete;
+    GlHsvHistogram &operator=(const GlHsvHistogram &) = delete;
+
+    // Whether the current context can sample textures in vertex shaders
+    static bool supported();
+
+    // Samples along an axis of this many input pixels
+    static constexpr int gridSize(int pixels, int step) {
+        return (pixels + step - 1) / step;
+    }
+
+    // RGBA8, each sample's hue, saturation and value bins as bytes in r, g and b
+    [[nodiscard]] GLuint samplesFramebuffer() const;
+
+    DmaBufRenderTarget importTarget(EGLDisplay display, int fd) const;
+
+    // Counts the grid_width x grid_height samples at the top left of the samples framebuffer into target.
+    // Samples on texture unit 1 and draws the sums with the full-screen quad that the caller has bound to
+    // QUAD_VERTEX_ATTRIB, which is bound again after the points.
+    void accumulate(int grid_width, int grid_height, const DmaBufRenderTarget &target);
+private:
+    int m_grid_width;
+    int m_grid_height;
+    int m_copies;
+    int m_copies_width;
+    int m_copies_height;
+
+    GLuint m_samples_texture = 0;
+    GLuint m_samples_framebuffer = 0;
+    GLuint m_copies_texture = 0;
+    GLuint m_copies_framebuffer = 0;
+    GLuint m_index_vbo = 0; // each point's index as a float
+
+    GLuint m_scatter_program;
+    GLint m_grid_width_loc;
+    GLint m_value_row_loc;
+    GLuint m_sum_program;
+};
+
+#endif //LIBCAMERA_MEME_GL_HSV_HISTOGRAM_H
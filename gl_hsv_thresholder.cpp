@@ -3,36 +3,94 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2ext.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <span>
 #include <stdexcept>
 #include <iostream>
 
+#include <poll.h>
+#include <unistd.h>
+
 #include <libdrm/drm_fourcc.h>
 
-#include "stb_image.h"
+#include "hsv_histogram.h"
+
+// The camera planes go on units 0, 3 and 4, GlMorphology, GlMaskReducer and GlHsvHistogram sample their
+// intermediate textures from unit 1
+static constexpr GLint LUT_TEXTURE_UNIT = 2;
+static constexpr GLint REMAP_TEXTURE_UNIT = 5;
+static constexpr std::array<GLint, 3> PLANE_TEXTURE_UNITS = {0, 3, 4};
+
+namespace {
+    // How one sampler of the shader sees the camera buffer. YUYV is imported twice from its single plane: as
+    // GR88 for the luma, and as ARGB8888 at half width where each texel is a whole Y0 U Y1 V group, so U lands in
+    // green and V in alpha.
+    struct PlaneTexture {
+        int plane;
+        uint32_t fourcc;
+        int width_divisor;
+        int height_divisor;
+        const char *sampler;
+    };
+
+    constexpr PlaneTexture YUV420_TEXTURES[] = {
+            {0, DRM_FORMAT_R8, 1, 1, "lumaPlane"},
+            {1, DRM_FORMAT_R8, 2, 2, "cbPlane"},
+            {2, DRM_FORMAT_R8, 2, 2, "crPlane"},
+    };
+    constexpr PlaneTexture NV12_TEXTURES[] = {
+            {0, DRM_FORMAT_R8, 1, 1, "lumaPlane"},
+            {1, DRM_FORMAT_GR88, 2, 2, "chromaPlane"},
+    };
+    constexpr PlaneTexture YUYV_TEXTURES[] = {
+            {0, DRM_FORMAT_GR88, 1, 1, "lumaPlane"},
+            {0, DRM_FORMAT_ARGB8888, 2, 1, "chromaPlane"},
+    };
+}
+
+static std::span<const PlaneTexture> plane_textures(YuvFormat format) {
+    switch (format) {
+        case YuvFormat::Yuv420:
+            return YUV420_TEXTURES;
+        case YuvFormat::Nv12:
+            return NV12_TEXTURES;
+        case YuvFormat::Yuyv:
+            return YUYV_TEXTURES;
+    }
+    throw std::runtime_error("unknown yuv format");
+}
 
-#define GLERROR() glerror(__LINE__)
-#define EGLERROR() eglerror(__LINE__)
+// Packed outputs keep the mask in alpha, planar ones in red
+static std::array<GLfloat, 4> mask_channel(HsvThresholder::OutputMode mode) {
+    if (mode == HsvThresholder::OutputMode::Planar) {
+        return {1.0f, 0.0f, 0.0f, 0.0f};
+    }
+    return {0.0f, 0.0f, 0.0f, 1.0f};
+}
 
-void glerror(int line) {
-    GLenum error = glGetError();
-    if (error != GL_NO_ERROR) {
-        std::string output;
-        output.resize(128);
-        snprintf(output.data(), 128, "GL error detected on line %d: 0x%04x\n", line, error);
-        std::cout << output << std::endl;
-        throw std::runtime_error(output);
+static void check_morphology(HsvThresholder::OutputMode mode, const std::vector<HsvThresholder::MorphologyStep> &steps) {
+    if (steps.empty()) {
+        return;
+    }
+    if (mode == HsvThresholder::OutputMode::BitPacked || mode == HsvThresholder::OutputMode::RangeBits) {
+        throw std::runtime_error("morphology needs a packed or planar mask");
     }
+    GlMorphology::checkSteps(steps);
 }
 
-void eglerror(int line) {
-    EGLint error = eglGetError();
-    if (error != EGL_SUCCESS) {
-        std::string output;
-        output.resize(128);
-        snprintf(output.data(), 128, "EGL error detected on line %d: 0x%04x\n", line, error);
-        std::cout << output << std::endl;
-        throw std::runtime_error(output);
+static const char *input_define(YuvFormat format) {
+    switch (format) {
+        case YuvFormat::Yuv420:
+            return "#define INPUT_YUV420\n";
+        case YuvFormat::Nv12:
+            return "#define INPUT_NV12\n";
+        case YuvFormat::Yuyv:
+            return "#define INPUT_YUYV\n";
     }
+    throw std::runtime_error("unknown yuv format");
 }
 
 static constexpr const char *VERTEX_SOURCE =
@@ -40,24 +98,71 @@ static constexpr const char *VERTEX_SOURCE =
         ""
         "attribute vec2 vertex;"
         "varying vec2 texcoord;"
+        // Origin and size of the window of the input that's sampled, in texture coordinates
+        "uniform highp vec4 sampleRect;"
         ""
         "void main(void) {"
-        "   texcoord = 0.5 * (vertex + 1.0);"
+        "   texcoord = sampleRect.xy + 0.5 * (vertex + 1.0) * sampleRect.zw;"
         "   gl_Position = vec4(vertex, 0.0, 1.0);"
         "}";
 
+// Prefixed with a #version line and the defines that pick the input layout and what gets written, see
+// fragment_source
 static constexpr const char *FRAGMENT_SOURCE =
-        "#version 100\n"
-        "#extension GL_OES_EGL_image_external : require\n"
-        ""
         "precision lowp float;"
         "precision lowp int;"
         ""
         "varying vec2 texcoord;"
         ""
-        "uniform vec3 lowerThresh;"
-        "uniform vec3 upperThresh;"
-        "uniform samplerExternalOES tex;"
+        "uniform sampler2D lumaPlane;"
+        "\n#if defined(INPUT_YUV420)\n"
+        "uniform sampler2D cbPlane;"
+        "uniform sampler2D crPlane;"
+        ""
+        "mediump vec3 sampleYuv(highp vec2 coord) {"
+        "  return vec3(texture2D(lumaPlane, coord).r, texture2D(cbPlane, coord).r, texture2D(crPlane, coord).r);"
+        "}"
+        "\n#elif defined(INPUT_NV12)\n"
+        "uniform sampler2D chromaPlane;"
+        ""
+        "mediump vec3 sampleYuv(highp vec2 coord) {"
+        "  return vec3(texture2D(lumaPlane, coord).r, texture2D(chromaPlane, coord).rg);"
+        "}"
+        "\n#elif defined(INPUT_YUYV)\n"
+        "uniform sampler2D chromaPlane;"
+        ""
+        "mediump vec3 sampleYuv(highp vec2 coord) {"
+        "  return vec3(texture2D(lumaPlane, coord).r, texture2D(chromaPlane, coord).ga);"
+        "}"
+        "\n#endif\n"
+        ""
+        // yuvToRgb * (yuv - yuvOffset), built from yuv_to_rgb_coefficients for the frame's encoding and range
+        "uniform mediump mat3 yuvToRgb;"
+        "uniform mediump vec3 yuvOffset;"
+        ""
+        "vec3 toRgb(mediump vec3 yuv) {"
+        "  return clamp(yuvToRgb * (yuv - yuvOffset), 0.0, 1.0);"
+        "}"
+        ""
+        "\n#if defined(REMAP)\n"
+        // Where each output pixel samples the input, from its nearest texel, see pack_remap. The coordinates are
+        // 16 bit fixed point split over the bytes, which only highp can put back together. Off the input it's
+        // yuvOffset, the samples of black.
+        "uniform sampler2D remapTable;"
+        ""
+        "mediump vec3 sampleFrameYuv(highp vec2 coord) {"
+        "  highp vec4 bytes = floor(texture2D(remapTable, coord) * 255.0 + 0.5);"
+        "  highp vec2 position = bytes.rb * 256.0 + bytes.ga;"
+        "  if (position.x > REMAP_OUTSIDE - 0.5) {"
+        "    return yuvOffset;"
+        "  }"
+        "  return sampleYuv(position / REMAP_ONE);"
+        "}"
+        "\n#else\n"
+        "mediump vec3 sampleFrameYuv(highp vec2 coord) {"
+        "  return sampleYuv(coord);"
+        "}"
+        "\n#endif\n"
         ""
         "vec3 rgb2hsv(const vec3 p) {"
         "  const vec4 H = vec4(0.0, -1.0 / 3.0, 2.0 / 3.0, -1.0);"
@@ -71,203 +176,324 @@ static constexpr const char *FRAGMENT_SOURCE =
         "t.x);"
         "}"
         ""
-        "bool inRange(vec3 hsv) {"
+        "bool inRange(vec3 hsv, vec3 lower, vec3 upper) {"
         "  const float epsilon = 0.0001;"
-        "  bvec3 botBool = greaterThanEqual(hsv, lowerThresh - epsilon);"
-        "  bvec3 topBool = lessThanEqual(hsv, upperThresh + epsilon);"
-        "  return all(botBool) && all(topBool);"
+        "  bvec3 botBool = greaterThanEqual(hsv, lower - epsilon);"
+        "  bvec3 topBool = lessThanEqual(hsv, upper + epsilon);"
+        // A hue range with its lower bound above the upper one wraps around through red
+        "  bool hue = lower.x <= upper.x ? botBool.x && topBool.x : botBool.x || topBool.x;"
+        "  return hue && botBool.y && botBool.z && topBool.y && topBool.z;"
+        "}"
+        ""
+        "\n#if defined(BAKED_RANGES)\n"
+        // The ranges as constants, see baked_ranges_defines
+        "bool inAnyRange(vec3 hsv) {"
+        "  return BAKED_ANY_RANGE(hsv);"
+        "}"
+        ""
+        "mediump float rangeBits(vec3 hsv) {"
+        "  mediump float bits = 0.0;"
+        "  BAKED_RANGE_BITS(hsv, bits)"
+        "  return bits;"
+        "}"
+        "\n#else\n"
+        // The first rangeCount entries are used, see HsvThresholder::setRanges
+        "uniform vec3 lowerThresh[MAX_RANGES];"
+        "uniform vec3 upperThresh[MAX_RANGES];"
+        "uniform int rangeCount;"
+        ""
+        "bool inAnyRange(vec3 hsv) {"
+        "  for (int i = 0; i < MAX_RANGES; i++) {"
+        "    if (i >= rangeCount) break;"
+        "    if (inRange(hsv, lowerThresh[i], upperThresh[i])) return true;"
+        "  }"
+        "  return false;"
+        "}"
+        ""
+        // Bit i for range i, counted in mediump as lowp can't hold 255
+        "mediump float rangeBits(vec3 hsv) {"
+        "  mediump float bits = 0.0;"
+        "  mediump float bit = 1.0;"
+        "  for (int i = 0; i < MAX_RANGES; i++) {"
+        "    if (i >= rangeCount) break;"
+        "    if (inRange(hsv, lowerThresh[i], upperThresh[i])) bits += bit;"
+        "    bit *= 2.0;"
+        "  }"
+        "  return bits;"
+        "}"
+        "\n#endif\n"
+        "\n#if defined(CLASSIFY_LUT)\n"
+        // One fetch from the ColorLut atlas, indexed by the samples themselves, instead of the conversion and the
+        // math above. They're rounded back to 8 bit steps first, a fetch that's a hair off would otherwise pick the
+        // neighbouring cell where a sample lies close to a cell boundary. The cell coordinates go up to the atlas
+        // size, past what lowp and mediump can count exactly.
+        "uniform sampler2D lut;"
+        "uniform highp float lutSize;"
+        "uniform highp float lutColumns;"
+        "uniform highp vec2 lutAtlasSize;"
+        ""
+        "bool classify(mediump vec3 yuv, vec3 col) {"
+        "  highp vec3 cell = floor(floor(yuv * 255.0 + 0.5) * ((lutSize - 1.0) / 255.0) + 0.5);"
+        "  highp float row = floor(cell.b / lutColumns);"
+        "  highp vec2 texel = vec2(cell.b - row * lutColumns, row) * lutSize + cell.rg + 0.5;"
+        "  return texture2D(lut, texel / lutAtlasSize).r > 0.5;"
+        "}"
+        "\n#else\n"
+        "bool classify(mediump vec3 yuv, vec3 col) {"
+        "  return inAnyRange(rgb2hsv(col));"
         "}"
+        "\n#endif\n"
+        "\n#if defined(OUTPUT_BITS)\n"
+        // Mask pixels of the window, whose positions go past what lowp and mediump can count exactly
+        "uniform highp vec2 outputSize;"
+        "uniform highp vec4 sampleRect;"
+        ""
+        "mediump float packByte(highp float first) {"
+        "  mediump float value = 0.0;"
+        "  mediump float bit = 1.0;"
+        "  highp float y = sampleRect.y + gl_FragCoord.y / outputSize.y * sampleRect.w;"
+        "  for (int i = 0; i < 8; i++) {"
+        "    highp float x = first + float(i);"
+        "    highp vec2 coord = vec2(sampleRect.x + (x + 0.5) / outputSize.x * sampleRect.z, y);"
+        "    mediump vec3 yuv = sampleFrameYuv(coord);"
+        "    if (x < outputSize.x && classify(yuv, toRgb(yuv))) {"
+        "      value += bit;"
+        "    }"
+        "    bit *= 2.0;"
+        "  }"
+        "  return value / 255.0;"
+        "}"
+        "\n#endif\n"
         ""
         "void main(void) {"
-        "  vec3 col = texture2D(tex, texcoord).rgb;"
-        "  gl_FragColor = vec4(col.bgr, int(inRange(rgb2hsv(col))));"
+        "\n#if defined(OUTPUT_BITS)\n"
+        // Each texel holds 32 pixels, least significant bit first. ARGB8888 keeps B, G, R, A in memory order,
+        // so bytes 0 to 3 of the word come from the b, g, r and a components.
+        "  highp float first = floor(gl_FragCoord.x) * 32.0;"
+        "  gl_FragColor = vec4(packByte(first + 16.0), packByte(first + 8.0), packByte(first), packByte(first + 24.0));"
+        "\n#else\n"
+        // A LUT mask never reads col, so the compiler drops the conversion
+        "  mediump vec3 yuv = sampleFrameYuv(texcoord);"
+        "  vec3 col = toRgb(yuv);"
+        "\n#if defined(OUTPUT_MASK)\n"
+        "  gl_FragColor = vec4(float(classify(yuv, col)), 0.0, 0.0, 1.0);"
+        "\n#elif defined(OUTPUT_RANGE_BITS)\n"
+        "  gl_FragColor = vec4(rangeBits(rgb2hsv(col)) / 255.0, 0.0, 0.0, 1.0);"
+        "\n#elif defined(OUTPUT_COLOR)\n"
+        "  gl_FragColor = vec4(col.bgr, 1.0);"
+        "\n#elif defined(OUTPUT_HSV_BINS)\n"
+        // Bin indices rather than the values, an 8 bit hue would leave some bins a step wider than others. Counted
+        // in mediump as lowp can't hold 32.
+        "  mediump vec3 hsv = rgb2hsv(col);"
+        "  mediump vec3 bins = min(floor(hsv * HSV_BINS), HSV_BINS - 1.0);"
+        "  gl_FragColor = vec4(bins / 255.0, 1.0);"
+        "\n#else\n"
+        "  gl_FragColor = vec4(col.bgr, int(classify(yuv, col)));"
+        "\n#endif\n"
+        "\n#endif\n"
         "}";
 
-GLuint make_shader(GLenum type, const char *source) {
-    auto shader = glCreateShader(type);
-    if (!shader) {
-        throw std::runtime_error("failed to create shader");
-    }
-    glShaderSource(shader, 1, &source, nullptr);
-    GLERROR();
-    glCompileShader(shader);
-    GLERROR();
-
-    GLint status;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (!status) {
-        GLint log_size;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
-
-        std::string out;
-        out.resize(log_size);
-        glGetShaderInfoLog(shader, log_size, nullptr, out.data());
+static std::string fragment_source(YuvFormat input_format, const std::string &defines) {
+    return "#version 100\n#define MAX_RANGES " + std::to_string(HsvThresholder::MAX_RANGES) + "\n" +
+           "#define REMAP_ONE " + std::to_string(REMAP_ONE) + ".0\n#define REMAP_OUTSIDE " +
+           std::to_string(REMAP_OUTSIDE) + ".0\n" + input_define(input_format) + defines + FRAGMENT_SOURCE;
+}
 
-        glDeleteShader(shader);
-        throw std::runtime_error("failed to compile shader with error: " + out);
+static std::string glsl_vec3(const std::array<float, 3> &v) {
+    std::string out = "vec3(";
+    for (std::size_t i = 0; i < v.size(); i++) {
+        char number[32];
+        // Exact for any float, and always a float literal
+        std::snprintf(number, sizeof(number), "%.9e", static_cast<double>(v[i]));
+        out += (i ? ", " : "") + std::string(number);
     }
-
-    return shader;
+    return out + ")";
 }
 
-GLuint make_program(const char *vertex_source, const char *fragment_source) {
-    auto vertex_shader = make_shader(GL_VERTEX_SHADER, vertex_source);
-    auto fragment_shader = make_shader(GL_FRAGMENT_SHADER, fragment_source);
+// The ranges as shader constants, so the compiler can fold the bounds and drop the loop. Both macros have to fit on
+// one line each.
+static std::string baked_ranges_defines(const std::vector<HsvRange> &ranges) {
+    std::string any, bits;
+    for (std::size_t i = 0; i < ranges.size(); i++) {
+        auto test = "inRange(hsv, " + glsl_vec3(ranges[i].lower) + ", " + glsl_vec3(ranges[i].upper) + ")";
+        any += (i ? " || " : "") + test;
+        bits += "if (" + test + ") bits += " + std::to_string(1 << i) + ".0; ";
+    }
+    return "#define BAKED_RANGES\n#define BAKED_ANY_RANGE(hsv) (" + any + ")\n#define BAKED_RANGE_BITS(hsv, bits) " +
+           bits + "\n";
+}
 
-    auto program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
+static void bind_plane_samplers(GLuint program, YuvFormat input_format) {
+    auto textures = plane_textures(input_format);
+    for (std::size_t i = 0; i < textures.size(); i++) {
+        glUniform1i(glGetUniformLocation(program, textures[i].sampler), PLANE_TEXTURE_UNITS[i]);
+        GLERROR();
+    }
+    // Programs without a remap have no such sampler, and glUniform ignores the -1 location
+    glUniform1i(glGetUniformLocation(program, "remapTable"), REMAP_TEXTURE_UNIT);
     GLERROR();
-    glAttachShader(program, fragment_shader);
+}
+
+static void set_sample_rect(GLuint program, const HsvThresholder::Roi &roi, int width, int height) {
+    const GLfloat rect[] = {
+            static_cast<GLfloat>(roi.x) / static_cast<GLfloat>(width),
+            static_cast<GLfloat>(roi.y) / static_cast<GLfloat>(height),
+            static_cast<GLfloat>(roi.width) / static_cast<GLfloat>(width),
+            static_cast<GLfloat>(roi.height) / static_cast<GLfloat>(height),
+    };
+    glUseProgram(program);
     GLERROR();
-    glLinkProgram(program);
+    glUniform4fv(glGetUniformLocation(program, "sampleRect"), 1, rect);
     GLERROR();
-
-    GLint status;
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
-    if (!status) {
-        GLint log_size;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_size);
-
-        std::string out;
-        out.resize(log_size);
-        glGetProgramInfoLog(program, log_size, nullptr, out.data());
-
-        throw std::runtime_error("failed to link program with error: " + out);
-    }
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
-
-    return program;
 }
 
-GlHsvThresholder::GlHsvThresholder(int width, int height, const std::vector<int>& output_buf_fds): m_width(width), m_height(height) {
-    static auto glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC) eglGetProcAddress(
-            "glEGLImageTargetTexture2DOES");
-    static auto eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
-
-    if (!glEGLImageTargetTexture2DOES) {
-        throw std::runtime_error("cannot get address of glEGLImageTargetTexture2DOES");
-    }
-
-    auto display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-    EGLERROR();
-    if (display == EGL_NO_DISPLAY) {
-        throw std::runtime_error("failed to get default display");
+GlHsvThresholder::GlHsvThresholder(int width, int height, YuvFormat input_format, DmaBufPool &output_pool,
+                                   const OutputConfig& output_config, bool pipelined, EglPlatform egl_platform,
+                                   std::shared_ptr<GlContext> context)
+        : m_width(width), m_height(height), m_input_format(input_format), m_output_config(output_config),
+          m_output_pool(output_pool), m_pipelined(pipelined),
+          // Every frame in flight holds at least one pooled buffer
+          m_pending_frames(std::max<std::size_t>(output_pool.maxBuffers(), 1)) {
+    if (m_output_config.scale < 1) {
+        throw std::runtime_error("the output scale has to be at least 1");
     }
-
-    if (!eglInitialize(display, nullptr, nullptr)) {
-        throw std::runtime_error("failed to initialize display");
+    m_output_width = output_size(m_output_config, width);
+    m_output_height = output_size(m_output_config, height);
+    if (m_output_config.color_width <= 0 || m_output_config.color_height <= 0) {
+        m_output_config.color_width = m_output_width;
+        m_output_config.color_height = m_output_height;
     }
-    EGLERROR();
 
-    const EGLint attribs[] = {
-            EGL_RED_SIZE, 8,
-            EGL_GREEN_SIZE, 8,
-            EGL_BLUE_SIZE, 8,
-            EGL_ALPHA_SIZE, 8,
-            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
-            EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-            EGL_NONE
-    };
+    m_context = context ? std::move(context) : std::make_shared<GlContext>(egl_platform);
+    m_context->makeCurrent();
+    m_display = m_context->display();
 
-    EGLConfig config;
-    EGLint num_configs;
-    if (!eglChooseConfig(display, attribs, &config, 1, &num_configs) || num_configs < 1) {
-        throw std::runtime_error("failed to choose config");
+    bool planar = m_output_config.mode == OutputMode::Planar;
+    bool bit_packed = m_output_config.mode == OutputMode::BitPacked;
+    bool range_bits = m_output_config.mode == OutputMode::RangeBits;
+    if (range_bits && m_output_config.lut_size > 0) {
+        // The table only knows inside or outside
+        throw std::runtime_error("range bits need the per-pixel hsv math, lut_size has to be zero");
     }
-    EGLERROR();
-
-    if (!eglBindAPI(EGL_OPENGL_ES_API)) {
-        throw std::runtime_error("failed to bind API");
+    if (m_output_config.bake_ranges && m_output_config.lut_size > 0) {
+        throw std::runtime_error("baked ranges need the per-pixel hsv math, lut_size has to be zero");
     }
-    EGLERROR();
-    m_display = display;
-
-    const EGLint ctx_attribs[] = {
-            EGL_CONTEXT_CLIENT_VERSION, 2,
-            EGL_NONE
-    };
-    auto context = eglCreateContext(display, config, EGL_NO_CONTEXT, ctx_attribs);
-    if (!context) {
-        throw std::runtime_error("failed to create context");
+    if (m_output_config.remap && (m_output_config.remap->width != width || m_output_config.remap->height != height)) {
+        throw std::runtime_error("the remap table has to be the size of the input");
     }
-    EGLERROR();
-    m_context = context;
+    m_programs = std::make_unique<GlProgramCache>(m_output_config.program_binary_dir);
+    {
+        if (planar) {
+            m_mask_defines = "#define OUTPUT_MASK\n";
+        } else if (bit_packed) {
+            m_mask_defines = "#define OUTPUT_BITS\n";
+        } else if (range_bits) {
+            m_mask_defines = "#define OUTPUT_RANGE_BITS\n";
+        }
+        if (m_output_config.lut_size > 0) {
+            m_mask_defines += "#define CLASSIFY_LUT\n";
+        }
+        if (m_output_config.remap) {
+            m_mask_defines += "#define REMAP\n";
+        }
+        auto program = m_programs->program(VERTEX_SOURCE, fragment_source(input_format, m_mask_defines));
+        setUpMaskProgram(program);
 
-    const EGLint pbuffer_attribs[] = {
-            EGL_WIDTH, width,
-            EGL_HEIGHT, height,
-            EGL_NONE
-    };
-    auto surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
-    if (!surface) {
-        throw std::runtime_error("failed to create pixel buffer surface");
+        m_lower_thresh_location = glGetUniformLocation(program, "lowerThresh");
+        m_upper_thresh_location = glGetUniformLocation(program, "upperThresh");
+        m_range_count_location = glGetUniformLocation(program, "rangeCount");
+        m_uniform_program = program;
+        m_program = program;
+        uploadRanges();
+        if (m_output_config.bake_ranges) {
+            bakeRanges();
+        }
     }
-    EGLERROR();
-    m_surface = surface;
 
-    if (!eglMakeCurrent(display, surface, surface, context)) {
-        throw std::runtime_error("failed to bind egl context");
+    if (m_output_config.lut_size > 0) {
+        // The table depends on the frames' conversion as well, so the first one is built when the first frame
+        // arrives, see setYuvConversion
+        m_lut_builder = std::make_unique<ColorLutBuilder>(m_output_config.lut_size, hsv_ranges_classifier(m_ranges));
     }
-    EGLERROR();
 
-    {
-        auto program = make_program(VERTEX_SOURCE, FRAGMENT_SOURCE);
+    if (m_output_config.remap) {
+        auto texels = pack_remap(*m_output_config.remap, m_output_width, m_output_height, m_output_config.scale);
 
-        glUseProgram(program);
+        glGenTextures(1, &m_remap_texture);
         GLERROR();
-        glUniform1i(glGetUniformLocation(program, "tex"), 0);
+        glActiveTexture(GL_TEXTURE0 + REMAP_TEXTURE_UNIT);
         GLERROR();
-
-        m_program = program;
-    }
-
-    for (auto fd: output_buf_fds) {
-        GLuint out_tex;
-        glGenTextures(1, &out_tex);
+        glBindTexture(GL_TEXTURE_2D, m_remap_texture);
         GLERROR();
-        glBindTexture(GL_TEXTURE_2D, out_tex);
+        // Filtering would mix the high and low bytes of neighbouring texels
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         GLERROR();
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         GLERROR();
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         GLERROR();
-
-        const EGLint image_attribs[] = {
-                EGL_WIDTH, static_cast<EGLint>(width),
-                EGL_HEIGHT, static_cast<EGLint>(height),
-                EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_ARGB8888,
-                EGL_DMA_BUF_PLANE0_FD_EXT, static_cast<EGLint>(fd),
-                EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-                EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(width * 4),
-                EGL_NONE
-        };
-        auto image = eglCreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, nullptr, image_attribs);
-        EGLERROR();
-        if (!image) {
-            throw std::runtime_error("failed to import fd " + std::to_string(fd));
-        }
-
-        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         GLERROR();
-
-        GLuint framebuffer;
-        glGenFramebuffers(1, &framebuffer);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        GLERROR();
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_output_width, m_output_height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                     texels.data());
         GLERROR();
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glActiveTexture(GL_TEXTURE0);
         GLERROR();
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, out_tex, 0);
+        // The table has been copied into the texture
+        m_output_config.remap.reset();
+    }
+
+    if (m_output_config.mode != OutputMode::Packed && m_output_config.color) {
+        auto defines = std::string("#define OUTPUT_COLOR\n") + (m_remap_texture ? "#define REMAP\n" : "");
+        auto program = m_programs->program(VERTEX_SOURCE, fragment_source(input_format, defines));
+
+        glUseProgram(program);
         GLERROR();
+        bind_plane_samplers(program, input_format);
 
-        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-            throw std::runtime_error("failed to complete framebuffer");
+        m_color_program = program;
+    }
+
+    if (m_output_config.stats) {
+        if (bit_packed || range_bits) {
+            throw std::runtime_error("tile stats need a packed or planar mask");
         }
+        m_reducer = std::make_unique<GlMaskReducer>(m_output_width, m_output_height, *m_programs);
+    }
 
-        m_framebuffers.emplace(fd, framebuffer);
-        m_renderable.push(fd);
+    if (m_output_config.histogram) {
+        if (!GlHsvHistogram::supported()) {
+            throw std::runtime_error("histograms need vertex texture fetch");
+        }
+        setHistogramRegion(m_output_config.histogram_region);
+        m_histogram = std::make_unique<GlHsvHistogram>(width, height, m_output_config.histogram_step, *m_programs);
+
+        auto defines = "#define OUTPUT_HSV_BINS\n#define HSV_BINS vec3(" + std::to_string(HISTOGRAM_HUE_BINS) +
+                       ".0, " + std::to_string(HISTOGRAM_SATURATION_BINS) + ".0, " +
+                       std::to_string(HISTOGRAM_VALUE_BINS) + ".0)\n" + (m_remap_texture ? "#define REMAP\n" : "");
+        m_histogram_program = m_programs->program(VERTEX_SOURCE, fragment_source(input_format, defines));
+        glUseProgram(m_histogram_program);
+        GLERROR();
+        bind_plane_samplers(m_histogram_program, input_format);
+    }
+
+    check_morphology(m_output_config.mode, m_output_config.morphology);
+    m_morphology_passes = GlMorphology::expandPasses(m_output_config.morphology);
+    if (!m_morphology_passes.empty()) {
+        m_morphology = std::make_unique<GlMorphology>(m_output_width, m_output_height, *m_programs);
+    }
+
+    if (m_output_config.gpu_timing) {
+        if (GlPassTimer::supported()) {
+            m_pass_timer = std::make_unique<GlPassTimer>(std::vector<std::string>{"import", "threshold",
+                                                                                  "morphology", "color",
+                                                                                  "reduce", "histogram"});
+        } else {
+            std::cout << "GL_EXT_disjoint_timer_query not supported, GPU timing disabled" << std::endl;
+        }
     }
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     {
         static GLfloat quad_varray[] = {
@@ -285,71 +511,260 @@ GlHsvThresholder::GlHsvThresholder(int width, int height, const std::vector<int>
 
         m_quad_vbo = quad_vbo;
     }
+
+    if (m_pipelined) {
+        if (!m_context->hasDisplayExtension("EGL_KHR_fence_sync")) {
+            throw std::runtime_error("pipelined mode requires EGL_KHR_fence_sync");
+        }
+        m_native_fences = m_context->hasDisplayExtension("EGL_ANDROID_native_fence_sync");
+
+        m_fence_waiter = std::thread([this]() {
+            waitFences();
+        });
+    }
 }
 
-void GlHsvThresholder::testFrame(const std::array<GlHsvThresholder::DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range) {
-    static auto glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC) eglGetProcAddress(
-            "glEGLImageTargetTexture2DOES");
-    static auto eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
-    static auto eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC) eglGetProcAddress("eglDestroyImageKHR");
+GlHsvThresholder::~GlHsvThresholder() {
+    if (m_fence_waiter.joinable()) {
+        m_pending_frames.close();
+        m_fence_waiter.join();
+    }
 
-    if (!glEGLImageTargetTexture2DOES) {
-        throw std::runtime_error("cannot get address of glEGLImageTargetTexture2DOES");
+    m_pass_timer.reset();
+    for (const auto &[key, texture]: m_imports) {
+        glDeleteTextures(1, &texture);
+    }
+    for (const auto &[key, target]: m_output_targets) {
+        destroy_render_target(target);
     }
+    m_reducer.reset();
+    m_morphology.reset();
+    m_histogram.reset();
+    m_lut_builder.reset();
+    if (m_lut_texture) {
+        glDeleteTextures(1, &m_lut_texture);
+    }
+    if (m_remap_texture) {
+        glDeleteTextures(1, &m_remap_texture);
+    }
+    glDeleteBuffers(1, &m_quad_vbo);
+    m_programs.reset();
+}
 
-    int framebuffer_fd;
+std::size_t GlHsvThresholder::ImportKeyHash::operator()(const ImportKey &key) const {
+    std::size_t seed = std::hash<uint32_t>()(key.fourcc);
+    for (auto value: {key.plane.fd, key.plane.offset, key.plane.pitch, key.width, key.height}) {
+        seed ^= std::hash<int>()(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
+GLuint GlHsvThresholder::importPlane(const DmaBufPlaneData &plane, uint32_t fourcc, int width, int height) {
+    ImportKey key{plane, fourcc, width, height};
+    if (auto it = m_imports.find(key); it != m_imports.end()) {
+        return it->second;
+    }
+
+    auto texture = import_dma_buf_texture(m_display, plane.fd, fourcc, width, height, plane.offset, plane.pitch);
+    m_imports.emplace(key, texture);
+    return texture;
+}
+
+const DmaBufRenderTarget &GlHsvThresholder::outputTarget(OutputRole role, int fd) {
+    auto key = std::make_pair(role, fd);
+    if (auto it = m_output_targets.find(key); it != m_output_targets.end()) {
+        return it->second;
+    }
+
+    DmaBufRenderTarget target;
+    switch (role) {
+        case OutputRole::Target:
+            if (m_output_config.mode == OutputMode::Planar || m_output_config.mode == OutputMode::RangeBits) {
+                target = import_render_target(m_display, fd, DRM_FORMAT_R8, m_output_width, m_output_height,
+                                              m_output_width);
+            } else if (m_output_config.mode == OutputMode::BitPacked) {
+                auto words = bit_packed_row_words(m_output_width);
+                target = import_render_target(m_display, fd, DRM_FORMAT_ARGB8888, words, m_output_height, words * 4);
+            } else {
+                target = import_render_target(m_display, fd, DRM_FORMAT_ARGB8888, m_output_width, m_output_height,
+                                              m_output_width * 4);
+            }
+            break;
+        case OutputRole::Color:
+            target = import_render_target(m_display, fd, DRM_FORMAT_XRGB8888, m_output_config.color_width,
+                                          m_output_config.color_height, m_output_config.color_width * 4);
+            break;
+        case OutputRole::Stats:
+            target = m_reducer->importTarget(m_display, fd);
+            break;
+        case OutputRole::Histogram:
+            target = m_histogram->importTarget(m_display, fd);
+            break;
+    }
+    return m_output_targets.emplace(key, target).first->second;
+}
+
+void GlHsvThresholder::setYuvConversion(EGLint encoding, EGLint range) {
+    auto yuv = yuv_to_rgb_coefficients(encoding, range);
+    // Samples arrive normalized to [0, 1] where the coefficients are per 8 bit step. Column major.
+    const GLfloat matrix[] = {
+            yuv.y_scale * 255.0f, yuv.y_scale * 255.0f, yuv.y_scale * 255.0f,
+            0.0f, yuv.cb_g * 255.0f, yuv.cb_b * 255.0f,
+            yuv.cr_r * 255.0f, yuv.cr_g * 255.0f, 0.0f,
+    };
+    const GLfloat offset[] = {yuv.y_offset / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f};
+
+    for (auto program: {m_program, m_color_program, m_histogram_program}) {
+        if (!program) {
+            continue;
+        }
+        glUseProgram(program);
+        GLERROR();
+        glUniformMatrix3fv(glGetUniformLocation(program, "yuvToRgb"), 1, GL_FALSE, matrix);
+        GLERROR();
+        glUniform3fv(glGetUniformLocation(program, "yuvOffset"), 1, offset);
+        GLERROR();
+    }
+    m_yuv_conversion = {encoding, range};
+
+    // Built right away so no frame is classified by a table for another conversion
+    if (m_lut_builder) {
+        uploadLut(m_lut_builder->rebuild(yuv));
+    }
+}
+
+void GlHsvThresholder::processEvictions() {
+    std::vector<int> evictions;
     {
-        std::scoped_lock lock(m_renderable_mutex);
-        if (!m_renderable.empty()) {
-            framebuffer_fd = m_renderable.front();
-            m_renderable.pop();
-        } else {
-            std::cout << "lost framebuffer, skipping" << std::endl;
+        std::scoped_lock lock(m_evictions_mutex);
+        if (m_pending_evictions.empty()) {
             return;
         }
+        std::swap(evictions, m_pending_evictions);
     }
 
-    auto framebuffer = m_framebuffers.at(framebuffer_fd);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    GLERROR();
-
-    EGLint attribs[] = {
-            EGL_WIDTH, m_width,
-            EGL_HEIGHT, m_height,
-            EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_YUV420,
-            EGL_DMA_BUF_PLANE0_FD_EXT, yuv_plane_data[0].fd,
-            EGL_DMA_BUF_PLANE0_OFFSET_EXT, yuv_plane_data[0].offset,
-            EGL_DMA_BUF_PLANE0_PITCH_EXT, yuv_plane_data[0].pitch,
-            EGL_DMA_BUF_PLANE1_FD_EXT, yuv_plane_data[1].fd,
-            EGL_DMA_BUF_PLANE1_OFFSET_EXT, yuv_plane_data[1].offset,
-            EGL_DMA_BUF_PLANE1_PITCH_EXT, yuv_plane_data[1].pitch,
-            EGL_DMA_BUF_PLANE2_FD_EXT, yuv_plane_data[2].fd,
-            EGL_DMA_BUF_PLANE2_OFFSET_EXT, yuv_plane_data[2].offset,
-            EGL_DMA_BUF_PLANE2_PITCH_EXT, yuv_plane_data[2].pitch,
-            EGL_YUV_COLOR_SPACE_HINT_EXT, encoding,
-            EGL_SAMPLE_RANGE_HINT_EXT, range,
-            EGL_NONE
-    };
+    std::erase_if(m_imports, [&](const auto &entry) {
+        const auto &[key, texture] = entry;
+        bool evict = std::find(evictions.begin(), evictions.end(), key.plane.fd) != evictions.end();
+        if (evict) {
+            glDeleteTextures(1, &texture);
+        }
+        return evict;
+    });
+}
+
+void GlHsvThresholder::testFrame(const std::array<GlHsvThresholder::DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range,
+                                 std::function<void()> onInputReleased, const FrameTag &tag) {
+    auto entered = FrameTracer::now();
+    if (m_fence_failed.load(std::memory_order_acquire)) {
+        if (onInputReleased) {
+            onInputReleased();
+        }
+        std::rethrow_exception(m_fence_error);
+    }
+    processEvictions();
+    if (auto ranges = takeRanges()) {
+        applyRanges(std::move(*ranges));
+    } else if (m_output_config.bake_ranges && m_program == m_uniform_program &&
+               ++m_settled_frames >= BAKE_SETTLE_FRAMES) {
+        bakeRanges();
+    }
+    if (m_lut_builder) {
+        if (auto lut = m_lut_builder->takeFinished()) {
+            uploadLut(*lut);
+        }
+    }
+    if (m_morphology_pending.load(std::memory_order_acquire)) {
+        std::scoped_lock lock(m_morphology_mutex);
+        m_morphology_pending.store(false, std::memory_order_relaxed);
+        m_output_config.morphology = std::move(m_pending_morphology);
+        m_morphology_passes = GlMorphology::expandPasses(m_output_config.morphology);
+        if (!m_morphology_passes.empty() && !m_morphology) {
+            m_morphology = std::make_unique<GlMorphology>(m_output_width, m_output_height, *m_programs);
+        }
+    }
+    bool morphology = !m_morphology_passes.empty();
+
+    auto frame = acquire_output_frame(m_output_pool, m_output_config, m_width, m_height);
+    if (!frame) {
+        std::cout << "output pool exhausted, dropping frame" << std::endl;
+        if (onInputReleased) {
+            onInputReleased();
+        }
+        return;
+    }
+    frame->tag = tag;
+    auto roi = frameRoi(m_output_config, m_width, m_height);
+    frame->roi = roi;
 
-    auto image = eglCreateImageKHR(m_display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, nullptr, attribs);
-    EGLERROR();
-    if (!image) {
-        throw std::runtime_error("failed to import fd " + std::to_string(yuv_plane_data[0].fd));
+    if (m_pass_timer) {
+        m_pass_timer->beginFrame();
     }
+    beginPass(TIMED_IMPORT);
 
-    GLuint texture;
-    glGenTextures(1, &texture);
+    if (m_yuv_conversion != std::make_pair(encoding, range)) {
+        setYuvConversion(encoding, range);
+    }
+    if (m_sampled_roi != roi) {
+        setSampleRect(roi);
+    }
+
+    auto textures = plane_textures(m_input_format);
+    for (std::size_t i = 0; i < textures.size(); i++) {
+        const auto &plane = textures[i];
+        glActiveTexture(GL_TEXTURE0 + PLANE_TEXTURE_UNITS[i]);
+        GLERROR();
+        auto texture = importPlane(yuv_plane_data[plane.plane], plane.fourcc,
+                                   (m_width + plane.width_divisor - 1) / plane.width_divisor,
+                                   (m_height + plane.height_divisor - 1) / plane.height_divisor);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        GLERROR();
+    }
+    // Thresholders sharing the context bind their own tables to the same units
+    if (m_lut_texture) {
+        glActiveTexture(GL_TEXTURE0 + LUT_TEXTURE_UNIT);
+        GLERROR();
+        glBindTexture(GL_TEXTURE_2D, m_lut_texture);
+        GLERROR();
+    }
+    if (m_remap_texture) {
+        glActiveTexture(GL_TEXTURE0 + REMAP_TEXTURE_UNIT);
+        GLERROR();
+        glBindTexture(GL_TEXTURE_2D, m_remap_texture);
+        GLERROR();
+    }
+    glActiveTexture(GL_TEXTURE0);
+    GLERROR();
+
+    const auto &target = outputTarget(OutputRole::Target, frame->target.fd());
+    endPass(TIMED_IMPORT);
+    auto imported = FrameTracer::now();
+    trace(TraceStage::Import, tag, entered, imported);
+
+    beginPass(TIMED_THRESHOLD);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_quad_vbo);
     GLERROR();
-    glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+    glEnableVertexAttribArray(QUAD_VERTEX_ATTRIB);
     GLERROR();
-    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glVertexAttribPointer(QUAD_VERTEX_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
     GLERROR();
-    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    // Only the window's corner of the buffer is drawn, the scissor keeps the clear to it as well
+    int mask_width = output_size(m_output_config, roi.width);
+    int mask_height = output_size(m_output_config, roi.height);
+    if (m_output_config.mode == OutputMode::BitPacked) {
+        mask_width = bit_packed_row_words(mask_width);
+    }
+    // With morphology the mask goes through its passes first, the last of which writes the target
+    glBindFramebuffer(GL_FRAMEBUFFER, morphology ? m_morphology->inputFramebuffer() : target.framebuffer);
     GLERROR();
-    glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+    glViewport(0, 0, mask_width, mask_height);
+    GLERROR();
+    glEnable(GL_SCISSOR_TEST);
+    GLERROR();
+    glScissor(0, 0, mask_width, mask_height);
     GLERROR();
-    eglDestroyImageKHR(m_display, image);
-    EGLERROR();
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     GLERROR();
@@ -357,38 +772,354 @@ void GlHsvThresholder::testFrame(const std::array<GlHsvThresholder::DmaBufPlaneD
     glUseProgram(m_program);
     GLERROR();
 
-    glActiveTexture(GL_TEXTURE0);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
     GLERROR();
-    glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+    endPass(TIMED_THRESHOLD);
+
+    if (morphology) {
+        beginPass(TIMED_MORPHOLOGY);
+        m_morphology->run(m_morphology_passes, mask_channel(m_output_config.mode), target, mask_width, mask_height);
+        endPass(TIMED_MORPHOLOGY);
+    }
+
+    if (frame->color) {
+        beginPass(TIMED_COLOR);
+        const auto &color = outputTarget(OutputRole::Color, frame->color->fd());
+        // The color buffer covers the whole frame at its own size, the window gets the same share of it
+        auto color_width = static_cast<GLsizei>((static_cast<std::int64_t>(roi.width) * color.width + m_width - 1) /
+                                                m_width);
+        auto color_height = static_cast<GLsizei>((static_cast<std::int64_t>(roi.height) * color.height + m_height - 1) /
+                                                 m_height);
+        glBindFramebuffer(GL_FRAMEBUFFER, color.framebuffer);
+        GLERROR();
+        glViewport(0, 0, color_width, color_height);
+        GLERROR();
+        glScissor(0, 0, color_width, color_height);
+        GLERROR();
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        GLERROR();
+
+        glUseProgram(m_color_program);
+        GLERROR();
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        GLERROR();
+        endPass(TIMED_COLOR);
+    }
+    glDisable(GL_SCISSOR_TEST);
     GLERROR();
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_quad_vbo);
+    if (frame->stats) {
+        beginPass(TIMED_REDUCE);
+        m_reducer->reduce(target.texture, mask_channel(m_output_config.mode), outputTarget(OutputRole::Stats, frame->stats->fd()),
+                          output_size(m_output_config, roi.width), output_size(m_output_config, roi.height));
+        endPass(TIMED_REDUCE);
+    }
+
+    if (frame->histogram) {
+        beginPass(TIMED_HISTOGRAM);
+        if (m_histogram_region_pending.load(std::memory_order_acquire)) {
+            std::scoped_lock lock(m_histogram_region_mutex);
+            m_histogram_region_pending.store(false, std::memory_order_relaxed);
+            m_histogram_region = m_pending_histogram_region;
+        }
+        auto region = roi;
+        if (m_histogram_region) {
+            region.x = std::clamp(m_histogram_region->x, 0, m_width - 1);
+            region.y = std::clamp(m_histogram_region->y, 0, m_height - 1);
+            region.width = std::min(m_histogram_region->width, m_width - region.x);
+            region.height = std::min(m_histogram_region->height, m_height - region.y);
+        }
+        if (m_histogram_sampled != region) {
+            set_sample_rect(m_histogram_program, region, m_width, m_height);
+            m_histogram_sampled = region;
+        }
+        auto grid_width = GlHsvHistogram::gridSize(region.width, m_output_config.histogram_step);
+        auto grid_height = GlHsvHistogram::gridSize(region.height, m_output_config.histogram_step);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, m_histogram->samplesFramebuffer());
+        GLERROR();
+        glViewport(0, 0, grid_width, grid_height);
+        GLERROR();
+        glUseProgram(m_histogram_program);
+        GLERROR();
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        GLERROR();
+        m_histogram->accumulate(grid_width, grid_height, outputTarget(OutputRole::Histogram, frame->histogram->fd()));
+        endPass(TIMED_HISTOGRAM);
+    }
+    reportTimings();
+
+    if (m_pipelined) {
+        submitFence(std::move(*frame), std::move(onInputReleased));
+        trace(TraceStage::Render, tag, imported, FrameTracer::now());
+        return;
+    }
+
+    glFinish();
     GLERROR();
-    // TODO: refactor these
-    static auto attr_loc = glGetAttribLocation(m_program, "vertex");
-    glEnableVertexAttribArray(attr_loc);
+    trace(TraceStage::Render, tag, imported, FrameTracer::now());
+
+    completeFrame(std::move(*frame), onInputReleased);
+}
+
+void GlHsvThresholder::setUpMaskProgram(GLuint program) {
+    glUseProgram(program);
     GLERROR();
-    glVertexAttribPointer(attr_loc, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    bind_plane_samplers(program, m_input_format);
+}
+
+void GlHsvThresholder::setSampleRect(const Roi &roi) {
+    for (auto program: {m_program, m_color_program}) {
+        if (program) {
+            set_sample_rect(program, roi, m_width, m_height);
+        }
+    }
+    if (m_output_config.mode == OutputMode::BitPacked) {
+        glUniform2f(glGetUniformLocation(m_program, "outputSize"),
+                    static_cast<GLfloat>(output_size(m_output_config, roi.width)),
+                    static_cast<GLfloat>(output_size(m_output_config, roi.height)));
+        GLERROR();
+    }
+    m_sampled_roi = roi;
+}
+
+void GlHsvThresholder::applyRanges(std::vector<HsvRange> ranges) {
+    m_ranges = std::move(ranges);
+    if (m_lut_builder) {
+        m_lut_builder->request(hsv_ranges_classifier(m_ranges));
+    }
+    // Back on the uniforms until the ranges settle, a slider being dragged would otherwise compile a variant for
+    // every frame
+    if (m_program != m_uniform_program) {
+        m_program = m_uniform_program;
+        m_yuv_conversion.reset();
+        m_sampled_roi.reset();
+    }
+    uploadRanges();
+    m_settled_frames = 0;
+}
+
+void GlHsvThresholder::bakeRanges() {
+    auto program = m_programs->program(VERTEX_SOURCE, fragment_source(m_input_format,
+                                                                      m_mask_defines + baked_ranges_defines(m_ranges)));
+    setUpMaskProgram(program);
+    m_program = program;
+    // The variant may have been made for other frames, or not at all yet
+    m_yuv_conversion.reset();
+    m_sampled_roi.reset();
+}
+
+void GlHsvThresholder::uploadRanges() {
+    std::array<GLfloat, MAX_RANGES * 3> lower{}, upper{};
+    for (std::size_t i = 0; i < m_ranges.size(); i++) {
+        std::copy(m_ranges[i].lower.begin(), m_ranges[i].lower.end(), lower.begin() + i * 3);
+        std::copy(m_ranges[i].upper.begin(), m_ranges[i].upper.end(), upper.begin() + i * 3);
+    }
+    auto count = static_cast<GLsizei>(m_ranges.size());
+
+    glUseProgram(m_uniform_program);
+    GLERROR();
+    glUniform3fv(m_lower_thresh_location, count, lower.data());
     GLERROR();
-    static auto lll = glGetUniformLocation(m_program, "lowerThresh");
-    glUniform3f(lll, 0.0, 50.0 / 255.0, 50.0 / 255.0);
+    glUniform3fv(m_upper_thresh_location, count, upper.data());
     GLERROR();
-    static auto uuu = glGetUniformLocation(m_program, "upperThresh");
-    glUniform3f(uuu, 1.0, 1.0, 1.0);
+    glUniform1i(m_range_count_location, count);
     GLERROR();
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+void GlHsvThresholder::beginPass(TimedPass pass) {
+    if (m_pass_timer) {
+        m_pass_timer->beginPass(pass);
+    }
+}
+
+void GlHsvThresholder::endPass(TimedPass pass) {
+    if (m_pass_timer) {
+        m_pass_timer->endPass(pass);
+    }
+}
+
+void GlHsvThresholder::reportTimings() {
+    if (!m_pass_timer || ++m_timed_frames % TIMING_REPORT_FRAMES != 0) {
+        return;
+    }
+    for (const auto &pass: m_pass_timer->stats()) {
+        std::cout << "gpu " << pass.name << ": min " << pass.gpu_min_ms << " mean " << pass.gpu_mean_ms << " p99 "
+                  << pass.gpu_p99_ms << " ms, issue " << pass.cpu_mean_ms << " ms on the cpu" << std::endl;
+    }
+    std::cout << "gpu timing dropped " << m_pass_timer->droppedFrames() << " frames" << std::endl;
+}
+
+std::vector<GlPassTimer::PassStats> GlHsvThresholder::passTimings() const {
+    return m_pass_timer ? m_pass_timer->stats() : std::vector<GlPassTimer::PassStats>{};
+}
+
+GlProgramCache::Stats GlHsvThresholder::programStats() const {
+    return m_programs->stats();
+}
+
+void GlHsvThresholder::uploadLut(const ColorLut &lut) {
+    glActiveTexture(GL_TEXTURE0 + LUT_TEXTURE_UNIT);
     GLERROR();
+    if (m_lut_texture) {
+        // Same size as the table the texture was created with, only the contents change
+        glBindTexture(GL_TEXTURE_2D, m_lut_texture);
+        GLERROR();
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, lut.atlasWidth(), lut.atlasHeight(), GL_LUMINANCE, GL_UNSIGNED_BYTE,
+                        lut.data());
+        GLERROR();
+        glActiveTexture(GL_TEXTURE0);
+        GLERROR();
+        return;
+    }
 
-    glFinish();
+    glGenTextures(1, &m_lut_texture);
+    GLERROR();
+    glBindTexture(GL_TEXTURE_2D, m_lut_texture);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    GLERROR();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLERROR();
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, lut.atlasWidth(), lut.atlasHeight(), 0, GL_LUMINANCE,
+                 GL_UNSIGNED_BYTE, lut.data());
+    GLERROR();
+    glActiveTexture(GL_TEXTURE0);
     GLERROR();
 
+    glUseProgram(m_program);
+    GLERROR();
+    glUniform1i(glGetUniformLocation(m_program, "lut"), LUT_TEXTURE_UNIT);
+    GLERROR();
+    glUniform1f(glGetUniformLocation(m_program, "lutSize"), static_cast<GLfloat>(lut.size()));
+    GLERROR();
+    glUniform1f(glGetUniformLocation(m_program, "lutColumns"), static_cast<GLfloat>(lut.columns()));
+    GLERROR();
+    glUniform2f(glGetUniformLocation(m_program, "lutAtlasSize"), static_cast<GLfloat>(lut.atlasWidth()),
+                static_cast<GLfloat>(lut.atlasHeight()));
+    GLERROR();
+}
+
+void GlHsvThresholder::completeFrame(OutputFrame frame, const std::function<void()>& onInputReleased) {
+    frame.tag.handoff = FrameTracer::now();
+    if (onInputReleased) {
+        onInputReleased();
+    }
     if(m_onComplete) {
-        m_onComplete->operator()(framebuffer_fd);
+        m_onComplete->operator()(std::move(frame));
     }
 }
 
-void GlHsvThresholder::setOnComplete(std::function<void(int)> onComplete) {
+void GlHsvThresholder::submitFence(OutputFrame frame, std::function<void()> onInputReleased) {
+    static auto eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC) eglGetProcAddress("eglCreateSyncKHR");
+    static auto eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC) eglGetProcAddress("eglDestroySyncKHR");
+    static auto eglDupNativeFenceFDANDROID = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC) eglGetProcAddress(
+            "eglDupNativeFenceFDANDROID");
+
+    if (m_native_fences) {
+        const EGLint sync_attribs[] = {
+                EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+                EGL_NONE
+        };
+        auto sync = eglCreateSyncKHR(m_display, EGL_SYNC_NATIVE_FENCE_ANDROID, sync_attribs);
+        EGLERROR();
+        // The fence fd only exists once the commands have been flushed to the kernel
+        glFlush();
+        GLERROR();
+        int fence_fd = eglDupNativeFenceFDANDROID(m_display, sync);
+        EGLERROR();
+        eglDestroySyncKHR(m_display, sync);
+        if (fence_fd < 0) {
+            throw std::runtime_error("failed to export native fence fd");
+        }
+
+        pushPending(PendingFrame{EGL_NO_SYNC_KHR, fence_fd, std::move(frame), std::move(onInputReleased),
+                                 FrameTracer::now()});
+    } else {
+        auto sync = eglCreateSyncKHR(m_display, EGL_SYNC_FENCE_KHR, nullptr);
+        EGLERROR();
+        if (sync == EGL_NO_SYNC_KHR) {
+            throw std::runtime_error("failed to create fence sync");
+        }
+        // The waiter thread has no current context, so it can't flush on our behalf
+        glFlush();
+        GLERROR();
+
+        pushPending(PendingFrame{sync, -1, std::move(frame), std::move(onInputReleased), FrameTracer::now()});
+    }
+}
+
+void GlHsvThresholder::pushPending(PendingFrame pending) {
+    if (!m_pending_frames.push(std::move(pending))) {
+        // The waiter stopped on an error since the last frame
+        releasePending(pending);
+        std::rethrow_exception(m_fence_error);
+    }
+}
+
+void GlHsvThresholder::releasePending(PendingFrame &pending) {
+    static auto eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC) eglGetProcAddress("eglDestroySyncKHR");
+
+    if (pending.fence_fd >= 0) {
+        close(pending.fence_fd);
+        pending.fence_fd = -1;
+    }
+    if (pending.sync != EGL_NO_SYNC_KHR) {
+        eglDestroySyncKHR(m_display, pending.sync);
+        pending.sync = EGL_NO_SYNC_KHR;
+    }
+    if (pending.onInputReleased) {
+        std::exchange(pending.onInputReleased, nullptr)();
+    }
+}
+
+void GlHsvThresholder::waitFences() {
+    static auto eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC) eglGetProcAddress("eglClientWaitSyncKHR");
+    static auto eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC) eglGetProcAddress("eglDestroySyncKHR");
+
+    while (auto pending = m_pending_frames.pop()) {
+        auto &frame = *pending;
+
+        try {
+            if (frame.fence_fd >= 0) {
+                pollfd fence = {frame.fence_fd, POLLIN, 0};
+                while (poll(&fence, 1, -1) < 0 && errno == EINTR) {}
+                close(std::exchange(frame.fence_fd, -1));
+            } else {
+                if (eglClientWaitSyncKHR(m_display, frame.sync, 0, EGL_FOREVER_KHR) == EGL_FALSE) {
+                    EGLERROR();
+                }
+                eglDestroySyncKHR(m_display, std::exchange(frame.sync, EGL_NO_SYNC_KHR));
+            }
+            trace(TraceStage::Gpu, frame.frame.tag, frame.submitted, FrameTracer::now());
+
+            // Moved out first, so a throwing onComplete doesn't release the input a second time below
+            auto onInputReleased = std::move(frame.onInputReleased);
+            frame.onInputReleased = nullptr;
+            completeFrame(std::move(frame.frame), onInputReleased);
+        } catch (...) {
+            // Nothing after this frame can be trusted to have rendered either. Their outputs are dropped, but the
+            // camera buffers go back, and the error reaches the submitting thread through testFrame.
+            m_fence_error = std::current_exception();
+            m_fence_failed.store(true, std::memory_order_release);
+            m_pending_frames.close();
+            releasePending(frame);
+            while (auto rest = m_pending_frames.pop()) {
+                releasePending(*rest);
+            }
+            return;
+        }
+    }
+}
+
+void GlHsvThresholder::setOnComplete(std::function<void(OutputFrame)> onComplete) {
     m_onComplete = std::move(onComplete);
 }
 
@@ -396,7 +1127,34 @@ void GlHsvThresholder::resetOnComplete() {
     m_onComplete.reset();
 }
 
-void GlHsvThresholder::returnBuffer(int fd) {
-    std::scoped_lock lock(m_renderable_mutex);
-    m_renderable.push(fd);
+void GlHsvThresholder::setColorClassifier(ColorClassifier classify) {
+    if (!m_lut_builder) {
+        throw std::runtime_error("color classifiers need OutputConfig::lut_size");
+    }
+    m_lut_builder->request(std::move(classify));
+}
+
+void GlHsvThresholder::setMorphology(std::vector<MorphologyStep> steps) {
+    check_morphology(m_output_config.mode, steps);
+    {
+        std::scoped_lock lock(m_morphology_mutex);
+        m_pending_morphology = std::move(steps);
+    }
+    m_morphology_pending.store(true, std::memory_order_release);
+}
+
+void GlHsvThresholder::setHistogramRegion(std::optional<Roi> region) {
+    if (region && (region->width <= 0 || region->height <= 0)) {
+        throw std::runtime_error("histogram regions need a size");
+    }
+    {
+        std::scoped_lock lock(m_histogram_region_mutex);
+        m_pending_histogram_region = region;
+    }
+    m_histogram_region_pending.store(true, std::memory_order_release);
+}
+
+void GlHsvThresholder::evictImports(int fd) {
+    std::scoped_lock lock(m_evictions_mutex);
+    m_pending_evictions.push_back(fd);
 }
@@ -2,46 +2,200 @@
 #define LIBCAMERA_MEME_GL_HSV_THRESHOLDER_H
 
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <string>
-#include <queue>
+#include <map>
+#include <optional>
 #include <utility>
 #include <mutex>
 #include <unordered_map>
+#include <thread>
 #include <vector>
 
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 
-class GlHsvThresholder {
+#include "color_lut.h"
+#include "gl_context.h"
+#include "gl_hsv_histogram.h"
+#include "gl_mask_reducer.h"
+#include "gl_morphology.h"
+#include "gl_pass_timer.h"
+#include "gl_program_cache.h"
+#include "gl_utility.h"
+#include "hsv_thresholder.h"
+#include "ring_queue.h"
+
+class GlHsvThresholder : public HsvThresholder {
 public:
-    struct DmaBufPlaneData {
-        int fd;
-        EGLint offset;
-        EGLint pitch;
-    };
+    // Each camera plane is imported as its own R8, GR88 or ARGB8888 texture and converted to RGB in the shader.
+    // Pooled output buffers are imported the first time they come around and stay imported, output_pool has to
+    // outlive the thresholder.
+    // In pipelined mode testFrame returns as soon as the draw is submitted, and a waiter thread fires the
+    // callbacks once the GPU fence for that frame signals. Otherwise testFrame blocks in glFinish, which with a
+    // shared context also waits for the other thresholders' work.
+    // Renders in its own context on egl_platform, or in context if one is given. Thresholders sharing a context
+    // all have to be created, fed and destroyed on the thread it's current on.
+    GlHsvThresholder(int width, int height, YuvFormat input_format, DmaBufPool &output_pool,
+                     const OutputConfig& output_config, bool pipelined = false,
+                     EglPlatform egl_platform = EglPlatform::Default, std::shared_ptr<GlContext> context = nullptr);
+    ~GlHsvThresholder() override;
+    void setOnComplete(std::function<void(OutputFrame)> onComplete) override;
+    void resetOnComplete() override;
 
-    explicit GlHsvThresholder(int width, int height, const std::vector<int>& output_buf_fds);
-    void setOnComplete(std::function<void(int)> onComplete);
-    void resetOnComplete();
+    // The textures are deleted on the GL thread before the next frame is imported
+    void evictImports(int fd) override;
+    void testFrame(const std::array<DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range,
+                   std::function<void()> onInputReleased = {}, const FrameTag &tag = {}) override;
+    // Needs OutputConfig::lut_size. The table is rebuilt on a background thread and frames keep using the old
+    // one until the new one is uploaded. Starts out as the default HSV thresholds.
+    void setColorClassifier(ColorClassifier classify);
+    // Replaces OutputConfig::morphology from the next frame on, empty to turn it off. Safe to call from any thread,
+    // like setRanges.
+    void setMorphology(std::vector<MorphologyStep> steps);
+    // Where OutputConfig::histogram counts from the next frame on, in input pixels and clamped to the frame. Unset
+    // it to go back to the frame's window. Safe to call from any thread, like setRanges.
+    void setHistogramRegion(std::optional<Roi> region);
 
-    void returnBuffer(int fd);
-    void testFrame(const std::array<GlHsvThresholder::DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range);
+    // Rolling GPU and CPU time of the import, threshold, morphology, color, reduce and histogram passes, empty unless
+    // OutputConfig::gpu_timing found GL_EXT_disjoint_timer_query. Also printed every TIMING_REPORT_FRAMES frames.
+    [[nodiscard]] std::vector<GlPassTimer::PassStats> passTimings() const;
+    // How the programs so far were made, e.g. to check that a restart found them in OutputConfig::program_binary_dir
+    [[nodiscard]] GlProgramCache::Stats programStats() const;
+    static constexpr int TIMING_REPORT_FRAMES = 300;
+    // With OutputConfig::bake_ranges, how many frames the ranges have to stay the same before they're compiled in
+    static constexpr int BAKE_SETTLE_FRAMES = 30;
 private:
+    enum TimedPass {
+        TIMED_IMPORT,
+        TIMED_THRESHOLD,
+        TIMED_MORPHOLOGY,
+        TIMED_COLOR,
+        TIMED_REDUCE,
+        TIMED_HISTOGRAM,
+    };
+
+    struct ImportKey {
+        DmaBufPlaneData plane;
+        uint32_t fourcc;
+        int width;
+        int height;
+
+        bool operator==(const ImportKey &other) const = default;
+    };
+
+    struct ImportKeyHash {
+        std::size_t operator()(const ImportKey &key) const;
+    };
+
+    enum class OutputRole {
+        Target,
+        Color,
+        Stats,
+        Histogram,
+    };
+
+    struct PendingFrame {
+        EGLSyncKHR sync;
+        int fence_fd;
+        OutputFrame frame;
+        std::function<void()> onInputReleased;
+        std::int64_t submitted; // FrameTracer::now() once the commands were flushed
+    };
+
+    const DmaBufRenderTarget &outputTarget(OutputRole role, int fd);
+
+    void completeFrame(OutputFrame frame, const std::function<void()>& onInputReleased);
+    void submitFence(OutputFrame frame, std::function<void()> onInputReleased);
+    // Hands the frame to the fence waiter, or rethrows the waiter's error once it has stopped
+    void pushPending(PendingFrame pending);
+    void waitFences();
+    // Gives back the camera buffer of a frame that won't be completed, and whatever fence it still holds
+    void releasePending(PendingFrame &pending);
+
+    void uploadLut(const ColorLut &lut);
+    void setUpMaskProgram(GLuint program);
+    // Points the programs at the window of the input the frame covers
+    void setSampleRect(const Roi &roi);
+    // With a lut_size, the table is rebuilt from the ranges like setColorClassifier would
+    void applyRanges(std::vector<HsvRange> ranges);
+    void uploadRanges();
+    void bakeRanges();
+
+    GLuint importPlane(const DmaBufPlaneData &plane, uint32_t fourcc, int width, int height);
+    void setYuvConversion(EGLint encoding, EGLint range);
+    void processEvictions();
+    void beginPass(TimedPass pass);
+    void endPass(TimedPass pass);
+    void reportTimings();
+
     int m_width;
     int m_height;
-    std::optional<std::function<void(int)>> m_onComplete;
+    // Of the whole frame's mask, the input size divided by OutputConfig::scale
+    int m_output_width;
+    int m_output_height;
+    YuvFormat m_input_format;
+    std::optional<std::function<void(OutputFrame)>> m_onComplete;
 
+    std::shared_ptr<GlContext> m_context;
     EGLDisplay m_display;
-    EGLContext m_context;
-    EGLSurface m_surface;
 
-    std::unordered_map<int, GLuint> m_framebuffers; // (dma_buf fd, framebuffer)
-    std::queue<int> m_renderable;
-    std::mutex m_renderable_mutex;
+    OutputConfig m_output_config;
+    DmaBufPool &m_output_pool;
+    std::map<std::pair<OutputRole, int>, DmaBufRenderTarget> m_output_targets; // ((role, pooled dma_buf fd), target)
+
+    std::unordered_map<ImportKey, GLuint, ImportKeyHash> m_imports; // (camera buffer plane view, texture)
+    std::vector<int> m_pending_evictions;
+    std::mutex m_evictions_mutex;
 
     GLuint m_quad_vbo;
-    GLuint m_program;
+    // Owns every program, reset before the context goes
+    std::unique_ptr<GlProgramCache> m_programs;
+    std::string m_mask_defines;
+    GLuint m_program; // the mask program in use, either m_uniform_program or a variant with the ranges baked in
+    GLuint m_uniform_program;
+    GLuint m_color_program = 0;
+    GLint m_lower_thresh_location;
+    GLint m_upper_thresh_location;
+    GLint m_range_count_location;
+    std::vector<HsvRange> m_ranges{{DEFAULT_LOWER_THRESH, DEFAULT_UPPER_THRESH}};
+    int m_settled_frames = 0;
+    std::optional<std::pair<EGLint, EGLint>> m_yuv_conversion; // (encoding, range) the programs were last set up for
+    std::optional<Roi> m_sampled_roi; // the window the programs were last set up for
+    std::unique_ptr<GlMaskReducer> m_reducer;
+    // Made with the first steps, and kept when they're turned off so turning them back on is cheap
+    std::unique_ptr<GlMorphology> m_morphology;
+    std::vector<GlMorphology::Pass> m_morphology_passes; // OutputConfig::morphology expanded, empty when it's off
+    std::mutex m_morphology_mutex;
+    std::vector<MorphologyStep> m_pending_morphology;
+    std::atomic<bool> m_morphology_pending{false};
+    std::unique_ptr<GlHsvHistogram> m_histogram;
+    GLuint m_histogram_program = 0; // draws each sample's bins for m_histogram
+    std::optional<Roi> m_histogram_region; // from setHistogramRegion, the frame's window if unset
+    std::optional<Roi> m_histogram_sampled; // the region m_histogram_program was last set up for
+    std::mutex m_histogram_region_mutex;
+    std::optional<Roi> m_pending_histogram_region;
+    std::atomic<bool> m_histogram_region_pending{false};
+
+    GLuint m_lut_texture = 0;
+    GLuint m_remap_texture = 0; // OutputConfig::remap packed for the shader, see pack_remap
+    std::unique_ptr<ColorLutBuilder> m_lut_builder;
+
+    std::unique_ptr<GlPassTimer> m_pass_timer;
+    int m_timed_frames = 0;
+
+    bool m_pipelined;
+    bool m_native_fences = false;
+    RingQueue<PendingFrame> m_pending_frames;
+    std::thread m_fence_waiter;
+    // Set once by the waiter when a wait fails, after which it stops and testFrame rethrows the error
+    std::exception_ptr m_fence_error;
+    std::atomic<bool> m_fence_failed{false};
 };
 
 #endif //LIBCAMERA_MEME_GL_HSV_THRESHOLDER_H
@@ -0,0 +1,133 @@
+#include "gl_mask_reducer.h"
+
+#include <string>
+
+#include <libdrm/drm_fourcc.h>
+
+static constexpr const char *REDUCE_VERTEX_SOURCE =
+        "#version 100\n"
+        ""
+        "attribute vec2 vertex;"
+        ""
+        "void main(void) {"
+        "   gl_Position = vec4(vertex, 0.0, 1.0);"
+        "}";
+
+// Every texel of a tile walks the whole tile and then writes its quarter of the record. All sums are tile
+// local integers that stay below 2^16, so they are exact in highp floats and split cleanly into two bytes.
+static constexpr const char *REDUCE_FRAGMENT_SOURCE =
+        "#version 100\n"
+        ""
+        "precision highp float;"
+        ""
+        "uniform sampler2D mask;"
+        "uniform vec4 maskChannel;"
+        "uniform vec2 maskSize;"
+        // The part of the mask that's reduced, from its top left
+        "uniform vec2 regionSize;"
+        ""
+        "vec2 split(float value) {"
+        "  float high = floor(value / 256.0);"
+        "  return vec2(value - high * 256.0, high);"
+        "}"
+        ""
+        "void main(void) {"
+        "  float column = floor(gl_FragCoord.x);"
+        "  float texel = mod(column, 4.0);"
+        "  vec2 origin = vec2(floor(column / 4.0), floor(gl_FragCoord.y)) * 16.0;"
+        ""
+        "  float n = 0.0;"
+        "  vec2 s = vec2(0.0);"
+        "  vec3 s2 = vec3(0.0);"
+        "  vec2 lo = vec2(15.0);"
+        "  vec2 hi = vec2(0.0);"
+        "  for (int j = 0; j < 16; j++) {"
+        "    for (int i = 0; i < 16; i++) {"
+        "      vec2 local = vec2(float(i), float(j));"
+        "      vec2 p = origin + local;"
+        "      if (p.x < regionSize.x && p.y < regionSize.y &&"
+        "          dot(texture2D(mask, (p + 0.5) / maskSize), maskChannel) > 0.5) {"
+        "        n += 1.0;"
+        "        s += local;"
+        "        s2 += vec3(local * local, local.x * local.y);"
+        "        lo = min(lo, local);"
+        "        hi = max(hi, local);"
+        "      }"
+        "    }"
+        "  }"
+        ""
+        "  vec4 bytes;"
+        "  if (texel < 0.5) {"
+        "    bytes = vec4(split(n), split(s.x));"
+        "  } else if (texel < 1.5) {"
+        "    bytes = vec4(split(s.y), split(s2.x));"
+        "  } else if (texel < 2.5) {"
+        "    bytes = vec4(split(s2.y), split(s2.z));"
+        "  } else if (n > 0.0) {"
+        "    bytes = vec4(lo.x + hi.x * 16.0, lo.y + hi.y * 16.0, 0.0, 0.0);"
+        "  } else {"
+        "    bytes = vec4(0.0);"
+        "  }"
+        // ARGB8888 keeps B, G, R, A in memory order
+        "  gl_FragColor = bytes.zyxw / 255.0;"
+        "}";
+
+GlMaskReducer::GlMaskReducer(int width, int height, GlProgramCache &programs)
+        : m_tiles_x(tileCount(width)), m_tiles_y(tileCount(height)) {
+    m_program = programs.program(REDUCE_VERTEX_SOURCE, REDUCE_FRAGMENT_SOURCE);
+
+    glUseProgram(m_program);
+    GLERROR();
+    glUniform1i(glGetUniformLocation(m_program, "mask"), 1);
+    GLERROR();
+    glUniform2f(glGetUniformLocation(m_program, "maskSize"), static_cast<GLfloat>(width), static_cast<GLfloat>(height));
+    GLERROR();
+    m_channel_loc = glGetUniformLocation(m_program, "maskChannel");
+    m_region_size_loc = glGetUniformLocation(m_program, "regionSize");
+}
+
+int GlMaskReducer::tilesX() const {
+    return m_tiles_x;
+}
+
+int GlMaskReducer::tilesY() const {
+    return m_tiles_y;
+}
+
+DmaBufRenderTarget GlMaskReducer::importTarget(EGLDisplay display, int fd) const {
+    return import_render_target(display, fd, DRM_FORMAT_ARGB8888, m_tiles_x * TEXELS_PER_TILE, m_tiles_y,
+                                m_tiles_x * TEXELS_PER_TILE * 4);
+}
+
+void GlMaskReducer::reduce(GLuint mask_texture, const std::array<GLfloat, 4> &channel, const DmaBufRenderTarget &target,
+                           int width, int height) {
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    GLERROR();
+    int tiles_x = tileCount(width), tiles_y = tileCount(height);
+    if (tiles_x < m_tiles_x || tiles_y < m_tiles_y) {
+        // Zero tiles outside the region, the buffer still holds whatever frame it was last used for
+        glClear(GL_COLOR_BUFFER_BIT);
+        GLERROR();
+    }
+    glViewport(0, 0, tiles_x * TEXELS_PER_TILE, tiles_y);
+    GLERROR();
+
+    glActiveTexture(GL_TEXTURE1);
+    GLERROR();
+    glBindTexture(GL_TEXTURE_2D, mask_texture);
+    GLERROR();
+
+    glUseProgram(m_program);
+    GLERROR();
+    glUniform4f(m_channel_loc, channel[0], channel[1], channel[2], channel[3]);
+    GLERROR();
+    glUniform2f(m_region_size_loc, static_cast<GLfloat>(width), static_cast<GLfloat>(height));
+    GLERROR();
+
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    GLERROR();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    GLERROR();
+}
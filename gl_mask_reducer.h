@@ -0,0 +1,56 @@
+#ifndef LIBCAMERA_MEME_GL_MASK_REDUCER_H
+#define LIBCAMERA_MEME_GL_MASK_REDUCER_H
+
+#include <array>
+#include <cstddef>
+
+#include <GLES2/gl2.h>
+#include <EGL/egl.h>
+
+#include "gl_program_cache.h"
+#include "gl_utility.h"
+#include "mask_stats.h"
+
+// Reduces a full resolution mask texture to per-tile moments (see TileStats in mask_stats.h) so the CPU only
+// has to read a few kilobytes per frame. Lives in the caller's GL context.
+class GlMaskReducer {
+public:
+    static constexpr int TILE_SIZE = STATS_TILE_SIZE;
+    // A TileStats record is 16 bytes, so each tile takes four ARGB8888 texels
+    static constexpr int TEXELS_PER_TILE = 4;
+
+    // The program comes from programs, which has to outlive the reducer
+    GlMaskReducer(int width, int height, GlProgramCache &programs);
+
+    GlMaskReducer(const GlMaskReducer &) = delete;
+    GlMaskReducer &operator=(const GlMaskReducer &) = delete;
+
+    static constexpr int tileCount(int pixels) {
+        return (pixels + TILE_SIZE - 1) / TILE_SIZE;
+    }
+
+    // Bytes needed for a stats dma-buf, tiles are stored row by row
+    static constexpr std::size_t statsBufferSize(int width, int height) {
+        return static_cast<std::size_t>(tileCount(width)) * TEXELS_PER_TILE * 4 * tileCount(height);
+    }
+
+    [[nodiscard]] int tilesX() const;
+    [[nodiscard]] int tilesY() const;
+
+    DmaBufRenderTarget importTarget(EGLDisplay display, int fd) const;
+
+    // channel selects the mask component of mask_texture, e.g. alpha for a packed output. Only the width x height
+    // region at the texture's top left is reduced, into the target's top left tiles, and the other tiles are
+    // zeroed. Draws with the full-screen quad that the caller has bound to QUAD_VERTEX_ATTRIB.
+    void reduce(GLuint mask_texture, const std::array<GLfloat, 4> &channel, const DmaBufRenderTarget &target,
+                int width, int height);
+private:
+    int m_tiles_x;
+    int m_tiles_y;
+
+    GLuint m_program;
+    GLint m_channel_loc;
+    GLint m_region_size_loc;
+};
+
+#endif //LIBCAMERA_MEME_GL_MASK_REDUCER_H
@@ -0,0 +1,190 @@
+#include "gl_morphology.h"
+
+#include <stdexcept>
+#include <string>
+
+static constexpr const char *MORPHOLOGY_VERTEX_SOURCE =
+        "#version 100\n"
+        ""
+        "attribute vec2 vertex;"
+        ""
+        "void main(void) {"
+        "   gl_Position = vec4(vertex, 0.0, 1.0);"
+        "}";
+
+// One direction of the kernel, the other one is the next pass. Samples past the region are clamped back to its
+// edge, which can't change a minimum or maximum that already includes the edge pixel.
+static constexpr const char *MORPHOLOGY_FRAGMENT_SOURCE =
+        "precision highp float;"
+        ""
+        "uniform sampler2D mask;"
+        "uniform vec4 maskChannel;"
+        "uniform vec2 maskSize;"
+        "uniform vec2 regionSize;"
+        "uniform vec2 direction;"
+        "uniform float radius;"
+        ""
+        "float sampleMask(vec2 p) {"
+        "  p = clamp(p, vec2(0.0), regionSize - 1.0);"
+        "  return dot(texture2D(mask, (p + 0.5) / maskSize), maskChannel);"
+        "}"
+        ""
+        "void main(void) {"
+        "  vec2 p = floor(gl_FragCoord.xy);"
+        "  vec4 center = texture2D(mask, (p + 0.5) / maskSize);"
+        "  float value = dot(center, maskChannel);"
+        "  for (int i = 1; i <= MAX_RADIUS; i++) {"
+        "    if (float(i) > radius) {"
+        "      break;"
+        "    }"
+        "    vec2 offset = direction * float(i);"
+        "\n#if defined(ERODE)\n"
+        "    value = min(value, min(sampleMask(p - offset), sampleMask(p + offset)));"
+        "\n#else\n"
+        "    value = max(value, max(sampleMask(p - offset), sampleMask(p + offset)));"
+        "\n#endif\n"
+        "  }"
+        // Only the mask channel changes, e.g. a packed output keeps its color
+        "  gl_FragColor = mix(center, vec4(value), maskChannel);"
+        "}";
+
+GlMorphology::GlMorphology(int width, int height, GlProgramCache &programs) {
+    m_erode = makeProgram(programs, "#define ERODE\n", width, height);
+    m_dilate = makeProgram(programs, "#define DILATE\n", width, height);
+
+    glGenTextures(2, m_textures.data());
+    GLERROR();
+    glGenFramebuffers(2, m_framebuffers.data());
+    GLERROR();
+    for (std::size_t i = 0; i < m_textures.size(); i++) {
+        glBindTexture(GL_TEXTURE_2D, m_textures[i]);
+        GLERROR();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        GLERROR();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        GLERROR();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        GLERROR();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GLERROR();
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        GLERROR();
+
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[i]);
+        GLERROR();
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_textures[i], 0);
+        GLERROR();
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            throw std::runtime_error("failed to complete morphology framebuffer");
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+GlMorphology::~GlMorphology() {
+    glDeleteFramebuffers(2, m_framebuffers.data());
+    glDeleteTextures(2, m_textures.data());
+}
+
+GlMorphology::Program GlMorphology::makeProgram(GlProgramCache &programs, const char *define, int width, int height) {
+    auto source = std::string("#version 100\n") + define + "#define MAX_RADIUS " + std::to_string(MAX_RADIUS) +
+                  "\n" + MORPHOLOGY_FRAGMENT_SOURCE;
+    auto program = programs.program(MORPHOLOGY_VERTEX_SOURCE, source);
+
+    glUseProgram(program);
+    GLERROR();
+    glUniform1i(glGetUniformLocation(program, "mask"), 1);
+    GLERROR();
+    glUniform2f(glGetUniformLocation(program, "maskSize"), static_cast<GLfloat>(width), static_cast<GLfloat>(height));
+    GLERROR();
+    return {program, glGetUniformLocation(program, "maskChannel"), glGetUniformLocation(program, "regionSize"),
+            glGetUniformLocation(program, "direction"), glGetUniformLocation(program, "radius")};
+}
+
+void GlMorphology::checkSteps(const std::vector<HsvThresholder::MorphologyStep> &steps) {
+    for (const auto &step: steps) {
+        if (step.radius < 1 || step.radius > MAX_RADIUS) {
+            throw std::runtime_error("morphology radius has to be between 1 and " + std::to_string(MAX_RADIUS));
+        }
+        if (step.iterations < 1) {
+            throw std::runtime_error("morphology steps need at least one iteration");
+        }
+    }
+}
+
+std::vector<GlMorphology::Pass> GlMorphology::expandPasses(const std::vector<HsvThresholder::MorphologyStep> &steps) {
+    using Op = HsvThresholder::MorphologyOp;
+
+    std::vector<Pass> passes;
+    auto add = [&](bool erode, const HsvThresholder::MorphologyStep &step) {
+        for (int i = 0; i < step.iterations; i++) {
+            passes.push_back({erode, false, step.radius});
+            passes.push_back({erode, true, step.radius});
+        }
+    };
+    for (const auto &step: steps) {
+        switch (step.op) {
+            case Op::Erode:
+                add(true, step);
+                break;
+            case Op::Dilate:
+                add(false, step);
+                break;
+            case Op::Open:
+                add(true, step);
+                add(false, step);
+                break;
+            case Op::Close:
+                add(false, step);
+                add(true, step);
+                break;
+        }
+    }
+    return passes;
+}
+
+GLuint GlMorphology::inputFramebuffer() const {
+    return m_framebuffers[0];
+}
+
+void GlMorphology::run(const std::vector<Pass> &passes, const std::array<GLfloat, 4> &channel,
+                       const DmaBufRenderTarget &target, int width, int height) {
+    if (passes.empty()) {
+        throw std::runtime_error("morphology needs at least one pass");
+    }
+
+    glViewport(0, 0, width, height);
+    GLERROR();
+    glActiveTexture(GL_TEXTURE1);
+    GLERROR();
+
+    for (std::size_t i = 0; i < passes.size(); i++) {
+        const auto &pass = passes[i];
+        const auto &program = pass.erode ? m_erode : m_dilate;
+
+        bool last = i + 1 == passes.size();
+        glBindFramebuffer(GL_FRAMEBUFFER, last ? target.framebuffer : m_framebuffers[(i + 1) % 2]);
+        GLERROR();
+        glBindTexture(GL_TEXTURE_2D, m_textures[i % 2]);
+        GLERROR();
+
+        glUseProgram(program.program);
+        GLERROR();
+        glUniform4f(program.channel_loc, channel[0], channel[1], channel[2], channel[3]);
+        GLERROR();
+        glUniform2f(program.region_size_loc, static_cast<GLfloat>(width), static_cast<GLfloat>(height));
+        GLERROR();
+        glUniform2f(program.direction_loc, pass.vertical ? 0.0f : 1.0f, pass.vertical ? 1.0f : 0.0f);
+        GLERROR();
+        glUniform1f(program.radius_loc, static_cast<GLfloat>(pass.radius));
+        GLERROR();
+
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        GLERROR();
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    GLERROR();
+}
@@ -0,0 +1,67 @@
+#ifndef LIBCAMERA_MEME_GL_MORPHOLOGY_H
+#define LIBCAMERA_MEME_GL_MORPHOLOGY_H
+
+#include <array>
+#include <vector>
+
+#include <GLES2/gl2.h>
+
+#include "gl_program_cache.h"
+#include "gl_utility.h"
+#include "hsv_thresholder.h"
+
+// Erodes and dilates a mask with square kernels, split into a horizontal and a vertical pass each. The threshold
+// pass draws into inputFramebuffer(), then the passes ping-pong between two intermediate textures and the last
+// one writes the output buffer. The intermediates are RGBA8 since GLES2 can't render to anything narrower, so a
+// packed output's color rides along untouched. Lives in the caller's GL context.
+class GlMorphology {
+public:
+    // Kernel radii are a loop bound in the shader
+    static constexpr int MAX_RADIUS = 16;
+
+    // One direction of one erode or dilate, a draw
+    struct Pass {
+        bool erode;
+        bool vertical;
+        int radius;
+    };
+
+    // The programs come from programs, which has to outlive the morphology. width x height is the whole mask.
+    GlMorphology(int width, int height, GlProgramCache &programs);
+    ~GlMorphology();
+
+    GlMorphology(const GlMorphology &) = delete;
+    GlMorphology &operator=(const GlMorphology &) = delete;
+
+    // Throws unless every radius is within 1 to MAX_RADIUS and every step runs at least once
+    static void checkSteps(const std::vector<HsvThresholder::MorphologyStep> &steps);
+    // The draws steps take each frame, two for each erode or dilate. Allocates, so it's done when the steps
+    // change rather than per frame.
+    static std::vector<Pass> expandPasses(const std::vector<HsvThresholder::MorphologyStep> &steps);
+
+    [[nodiscard]] GLuint inputFramebuffer() const;
+
+    // Runs passes, from expandPasses, over the width x height region at the top left of the input, channel
+    // selecting the mask like GlMaskReducer::reduce, and leaves the result in the same region of target. The
+    // region's edge pixels are repeated past it. Samples on texture unit 1 and draws with the full-screen quad that
+    // the caller has bound to QUAD_VERTEX_ATTRIB. Needs at least one pass.
+    void run(const std::vector<Pass> &passes, const std::array<GLfloat, 4> &channel,
+             const DmaBufRenderTarget &target, int width, int height);
+private:
+    struct Program {
+        GLuint program;
+        GLint channel_loc;
+        GLint region_size_loc;
+        GLint direction_loc;
+        GLint radius_loc;
+    };
+
+    Program makeProgram(GlProgramCache &programs, const char *define, int width, int height);
+
+    Program m_erode;
+    Program m_dilate;
+    std::array<GLuint, 2> m_textures{};
+    std::array<GLuint, 2> m_framebuffers{};
+};
+
+#endif //LIBCAMERA_MEME_GL_MORPHOLOGY_H
@@ -0,0 +1,158 @@
+#include "gl_pass_timer.h"
+
+#include <GLES2/gl2ext.h>
+#include <EGL/egl.h>
+
+#include <algorithm>
+#include <numeric>
+
+#include "frame_trace.h"
+#include "gl_utility.h"
+
+static PFNGLGENQUERIESEXTPROC glGenQueriesEXT;
+static PFNGLDELETEQUERIESEXTPROC glDeleteQueriesEXT;
+static PFNGLBEGINQUERYEXTPROC glBeginQueryEXT;
+static PFNGLENDQUERYEXTPROC glEndQueryEXT;
+static PFNGLGETQUERYOBJECTUIVEXTPROC glGetQueryObjectuivEXT;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT;
+
+void GlPassTimer::Window::add(double value) {
+    samples[count % WINDOW] = value;
+    count++;
+}
+
+GlPassTimer::GlPassTimer(std::vector<std::string> pass_names)
+        : m_pass_names(std::move(pass_names)), m_elapsed(m_pass_names.size()), m_gpu(m_pass_names.size()),
+          m_cpu(m_pass_names.size()) {
+    glGenQueriesEXT = (PFNGLGENQUERIESEXTPROC) eglGetProcAddress("glGenQueriesEXT");
+    glDeleteQueriesEXT = (PFNGLDELETEQUERIESEXTPROC) eglGetProcAddress("glDeleteQueriesEXT");
+    glBeginQueryEXT = (PFNGLBEGINQUERYEXTPROC) eglGetProcAddress("glBeginQueryEXT");
+    glEndQueryEXT = (PFNGLENDQUERYEXTPROC) eglGetProcAddress("glEndQueryEXT");
+    glGetQueryObjectuivEXT = (PFNGLGETQUERYOBJECTUIVEXTPROC) eglGetProcAddress("glGetQueryObjectuivEXT");
+    glGetQueryObjectui64vEXT = (PFNGLGETQUERYOBJECTUI64VEXTPROC) eglGetProcAddress("glGetQueryObjectui64vEXT");
+
+    for (auto &frame: m_frames) {
+        frame.queries.resize(m_pass_names.size());
+        frame.issued.resize(m_pass_names.size());
+        glGenQueriesEXT(static_cast<GLsizei>(frame.queries.size()), frame.queries.data());
+        GLERROR();
+    }
+    // Reading the flag clears it, so whatever happened before we started doesn't count
+    GLint disjoint;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    GLERROR();
+}
+
+GlPassTimer::~GlPassTimer() {
+    for (auto &frame: m_frames) {
+        glDeleteQueriesEXT(static_cast<GLsizei>(frame.queries.size()), frame.queries.data());
+    }
+}
+
+bool GlPassTimer::supported() {
+    return has_extension(reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS)), "GL_EXT_disjoint_timer_query");
+}
+
+void GlPassTimer::beginFrame() {
+    m_frame++;
+    auto &frame = m_frames[m_frame % FRAMES_IN_FLIGHT];
+    if (frame.pending) {
+        collect(frame);
+    }
+    std::fill(frame.issued.begin(), frame.issued.end(), false);
+    frame.pending = true;
+}
+
+void GlPassTimer::beginPass(int pass) {
+    auto &frame = m_frames[m_frame % FRAMES_IN_FLIGHT];
+    glBeginQueryEXT(GL_TIME_ELAPSED_EXT, frame.queries[pass]);
+    GLERROR();
+    frame.issued[pass] = true;
+    m_pass_start = FrameTracer::now();
+}
+
+void GlPassTimer::endPass(int pass) {
+    auto cpu_ns = FrameTracer::now() - m_pass_start;
+    glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+    GLERROR();
+
+    std::scoped_lock lock(m_mutex);
+    m_cpu[pass].add(static_cast<double>(cpu_ns) / 1e6);
+}
+
+void GlPassTimer::collect(FrameQueries &frame) {
+    frame.pending = false;
+    for (std::size_t i = 0; i < frame.queries.size(); i++) {
+        if (!frame.issued[i]) {
+            continue;
+        }
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuivEXT(frame.queries[i], GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+        GLERROR();
+        if (!available) {
+            std::scoped_lock lock(m_mutex);
+            m_dropped++;
+            return;
+        }
+    }
+
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    GLERROR();
+    if (disjoint) {
+        std::scoped_lock lock(m_mutex);
+        m_dropped++;
+        return;
+    }
+
+    auto &elapsed = m_elapsed;
+    for (std::size_t i = 0; i < frame.queries.size(); i++) {
+        if (!frame.issued[i]) {
+            continue;
+        }
+        glGetQueryObjectui64vEXT(frame.queries[i], GL_QUERY_RESULT_EXT, &elapsed[i]);
+        GLERROR();
+        // No pass takes a second, some drivers (llvmpipe among them) report garbage for the very first query
+        if (elapsed[i] > MAX_PASS_NS) {
+            std::scoped_lock lock(m_mutex);
+            m_dropped++;
+            return;
+        }
+    }
+
+    std::scoped_lock lock(m_mutex);
+    for (std::size_t i = 0; i < frame.queries.size(); i++) {
+        if (frame.issued[i]) {
+            m_gpu[i].add(static_cast<double>(elapsed[i]) / 1e6);
+        }
+    }
+}
+
+std::vector<GlPassTimer::PassStats> GlPassTimer::stats() const {
+    std::scoped_lock lock(m_mutex);
+    std::vector<PassStats> result;
+    for (std::size_t i = 0; i < m_pass_names.size(); i++) {
+        PassStats stats{m_pass_names[i], std::min(m_gpu[i].count, WINDOW), 0, 0, 0, 0};
+
+        if (stats.samples) {
+            std::vector<double> gpu(m_gpu[i].samples.begin(), m_gpu[i].samples.begin() + stats.samples);
+            std::sort(gpu.begin(), gpu.end());
+            stats.gpu_min_ms = gpu.front();
+            stats.gpu_mean_ms = std::accumulate(gpu.begin(), gpu.end(), 0.0) / gpu.size();
+            stats.gpu_p99_ms = gpu[(gpu.size() * 99 + 99) / 100 - 1];
+        }
+
+        auto cpu_samples = std::min(m_cpu[i].count, WINDOW);
+        if (cpu_samples) {
+            stats.cpu_mean_ms = std::accumulate(m_cpu[i].samples.begin(), m_cpu[i].samples.begin() + cpu_samples,
+                                                0.0) / cpu_samples;
+        }
+        result.push_back(std::move(stats));
+    }
+    return result;
+}
+
+std::uint64_t GlPassTimer::droppedFrames() const {
+    std::scoped_lock lock(m_mutex);
+    return m_dropped;
+}
@@ -0,0 +1,81 @@
+#ifndef LIBCAMERA_MEME_GL_PASS_TIMER_H
+#define LIBCAMERA_MEME_GL_PASS_TIMER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <GLES2/gl2.h>
+
+// Times GPU passes with GL_EXT_disjoint_timer_query without ever stalling: a frame's queries are only read back
+// FRAMES_IN_FLIGHT frames later, and if they still aren't ready then the frame's samples are dropped instead of
+// waited for. The CPU time spent issuing each pass is kept next to it, so driver overhead can be told apart from
+// shader time. Lives in the caller's GL context, stats can be read from any thread.
+class GlPassTimer {
+public:
+    struct PassStats {
+        std::string name;
+        std::size_t samples; // GPU samples in the window
+        double gpu_min_ms;
+        double gpu_mean_ms;
+        double gpu_p99_ms;
+        double cpu_mean_ms;
+    };
+
+    static constexpr int FRAMES_IN_FLIGHT = 4;
+    // Rolling stats cover this many of the most recent frames
+    static constexpr std::size_t WINDOW = 128;
+
+    explicit GlPassTimer(std::vector<std::string> pass_names);
+    ~GlPassTimer();
+
+    GlPassTimer(const GlPassTimer &) = delete;
+    GlPassTimer &operator=(const GlPassTimer &) = delete;
+
+    // Whether the current context exposes GL_EXT_disjoint_timer_query
+    static bool supported();
+
+    // Passes are indices into pass_names, can't nest and may be skipped in a frame
+    void beginFrame();
+    void beginPass(int pass);
+    void endPass(int pass);
+
+    [[nodiscard]] std::vector<PassStats> stats() const;
+    // Frames whose results were thrown away, because they weren't ready in time or the GPU reported a disjoint
+    // event (e.g. a frequency change) that makes them meaningless
+    [[nodiscard]] std::uint64_t droppedFrames() const;
+
+private:
+    struct Window {
+        std::array<double, WINDOW> samples{};
+        std::size_t count = 0;
+
+        void add(double value);
+    };
+
+    struct FrameQueries {
+        std::vector<GLuint> queries; // one per pass
+        std::vector<bool> issued;
+        bool pending = false;
+    };
+
+    static constexpr GLuint64 MAX_PASS_NS = 1'000'000'000;
+
+    void collect(FrameQueries &frame);
+
+    std::vector<std::string> m_pass_names;
+    std::array<FrameQueries, FRAMES_IN_FLIGHT> m_frames;
+    std::size_t m_frame = 0;
+    std::int64_t m_pass_start = 0;
+    std::vector<GLuint64> m_elapsed; // scratch for collect
+
+    mutable std::mutex m_mutex;
+    std::vector<Window> m_gpu;
+    std::vector<Window> m_cpu;
+    std::uint64_t m_dropped = 0;
+};
+
+#endif //LIBCAMERA_MEME_GL_PASS_TIMER_H
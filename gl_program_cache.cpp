@@ -0,0 +1,187 @@
+#include "gl_program_cache.h"
+
+#include <GLES2/gl2ext.h>
+#include <EGL/egl.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include <unistd.h>
+
+#include "gl_utility.h"
+
+static PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+static PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+
+namespace {
+    // Starts every binary file, native byte order
+    struct BinaryHeader {
+        static constexpr std::uint64_t MAGIC = 0x31304e4942474c4cULL; // "LLGBIN01"
+
+        std::uint64_t magic;
+        std::uint64_t key;
+        std::uint32_t format;
+        std::uint32_t length;
+    };
+}
+
+// FNV-1a, std::hash isn't guaranteed to stay the same between builds
+static std::uint64_t stable_hash(const std::string &data) {
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c: data) {
+        hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::string gl_string(GLenum name) {
+    auto value = reinterpret_cast<const char *>(glGetString(name));
+    return value ? value : "";
+}
+
+GlProgramCache::GlProgramCache(std::string binary_dir) : m_binary_dir(std::move(binary_dir)) {
+    if (m_binary_dir.empty()) {
+        return;
+    }
+    if (!binariesSupported()) {
+        std::cout << "GL_OES_get_program_binary not supported, programs won't be cached on disk" << std::endl;
+        m_binary_dir.clear();
+        return;
+    }
+    std::error_code error;
+    std::filesystem::create_directories(m_binary_dir, error);
+    if (error) {
+        std::cout << "can't create program cache " << m_binary_dir << ": " << error.message() << std::endl;
+        m_binary_dir.clear();
+        return;
+    }
+
+    glGetProgramBinaryOES = (PFNGLGETPROGRAMBINARYOESPROC) eglGetProcAddress("glGetProgramBinaryOES");
+    glProgramBinaryOES = (PFNGLPROGRAMBINARYOESPROC) eglGetProcAddress("glProgramBinaryOES");
+    m_driver = gl_string(GL_VENDOR) + '\n' + gl_string(GL_RENDERER) + '\n' + gl_string(GL_VERSION);
+}
+
+GlProgramCache::~GlProgramCache() {
+    for (const auto &[source, program]: m_programs) {
+        glDeleteProgram(program);
+    }
+}
+
+bool GlProgramCache::binariesSupported() {
+    if (!has_extension(reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS)), "GL_OES_get_program_binary")) {
+        return false;
+    }
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+    GLERROR();
+    return formats > 0;
+}
+
+GLuint GlProgramCache::program(const std::string &vertex_source, const std::string &fragment_source) {
+    auto source = vertex_source + '\0' + fragment_source;
+    if (auto it = m_programs.find(source); it != m_programs.end()) {
+        m_stats.hits++;
+        return it->second;
+    }
+
+    GLuint program = 0;
+    std::string path;
+    std::uint64_t key = 0;
+    if (!m_binary_dir.empty()) {
+        key = stable_hash(m_driver + '\0' + source);
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+        path = (std::filesystem::path(m_binary_dir) / name).string();
+        program = loadBinary(path, key);
+    }
+
+    if (program) {
+        m_stats.binary_loads++;
+    } else {
+        program = make_program(vertex_source.c_str(), fragment_source.c_str());
+        m_stats.compiles++;
+        if (!path.empty()) {
+            saveBinary(path, key, program);
+        }
+    }
+    m_programs.emplace(std::move(source), program);
+    return program;
+}
+
+GlProgramCache::Stats GlProgramCache::stats() const {
+    return m_stats;
+}
+
+GLuint GlProgramCache::loadBinary(const std::string &path, std::uint64_t key) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return 0;
+    }
+    std::vector<char> data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+
+    BinaryHeader header{};
+    if (data.size() < sizeof(header)) {
+        return 0;
+    }
+    std::copy_n(data.data(), sizeof(header), reinterpret_cast<char *>(&header));
+    if (header.magic != BinaryHeader::MAGIC || header.key != key || data.size() - sizeof(header) != header.length) {
+        return 0;
+    }
+
+    auto program = glCreateProgram();
+    GLERROR();
+    glProgramBinaryOES(program, header.format, data.data() + sizeof(header), static_cast<GLint>(header.length));
+    // A binary the driver no longer accepts isn't an error, it fails to link and gets compiled from source
+    glGetError();
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    GLERROR();
+    if (!status) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void GlProgramCache::saveBinary(const std::string &path, std::uint64_t key, GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+    GLERROR();
+    if (length <= 0) {
+        return;
+    }
+
+    BinaryHeader header{BinaryHeader::MAGIC, key, 0, 0};
+    std::vector<char> binary(length);
+    GLsizei written = 0;
+    GLenum format = 0;
+    glGetProgramBinaryOES(program, length, &written, &format, binary.data());
+    GLERROR();
+    header.format = format;
+    header.length = static_cast<std::uint32_t>(written);
+
+    // Renamed into place, so other processes sharing the directory never see half a file
+    auto temporary = path + ".tmp" + std::to_string(getpid());
+    std::error_code error;
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(binary.data(), written);
+        if (!out) {
+            std::cout << "failed to write program binary " << temporary << std::endl;
+            out.close();
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+    }
+}
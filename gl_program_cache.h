@@ -0,0 +1,52 @@
+#ifndef LIBCAMERA_MEME_GL_PROGRAM_CACHE_H
+#define LIBCAMERA_MEME_GL_PROGRAM_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include <GLES2/gl2.h>
+
+// Linked programs by source, so a shader variant is only ever compiled once per thresholder. Thresholders sharing
+// a GlContext each keep their own cache: they set uniforms such as sampleRect and yuvToRgb only when their own last
+// values change, so a program shared with another thresholder would be left with that one's. With a binary
+// directory and GL_OES_get_program_binary, linked programs are also written to disk and loaded back by later runs,
+// which skips GLSL compilation at startup altogether. Files are named after a hash of the sources and the driver's
+// vendor, renderer and version strings, so a driver update just means compiling again; binaries the driver
+// rejects anyway are recompiled and overwritten.
+// Lives in the caller's GL context and owns every program it hands out, until it's destroyed.
+class GlProgramCache {
+public:
+    struct Stats {
+        std::uint64_t hits; // already linked in this context
+        std::uint64_t binary_loads; // loaded from the binary directory
+        std::uint64_t compiles;
+    };
+
+    // An empty binary_dir keeps programs in memory only. The directory is created if it doesn't exist.
+    explicit GlProgramCache(std::string binary_dir = {});
+    ~GlProgramCache();
+
+    GlProgramCache(const GlProgramCache &) = delete;
+    GlProgramCache &operator=(const GlProgramCache &) = delete;
+
+    // Whether the current context can save and load program binaries at all
+    static bool binariesSupported();
+
+    // Like make_program. Everyone asking for the same sources gets the same program, so uniforms that differ
+    // between users have to be set before each draw.
+    GLuint program(const std::string &vertex_source, const std::string &fragment_source);
+
+    [[nodiscard]] Stats stats() const;
+
+private:
+    GLuint loadBinary(const std::string &path, std::uint64_t key);
+    void saveBinary(const std::string &path, std::uint64_t key, GLuint program);
+
+    std::string m_binary_dir;
+    std::string m_driver; // vendor, renderer and version, part of every binary's key
+    std::unordered_map<std::string, GLuint> m_programs; // (vertex and fragment source, program)
+    Stats m_stats{};
+};
+
+#endif //LIBCAMERA_MEME_GL_PROGRAM_CACHE_H
@@ -0,0 +1,178 @@
+#include "gl_utility.h"
+
+#include <EGL/eglext.h>
+#include <GLES2/gl2ext.h>
+
+#include <stdexcept>
+#include <string_view>
+#include <iostream>
+
+void glerror(const char *file, int line) {
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+        std::string output;
+        output.resize(128);
+        snprintf(output.data(), 128, "GL error detected at %s:%d: 0x%04x\n", file, line, error);
+        std::cout << output << std::endl;
+        throw std::runtime_error(output);
+    }
+}
+
+void eglerror(const char *file, int line) {
+    EGLint error = eglGetError();
+    if (error != EGL_SUCCESS) {
+        std::string output;
+        output.resize(128);
+        snprintf(output.data(), 128, "EGL error detected at %s:%d: 0x%04x\n", file, line, error);
+        std::cout << output << std::endl;
+        throw std::runtime_error(output);
+    }
+}
+
+GLuint make_shader(GLenum type, const char *source) {
+    auto shader = glCreateShader(type);
+    if (!shader) {
+        throw std::runtime_error("failed to create shader");
+    }
+    glShaderSource(shader, 1, &source, nullptr);
+    GLERROR();
+    glCompileShader(shader);
+    GLERROR();
+
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        GLint log_size;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
+
+        std::string out;
+        out.resize(log_size);
+        glGetShaderInfoLog(shader, log_size, nullptr, out.data());
+
+        glDeleteShader(shader);
+        throw std::runtime_error("failed to compile shader with error: " + out);
+    }
+
+    return shader;
+}
+
+GLuint make_program(const char *vertex_source, const char *fragment_source) {
+    auto vertex_shader = make_shader(GL_VERTEX_SHADER, vertex_source);
+    auto fragment_shader = make_shader(GL_FRAGMENT_SHADER, fragment_source);
+
+    auto program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    GLERROR();
+    glAttachShader(program, fragment_shader);
+    GLERROR();
+    glBindAttribLocation(program, QUAD_VERTEX_ATTRIB, "vertex");
+    GLERROR();
+    glLinkProgram(program);
+    GLERROR();
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+        GLint log_size;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_size);
+
+        std::string out;
+        out.resize(log_size);
+        glGetProgramInfoLog(program, log_size, nullptr, out.data());
+
+        throw std::runtime_error("failed to link program with error: " + out);
+    }
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    return program;
+}
+
+bool has_extension(const char *extensions, const std::string &name) {
+    if (!extensions) {
+        return false;
+    }
+    std::string_view list(extensions);
+    for (std::size_t pos = list.find(name); pos != std::string_view::npos; pos = list.find(name, pos + 1)) {
+        auto end = pos + name.size();
+        if ((pos == 0 || list[pos - 1] == ' ') && (end == list.size() || list[end] == ' ')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+GLuint import_dma_buf_texture(EGLDisplay display, int fd, uint32_t fourcc, int width, int height, int offset, int pitch) {
+    static auto glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC) eglGetProcAddress(
+            "glEGLImageTargetTexture2DOES");
+    static auto eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
+    static auto eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC) eglGetProcAddress("eglDestroyImageKHR");
+
+    if (!glEGLImageTargetTexture2DOES) {
+        throw std::runtime_error("cannot get address of glEGLImageTargetTexture2DOES");
+    }
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    GLERROR();
+    glBindTexture(GL_TEXTURE_2D, texture);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    GLERROR();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    GLERROR();
+
+    const EGLint image_attribs[] = {
+            EGL_WIDTH, static_cast<EGLint>(width),
+            EGL_HEIGHT, static_cast<EGLint>(height),
+            EGL_LINUX_DRM_FOURCC_EXT, static_cast<EGLint>(fourcc),
+            EGL_DMA_BUF_PLANE0_FD_EXT, static_cast<EGLint>(fd),
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT, static_cast<EGLint>(offset),
+            EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(pitch),
+            EGL_NONE
+    };
+    auto image = eglCreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, nullptr, image_attribs);
+    EGLERROR();
+    if (!image) {
+        glDeleteTextures(1, &texture);
+        throw std::runtime_error("failed to import fd " + std::to_string(fd));
+    }
+
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    GLERROR();
+    eglDestroyImageKHR(display, image);
+    EGLERROR();
+
+    return texture;
+}
+
+DmaBufRenderTarget import_render_target(EGLDisplay display, int fd, uint32_t fourcc, int width, int height, int pitch) {
+    auto out_tex = import_dma_buf_texture(display, fd, fourcc, width, height, 0, pitch);
+
+    GLuint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    GLERROR();
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    GLERROR();
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, out_tex, 0);
+    GLERROR();
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("failed to complete framebuffer");
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    return {fd, width, height, out_tex, framebuffer};
+}
+
+void destroy_render_target(const DmaBufRenderTarget &target) {
+    glDeleteFramebuffers(1, &target.framebuffer);
+    glDeleteTextures(1, &target.texture);
+}
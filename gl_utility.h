@@ -0,0 +1,41 @@
+#ifndef LIBCAMERA_MEME_GL_UTILITY_H
+#define LIBCAMERA_MEME_GL_UTILITY_H
+
+#include <cstdint>
+#include <string>
+
+#include <GLES2/gl2.h>
+#include <EGL/egl.h>
+
+#define GLERROR() glerror(__FILE__, __LINE__)
+#define EGLERROR() eglerror(__FILE__, __LINE__)
+
+void glerror(const char *file, int line);
+void eglerror(const char *file, int line);
+
+// Every program draws the same full-screen quad, so make_program pins its "vertex" attribute here
+constexpr GLuint QUAD_VERTEX_ATTRIB = 0;
+
+GLuint make_shader(GLenum type, const char *source);
+GLuint make_program(const char *vertex_source, const char *fragment_source);
+
+// Checks a space separated extension string, as returned by eglQueryString or glGetString
+bool has_extension(const char *extensions, const std::string &name);
+
+// One plane of a dma-buf as a GL_TEXTURE_2D with linear filtering, left bound to the active texture unit. The
+// texture keeps the buffer alive on its own, no EGLImage is left to clean up.
+GLuint import_dma_buf_texture(EGLDisplay display, int fd, uint32_t fourcc, int width, int height, int offset, int pitch);
+
+// A single plane dma-buf imported as a GL_TEXTURE_2D and attached to its own framebuffer
+struct DmaBufRenderTarget {
+    int fd;
+    int width;
+    int height;
+    GLuint texture;
+    GLuint framebuffer;
+};
+
+DmaBufRenderTarget import_render_target(EGLDisplay display, int fd, uint32_t fourcc, int width, int height, int pitch);
+void destroy_render_target(const DmaBufRenderTarget &target);
+
+#endif //LIBCAMERA_MEME_GL_UTILITY_H
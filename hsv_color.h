@@ -0,0 +1,59 @@
+#ifndef LIBCAMERA_MEME_HSV_COLOR_H
+#define LIBCAMERA_MEME_HSV_COLOR_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+// Scalar versions of the shader's rgb2hsv and inRange, everything in [0, 1]. The mix/step pairs of the shader
+// are written out as selects, and the CPU thresholder's vector kernels repeat these operations in this order.
+struct Hsv {
+    float h;
+    float s;
+    float v;
+};
+
+inline Hsv rgb_to_hsv(float r, float g, float b) {
+    bool gb = g >= b;
+    float o_x = gb ? g : b;
+    float o_y = gb ? b : g;
+    float o_z = gb ? 0.0f : -1.0f;
+    float o_w = gb ? -1.0f / 3.0f : 2.0f / 3.0f;
+    bool ro = r >= o_x;
+    float t_x = ro ? r : o_x;
+    float t_y = o_y;
+    float t_z = ro ? o_z : o_w;
+    float t_w = ro ? o_x : r;
+
+    float chroma = t_x - std::min(t_w, t_y);
+    constexpr float n = 1.0e-10f;
+    return {std::abs(t_z + (t_w - t_y) / (6.0f * chroma + n)), chroma / (t_x + n), t_x};
+}
+
+// The shader's epsilon, the bounds are widened by it
+constexpr float HSV_RANGE_EPSILON = 0.0001f;
+
+// An inclusive box in HSV space. A hue lower bound above the upper one wraps around through 0, so reds can be
+// caught with e.g. 0.95 to 0.05 instead of two ranges.
+struct HsvRange {
+    std::array<float, 3> lower;
+    std::array<float, 3> upper;
+
+    [[nodiscard]] bool hueWraps() const {
+        return lower[0] > upper[0];
+    }
+};
+
+inline bool hsv_in_range(const Hsv &hsv, const HsvRange &range) {
+    bool above_hue = hsv.h >= range.lower[0] - HSV_RANGE_EPSILON;
+    bool below_hue = hsv.h <= range.upper[0] + HSV_RANGE_EPSILON;
+    bool hue = range.hueWraps() ? above_hue || below_hue : above_hue && below_hue;
+    return hue && hsv.s >= range.lower[1] - HSV_RANGE_EPSILON && hsv.v >= range.lower[2] - HSV_RANGE_EPSILON &&
+           hsv.s <= range.upper[1] + HSV_RANGE_EPSILON && hsv.v <= range.upper[2] + HSV_RANGE_EPSILON;
+}
+
+inline bool hsv_in_range(const Hsv &hsv, const std::array<float, 3> &lower, const std::array<float, 3> &upper) {
+    return hsv_in_range(hsv, HsvRange{lower, upper});
+}
+
+#endif //LIBCAMERA_MEME_HSV_COLOR_H
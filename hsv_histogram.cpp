@@ -0,0 +1,104 @@
+#include "hsv_histogram.h"
+
+#include <cmath>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+std::uint64_t HsvHistogram::total() const {
+    return std::accumulate(value.begin(), value.end(), std::uint64_t{0});
+}
+
+HsvHistogram &HsvHistogram::operator+=(const HsvHistogram &other) {
+    for (std::size_t i = 0; i < hue_saturation.size(); i++) {
+        hue_saturation[i] += other.hue_saturation[i];
+    }
+    for (std::size_t i = 0; i < value.size(); i++) {
+        value[i] += other.value[i];
+    }
+    return *this;
+}
+
+HsvHistogram read_hsv_histogram(const std::uint8_t *buffer) {
+    auto count = [&](std::size_t texel) {
+        const auto *bytes = buffer + texel * 4;
+        return static_cast<std::uint32_t>(bytes[0]) | static_cast<std::uint32_t>(bytes[1]) << 8 |
+               static_cast<std::uint32_t>(bytes[2]) << 16;
+    };
+
+    HsvHistogram histogram;
+    for (std::size_t i = 0; i < histogram.hue_saturation.size(); i++) {
+        histogram.hue_saturation[i] = count(i);
+    }
+    for (std::size_t i = 0; i < histogram.value.size(); i++) {
+        histogram.value[i] = count(histogram.hue_saturation.size() + i);
+    }
+    return histogram;
+}
+
+// First and last bin once the given share of the samples is dropped from each end
+static std::pair<int, int> central_bins(const std::vector<std::uint64_t> &counts, double drop) {
+    auto total = std::accumulate(counts.begin(), counts.end(), std::uint64_t{0});
+    auto limit = static_cast<double>(total) * drop;
+    int first = 0, last = static_cast<int>(counts.size()) - 1;
+    for (double below = 0; first < last && below + static_cast<double>(counts[first]) <= limit; first++) {
+        below += static_cast<double>(counts[first]);
+    }
+    for (double above = 0; last > first && above + static_cast<double>(counts[last]) <= limit; last--) {
+        above += static_cast<double>(counts[last]);
+    }
+    return {first, last};
+}
+
+std::optional<HsvRange> suggest_hsv_range(const HsvHistogram &histogram, double coverage, float min_saturation) {
+    if (histogram.total() == 0) {
+        return std::nullopt;
+    }
+    double drop = (1.0 - coverage) / 2;
+
+    std::vector<std::uint64_t> saturation(HISTOGRAM_SATURATION_BINS), hue(HISTOGRAM_HUE_BINS);
+    auto chromatic = static_cast<int>(std::ceil(min_saturation * HISTOGRAM_SATURATION_BINS));
+    for (int s = 0; s < HISTOGRAM_SATURATION_BINS; s++) {
+        for (int h = 0; h < HISTOGRAM_HUE_BINS; h++) {
+            auto count = histogram.hue_saturation[s * HISTOGRAM_HUE_BINS + h];
+            saturation[s] += count;
+            if (s >= chromatic) {
+                hue[h] += count;
+            }
+        }
+    }
+    std::vector<std::uint64_t> value(histogram.value.begin(), histogram.value.end());
+
+    auto [s_first, s_last] = central_bins(saturation, drop);
+    auto [v_first, v_last] = central_bins(value, drop);
+    HsvRange range{{0.0f, static_cast<float>(s_first) / HISTOGRAM_SATURATION_BINS,
+                    static_cast<float>(v_first) / HISTOGRAM_VALUE_BINS},
+                   {1.0f, static_cast<float>(s_last + 1) / HISTOGRAM_SATURATION_BINS,
+                    static_cast<float>(v_last + 1) / HISTOGRAM_VALUE_BINS}};
+
+    // A grey target leaves hue wide open
+    auto hue_total = std::accumulate(hue.begin(), hue.end(), std::uint64_t{0});
+    if (hue_total == 0) {
+        return range;
+    }
+    auto wanted = static_cast<double>(hue_total) * coverage;
+    int best_start = 0, best_length = HISTOGRAM_HUE_BINS;
+    for (int start = 0; start < HISTOGRAM_HUE_BINS; start++) {
+        double covered = 0;
+        for (int length = 1; length < best_length; length++) {
+            covered += static_cast<double>(hue[(start + length - 1) % HISTOGRAM_HUE_BINS]);
+            if (covered >= wanted) {
+                best_start = start;
+                best_length = length;
+                break;
+            }
+        }
+    }
+    if (best_length < HISTOGRAM_HUE_BINS) {
+        int end = best_start + best_length;
+        range.lower[0] = static_cast<float>(best_start) / HISTOGRAM_HUE_BINS;
+        range.upper[0] = static_cast<float>(end > HISTOGRAM_HUE_BINS ? end - HISTOGRAM_HUE_BINS : end) /
+                         HISTOGRAM_HUE_BINS;
+    }
+    return range;
+}
@@ -0,0 +1,42 @@
+#ifndef LIBCAMERA_MEME_HSV_HISTOGRAM_H
+#define LIBCAMERA_MEME_HSV_HISTOGRAM_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "hsv_color.h"
+
+// Bins of the histograms GlHsvThresholder collects with OutputConfig::histogram, each an equal share of [0, 1]
+constexpr int HISTOGRAM_HUE_BINS = 32;
+constexpr int HISTOGRAM_SATURATION_BINS = 32;
+constexpr int HISTOGRAM_VALUE_BINS = 32;
+// The value histogram is stored as one more row of the hue by saturation one
+static_assert(HISTOGRAM_VALUE_BINS == HISTOGRAM_HUE_BINS, "the value row has to be as wide as the hue rows");
+
+// A histogram buffer is HISTOGRAM_HUE_BINS x (HISTOGRAM_SATURATION_BINS + 1) ARGB8888 texels, each a 24 bit
+// little endian count: the hue by saturation bins row by row, then the value bins
+constexpr std::size_t HSV_HISTOGRAM_BUFFER_SIZE =
+        static_cast<std::size_t>(HISTOGRAM_HUE_BINS) * (HISTOGRAM_SATURATION_BINS + 1) * 4;
+
+// Sample counts of a region of a frame, or several frames added up
+struct HsvHistogram {
+    // Saturation major, [s * HISTOGRAM_HUE_BINS + h]
+    std::array<std::uint32_t, HISTOGRAM_HUE_BINS * HISTOGRAM_SATURATION_BINS> hue_saturation{};
+    std::array<std::uint32_t, HISTOGRAM_VALUE_BINS> value{};
+
+    [[nodiscard]] std::uint64_t total() const;
+    HsvHistogram &operator+=(const HsvHistogram &other);
+};
+
+HsvHistogram read_hsv_histogram(const std::uint8_t *buffer);
+
+// A range that takes in coverage of the histogram's samples, for a histogram over a region that's mostly the
+// target. Hue is the shortest arc around the circle holding that share of the samples that are saturated enough
+// for their hue to mean anything, and may wrap through red. Saturation and value drop an equal share from each
+// end. Nothing if there are no samples.
+std::optional<HsvRange> suggest_hsv_range(const HsvHistogram &histogram, double coverage = 0.9,
+                                          float min_saturation = 0.15f);
+
+#endif //LIBCAMERA_MEME_HSV_HISTOGRAM_H
@@ -0,0 +1,141 @@
+#include "hsv_thresholder.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "hsv_histogram.h"
+#include "mask_stats.h"
+
+std::size_t HsvThresholder::target_buffer_size(const OutputConfig &config, int width, int height) {
+    width = output_size(config, width);
+    height = output_size(config, height);
+    auto pixels = static_cast<std::size_t>(width) * height;
+    switch (config.mode) {
+        case OutputMode::Packed:
+            return pixels * 4;
+        case OutputMode::Planar:
+        case OutputMode::RangeBits:
+            return pixels;
+        case OutputMode::BitPacked:
+            return static_cast<std::size_t>(bit_packed_row_words(width)) * 4 * height;
+    }
+    throw std::runtime_error("unknown output mode");
+}
+
+std::size_t HsvThresholder::color_buffer_size(const OutputConfig &config, int width, int height) {
+    int color_width = config.color_width > 0 ? config.color_width : output_size(config, width);
+    int color_height = config.color_height > 0 ? config.color_height : output_size(config, height);
+    return static_cast<std::size_t>(color_width) * color_height * 4;
+}
+
+std::size_t HsvThresholder::stats_buffer_size(const OutputConfig &config, int width, int height) {
+    return static_cast<std::size_t>(stats_tile_count(output_size(config, width))) *
+           stats_tile_count(output_size(config, height)) * sizeof(TileStats);
+}
+
+void HsvThresholder::setRanges(const std::vector<HsvRange> &ranges) {
+    check_hsv_ranges(ranges);
+    {
+        std::scoped_lock lock(m_ranges_mutex);
+        m_pending_ranges = ranges;
+    }
+    m_ranges_pending.store(true, std::memory_order_release);
+}
+
+std::optional<std::vector<HsvRange>> HsvThresholder::takeRanges() {
+    if (!m_ranges_pending.load(std::memory_order_acquire)) {
+        return std::nullopt;
+    }
+    std::scoped_lock lock(m_ranges_mutex);
+    m_ranges_pending.store(false, std::memory_order_relaxed);
+    return std::move(m_pending_ranges);
+}
+
+void HsvThresholder::setRoi(std::optional<Roi> roi) {
+    if (roi && (roi->width <= 0 || roi->height <= 0)) {
+        throw std::runtime_error("a roi needs a positive size");
+    }
+    {
+        std::scoped_lock lock(m_roi_mutex);
+        m_pending_roi = roi;
+    }
+    m_roi_pending.store(true, std::memory_order_release);
+}
+
+HsvThresholder::Roi HsvThresholder::frameRoi(const OutputConfig &config, int width, int height) {
+    if (m_roi_pending.load(std::memory_order_acquire)) {
+        std::scoped_lock lock(m_roi_mutex);
+        m_roi_pending.store(false, std::memory_order_relaxed);
+        m_roi = m_pending_roi;
+    }
+    if (!m_roi) {
+        return {0, 0, width, height};
+    }
+
+    // Even, so the chroma planes start on a whole sample, and whole output pixels so the filter footprint
+    // doesn't shift with the window
+    int align = config.scale % 2 == 0 ? config.scale : config.scale * 2;
+    auto axis = [&](int begin, int size, int pixels) {
+        int end = std::clamp(begin + size, 0, pixels);
+        begin = std::clamp(begin, 0, pixels) / align * align;
+        end = std::min((end + align - 1) / align * align, pixels);
+        // A window that's off the frame keeps a sliver along the edge
+        if (end - begin < align) {
+            end = std::min(begin + align, pixels);
+            begin = std::max(end - align, 0) / align * align;
+        }
+        return std::make_pair(begin, end - begin);
+    };
+    auto [x, roi_width] = axis(m_roi->x, m_roi->width, width);
+    auto [y, roi_height] = axis(m_roi->y, m_roi->height, height);
+    return {x, y, roi_width, roi_height};
+}
+
+std::optional<HsvThresholder::OutputFrame> acquire_output_frame(DmaBufPool &pool,
+                                                                const HsvThresholder::OutputConfig &output_config,
+                                                                int width, int height) {
+    auto target = pool.acquire(HsvThresholder::target_buffer_size(output_config, width, height));
+    if (!target) {
+        return std::nullopt;
+    }
+    HsvThresholder::OutputFrame frame{std::move(*target), std::nullopt, std::nullopt, std::nullopt, {},
+                                      {0, 0, width, height}};
+
+    // Whatever was already taken goes straight back if a later buffer isn't there
+    if (output_config.color && output_config.mode != HsvThresholder::OutputMode::Packed) {
+        frame.color = pool.acquire(HsvThresholder::color_buffer_size(output_config, width, height));
+        if (!frame.color) {
+            return std::nullopt;
+        }
+    }
+    if (output_config.stats) {
+        frame.stats = pool.acquire(HsvThresholder::stats_buffer_size(output_config, width, height));
+        if (!frame.stats) {
+            return std::nullopt;
+        }
+    }
+    if (output_config.histogram) {
+        frame.histogram = pool.acquire(HSV_HISTOGRAM_BUFFER_SIZE);
+        if (!frame.histogram) {
+            return std::nullopt;
+        }
+    }
+    return frame;
+}
+
+void check_hsv_ranges(const std::vector<HsvRange> &ranges) {
+    if (ranges.empty() || ranges.size() > HsvThresholder::MAX_RANGES) {
+        throw std::runtime_error("thresholders take 1 to " + std::to_string(HsvThresholder::MAX_RANGES) +
+                                 " hsv ranges");
+    }
+    for (const auto &range: ranges) {
+        auto in_unit = [](float bound) {
+            return bound >= 0.0f && bound <= 1.0f;
+        };
+        if (!std::all_of(range.lower.begin(), range.lower.end(), in_unit) ||
+            !std::all_of(range.upper.begin(), range.upper.end(), in_unit)) {
+            throw std::runtime_error("hsv range bounds have to be in [0, 1]");
+        }
+    }
+}
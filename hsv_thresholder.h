@@ -0,0 +1,251 @@
+#ifndef LIBCAMERA_MEME_HSV_THRESHOLDER_H
+#define LIBCAMERA_MEME_HSV_THRESHOLDER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <EGL/egl.h>
+
+#include "dma_buf_pool.h"
+#include "frame_trace.h"
+#include "hsv_color.h"
+#include "lens_remap.h"
+#include "yuv_conversion.h"
+
+// Common interface of the thresholding backends: YUV camera dma-bufs in, mask (and color) dma-bufs out. The input
+// format is fixed at construction and every frame takes its outputs from a DmaBufPool. Encoding and range take the
+// EGL_EXT_image_dma_buf_import values whichever backend is used.
+class HsvThresholder {
+public:
+    struct DmaBufPlaneData {
+        int fd;
+        EGLint offset;
+        EGLint pitch;
+
+        bool operator==(const DmaBufPlaneData &other) const = default;
+    };
+
+    enum class OutputMode {
+        // One ARGB8888 buffer per frame, with the color in the color channels and the mask in alpha
+        Packed,
+        // An R8 mask buffer per frame, plus an optional XRGB8888 color buffer that can be downscaled
+        Planar,
+        // A 1 bit per pixel mask, 32 pixels to a little endian word with the leftmost pixel in bit 0. Rows are
+        // bit_packed_row_words(width) words long. Takes the same optional color buffer as Planar.
+        BitPacked,
+        // An R8 buffer per frame with bit i set where the pixel is inside range i of setRanges, so up to
+        // MAX_RANGES differently colored targets come out of one pass. Takes the same optional color buffer as
+        // Planar.
+        RangeBits,
+    };
+
+    // A window of the input in pixels, see setRoi
+    struct Roi {
+        int x;
+        int y;
+        int width;
+        int height;
+
+        bool operator==(const Roi &other) const = default;
+    };
+
+    enum class MorphologyOp {
+        Erode,
+        Dilate,
+        // Erode then dilate, drops specks smaller than the kernel
+        Open,
+        // Dilate then erode, fills holes smaller than the kernel
+        Close,
+    };
+
+    // A square kernel of 2 * radius + 1 pixels a side, applied iterations times
+    struct MorphologyStep {
+        MorphologyOp op;
+        int radius;
+        int iterations = 1;
+
+        bool operator==(const MorphologyStep &other) const = default;
+    };
+
+    struct OutputConfig {
+        OutputMode mode = OutputMode::Packed;
+        // Also write a color buffer, ignored in packed mode
+        bool color = false;
+        // Also reduce the mask to per-tile moments, see TileStats in mask_stats.h. Needs a packed or planar mask.
+        bool stats = false;
+        // Size of the planar color buffers, zero means the mask size
+        int color_width = 0;
+        int color_height = 0;
+        // GL backend only: input pixels per output pixel along each axis, e.g. 2 or 4. The mask and stats shrink
+        // by as much, and the camera planes are sampled between texels so the GPU's bilinear filter averages them.
+        int scale = 1;
+        // GL backend only: entries per axis of a ColorLut that replaces the per-pixel RGB conversion and HSV math of
+        // the mask, zero to keep the math. See GlHsvThresholder::setColorClassifier.
+        int lut_size = 0;
+        // GL backend only: time each pass on the GPU with GL_EXT_disjoint_timer_query, if the driver has it. See
+        // GlHsvThresholder::passTimings.
+        bool gpu_timing = false;
+        // GL backend only: compile the ranges into the mask program as constants once they've stopped changing.
+        // Saves the uniform loop per pixel at the cost of a compile whenever they settle on new values. Needs the
+        // per-pixel HSV math, so no lut_size.
+        bool bake_ranges = false;
+        // GL backend only: where compiled programs are kept between runs, see GlProgramCache. Empty to compile
+        // everything at startup.
+        std::string program_binary_dir;
+        // GL backend only: erode and dilate passes run over the mask in order before it's written out, see
+        // GlMorphology. Needs a packed or planar mask, GlHsvThresholder::setMorphology changes them while running.
+        std::vector<MorphologyStep> morphology;
+        // GL backend only: the mask and color are thresholded from the input as sampled through this table, e.g.
+        // undistort_remap, at the input's size. Pixels that land off the input come out black.
+        std::shared_ptr<const RemapTable> remap;
+        // GL backend only: also count the hue, saturation and value of the frame's window, or of histogram_region,
+        // into OutputFrame::histogram. See HsvHistogram.
+        bool histogram = false;
+        // Input pixels between histogram samples along each axis
+        int histogram_step = 4;
+        // In input pixels, e.g. where the target is held up while tuning. GlHsvThresholder::setHistogramRegion
+        // moves it while running.
+        std::optional<Roi> histogram_region;
+    };
+
+    // A finished frame. Its buffers go back to the pool when it's destroyed, so holding on to it for as long as
+    // the data is needed is all the bookkeeping there is.
+    struct OutputFrame {
+        DmaBufPool::Buffer target; // the ARGB8888 frame in packed mode, otherwise the mask
+        std::optional<DmaBufPool::Buffer> color;
+        std::optional<DmaBufPool::Buffer> stats;
+        std::optional<DmaBufPool::Buffer> histogram; // HSV_HISTOGRAM_BUFFER_SIZE bytes, read_hsv_histogram reads it
+        // The tag testFrame was given, with handoff set to when the frame was completed
+        FrameTag tag;
+        // The input pixels the outputs cover. They start at the top left of each buffer, output_size(roi.width) by
+        // output_size(roi.height) mask pixels laid out with the whole frame's strides, and the rest of the mask
+        // and color buffers is left as it was. Tiles of the stats outside it are zero.
+        Roi roi;
+    };
+
+    static constexpr int bit_packed_row_words(int width) {
+        return (width + 31) / 32;
+    }
+
+    // Mask pixels along an axis of this many input pixels
+    static constexpr int output_size(const OutputConfig &config, int pixels) {
+        return (pixels + config.scale - 1) / config.scale;
+    }
+
+    // Bytes each buffer of an OutputFrame of a width x height input needs, what to DmaBufPool::reserve for a given
+    // pipeline depth
+    static std::size_t target_buffer_size(const OutputConfig &config, int width, int height);
+    static std::size_t color_buffer_size(const OutputConfig &config, int width, int height);
+    static std::size_t stats_buffer_size(const OutputConfig &config, int width, int height);
+
+    // Hue, saturation and value bounds in [0, 1], inclusive
+    static constexpr std::array<float, 3> DEFAULT_LOWER_THRESH = {0.0f, 50.0f / 255.0f, 50.0f / 255.0f};
+    static constexpr std::array<float, 3> DEFAULT_UPPER_THRESH = {1.0f, 1.0f, 1.0f};
+    // One bit each in a RangeBits mask
+    static constexpr int MAX_RANGES = 8;
+
+    virtual ~HsvThresholder() = default;
+
+    virtual void setOnComplete(std::function<void(OutputFrame)> onComplete) = 0;
+    virtual void resetOnComplete() = 0;
+
+    // Drops everything cached for this camera dma-buf fd. Safe to call from any thread.
+    virtual void evictImports(int fd) = 0;
+    // Only the first yuv_plane_count(format) planes are read. onInputReleased is called once the backend is done
+    // reading the camera buffer, before the onComplete callback. If the pool has nothing left the frame is dropped,
+    // onInputReleased still fires but onComplete doesn't.
+    virtual void testFrame(const std::array<DmaBufPlaneData, 3>& yuv_plane_data, EGLint encoding, EGLint range,
+                           std::function<void()> onInputReleased = {}, const FrameTag &tag = {}) = 0;
+
+    // The ranges frames are tested against, 1 to MAX_RANGES of them. Packed, planar and bit packed masks are set
+    // where a pixel is inside any range, RangeBits masks get a bit per range. Starts out as the single default
+    // range. Safe to call from any thread, e.g. while tuning live: the ranges are copied aside and the frame
+    // thread swaps them in before its next frame, so a frame never sees half of an update.
+    void setRanges(const std::vector<HsvRange> &ranges);
+
+    // Thresholds only this window of the input from the next frame on, nullopt for the whole frame again. Cuts
+    // the fragment work and what the consumer reads back in proportion to the area, e.g. to follow a target with
+    // RoiTracker. The window is grown to even coordinates (and multiples of the scale) and clamped to the frame,
+    // OutputFrame::roi has what was used. Safe to call from any thread, like setRanges.
+    void setRoi(std::optional<Roi> roi);
+
+    // Records each frame's stages from here on, nullptr stops. Set it before the first frame, the tracer has to
+    // outlive the thresholder.
+    void setTracer(FrameTracer *tracer) {
+        m_tracer = tracer;
+    }
+
+protected:
+    // The ranges from the last setRanges, if there was one since the last call. Only a flag is checked when
+    // nothing changed, so backends call it every frame.
+    std::optional<std::vector<HsvRange>> takeRanges();
+    // The window from the last setRoi, clamped to a width x height frame. Called once per frame, only a flag is
+    // checked when nothing changed.
+    Roi frameRoi(const OutputConfig &config, int width, int height);
+
+    void trace(TraceStage stage, const FrameTag &tag, std::int64_t begin, std::int64_t end) const {
+        if (m_tracer) {
+            m_tracer->record(stage, tag, begin, end);
+        }
+    }
+
+    FrameTracer *m_tracer = nullptr;
+
+private:
+    std::mutex m_ranges_mutex;
+    std::vector<HsvRange> m_pending_ranges;
+    std::atomic<bool> m_ranges_pending{false};
+
+    std::mutex m_roi_mutex;
+    std::optional<Roi> m_pending_roi;
+    std::atomic<bool> m_roi_pending{false};
+    std::optional<Roi> m_roi; // only touched by the frame thread
+};
+
+enum class ThresholderBackend {
+    Gl,
+    Cpu,
+};
+
+// "gl" or "cpu"
+ThresholderBackend thresholder_backend_from_name(const std::string &name);
+
+// Which EGL display the GL backend renders on
+enum class EglPlatform {
+    // eglGetDisplay(EGL_DEFAULT_DISPLAY) with a pbuffer surface, whatever the environment picks
+    Default,
+    // EGL_MESA_platform_surfaceless with no surface at all, needs no display server or DRM device. Lets Mesa's
+    // llvmpipe run on headless machines.
+    Surfaceless,
+};
+
+// "default" or "surfaceless"
+EglPlatform egl_platform_from_name(const std::string &name);
+
+// Everything an OutputFrame of this config needs, or nullopt if the pool ran out. Used by both backends.
+std::optional<HsvThresholder::OutputFrame> acquire_output_frame(DmaBufPool &pool,
+                                                                const HsvThresholder::OutputConfig &output_config,
+                                                                int width, int height);
+
+// Throws unless there are 1 to MAX_RANGES ranges with bounds in [0, 1]. Used by both backends.
+void check_hsv_ranges(const std::vector<HsvRange> &ranges);
+
+class GlContext;
+
+// output_pool has to outlive the thresholder. pipelined, egl_platform and gl_context only apply to the GL backend,
+// the CPU one always finishes the frame inside testFrame. See GlHsvThresholder for sharing a gl_context.
+std::unique_ptr<HsvThresholder> make_hsv_thresholder(ThresholderBackend backend, int width, int height,
+                                                     YuvFormat input_format, DmaBufPool &output_pool,
+                                                     const HsvThresholder::OutputConfig& output_config,
+                                                     bool pipelined = false,
+                                                     EglPlatform egl_platform = EglPlatform::Default,
+                                                     std::shared_ptr<GlContext> gl_context = nullptr);
+
+#endif //LIBCAMERA_MEME_HSV_THRESHOLDER_H
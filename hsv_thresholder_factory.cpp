@@ -0,0 +1,41 @@
+#include "hsv_thresholder.h"
+
+#include <stdexcept>
+
+#include "cpu_hsv_thresholder.h"
+#include "gl_hsv_thresholder.h"
+
+ThresholderBackend thresholder_backend_from_name(const std::string &name) {
+    if (name == "gl") {
+        return ThresholderBackend::Gl;
+    }
+    if (name == "cpu") {
+        return ThresholderBackend::Cpu;
+    }
+    throw std::runtime_error("unknown thresholder backend " + name);
+}
+
+EglPlatform egl_platform_from_name(const std::string &name) {
+    if (name == "default") {
+        return EglPlatform::Default;
+    }
+    if (name == "surfaceless") {
+        return EglPlatform::Surfaceless;
+    }
+    throw std::runtime_error("unknown egl platform " + name);
+}
+
+std::unique_ptr<HsvThresholder> make_hsv_thresholder(ThresholderBackend backend, int width, int height,
+                                                     YuvFormat input_format, DmaBufPool &output_pool,
+                                                     const HsvThresholder::OutputConfig& output_config,
+                                                     bool pipelined, EglPlatform egl_platform,
+                                                     std::shared_ptr<GlContext> gl_context) {
+    switch (backend) {
+        case ThresholderBackend::Gl:
+            return std::make_unique<GlHsvThresholder>(width, height, input_format, output_pool, output_config, pipelined,
+                                                      egl_platform, std::move(gl_context));
+        case ThresholderBackend::Cpu:
+            return std::make_unique<CpuHsvThresholder>(width, height, input_format, output_pool, output_config);
+    }
+    throw std::runtime_error("unknown thresholder backend");
+}
@@ -0,0 +1,79 @@
+#include "lens_remap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+
+std::pair<float, float> RemapTable::at(double sample_x, double sample_y) const {
+    sample_x = std::clamp(sample_x, 0.0, static_cast<double>(width - 1));
+    sample_y = std::clamp(sample_y, 0.0, static_cast<double>(height - 1));
+    int x0 = std::min(static_cast<int>(sample_x), std::max(width - 2, 0));
+    int y0 = std::min(static_cast<int>(sample_y), std::max(height - 2, 0));
+    int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+    double fx = sample_x - x0, fy = sample_y - y0;
+
+    auto lerp = [&](const std::vector<float> &map) {
+        auto entry = [&](int ex, int ey) {
+            return static_cast<double>(map[static_cast<std::size_t>(ey) * width + ex]);
+        };
+        double top = entry(x0, y0) + (entry(x1, y0) - entry(x0, y0)) * fx;
+        double bottom = entry(x0, y1) + (entry(x1, y1) - entry(x0, y1)) * fx;
+        return static_cast<float>(top + (bottom - top) * fy);
+    };
+    return {lerp(x), lerp(y)};
+}
+
+RemapTable undistort_remap(const LensCalibration &calibration, int width, int height,
+                           const std::optional<CameraIntrinsics> &output) {
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("remap tables need a size");
+    }
+    const auto &camera = calibration.intrinsics;
+    const auto &corrected = output ? *output : camera;
+    const auto &d = calibration.distortion;
+
+    RemapTable table{width, height, {}, {}};
+    table.x.resize(static_cast<std::size_t>(width) * height);
+    table.y.resize(table.x.size());
+    for (int row = 0; row < height; row++) {
+        double y = (row - corrected.cy) / corrected.fy;
+        for (int column = 0; column < width; column++) {
+            double x = (column - corrected.cx) / corrected.fx;
+            double r2 = x * x + y * y;
+            double radial = 1 + r2 * (d.k1 + r2 * (d.k2 + r2 * d.k3));
+            double distorted_x = x * radial + 2 * d.p1 * x * y + d.p2 * (r2 + 2 * x * x);
+            double distorted_y = y * radial + d.p1 * (r2 + 2 * y * y) + 2 * d.p2 * x * y;
+
+            auto i = static_cast<std::size_t>(row) * width + column;
+            table.x[i] = static_cast<float>(camera.fx * distorted_x + camera.cx);
+            table.y[i] = static_cast<float>(camera.fy * distorted_y + camera.cy);
+        }
+    }
+    return table;
+}
+
+std::vector<uint8_t> pack_remap(const RemapTable &table, int output_width, int output_height, int scale) {
+    std::vector<uint8_t> texels(static_cast<std::size_t>(output_width) * output_height * 4);
+    auto quantize = [](double fraction) {
+        return static_cast<int>(std::lround(fraction * REMAP_ONE));
+    };
+    for (int row = 0; row < output_height; row++) {
+        for (int column = 0; column < output_width; column++) {
+            auto [x, y] = table.at((column + 0.5) * scale - 0.5, (row + 0.5) * scale - 0.5);
+            // Pixel centres are on whole numbers in the table and halfway between texels in GL
+            double u = (x + 0.5) / table.width, v = (y + 0.5) / table.height;
+            int fixed_x = REMAP_OUTSIDE, fixed_y = 0;
+            if (u >= 0.0 && u <= 1.0 && v >= 0.0 && v <= 1.0) {
+                fixed_x = quantize(u);
+                fixed_y = quantize(v);
+            }
+            auto *texel = texels.data() + (static_cast<std::size_t>(row) * output_width + column) * 4;
+            texel[0] = static_cast<uint8_t>(fixed_x >> 8);
+            texel[1] = static_cast<uint8_t>(fixed_x & 0xff);
+            texel[2] = static_cast<uint8_t>(fixed_y >> 8);
+            texel[3] = static_cast<uint8_t>(fixed_y & 0xff);
+        }
+    }
+    return texels;
+}
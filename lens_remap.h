@@ -0,0 +1,60 @@
+#ifndef LIBCAMERA_MEME_LENS_REMAP_H
+#define LIBCAMERA_MEME_LENS_REMAP_H
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Pinhole camera matrix in pixels, as cv::calibrateCamera reports it. Calibrated at another resolution, scale all
+// four by the ratio of the sizes.
+struct CameraIntrinsics {
+    double fx;
+    double fy;
+    double cx;
+    double cy;
+};
+
+// OpenCV's radial and tangential model, the coefficients in cv::calibrateCamera's order
+struct LensDistortion {
+    double k1 = 0;
+    double k2 = 0;
+    double p1 = 0;
+    double p2 = 0;
+    double k3 = 0;
+};
+
+struct LensCalibration {
+    CameraIntrinsics intrinsics;
+    LensDistortion distortion;
+};
+
+// For every pixel of the corrected width x height image, where to sample the camera's, in pixels with their
+// centres on whole numbers. The same as the map1 and map2 cv::initUndistortRectifyMap makes with CV_32FC1, so those
+// can be copied straight in. Entries row by row.
+struct RemapTable {
+    int width;
+    int height;
+    std::vector<float> x;
+    std::vector<float> y;
+
+    // Interpolated between the four nearest entries, clamped to the table
+    [[nodiscard]] std::pair<float, float> at(double x, double y) const;
+};
+
+// Straightens the lens distortion out of a width x height image like cv::initUndistortRectifyMap without a
+// rectification. The corrected image uses output's camera matrix, or the camera's own if there's none.
+RemapTable undistort_remap(const LensCalibration &calibration, int width, int height,
+                           const std::optional<CameraIntrinsics> &output = std::nullopt);
+
+// A packed remap texel's x and y are fractions of the input scaled to REMAP_ONE, and an x of REMAP_OUTSIDE marks a
+// pixel that comes from off the input
+constexpr int REMAP_ONE = 65534;
+constexpr int REMAP_OUTSIDE = 65535;
+
+// The table as GlHsvThresholder's remap texture: one RGBA texel per output pixel with where the middle of the input
+// pixels it covers lands in the input, x and y high byte first. Scaled outputs interpolate the table between its
+// entries.
+std::vector<uint8_t> pack_remap(const RemapTable &table, int output_width, int output_height, int scale);
+
+#endif //LIBCAMERA_MEME_LENS_REMAP_H
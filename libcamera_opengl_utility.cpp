@@ -1,6 +1,7 @@
 #include "libcamera_opengl_utility.h"
 
 #include <EGL/eglext.h>
+#include <libcamera/control_ids.h>
 
 #include <stdexcept>
 
@@ -23,3 +24,65 @@ EGLint encodingFromColorspace(const libcamera::ColorSpace& colorSpace) {
         throw std::runtime_error("unknown color space encoding");
     }
 }
+
+std::array<HsvThresholder::DmaBufPlaneData, 3> planesFromFrameBuffer(const libcamera::FrameBuffer& buffer,
+                                                                     YuvFormat format, unsigned int stride,
+                                                                     int height) {
+    const auto &planes = buffer.planes();
+    if (planes.empty()) {
+        throw std::runtime_error("frame buffer has no planes");
+    }
+
+    std::array<HsvThresholder::DmaBufPlaneData, 3> plane_data{};
+    for (int i = 0; i < yuv_plane_count(format); i++) {
+        // Chroma rows of YUV420 are half as long, NV12 interleaves two half width rows into a full one
+        auto pitch = static_cast<EGLint>(format == YuvFormat::Yuv420 && i > 0 ? stride / 2 : stride);
+        if (static_cast<std::size_t>(i) < planes.size()) {
+            plane_data[i] = {planes[i].fd.get(), static_cast<EGLint>(planes[i].offset), pitch};
+        } else {
+            const auto &previous = plane_data[i - 1];
+            auto previous_rows = i == 1 ? height : (height + 1) / 2;
+            plane_data[i] = {previous.fd, previous.offset + previous.pitch * previous_rows, pitch};
+        }
+    }
+    return plane_data;
+}
+
+CaptureFormat captureFormatFromFrameBuffer(const libcamera::FrameBuffer& buffer, YuvFormat format,
+                                           unsigned int stride, int width, int height,
+                                           const libcamera::ColorSpace& colorSpace) {
+    CaptureFormat capture{};
+    capture.width = static_cast<std::uint32_t>(width);
+    capture.height = static_cast<std::uint32_t>(height);
+    capture.format = format;
+    capture.encoding = encodingFromColorspace(colorSpace);
+    capture.range = rangeFromColorspace(colorSpace);
+    capture.planes = planesFromFrameBuffer(buffer, format, stride, height);
+
+    for (const auto &plane: buffer.planes()) {
+        if (plane.fd.get() != buffer.planes().front().fd.get()) {
+            throw std::runtime_error("can't record frames spread over several dma-bufs");
+        }
+        // Same length CameraGrabber maps
+        capture.frame_bytes += plane.length;
+    }
+    for (auto &plane: capture.planes) {
+        plane.fd = -1;
+    }
+    return capture;
+}
+
+CaptureRecord captureRecordFromRequest(const libcamera::Request& request, const FrameTag& tag) {
+    const auto &metadata = request.metadata();
+    CaptureRecord record{};
+    record.sequence = tag.sequence;
+    record.sensor_timestamp = tag.sensor_timestamp;
+    record.exposure_time = metadata.get(libcamera::controls::ExposureTime).value_or(0);
+    record.analogue_gain = metadata.get(libcamera::controls::AnalogueGain).value_or(0.0f);
+    record.digital_gain = metadata.get(libcamera::controls::DigitalGain).value_or(0.0f);
+    if (auto gains = metadata.get(libcamera::controls::ColourGains)) {
+        record.colour_gains = {(*gains)[0], (*gains)[1]};
+    }
+    record.frame_duration = metadata.get(libcamera::controls::FrameDuration).value_or(0);
+    return record;
+}
@@ -1,10 +1,31 @@
 #ifndef LIBCAMERA_MEME_LIBCAMERA_OPENGL_UTILITY_H
 #define LIBCAMERA_MEME_LIBCAMERA_OPENGL_UTILITY_H
 
+#include <array>
+
 #include <libcamera/color_space.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
 #include <EGL/egl.h>
 
+#include "capture_file.h"
+#include "hsv_thresholder.h"
+
 EGLint rangeFromColorspace(const libcamera::ColorSpace& colorSpace);
 EGLint encodingFromColorspace(const libcamera::ColorSpace& colorSpace);
 
+// The thresholder's view of a camera buffer. stride is the luma pitch from the StreamConfiguration. Planes that
+// libcamera folds into the one before them get their offset from the size of that plane.
+std::array<HsvThresholder::DmaBufPlaneData, 3> planesFromFrameBuffer(const libcamera::FrameBuffer& buffer,
+                                                                     YuvFormat format, unsigned int stride,
+                                                                     int height);
+
+// How CameraGrabber::readBuffer's view of this buffer is recorded. The planes have to share one dma-buf, as their
+// offsets are into it.
+CaptureFormat captureFormatFromFrameBuffer(const libcamera::FrameBuffer& buffer, YuvFormat format,
+                                           unsigned int stride, int width, int height,
+                                           const libcamera::ColorSpace& colorSpace);
+// The tag's sequence and sensor timestamp, plus whichever controls the pipeline reported for the request
+CaptureRecord captureRecordFromRequest(const libcamera::Request& request, const FrameTag& tag);
+
 #endif //LIBCAMERA_MEME_LIBCAMERA_OPENGL_UTILITY_H
@@ -3,127 +3,454 @@
 
 #include <thread>
 #include <chrono>
+#include <cstdlib>
+#include <future>
 #include <iostream>
-#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
-#include <sys/mman.h>
 
+#include "bit_mask.h"
+#include "capture_file.h"
 #include "dma_buf_alloc.h"
-#include "gl_hsv_thresholder.h"
+#include "dma_buf_pool.h"
+#include "frame_scheduler.h"
+#include "frame_trace.h"
 #include "camera_grabber.h"
+#include "gl_context.h"
+#include "gl_mask_reducer.h"
+#include "hsv_histogram.h"
+#include "hsv_thresholder.h"
+#include "lens_remap.h"
 #include "libcamera_opengl_utility.h"
-#include "concurrent_blocking_queue.h"
+#include "mask_stats.h"
+#include "pixel_deinterleave.h"
+#include "ring_queue.h"
+#include "roi_tracker.h"
+#include "thread_pool.h"
 
-int main() {
-    constexpr int width = 1920, height = 1080;
-    auto allocer = DmaBufAlloc("/dev/dma_heap/linux,cma");
+// $XDG_CACHE_HOME/libcamera_meme, or the same under ~/.cache. Empty if neither is set.
+static std::string program_cache_dir() {
+    if (auto cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+        return std::string(cache) + "/libcamera_meme";
+    }
+    if (auto home = std::getenv("HOME"); home && *home) {
+        return std::string(home) + "/.cache/libcamera_meme";
+    }
+    return {};
+}
 
-    auto camera_manager = std::make_unique<libcamera::CameraManager>();
-    camera_manager->start();
+// Planar output lets the display thread wrap the GPU's buffers in cv::Mats directly instead of deinterleaving.
+// BitPacked reads back an eighth of the mask, but has no tile stats, so there are no blobs to track.
+constexpr HsvThresholder::OutputMode output_mode = HsvThresholder::OutputMode::Planar;
+constexpr bool planar_output = output_mode != HsvThresholder::OutputMode::Packed;
+constexpr bool stats_output = output_mode != HsvThresholder::OutputMode::BitPacked;
+// Thresholds only a window around the last blob while one is in view, see RoiTracker
+constexpr bool track_roi = true;
 
-    auto cameras = camera_manager->cameras();
-    if (cameras.size() != 1) {
-        throw std::runtime_error("code expects only one camera present");
+// Per camera, in the camera manager's order. Cameras past the end of the list get the last entry.
+struct CameraSetup {
+    int width;
+    int height;
+    // Short exposures at a high frame rate while tracking, a brighter, steadier picture for the rest of the match.
+    // Switched between at runtime, the stream keeps running.
+    CameraGrabber::Controls tracking;
+    CameraGrabber::Controls quality;
+    // From cv::calibrateCamera at this resolution. The GL backend then thresholds the straightened picture, so
+    // blob positions and sizes don't need undistorting afterwards.
+    std::optional<LensCalibration> lens = std::nullopt;
+    // Where the target is held up while tuning, in pixels. The GL backend then counts a histogram of it and the
+    // display thread prints the range it suggests every second.
+    std::optional<HsvThresholder::Roi> tune_region = std::nullopt;
+};
+
+constexpr CameraSetup CAMERA_SETUPS[] = {
+        {1920, 1080, {8333, 1}, {33333, 20000}},
+};
+
+// Everything one camera needs, from the grabber to its display thread. Cameras only share the submission thread
+// and, on the GL backend, its context.
+struct CameraPipeline {
+    CameraPipeline(std::shared_ptr<libcamera::Camera> camera, const CameraSetup &setup, DmaBufAlloc &allocer,
+                   std::size_t trace_capacity);
+
+    int width;
+    int height;
+    CameraSetup setup;
+    FrameTracer tracer;
+    // Created before the camera starts, from the layout of its buffers, so the first frame doesn't wait for the
+    // file to be set up. Declared before the grabber so it outlives the camera thread that records into it.
+    std::unique_ptr<CaptureRecorder> recorder;
+    std::unique_ptr<CameraGrabber> grabber;
+    unsigned int stride;
+    YuvFormat format;
+    libcamera::ColorSpace colorspace;
+
+    HsvThresholder::OutputConfig output_config;
+    std::unique_ptr<DmaBufPool> output_pool;
+    // Created, fed and destroyed on the submission thread
+    std::unique_ptr<HsvThresholder> thresholder;
+    std::unique_ptr<RingQueue<HsvThresholder::OutputFrame>> output_queue;
+    std::thread display;
+
+    // Where the display thread's tracker wants the next frames' window. Handed over to the submission thread,
+    // the only one that may touch the thresholder.
+    std::mutex roi_mutex;
+    std::optional<std::optional<HsvThresholder::Roi>> tracked_roi;
+};
+
+// Blobs feed a control loop, so only the newest frame of each camera is thresholded and stale ones go straight
+// back to the camera. Four buffers leave one for the sensor while the scheduler and the thresholder each hold one.
+constexpr unsigned int camera_buffers = 4;
+// Enough for three frames in flight up front, and room to grow to twice that if the display thread holds on to
+// frames for longer
+constexpr std::size_t pipeline_depth = 3;
+
+CameraPipeline::CameraPipeline(std::shared_ptr<libcamera::Camera> camera, const CameraSetup &setup,
+                               DmaBufAlloc &allocer, std::size_t trace_capacity)
+        : width(setup.width), height(setup.height), setup(setup), tracer(trace_capacity),
+          // The smallest readout that covers the stream runs the sensor fastest
+          grabber(std::make_unique<CameraGrabber>(camera, setup.width, setup.height,
+                                                  camera_buffers,
+                                                  pick_sensor_mode(CameraGrabber::sensorModes(*camera), setup.width,
+                                                                   setup.height),
+                                                  setup.tracking)),
+          stride(grabber->streamConfiguration().stride), format(grabber->yuvFormat()),
+          colorspace(grabber->streamConfiguration().colorSpace.value()) {
+    // One texture fetch per pixel instead of rgb2hsv, the CPU backend ignores it
+    output_config.lut_size = 64;
+    output_config.stats = stats_output;
+    // Prints per-pass GPU times every few hundred frames where the driver supports timer queries
+    output_config.gpu_timing = true;
+    // Restarts load the linked shaders instead of compiling them again
+    output_config.program_binary_dir = program_cache_dir();
+    if (planar_output) {
+        output_config.mode = output_mode;
+        output_config.color = true;
     }
 
-    auto camera = cameras[0];
-    auto grabber = CameraGrabber(std::move(camera), width, height);
-    unsigned int stride = grabber.streamConfiguration().stride;
+    // Plus the histogram the GL backend collects for a tune region, reserved once the backend is known
+    const std::size_t buffers_per_frame = (planar_output ? 2 : 1) + (stats_output ? 1 : 0) + (setup.tune_region ? 1 : 0);
+    output_pool = std::make_unique<DmaBufPool>(allocer, pipeline_depth * 2 * buffers_per_frame);
+    output_pool->reserve(HsvThresholder::target_buffer_size(output_config, width, height), pipeline_depth);
+    if (planar_output) {
+        output_pool->reserve(HsvThresholder::color_buffer_size(output_config, width, height), pipeline_depth);
+    }
+    if (stats_output) {
+        output_pool->reserve(HsvThresholder::stats_buffer_size(output_config, width, height), pipeline_depth);
+    }
+    output_queue = std::make_unique<RingQueue<HsvThresholder::OutputFrame>>(output_pool->maxBuffers());
+}
 
-    auto camera_queue = ConcurrentBlockingQueue<libcamera::Request *>();
-    grabber.setOnData([&](libcamera::Request *request) {
-        camera_queue.push(request);
-    });
+// Runs on the submission thread
+static void threshold_request(CameraPipeline &camera, libcamera::Request *request) {
+    auto tag = camera.grabber->frameTag(request);
+    auto taken = FrameTracer::now();
+    camera.tracer.record(TraceStage::Exposure, tag, tag.sensor_timestamp, tag.handoff);
+    camera.tracer.record(TraceStage::CameraQueue, tag, tag.handoff, taken);
+    auto buffer = request->buffers().at(camera.grabber->streamConfiguration().stream());
+    auto yuv_data = planesFromFrameBuffer(*buffer, camera.format, camera.stride, camera.height);
+    {
+        std::scoped_lock lock(camera.roi_mutex);
+        if (camera.tracked_roi) {
+            camera.thresholder->setRoi(*camera.tracked_roi);
+            camera.tracked_roi.reset();
+        }
+    }
 
-    std::vector<int> fds {
-            allocer.alloc_buf(width * height * 4),
-            allocer.alloc_buf(width * height * 4),
-            allocer.alloc_buf(width * height * 4)
-    };
+    camera.thresholder->testFrame(yuv_data, encodingFromColorspace(camera.colorspace),
+                                  rangeFromColorspace(camera.colorspace), [&camera, request]() {
+        camera.grabber->requeueRequest(request);
+    }, tag);
+}
 
-    std::thread threshold([&]() {
-        auto colorspace = grabber.streamConfiguration().colorSpace.value();
-        auto thresholder = GlHsvThresholder(width, height, fds);
+static void display_frames(CameraPipeline &camera) {
+    const int width = camera.width, height = camera.height;
+    const auto &config = camera.output_config;
+    // The whole frame's mask and color buffers, a frame's window only fills their top left
+    const int mask_width = HsvThresholder::output_size(config, width);
+    const int mask_height = HsvThresholder::output_size(config, height);
+    const int color_width = config.color_width > 0 ? config.color_width : mask_width;
+    const int color_height = config.color_height > 0 ? config.color_height : mask_height;
+    RoiTracker tracker(width, height, {});
+    HsvHistogram tune_histogram;
+    auto tune_printed = std::chrono::steady_clock::now();
+    // Reused so the bit packed path doesn't allocate once it has seen its busiest frame
+    std::vector<MaskRun> mask_runs;
 
-        auto gpu_queue = ConcurrentBlockingQueue<int>();
-        thresholder.setOnComplete([&](int fd) {
-            gpu_queue.push(fd);
-        });
+    cv::Mat threshold_mat(height, width, CV_8UC1);
+    unsigned char *threshold_out_buf = threshold_mat.data;
+    cv::Mat color_mat(height, width, CV_8UC3);
+    unsigned char *color_out_buf = color_mat.data;
 
-        std::thread display([&]() {
-            std::unordered_map<int, unsigned char *> mmaped;
+    ThreadPool pool;
 
-            for (auto fd: fds) {
-                auto mmap_ptr = mmap(nullptr, width * height * 4, PROT_READ, MAP_SHARED, fd, 0);
-                if (mmap_ptr == MAP_FAILED) {
-                    throw std::runtime_error("failed to mmap pointer");
-                }
-                mmaped.emplace(fd, static_cast<unsigned char *>(mmap_ptr));
+    while (auto next = camera.output_queue->pop()) {
+        // The pool keeps every buffer mapped, and they go back to it when frame goes out of scope
+        auto frame = std::move(*next);
+        auto popped = FrameTracer::now();
+        camera.tracer.record(TraceStage::OutputQueue, frame.tag, frame.tag.handoff, popped);
+        auto input_ptr = frame.target.data();
+
+        ScopedDmaBufSync target_sync(frame.target.fd(), DmaBufAccess::Read);
+        std::optional<ScopedDmaBufSync> stats_sync, color_sync;
+        if (frame.stats) {
+            stats_sync.emplace(frame.stats->fd(), DmaBufAccess::Read);
+        }
+        if (frame.color) {
+            color_sync.emplace(frame.color->fd(), DmaBufAccess::Read);
+        }
+
+        const auto &roi = frame.roi;
+        std::vector<BlobMoments> blobs;
+        if (frame.stats) {
+            blobs = find_blobs(frame.stats->data(), GlMaskReducer::tileCount(mask_width),
+                               GlMaskReducer::tileCount(mask_height), GlMaskReducer::TILE_SIZE, 64);
+        }
+        for (const auto &blob: blobs) {
+            std::cout << "blob at " << roi.x + blob.centroidX() * config.scale << ", "
+                      << roi.y + blob.centroidY() * config.scale << " angle " << blob.orientation() << std::endl;
+        }
+        if (track_roi && frame.stats) {
+            auto previous = tracker.roi();
+            auto next_roi = tracker.update(blobs, roi, config.scale);
+            if (next_roi != previous) {
+                std::scoped_lock lock(camera.roi_mutex);
+                camera.tracked_roi = next_roi;
             }
+        }
 
-            cv::Mat threshold_mat(height, width, CV_8UC1);
-            unsigned char *threshold_out_buf = threshold_mat.data;
-            cv::Mat color_mat(height, width, CV_8UC3);
-            unsigned char *color_out_buf = color_mat.data;
+        int roi_mask_width = HsvThresholder::output_size(config, roi.width);
+        int roi_mask_height = HsvThresholder::output_size(config, roi.height);
+        if (output_mode == HsvThresholder::OutputMode::BitPacked) {
+            // Straight from the mapped buffer, the rows are as long as the whole frame's
+            auto stride_words = static_cast<std::size_t>(HsvThresholder::bit_packed_row_words(mask_width));
+            auto pixels = count_mask_pixels(input_ptr, stride_words, roi_mask_width, roi_mask_height);
+            mask_runs.clear();
+            extract_mask_runs(input_ptr, stride_words, roi_mask_width, roi_mask_height, mask_runs);
+            std::cout << pixels << " pixels in " << mask_runs.size() << " runs" << std::endl;
+        } else if (planar_output) {
+            // Zero copy, the mats alias the GPU output until the buffer is returned
+            cv::Mat planar_threshold_mat(roi_mask_height, roi_mask_width, CV_8UC1, input_ptr, mask_width);
+            cv::Mat planar_color_mat((roi.height * color_height + height - 1) / height,
+                                     (roi.width * color_width + width - 1) / width, CV_8UC4, frame.color->data(),
+                                     color_width * 4);
 
-            while (true) {
-                auto fd = gpu_queue.pop();
-                if (fd == -1) {
-                    break;
-                }
+            std::cout << reinterpret_cast<uint64_t>(planar_threshold_mat.data) << " " << reinterpret_cast<uint64_t>(planar_color_mat.data) << std::endl;
+        } else {
+            deinterleave_color_mask(input_ptr, mask_width * 4, color_out_buf, width * 3, threshold_out_buf, width,
+                                    roi_mask_width, roi_mask_height, &pool);
 
-                auto input_ptr = mmaped.at(fd);
-                int bound = width * height;
+            // pls don't optimize these writes out compiler
+            std::cout << reinterpret_cast<uint64_t>(threshold_out_buf) << " " << reinterpret_cast<uint64_t>(color_out_buf) << std::endl;
+        }
 
-                for (int i = 0; i < bound; i++) {
-                    std::memcpy(color_out_buf + i * 3, input_ptr + i * 4, 3);
-                    threshold_out_buf[i] = input_ptr[i * 4 + 3];
+        if (frame.histogram) {
+            ScopedDmaBufSync histogram_sync(frame.histogram->fd(), DmaBufAccess::Read);
+            tune_histogram += read_hsv_histogram(frame.histogram->data());
+            if (std::chrono::steady_clock::now() - tune_printed >= std::chrono::seconds(1)) {
+                if (auto range = suggest_hsv_range(tune_histogram)) {
+                    std::cout << "suggested range h " << range->lower[0] << "-" << range->upper[0] << " s "
+                              << range->lower[1] << "-" << range->upper[1] << " v " << range->lower[2] << "-"
+                              << range->upper[2] << std::endl;
                 }
+                tune_histogram = {};
+                tune_printed = std::chrono::steady_clock::now();
+            }
+        }
+
+        // cv::imshow("cam", mat);
+        // cv::waitKey(3);
+
+        auto done = FrameTracer::now();
+        camera.tracer.record(TraceStage::Readback, frame.tag, popped, done);
+        camera.tracer.record(TraceStage::Total, frame.tag, frame.tag.sensor_timestamp, done);
+    }
+}
+
+// With more than one camera each gets its own file, with the camera's index appended
+static std::string camera_path(const std::string &path, std::size_t index, std::size_t cameras) {
+    return cameras == 1 ? path : path + "." + std::to_string(index);
+}
+
+int main(int argc, char **argv) {
+    // "cpu" thresholds without touching the GPU, for machines without a usable GLES driver
+    auto backend = argc > 1 ? thresholder_backend_from_name(argv[1]) : ThresholderBackend::Gl;
+    // The output heap, e.g. "system" or a cached CMA heap. CMA is usually mapped uncached, which makes the display
+    // thread's reads slow; the syncs below keep cached heaps coherent.
+    auto allocer = DmaBufAlloc(argc > 2 ? argv[2] : "linux,cma");
+    // Where to dump a Chrome trace of the last frames' stages, histograms are printed either way
+    std::optional<std::string> trace_path;
+    if (argc > 3) {
+        trace_path = argv[3];
+    }
+    // Where to record the raw camera frames for replaying them later, e.g. through libcamera_meme_bench
+    std::optional<std::string> capture_path;
+    if (argc > 4) {
+        capture_path = argv[4];
+    }
+
+    auto camera_manager = std::make_unique<libcamera::CameraManager>();
+    camera_manager->start();
 
-                // pls don't optimize these writes out compiler
-                std::cout << reinterpret_cast<uint64_t>(threshold_out_buf) << " " << reinterpret_cast<uint64_t>(color_out_buf) << std::endl;
+    auto cameras = camera_manager->cameras();
+    if (cameras.empty()) {
+        throw std::runtime_error("no cameras present");
+    }
 
-                thresholder.returnBuffer(fd);
-                // cv::imshow("cam", mat);
-                // cv::waitKey(3);
+    // Every camera's frames go through one thread, which owns the only GL context. Declared before the pipelines
+    // so it outlives the cameras that submit to it.
+    FrameScheduler scheduler(cameras.size());
+    std::vector<std::unique_ptr<CameraPipeline>> pipelines;
+    for (std::size_t i = 0; i < cameras.size(); i++) {
+        const auto &setup = CAMERA_SETUPS[std::min(i, std::size(CAMERA_SETUPS) - 1)];
+        pipelines.push_back(std::make_unique<CameraPipeline>(cameras[i], setup, allocer, trace_path ? 1 << 16 : 0));
+    }
+
+    for (std::size_t i = 0; i < pipelines.size(); i++) {
+        auto &camera = *pipelines[i];
+        // The first five seconds at 120 fps. Room for all of them is allocated up front, and the file is trimmed
+        // to what was actually recorded.
+        constexpr std::size_t capture_frames = 5 * 120;
+        if (capture_path) {
+            // Every buffer of the stream has the same layout
+            auto capture_format = captureFormatFromFrameBuffer(*camera.grabber->buffers().front(), camera.format,
+                                                               camera.stride, camera.width, camera.height,
+                                                               camera.colorspace);
+            camera.recorder = std::make_unique<CaptureRecorder>(camera_path(*capture_path, i, pipelines.size()),
+                                                                capture_format, capture_frames);
+        }
+
+        camera.grabber->setOnData([&, i](libcamera::Request *request) {
+            if (camera.recorder) {
+                auto buffer = request->buffers().at(camera.grabber->streamConfiguration().stream());
+                auto mapped = camera.grabber->readBuffer(*buffer);
+                camera.recorder->record(reinterpret_cast<const uint8_t *>(mapped.data),
+                                        captureRecordFromRequest(*request, camera.grabber->frameTag(request)));
             }
+
+            scheduler.submit(i, [&camera, request]() {
+                threshold_request(camera, request);
+            }, [&camera, request]() {
+                camera.grabber->requeueRequest(request);
+            });
         });
+    }
 
-        while (true) {
-            auto request = camera_queue.pop();
+    std::promise<void> ready;
+    std::thread submission([&]() {
+        std::shared_ptr<GlContext> gl_context;
+        if (backend == ThresholderBackend::Gl) {
+            gl_context = std::make_shared<GlContext>();
+        }
 
-            if (!request) {
-                break;
+        for (auto &pipeline: pipelines) {
+            auto &camera = *pipeline;
+            if (backend == ThresholderBackend::Gl) {
+                // Drops speckle a few pixels across before the mask is read back, rather than eroding on the CPU
+                camera.output_config.morphology = {{HsvThresholder::MorphologyOp::Open, 1}};
+                if (camera.setup.lens) {
+                    camera.output_config.remap = std::make_shared<const RemapTable>(
+                            undistort_remap(*camera.setup.lens, camera.width, camera.height));
+                }
+                if (camera.setup.tune_region) {
+                    camera.output_config.histogram = true;
+                    camera.output_config.histogram_region = camera.setup.tune_region;
+                    camera.output_pool->reserve(HSV_HISTOGRAM_BUFFER_SIZE, pipeline_depth);
+                }
             }
+            camera.thresholder = make_hsv_thresholder(backend, camera.width, camera.height, camera.format,
+                                                      *camera.output_pool, camera.output_config, true,
+                                                      EglPlatform::Default, gl_context);
+            camera.thresholder->setTracer(&camera.tracer);
+            camera.thresholder->setOnComplete([&camera](HsvThresholder::OutputFrame frame) {
+                camera.output_queue->push(std::move(frame));
+            });
+            camera.grabber->setOnBufferReleased([&camera](int fd) {
+                camera.thresholder->evictImports(fd);
+            });
+            camera.display = std::thread([&camera]() {
+                display_frames(camera);
+            });
+        }
+        ready.set_value();
 
-            auto planes = request->buffers().at(grabber.streamConfiguration().stream())->planes();
-
-            std::array<GlHsvThresholder::DmaBufPlaneData, 3> yuv_data {{
-             {planes[0].fd.get(),
-              static_cast<EGLint>(planes[0].offset),
-              static_cast<EGLint>(stride)},
-             {planes[1].fd.get(),
-              static_cast<EGLint>(planes[1].offset),
-              static_cast<EGLint>(stride / 2)},
-             {planes[2].fd.get(),
-              static_cast<EGLint>(planes[2].offset),
-              static_cast<EGLint>(stride / 2)},
-             }};
+        scheduler.run();
 
-            thresholder.testFrame(yuv_data, encodingFromColorspace(colorspace), rangeFromColorspace(colorspace));
-            grabber.requeueRequest(request);
+        // Finishes the frames still in flight before the display threads are told there are no more
+        for (auto &pipeline: pipelines) {
+            auto &camera = *pipeline;
+            camera.grabber->resetOnBufferReleased();
+            camera.thresholder.reset();
+            camera.output_queue->close();
+            camera.display.join();
         }
     });
+    ready.get_future().wait();
 
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    for (auto &camera: pipelines) {
+        camera->grabber->startAndQueue();
+    }
 
-    grabber.startAndQueue();
+    for (std::size_t i = 0; i < pipelines.size(); i++) {
+        if (auto limits = pipelines[i]->grabber->frameDurationLimits()) {
+            std::cout << "camera " << i << " frame duration " << limits->first << "-" << limits->second << " us"
+                      << std::endl;
+        }
+    }
 
-    for (int i = 0; i < 10; i++) {
+    // Halfway through, as if the match moved on to a phase where the picture matters more than latency
+    std::vector<std::uint64_t> quality_generation(pipelines.size());
+    for (int second = 0; second < 10; second++) {
+        if (second == 5) {
+            for (std::size_t i = 0; i < pipelines.size(); i++) {
+                quality_generation[i] = pipelines[i]->grabber->setControls(pipelines[i]->setup.quality);
+            }
+        }
         std::cout << "Waiting for 1 second" << std::endl;
         std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        for (std::size_t i = 0; i < pipelines.size(); i++) {
+            auto applied = pipelines[i]->grabber->latestApplied();
+            if (!applied) {
+                continue;
+            }
+            std::cout << "camera " << i << " frame " << applied->sequence << ": frame duration "
+                      << applied->frame_duration_us.value_or(0) << " us, exposure "
+                      << applied->exposure_us.value_or(0) << " us, "
+                      << (quality_generation[i] && applied->generation >= quality_generation[i] ? "quality"
+                                                                                                : "tracking")
+                      << " controls sent" << std::endl;
+        }
+    }
+
+    scheduler.close();
+    submission.join();
+
+    for (std::size_t i = 0; i < pipelines.size(); i++) {
+        auto &camera = *pipelines[i];
+        std::cout << "camera " << i << std::endl;
+        camera.tracer.printSummary(std::cout);
+        if (trace_path) {
+            camera.tracer.writeChromeTrace(camera_path(*trace_path, i, pipelines.size()));
+        }
+
+        auto delivery = camera.grabber->deliveryStats();
+        auto scheduled = scheduler.stats(i);
+        std::cout << delivery.delivered << " frames delivered, " << scheduled.run << " thresholded, "
+                  << scheduled.replaced << " replaced unclaimed, " << delivery.skipped << " skipped by the sensor"
+                  << std::endl;
+        if (camera.recorder) {
+            auto capture = camera.recorder->stats();
+            std::cout << capture.recorded << " frames recorded to "
+                      << camera_path(*capture_path, i, pipelines.size()) << ", " << capture.dropped << " dropped"
+                      << std::endl;
+        }
     }
 
     return 0;
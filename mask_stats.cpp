@@ -0,0 +1,167 @@
+#include "mask_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void tile_stats_from_mask(const uint8_t *mask, std::size_t mask_stride, int width, int rows, TileStats *tiles) {
+    int tiles_x = stats_tile_count(width);
+    rows = std::min(rows, STATS_TILE_SIZE);
+
+    for (int tile_x = 0; tile_x < tiles_x; tile_x++) {
+        int origin = tile_x * STATS_TILE_SIZE;
+        int columns = std::min(STATS_TILE_SIZE, width - origin);
+
+        // Same integer sums the reduction shader builds, none of them can overflow 16 bits
+        unsigned int n = 0, sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+        int lo_x = STATS_TILE_SIZE - 1, lo_y = STATS_TILE_SIZE - 1, hi_x = 0, hi_y = 0;
+        for (int j = 0; j < rows; j++) {
+            const uint8_t *row = mask + j * mask_stride + origin;
+            for (int i = 0; i < columns; i++) {
+                if (row[i]) {
+                    n++;
+                    sx += i;
+                    sy += j;
+                    sxx += i * i;
+                    syy += j * j;
+                    sxy += i * j;
+                    lo_x = std::min(lo_x, i);
+                    hi_x = std::max(hi_x, i);
+                    lo_y = std::min(lo_y, j);
+                    hi_y = std::max(hi_y, j);
+                }
+            }
+        }
+
+        TileStats tile{};
+        tile.count = n;
+        tile.sum_x = sx;
+        tile.sum_y = sy;
+        tile.sum_xx = sxx;
+        tile.sum_yy = syy;
+        tile.sum_xy = sxy;
+        if (n > 0) {
+            tile.x_extent = lo_x | (hi_x << 4);
+            tile.y_extent = lo_y | (hi_y << 4);
+        }
+        tiles[tile_x] = tile;
+    }
+}
+
+void BlobMoments::add(const TileStats &tile, int origin_x, int origin_y) {
+    if (tile.count == 0) {
+        return;
+    }
+
+    double n = tile.count;
+    double ox = origin_x, oy = origin_y;
+    int tile_min_x = origin_x + (tile.x_extent & 0xF), tile_max_x = origin_x + (tile.x_extent >> 4);
+    int tile_min_y = origin_y + (tile.y_extent & 0xF), tile_max_y = origin_y + (tile.y_extent >> 4);
+
+    if (count == 0) {
+        min_x = tile_min_x;
+        max_x = tile_max_x;
+        min_y = tile_min_y;
+        max_y = tile_max_y;
+    } else {
+        min_x = std::min(min_x, tile_min_x);
+        max_x = std::max(max_x, tile_max_x);
+        min_y = std::min(min_y, tile_min_y);
+        max_y = std::max(max_y, tile_max_y);
+    }
+
+    // Shift the tile local sums by the tile origin
+    count += n;
+    sum_x += n * ox + tile.sum_x;
+    sum_y += n * oy + tile.sum_y;
+    sum_xx += n * ox * ox + 2 * ox * tile.sum_x + tile.sum_xx;
+    sum_yy += n * oy * oy + 2 * oy * tile.sum_y + tile.sum_yy;
+    sum_xy += n * ox * oy + ox * tile.sum_y + oy * tile.sum_x + tile.sum_xy;
+}
+
+void BlobMoments::merge(const BlobMoments &other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (count == 0) {
+        *this = other;
+        return;
+    }
+
+    count += other.count;
+    sum_x += other.sum_x;
+    sum_y += other.sum_y;
+    sum_xx += other.sum_xx;
+    sum_yy += other.sum_yy;
+    sum_xy += other.sum_xy;
+    min_x = std::min(min_x, other.min_x);
+    max_x = std::max(max_x, other.max_x);
+    min_y = std::min(min_y, other.min_y);
+    max_y = std::max(max_y, other.max_y);
+}
+
+double BlobMoments::centroidX() const {
+    return count > 0 ? sum_x / count : 0;
+}
+
+double BlobMoments::centroidY() const {
+    return count > 0 ? sum_y / count : 0;
+}
+
+double BlobMoments::orientation() const {
+    if (count == 0) {
+        return 0;
+    }
+    double cx = centroidX(), cy = centroidY();
+    double mu20 = sum_xx / count - cx * cx;
+    double mu02 = sum_yy / count - cy * cy;
+    double mu11 = sum_xy / count - cx * cy;
+    return 0.5 * std::atan2(2 * mu11, mu20 - mu02);
+}
+
+std::vector<BlobMoments> find_blobs(const uint8_t *stats, int tiles_x, int tiles_y, int tile_size, double min_pixels) {
+    auto tile_at = [&](int tx, int ty) {
+        TileStats tile;
+        std::memcpy(&tile, stats + (static_cast<std::size_t>(ty) * tiles_x + tx) * sizeof(TileStats), sizeof(tile));
+        return tile;
+    };
+
+    std::vector<BlobMoments> blobs;
+    std::vector<char> visited(static_cast<std::size_t>(tiles_x) * tiles_y, 0);
+    std::vector<std::pair<int, int>> stack;
+
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            if (visited[ty * tiles_x + tx] || tile_at(tx, ty).count == 0) {
+                continue;
+            }
+
+            BlobMoments blob;
+            visited[ty * tiles_x + tx] = 1;
+            stack.emplace_back(tx, ty);
+            while (!stack.empty()) {
+                auto [x, y] = stack.back();
+                stack.pop_back();
+                blob.add(tile_at(x, y), x * tile_size, y * tile_size);
+
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx < 0 || ny < 0 || nx >= tiles_x || ny >= tiles_y || visited[ny * tiles_x + nx]) {
+                            continue;
+                        }
+                        if (tile_at(nx, ny).count > 0) {
+                            visited[ny * tiles_x + nx] = 1;
+                            stack.emplace_back(nx, ny);
+                        }
+                    }
+                }
+            }
+
+            if (blob.count >= min_pixels) {
+                blobs.push_back(blob);
+            }
+        }
+    }
+    return blobs;
+}
@@ -0,0 +1,61 @@
+#ifndef LIBCAMERA_MEME_MASK_STATS_H
+#define LIBCAMERA_MEME_MASK_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// TileStats cover square tiles of this size, the extents only have a nibble per coordinate
+constexpr int STATS_TILE_SIZE = 16;
+
+// One tile's worth of mask moments as written by GlMaskReducer. Coordinates are relative to the tile's
+// top left corner, all fields little endian.
+struct TileStats {
+    uint16_t count;
+    uint16_t sum_x;
+    uint16_t sum_y;
+    uint16_t sum_xx;
+    uint16_t sum_yy;
+    uint16_t sum_xy;
+    uint8_t x_extent; // min x in the low nibble, max x in the high nibble
+    uint8_t y_extent;
+    uint8_t reserved[2];
+};
+static_assert(sizeof(TileStats) == 16, "TileStats has to match the GPU layout");
+
+constexpr int stats_tile_count(int pixels) {
+    return (pixels + STATS_TILE_SIZE - 1) / STATS_TILE_SIZE;
+}
+
+// CPU version of GlMaskReducer for one row of tiles: reads up to STATS_TILE_SIZE rows of an 8 bit mask where any
+// non-zero byte is set, and writes stats_tile_count(width) records
+void tile_stats_from_mask(const uint8_t *mask, std::size_t mask_stride, int width, int rows, TileStats *tiles);
+
+// Raw moments of a set of mask pixels in image coordinates
+struct BlobMoments {
+    double count = 0;
+    double sum_x = 0;
+    double sum_y = 0;
+    double sum_xx = 0;
+    double sum_yy = 0;
+    double sum_xy = 0;
+    int min_x = 0;
+    int max_x = 0;
+    int min_y = 0;
+    int max_y = 0;
+
+    void add(const TileStats &tile, int origin_x, int origin_y);
+    void merge(const BlobMoments &other);
+
+    [[nodiscard]] double centroidX() const;
+    [[nodiscard]] double centroidY() const;
+    // Angle of the major axis in radians, measured from the x axis towards +y
+    [[nodiscard]] double orientation() const;
+};
+
+// Groups tiles with at least one mask pixel into 8-connected blobs. Two targets closer than a tile apart end
+// up in the same blob.
+std::vector<BlobMoments> find_blobs(const uint8_t *stats, int tiles_x, int tiles_y, int tile_size,
+                                    double min_pixels = 1);
+
+#endif //LIBCAMERA_MEME_MASK_STATS_H
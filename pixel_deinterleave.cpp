@@ -0,0 +1,200 @@
+#include "pixel_deinterleave.h"
+
+#include "thread_pool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIBCAMERA_MEME_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LIBCAMERA_MEME_NEON 1
+#endif
+
+static void deinterleave_scalar(const uint8_t *src, uint8_t *color, uint8_t *mask, std::size_t pixels) {
+    for (std::size_t i = 0; i < pixels; i++) {
+        color[i * 3] = src[i * 4];
+        color[i * 3 + 1] = src[i * 4 + 1];
+        color[i * 3 + 2] = src[i * 4 + 2];
+        mask[i] = src[i * 4 + 3];
+    }
+}
+
+#ifdef LIBCAMERA_MEME_X86
+// SSE2 has no byte shuffle, so the color half needs SSSE3's pshufb. The mask half is plain SSE2.
+__attribute__((target("ssse3")))
+static void deinterleave_ssse3(const uint8_t *src, uint8_t *color, uint8_t *mask, std::size_t pixels) {
+    const __m128i color_shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    std::size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        auto in = reinterpret_cast<const __m128i *>(src + i * 4);
+        __m128i p0 = _mm_loadu_si128(in);
+        __m128i p1 = _mm_loadu_si128(in + 1);
+        __m128i p2 = _mm_loadu_si128(in + 2);
+        __m128i p3 = _mm_loadu_si128(in + 3);
+
+        // Each shuffle leaves 12 color bytes at the bottom, stitch the four of them into three full registers
+        __m128i c0 = _mm_shuffle_epi8(p0, color_shuffle);
+        __m128i c1 = _mm_shuffle_epi8(p1, color_shuffle);
+        __m128i c2 = _mm_shuffle_epi8(p2, color_shuffle);
+        __m128i c3 = _mm_shuffle_epi8(p3, color_shuffle);
+        auto out = reinterpret_cast<__m128i *>(color + i * 3);
+        _mm_storeu_si128(out, _mm_or_si128(c0, _mm_slli_si128(c1, 12)));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8)));
+        _mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4)));
+
+        __m128i m01 = _mm_packs_epi32(_mm_srli_epi32(p0, 24), _mm_srli_epi32(p1, 24));
+        __m128i m23 = _mm_packs_epi32(_mm_srli_epi32(p2, 24), _mm_srli_epi32(p3, 24));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(mask + i), _mm_packus_epi16(m01, m23));
+    }
+
+    deinterleave_scalar(src + i * 4, color + i * 3, mask + i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_avx2(const uint8_t *src, uint8_t *color, uint8_t *mask, std::size_t pixels) {
+    const __m256i color_shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                   0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    // pshufb works per 128 bit lane, this pulls both lanes' 12 bytes together
+    const __m256i color_compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    const __m256i mask_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    std::size_t i = 0;
+    for (; i + 32 <= pixels; i += 32) {
+        auto in = reinterpret_cast<const __m256i *>(src + i * 4);
+        __m256i p0 = _mm256_loadu_si256(in);
+        __m256i p1 = _mm256_loadu_si256(in + 1);
+        __m256i p2 = _mm256_loadu_si256(in + 2);
+        __m256i p3 = _mm256_loadu_si256(in + 3);
+
+        // Each store writes 24 useful bytes, the 8 byte overhang gets overwritten by the next one
+        uint8_t *out = color + i * 3;
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out),
+                            _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p0, color_shuffle), color_compact));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 24),
+                            _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p1, color_shuffle), color_compact));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 48),
+                            _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p2, color_shuffle), color_compact));
+        __m256i c3 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p3, color_shuffle), color_compact);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 72), _mm256_castsi256_si128(c3));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 88), _mm256_extracti128_si256(c3, 1));
+
+        __m256i m01 = _mm256_packs_epi32(_mm256_srli_epi32(p0, 24), _mm256_srli_epi32(p1, 24));
+        __m256i m23 = _mm256_packs_epi32(_mm256_srli_epi32(p2, 24), _mm256_srli_epi32(p3, 24));
+        __m256i m = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(m01, m23), mask_order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i), m);
+    }
+
+    deinterleave_scalar(src + i * 4, color + i * 3, mask + i, pixels - i);
+}
+#endif
+
+#ifdef LIBCAMERA_MEME_NEON
+static void deinterleave_neon(const uint8_t *src, uint8_t *color, uint8_t *mask, std::size_t pixels) {
+    std::size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x16x4_t pixel = vld4q_u8(src + i * 4);
+        uint8x16x3_t bgr = {{pixel.val[0], pixel.val[1], pixel.val[2]}};
+        vst3q_u8(color + i * 3, bgr);
+        vst1q_u8(mask + i, pixel.val[3]);
+    }
+
+    deinterleave_scalar(src + i * 4, color + i * 3, mask + i, pixels - i);
+}
+#endif
+
+bool simd_level_supported(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Scalar:
+            return true;
+#ifdef LIBCAMERA_MEME_X86
+        case SimdLevel::Ssse3:
+            return __builtin_cpu_supports("ssse3");
+        case SimdLevel::Avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef LIBCAMERA_MEME_NEON
+        case SimdLevel::Neon:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+SimdLevel detected_simd_level() {
+    static const SimdLevel level = []() {
+        for (auto candidate: {SimdLevel::Avx2, SimdLevel::Ssse3, SimdLevel::Neon}) {
+            if (simd_level_supported(candidate)) {
+                return candidate;
+            }
+        }
+        return SimdLevel::Scalar;
+    }();
+    return level;
+}
+
+const char *simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Scalar:
+            return "scalar";
+        case SimdLevel::Ssse3:
+            return "ssse3";
+        case SimdLevel::Avx2:
+            return "avx2";
+        case SimdLevel::Neon:
+            return "neon";
+    }
+    return "unknown";
+}
+
+void deinterleave_color_mask(const uint8_t *src, uint8_t *color, uint8_t *mask, std::size_t pixels, SimdLevel level) {
+    if (!simd_level_supported(level)) {
+        level = detected_simd_level();
+    }
+
+    switch (level) {
+#ifdef LIBCAMERA_MEME_X86
+        case SimdLevel::Avx2:
+            deinterleave_avx2(src, color, mask, pixels);
+            return;
+        case SimdLevel::Ssse3:
+            deinterleave_ssse3(src, color, mask, pixels);
+            return;
+#endif
+#ifdef LIBCAMERA_MEME_NEON
+        case SimdLevel::Neon:
+            deinterleave_neon(src, color, mask, pixels);
+            return;
+#endif
+        default:
+            deinterleave_scalar(src, color, mask, pixels);
+    }
+}
+
+void deinterleave_color_mask(const uint8_t *src, std::size_t src_stride,
+                             uint8_t *color, std::size_t color_stride,
+                             uint8_t *mask, std::size_t mask_stride,
+                             int width, int height, ThreadPool *pool, SimdLevel level) {
+    auto row_width = static_cast<std::size_t>(width);
+    bool contiguous = src_stride == row_width * 4 && color_stride == row_width * 3 && mask_stride == row_width;
+
+    auto band = [&](int row_begin, int row_end) {
+        if (contiguous) {
+            deinterleave_color_mask(src + row_begin * src_stride, color + row_begin * color_stride,
+                                    mask + row_begin * mask_stride, row_width * (row_end - row_begin), level);
+            return;
+        }
+        for (int row = row_begin; row < row_end; row++) {
+            deinterleave_color_mask(src + row * src_stride, color + row * color_stride, mask + row * mask_stride,
+                                    row_width, level);
+        }
+    };
+
+    if (pool) {
+        // Bands much smaller than this spend more time on the handoff than on the copy
+        pool->parallelFor(0, height, band, 16);
+    } else {
+        band(0, height);
+    }
+}
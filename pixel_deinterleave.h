@@ -0,0 +1,33 @@
+#ifndef LIBCAMERA_MEME_PIXEL_DEINTERLEAVE_H
+#define LIBCAMERA_MEME_PIXEL_DEINTERLEAVE_H
+
+#include <cstddef>
+#include <cstdint>
+
+class ThreadPool;
+
+enum class SimdLevel {
+    Scalar,
+    Ssse3,
+    Avx2,
+    Neon,
+};
+
+bool simd_level_supported(SimdLevel level);
+// Best kernel the running CPU supports, detected once
+SimdLevel detected_simd_level();
+const char *simd_level_name(SimdLevel level);
+
+// Splits 4 byte pixels into their first three bytes (BGR for our ARGB8888 output) and the fourth (the mask).
+// Falls back to the best level the CPU supports if the requested one isn't available.
+void deinterleave_color_mask(const uint8_t *src, uint8_t *color, uint8_t *mask, std::size_t pixels,
+                             SimdLevel level = detected_simd_level());
+
+// Same split over a whole image, strides are in bytes. With a pool the rows are split into bands across its threads.
+void deinterleave_color_mask(const uint8_t *src, std::size_t src_stride,
+                             uint8_t *color, std::size_t color_stride,
+                             uint8_t *mask, std::size_t mask_stride,
+                             int width, int height, ThreadPool *pool = nullptr,
+                             SimdLevel level = detected_simd_level());
+
+#endif //LIBCAMERA_MEME_PIXEL_DEINTERLEAVE_H
@@ -0,0 +1,321 @@
+#ifndef LIBCAMERA_MEME_RING_QUEUE_H
+#define LIBCAMERA_MEME_RING_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+enum class RingQueueThreading {
+    // One producer thread and one consumer thread, no read-modify-write on the indices
+    Spsc,
+    // Any number of producers and consumers
+    Mpmc,
+};
+
+enum class RingQueueWait {
+    // Block on the condition variable as soon as the queue is empty (or full)
+    Park,
+    // Busy-poll for a while before blocking, trading a core for wakeup latency
+    SpinThenPark,
+};
+
+// Fixed-capacity ring buffer queue. The fast path is lock-free (a bounded Vyukov queue with per-slot
+// sequence numbers), the mutex and condition variables are only touched when a thread has to sleep.
+template <typename T, RingQueueThreading Threading = RingQueueThreading::Spsc>
+class RingQueue {
+public:
+    explicit RingQueue(std::size_t capacity, RingQueueWait wait = RingQueueWait::Park, int spin_count = 1024)
+            : m_capacity(round_up_pow2(capacity)), m_mask(m_capacity - 1), m_slots(new Slot[m_capacity]),
+              // Spinning on a single core only delays the thread we are waiting for
+              m_wait(std::thread::hardware_concurrency() > 1 ? wait : RingQueueWait::Park), m_spin_count(spin_count) {
+        for (std::size_t i = 0; i < m_capacity; i++) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~RingQueue() {
+        while (try_pop_item()) {}
+    }
+
+    RingQueue(const RingQueue &) = delete;
+    RingQueue &operator=(const RingQueue &) = delete;
+
+    [[nodiscard]] std::size_t capacity() const {
+        return m_capacity;
+    }
+
+    // Only a snapshot, other threads may be pushing or popping concurrently
+    [[nodiscard]] std::size_t size() const {
+        auto dequeue = m_dequeue_pos.load(std::memory_order_acquire);
+        auto enqueue = m_enqueue_pos.load(std::memory_order_acquire);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return size() == 0;
+    }
+
+    // Returns false without touching item if the queue is full or closed
+    template <typename U>
+    bool try_push(U &&item) {
+        if (m_closed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        if (!try_push_item(std::forward<U>(item))) {
+            return false;
+        }
+        wake(m_waiting_consumers, m_not_empty);
+        return true;
+    }
+
+    // Blocks while the queue is full. Returns false, without touching item, if the queue was closed before the item
+    // went in. True means the queue owns the item, even if it has been closed since.
+    template <typename U>
+    bool push(U &&item) {
+        if (try_push(std::forward<U>(item))) {
+            return true;
+        }
+        // Once the item is in it belongs to the queue, a close landing after that doesn't give it back
+        bool pushed = false;
+        if (spin([&] {
+            if (m_closed.load(std::memory_order_acquire)) {
+                return true;
+            }
+            pushed = try_push_item(std::forward<U>(item));
+            return pushed;
+        })) {
+            if (pushed) {
+                wake(m_waiting_consumers, m_not_empty);
+            }
+            return pushed;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waiting_producers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!m_closed.load(std::memory_order_acquire)) {
+            if (try_push_item(std::forward<U>(item))) {
+                pushed = true;
+                break;
+            }
+            m_not_full.wait(lock);
+        }
+        m_waiting_producers.fetch_sub(1, std::memory_order_relaxed);
+        lock.unlock();
+
+        if (pushed) {
+            wake(m_waiting_consumers, m_not_empty);
+        }
+        return pushed;
+    }
+
+    std::optional<T> try_pop() {
+        auto item = try_pop_item();
+        if (item) {
+            wake(m_waiting_producers, m_not_full);
+        }
+        return item;
+    }
+
+    // Blocks until an item is available. Returns nullopt once the queue is closed and drained.
+    std::optional<T> pop() {
+        return pop_until(std::nullopt);
+    }
+
+    // Like pop, but also returns nullopt if nothing arrives within the timeout
+    template <typename Rep, typename Period>
+    std::optional<T> pop_for(const std::chrono::duration<Rep, Period> &timeout) {
+        return pop_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    // Refuses further pushes and wakes every blocked thread. Items already queued can still be popped.
+    void close() {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_closed.store(true, std::memory_order_release);
+        }
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+    [[nodiscard]] bool closed() const {
+        return m_closed.load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    struct alignas(CACHE_LINE) Slot {
+        std::atomic<std::size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *item() {
+            return std::launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    static std::size_t round_up_pow2(std::size_t value) {
+        std::size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+    }
+
+    template <typename U>
+    bool try_push_item(U &&item) {
+        auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &m_slots[pos & m_mask];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if constexpr (Threading == RingQueueThreading::Spsc) {
+                    m_enqueue_pos.store(pos + 1, std::memory_order_relaxed);
+                    break;
+                } else if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        new (slot->storage) T(std::forward<U>(item));
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> try_pop_item() {
+        auto pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &m_slots[pos & m_mask];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if constexpr (Threading == RingQueueThreading::Spsc) {
+                    m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+                    break;
+                } else if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return std::nullopt;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::optional<T> result(std::move(*slot->item()));
+        slot->item()->~T();
+        slot->sequence.store(pos + m_capacity, std::memory_order_release);
+        return result;
+    }
+
+    template <typename F>
+    bool spin(F &&attempt) {
+        if (m_wait != RingQueueWait::SpinThenPark) {
+            return false;
+        }
+        for (int i = 0; i < m_spin_count; i++) {
+            if (attempt()) {
+                return true;
+            }
+            cpu_relax();
+        }
+        return false;
+    }
+
+    // Pairs with the fence a sleeper issues after registering itself, so either we see the sleeper or
+    // the sleeper sees our item
+    void wake(std::atomic<int> &waiting, std::condition_variable &cond) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) > 0) {
+            { std::unique_lock<std::mutex> lock(m_mutex); }
+            cond.notify_one();
+        }
+    }
+
+    std::optional<T> pop_until(std::optional<std::chrono::steady_clock::time_point> deadline) {
+        if (auto item = try_pop()) {
+            return item;
+        }
+        std::optional<T> item;
+        if (spin([&] { return (item = try_pop_item()).has_value() || m_closed.load(std::memory_order_acquire); })) {
+            if (!item) {
+                item = try_pop_item();
+            }
+            if (item) {
+                wake(m_waiting_producers, m_not_full);
+            }
+            return item;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waiting_consumers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (true) {
+            item = try_pop_item();
+            if (item || m_closed.load(std::memory_order_acquire)) {
+                break;
+            }
+            if (deadline) {
+                if (m_not_empty.wait_until(lock, *deadline) == std::cv_status::timeout) {
+                    item = try_pop_item();
+                    break;
+                }
+            } else {
+                m_not_empty.wait(lock);
+            }
+        }
+        m_waiting_consumers.fetch_sub(1, std::memory_order_relaxed);
+        lock.unlock();
+
+        if (item) {
+            wake(m_waiting_producers, m_not_full);
+        }
+        return item;
+    }
+
+    const std::size_t m_capacity;
+    const std::size_t m_mask;
+    std::unique_ptr<Slot[]> m_slots;
+
+    alignas(CACHE_LINE) std::atomic<std::size_t> m_enqueue_pos{0};
+    alignas(CACHE_LINE) std::atomic<std::size_t> m_dequeue_pos{0};
+
+    alignas(CACHE_LINE) std::atomic<bool> m_closed{false};
+    std::atomic<int> m_waiting_consumers{0};
+    std::atomic<int> m_waiting_producers{0};
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+
+    const RingQueueWait m_wait;
+    const int m_spin_count;
+};
+
+#endif //LIBCAMERA_MEME_RING_QUEUE_H
@@ -0,0 +1,41 @@
+#include "roi_tracker.h"
+
+#include <algorithm>
+
+RoiTracker::RoiTracker(int width, int height, const Config &config)
+        : m_width(width), m_height(height), m_config(config) {}
+
+std::optional<HsvThresholder::Roi> RoiTracker::update(const std::vector<BlobMoments> &blobs,
+                                                      const HsvThresholder::Roi &roi, int scale) {
+    auto biggest = std::max_element(blobs.begin(), blobs.end(), [](const BlobMoments &a, const BlobMoments &b) {
+        return a.count < b.count;
+    });
+    if (biggest == blobs.end()) {
+        if (++m_missed >= m_config.lost_frames) {
+            m_roi.reset();
+        }
+        return m_roi;
+    }
+    m_missed = 0;
+
+    // Mask pixel i covers input pixels roi.x + i * scale up to the next one
+    int left = roi.x + biggest->min_x * scale - m_config.margin;
+    int right = roi.x + (biggest->max_x + 1) * scale + m_config.margin;
+    int top = roi.y + biggest->min_y * scale - m_config.margin;
+    int bottom = roi.y + (biggest->max_y + 1) * scale + m_config.margin;
+
+    // Grown around the center and then slid back inside the frame, rather than cut off at the edge
+    auto axis = [](int begin, int end, int min_size, int pixels) {
+        int size = std::min(std::max(end - begin, min_size), pixels);
+        begin = (begin + end) / 2 - size / 2;
+        return std::make_pair(std::clamp(begin, 0, pixels - size), size);
+    };
+    auto [x, width] = axis(left, right, m_config.min_width, m_width);
+    auto [y, height] = axis(top, bottom, m_config.min_height, m_height);
+    m_roi = HsvThresholder::Roi{x, y, width, height};
+    return m_roi;
+}
+
+std::optional<HsvThresholder::Roi> RoiTracker::roi() const {
+    return m_roi;
+}
@@ -0,0 +1,43 @@
+#ifndef LIBCAMERA_MEME_ROI_TRACKER_H
+#define LIBCAMERA_MEME_ROI_TRACKER_H
+
+#include <optional>
+#include <vector>
+
+#include "hsv_thresholder.h"
+#include "mask_stats.h"
+
+// Picks the window for HsvThresholder::setRoi from the blobs of the last frame: the biggest blob's bounding box
+// grown by a margin on every side, so the target can move that far before the next frame and still be inside.
+// Once nothing has been seen for a few frames it goes back to the whole frame to find the target again.
+class RoiTracker {
+public:
+    struct Config {
+        // Input pixels added on each side of the detection
+        int margin = 64;
+        // The window never gets smaller than this, so a small or distant target still has room to move
+        int min_width = 400;
+        int min_height = 300;
+        // Frames without a blob before the whole frame is searched again
+        int lost_frames = 5;
+    };
+
+    RoiTracker(int width, int height, const Config &config);
+
+    // blobs come from find_blobs over a frame's stats, in its mask pixels. roi and scale are the frame's
+    // OutputFrame::roi and OutputConfig::scale, to get back to input pixels. Returns what to pass to setRoi.
+    std::optional<HsvThresholder::Roi> update(const std::vector<BlobMoments> &blobs, const HsvThresholder::Roi &roi,
+                                              int scale);
+
+    // The last window update returned
+    [[nodiscard]] std::optional<HsvThresholder::Roi> roi() const;
+
+private:
+    int m_width;
+    int m_height;
+    Config m_config;
+    int m_missed = 0;
+    std::optional<HsvThresholder::Roi> m_roi;
+};
+
+#endif //LIBCAMERA_MEME_ROI_TRACKER_H
@@ -0,0 +1,89 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int threads) {
+    // The caller of parallelFor is one of the threads
+    for (unsigned int i = 1; i < std::max(threads, 1u); i++) {
+        m_workers.emplace_back([this]() {
+            workerLoop();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_cond.notify_all();
+    for (auto &worker: m_workers) {
+        worker.join();
+    }
+}
+
+unsigned int ThreadPool::concurrency() const {
+    return m_workers.size() + 1;
+}
+
+void ThreadPool::runFor(int begin, int end, BandFn fn, int min_band) {
+    if (end <= begin) {
+        return;
+    }
+
+    int count = end - begin;
+    int band = std::max(min_band, (count + static_cast<int>(concurrency()) - 1) / static_cast<int>(concurrency()));
+    if (m_workers.empty() || band >= count) {
+        fn(begin, end);
+        return;
+    }
+
+    {
+        std::scoped_lock lock(m_mutex);
+        m_fn = fn;
+        m_begin = begin;
+        m_end = end;
+        m_band = band;
+        m_next_band.store(0, std::memory_order_relaxed);
+        m_active = m_workers.size();
+        m_generation++;
+    }
+    m_work_cond.notify_all();
+
+    runBands();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done_cond.wait(lock, [&]{ return m_active == 0; });
+    m_fn = {};
+}
+
+void ThreadPool::runBands() {
+    while (true) {
+        int band_begin = m_begin + m_next_band.fetch_add(1, std::memory_order_relaxed) * m_band;
+        if (band_begin >= m_end) {
+            break;
+        }
+        m_fn(band_begin, std::min(band_begin + m_band, m_end));
+    }
+}
+
+void ThreadPool::workerLoop() {
+    unsigned long seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_work_cond.wait(lock, [&]{ return m_stopping || m_generation != seen_generation; });
+            if (m_stopping) {
+                return;
+            }
+            seen_generation = m_generation;
+        }
+
+        runBands();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (--m_active == 0) {
+            m_done_cond.notify_one();
+        }
+    }
+}
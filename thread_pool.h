@@ -0,0 +1,62 @@
+#ifndef LIBCAMERA_MEME_THREAD_POOL_H
+#define LIBCAMERA_MEME_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for splitting a frame into row bands. parallelFor blocks until every
+// band is done, and the calling thread works on bands too instead of just waiting.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned int threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    [[nodiscard]] unsigned int concurrency() const;
+
+    // Calls fn(band_begin, band_end) over [begin, end), in bands of at least min_band items. fn is only referred
+    // to, never copied, so no call allocates however much a lambda captures.
+    template<typename Fn>
+    void parallelFor(int begin, int end, const Fn &fn, int min_band = 1) {
+        runFor(begin, end, {&fn, [](const void *object, int band_begin, int band_end) {
+            (*static_cast<const Fn *>(object))(band_begin, band_end);
+        }}, min_band);
+    }
+private:
+    // A borrowed fn(band_begin, band_end)
+    struct BandFn {
+        const void *object;
+        void (*call)(const void *object, int band_begin, int band_end);
+
+        void operator()(int band_begin, int band_end) const {
+            call(object, band_begin, band_end);
+        }
+    };
+
+    void runFor(int begin, int end, BandFn fn, int min_band);
+    void workerLoop();
+    void runBands();
+
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_cond;
+    std::condition_variable m_done_cond;
+    bool m_stopping = false;
+    unsigned long m_generation = 0;
+    unsigned int m_active = 0;
+
+    // Only valid while a parallelFor call is in progress
+    BandFn m_fn{};
+    int m_begin = 0;
+    int m_end = 0;
+    int m_band = 1;
+    std::atomic<int> m_next_band{0};
+};
+
+#endif //LIBCAMERA_MEME_THREAD_POOL_H
@@ -0,0 +1,96 @@
+#include "yuv_conversion.h"
+
+#include <EGL/eglext.h>
+
+#include <stdexcept>
+
+#include <libdrm/drm_fourcc.h>
+
+int yuv_plane_count(YuvFormat format) {
+    switch (format) {
+        case YuvFormat::Yuv420:
+            return 3;
+        case YuvFormat::Nv12:
+            return 2;
+        case YuvFormat::Yuyv:
+            return 1;
+    }
+    throw std::runtime_error("unknown yuv format");
+}
+
+YuvPlaneSize yuv_plane_size(YuvFormat format, int plane, int width, int height) {
+    if (plane < 0 || plane >= yuv_plane_count(format)) {
+        throw std::runtime_error("yuv plane out of range");
+    }
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+    switch (format) {
+        case YuvFormat::Yuv420:
+            return plane == 0 ? YuvPlaneSize{width, height} : YuvPlaneSize{chroma_width, chroma_height};
+        case YuvFormat::Nv12:
+            return plane == 0 ? YuvPlaneSize{width, height} : YuvPlaneSize{chroma_width * 2, chroma_height};
+        case YuvFormat::Yuyv:
+            return {chroma_width * 4, height};
+    }
+    throw std::runtime_error("unknown yuv format");
+}
+
+int yuv_bits_per_pixel(YuvFormat format) {
+    return format == YuvFormat::Yuyv ? 16 : 12;
+}
+
+std::optional<YuvFormat> yuv_format_from_fourcc(uint32_t fourcc) {
+    switch (fourcc) {
+        case DRM_FORMAT_YUV420:
+            return YuvFormat::Yuv420;
+        case DRM_FORMAT_NV12:
+            return YuvFormat::Nv12;
+        case DRM_FORMAT_YUYV:
+            return YuvFormat::Yuyv;
+        default:
+            return std::nullopt;
+    }
+}
+
+YuvToRgb yuv_to_rgb_coefficients(EGLint encoding, EGLint range) {
+    float kr, kb;
+    switch (encoding) {
+        case EGL_ITU_REC601_EXT:
+            kr = 0.299f;
+            kb = 0.114f;
+            break;
+        case EGL_ITU_REC709_EXT:
+            kr = 0.2126f;
+            kb = 0.0722f;
+            break;
+        case EGL_ITU_REC2020_EXT:
+            kr = 0.2627f;
+            kb = 0.0593f;
+            break;
+        default:
+            throw std::runtime_error("unknown yuv encoding");
+    }
+    float kg = 1.0f - kr - kb;
+
+    float y_offset, y_scale, c_scale;
+    if (range == EGL_YUV_FULL_RANGE_EXT) {
+        y_offset = 0.0f;
+        y_scale = 1.0f / 255.0f;
+        c_scale = 1.0f / 255.0f;
+    } else if (range == EGL_YUV_NARROW_RANGE_EXT) {
+        y_offset = 16.0f;
+        y_scale = 1.0f / 219.0f;
+        c_scale = 1.0f / 224.0f;
+    } else {
+        throw std::runtime_error("unknown yuv range");
+    }
+
+    return {
+            y_offset,
+            y_scale,
+            2.0f * (1.0f - kr) * c_scale,
+            -2.0f * kb * (1.0f - kb) / kg * c_scale,
+            -2.0f * kr * (1.0f - kr) / kg * c_scale,
+            2.0f * (1.0f - kb) * c_scale,
+    };
+}
@@ -0,0 +1,45 @@
+#ifndef LIBCAMERA_MEME_YUV_CONVERSION_H
+#define LIBCAMERA_MEME_YUV_CONVERSION_H
+
+#include <cstdint>
+#include <optional>
+
+#include <EGL/egl.h>
+
+// Camera layouts the thresholders read. Chroma is halved horizontally in all of them, and vertically too in the
+// 4:2:0 ones.
+enum class YuvFormat {
+    Yuv420, // three planes: Y, U, V
+    Nv12, // two planes: Y, then U and V interleaved
+    Yuyv, // one plane of Y0 U Y1 V groups
+};
+
+struct YuvPlaneSize {
+    int row_bytes;
+    int rows;
+};
+
+int yuv_plane_count(YuvFormat format);
+YuvPlaneSize yuv_plane_size(YuvFormat format, int plane, int width, int height);
+// Bytes moved per frame is what the camera format negotiation compares
+int yuv_bits_per_pixel(YuvFormat format);
+// Takes a DRM fourcc, which is also what libcamera::PixelFormat::fourcc returns. nullopt for anything else.
+std::optional<YuvFormat> yuv_format_from_fourcc(uint32_t fourcc);
+
+// Y'CbCr to R'G'B' for 8 bit samples, giving values in [0, 1] before clamping:
+//   y' = y_scale * (y - y_offset), cb' = cb - 128, cr' = cr - 128
+//   r = y' + cr_r * cr', g = y' + cb_g * cb' + cr_g * cr', b = y' + cb_b * cb'
+struct YuvToRgb {
+    float y_offset;
+    float y_scale;
+    float cr_r;
+    float cb_g;
+    float cr_g;
+    float cb_b;
+};
+
+// encoding and range are the EGL_EXT_image_dma_buf_import values, as returned by encodingFromColorspace and
+// rangeFromColorspace
+YuvToRgb yuv_to_rgb_coefficients(EGLint encoding, EGLint range);
+
+#endif //LIBCAMERA_MEME_YUV_CONVERSION_H